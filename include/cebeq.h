@@ -5,6 +5,7 @@
 #include <inttypes.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 
 #ifdef _WIN32
     #define _CEBEQ_EXPORT __declspec(dllexport)
@@ -28,7 +29,7 @@
 #endif // CEBEQ_SHARED
 
 #define MAX_LONG_PATH 32767
-#define MAX_QUEUE 100
+#define MSGQ_DEFAULT_CAPACITY 4096
 #define MAX_MSG_LEN 256
 
 #define PROGRAM_NAME "cebeq"
@@ -79,23 +80,71 @@
     #endif // CEBEQ_DEBUG
 #endif // CEBEQ_MSGQ
 
+typedef enum{
+    CHANGE_FAST,   // size and modification time with nanoseconds
+    CHANGE_STRICT, // additionally inode change time, inode and device
+    CHANGE__POLICY_COUNT
+} change_policy;
+
+typedef enum{
+    COMPRESS_NONE,
+    COMPRESS_LZ4,  // built in, fast enough to pay off on most targets
+    COMPRESS_ZSTD, // needs a build with CEBEQ_ZSTD
+    COMPRESS__CODEC_COUNT
+} compress_codec;
+
+typedef struct{
+    size_t jobs; // number of worker threads, 0 for one per cpu
+    bool json_export; // also write a json info file into every directory
+    bool dedup; // store file contents as chunks in <dest>/.chunks
+    bool link_unchanged; // hardlink unchanged files from the parent, so every backup is a full tree
+    change_policy changes; // how files are compared against the parent backup
+    bool hash; // keep content hashes, files whose metadata changed are only copied if their hash did too
+    bool delta; // store large changed files as block patches against their previous version
+    unsigned uring_depth; // copy small files in batches with io_uring, files in flight per worker, 0 to copy them one by one
+    bool pack; // append small files to a few segment files instead of storing each on its own
+    compress_codec compression; // COMPRESS_NONE uses the compression of the branch
+    int compression_level;
+    const char *tar; // back up the content of this archive ("-": stdin) instead of the directories of the branch
+    const char *tar_root; // directory the archive's entries are put into, needed for archives with top-level files
+    bool stats; // report the time of each phase, files handled and system calls made
+    const char *stats_json; // also write that report to this json file, NULL for none
+    bool estimate; // walk the sources in parallel ahead of the backup, so progress has totals and an ETA early
+    bool full_scan; // list every directory even if 'cbq watch' journaled the changes since the parent, see watch.h
+} backup_options_t;
+
+typedef struct{
+    size_t jobs; // number of files restored at the same time, 0 for one per cpu
+    unsigned uring_depth; // like backup_options_t.uring_depth
+    bool stats; // like backup_options_t.stats
+    const char *stats_json;
+} merge_options_t;
+
 typedef struct{
     const char *args[3];
+    backup_options_t backup_options;
+    merge_options_t merge_options;
+    int result; // what the thread function returned, 0 on success
 } thread_args_t;
 
 CBQLIB extern char program_dir[FILENAME_MAX];
 CBQLIB extern char exe_dir[FILENAME_MAX];
 CBQLIB extern char exe_path[FILENAME_MAX];
 CBQLIB extern char *long_path_buf;
-CBQLIB extern volatile int worker_done;
+CBQLIB extern atomic_bool worker_done;
 
 CBQLIB bool setup(void);
 CBQLIB void cleanup(void);
+CBQLIB void worker_finish(void); // sets worker_done and wakes a thread waiting on the message queue
 
 CBQLIB void* tbackup(void *args);
 CBQLIB void* tmerge(void *args);
-CBQLIB int backup(const char *branch_name, const char *dest, const char *parent);
-CBQLIB int merge(const char *src, const char *dest);
+CBQLIB void* texport(void *args); // args: backup, archive path or "-" for stdout
+CBQLIB void* twatch(void *args); // args: branch
+CBQLIB int backup(const char *branch_name, const char *dest, const char *parent, const backup_options_t *options);
+CBQLIB int merge(const char *src, const char *dest, const merge_options_t *options);
+CBQLIB int export_backup(const char *src, int fd); // writes the point-in-time tree of a backup as a pax archive
+CBQLIB int watch(const char *branch_name); // journals the changes to a branch until watch_stop, see watch.h
 
 CBQLIB bool get_exe_path(char *buffer, size_t buffer_size);
 CBQLIB bool get_parent_dir(const char *path, char *buffer, size_t buffer_size);
@@ -0,0 +1,37 @@
+#ifndef _CBQCHANGE_H
+#define _CBQCHANGE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <cebeq.h>
+#include <flib.h>
+#include <manifest.h>
+
+/*
+    Decides whether a file has to be stored again, using only its metadata.
+
+    CHANGE_FAST compares size and the modification time including nanoseconds,
+    any difference counts (a file restored to an older version is a change too).
+    CHANGE_STRICT also compares the inode change time, inode and device, which
+    catches tools that reset the modification time and files that were replaced.
+
+    A file whose modification time is not older than the parent backup's scan
+    time may have been written again within the same timestamp tick after it was
+    read, so such a "racily clean" entry is always treated as changed.
+*/
+
+static const char* const change_policy_names[] = {
+    [CHANGE_FAST] = "fast",
+    [CHANGE_STRICT] = "strict",
+};
+
+_Static_assert(CHANGE__POLICY_COUNT == arr_len(change_policy_names), "change_policy count has changed!");
+
+CBQLIB bool change_policy_parse(const char *name, change_policy *policy);
+CBQLIB void change_entry_from_stat(manifest_entry *item, const flib_entry *entry);
+// an unchanged entry keeps the identity (and content hash) of the stored version, so a later strict backup still sees the difference
+CBQLIB void change_keep_stored(manifest_entry *item, const manifest_entry *stored);
+CBQLIB bool change_file_changed(change_policy policy, const manifest_t *prev, uint32_t prev_index, const manifest_entry *current);
+
+#endif // _CBQCHANGE_H
@@ -0,0 +1,57 @@
+#ifndef _CBQCHUNK_H
+#define _CBQCHUNK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include <cebeq.h>
+#include <hash.h>
+
+/*
+    Content-addressed chunk store, shared by all backups in a destination:
+        <dest>/.chunks/<first 2 hex digits>/<remaining hex digits of the SHA-256>
+
+    Files are cut into content-defined chunks (FastCDC with normalized chunking),
+    so an insertion only changes the chunks around it, and every chunk is
+    stored once no matter how many files, backups or branches contain it.
+*/
+
+#define CHUNK_STORE_DIR ".chunks"
+#define CHUNK_MIN_SIZE (16*1024)
+#define CHUNK_AVG_SIZE (64*1024)
+#define CHUNK_MAX_SIZE (256*1024)
+#define CHUNK_READ_SIZE (4*CHUNK_MAX_SIZE)
+
+typedef struct{
+    uint8_t bytes[HASH_SHA256_SIZE];
+} chunk_id;
+
+typedef struct{
+    chunk_id *items;
+    size_t count;
+    size_t capacity;
+} chunk_list;
+
+typedef struct{
+    char path[FILENAME_MAX];
+    atomic_size_t tmp_counter;
+    atomic_size_t chunks_new;
+    atomic_size_t chunks_dup;
+    atomic_uint_least64_t bytes_new;
+    atomic_uint_least64_t bytes_dup;
+} chunk_store_t;
+
+CBQLIB size_t chunk_cut(const uint8_t *data, size_t len);
+
+CBQLIB bool chunk_store_open(chunk_store_t *store, const char *dest, bool create);
+CBQLIB bool chunk_store_put(chunk_store_t *store, const void *data, size_t len, chunk_id *id);
+CBQLIB bool chunk_store_add_file(chunk_store_t *store, const char *path, chunk_list *chunks);
+CBQLIB bool chunk_store_restore_file(chunk_store_t *store, const chunk_id *chunks, size_t count, const char *path);
+CBQLIB void chunk_store_path(const chunk_store_t *store, const chunk_id *id, char *buffer, size_t buffer_size);
+
+CBQLIB void chunk_list_push(chunk_list *chunks, const chunk_id *id);
+CBQLIB void chunk_list_free(chunk_list *chunks);
+
+#endif // _CBQCHUNK_H
@@ -0,0 +1,69 @@
+#ifndef _CBQCOMPRESS_H
+#define _CBQCOMPRESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <cebeq.h>
+
+/*
+    Transparent per-file compression of stored files.
+
+    A compressed file keeps its name in the backup and starts with a header,
+    followed by independent blocks:
+        compress_header  magic, codec, block size, size of the original file
+        uint32_t raw_len, uint32_t stored_len (COMPRESS_RAW_BLOCK: stored as it is), data
+        ...
+
+    lz4 is built in (the LZ4 block format, so any lz4 implementation can read the
+    blocks), zstd is used from libzstd when the library is built with CEBEQ_ZSTD.
+    The first block doubles as a sample: a file whose start does not compress is
+    stored as it is, so media and archives cost no cpu time on the next backups.
+*/
+
+#define COMPRESS_MAGIC "CBQCMP1"
+#define COMPRESS_BLOCK_SIZE (128*1024)
+#define COMPRESS_MIN_FILE_SIZE (4*1024)
+#define COMPRESS_RAW_BLOCK (1u << 31)
+// the sample has to shrink to at most this many percent, otherwise the file is stored as it is
+#define COMPRESS_SAMPLE_PERCENT 90
+#define COMPRESS_ZSTD_DEFAULT_LEVEL 3
+
+static const char* const compress_codec_names[] = {
+    [COMPRESS_NONE] = "none",
+    [COMPRESS_LZ4] = "lz4",
+    [COMPRESS_ZSTD] = "zstd",
+};
+
+_Static_assert(COMPRESS__CODEC_COUNT == arr_len(compress_codec_names), "compress_codec count has changed!");
+
+typedef struct{
+    char magic[8];
+    uint32_t codec;
+    uint32_t block_size;
+    uint64_t raw_size;
+} compress_header;
+
+typedef enum{
+    COMPRESS_STORED,  // dest holds the compressed file
+    COMPRESS_SKIPPED, // too small or incompressible, nothing was written
+    COMPRESS_FAILED,
+} compress_result;
+
+// "none", "lz4", "zstd" or "zstd:<level>"
+CBQLIB bool compress_parse(const char *value, compress_codec *codec, int *level);
+CBQLIB bool compress_available(compress_codec codec);
+CBQLIB size_t compress_bound(size_t len);
+// returns the compressed size or 0 if the block does not fit into dst
+CBQLIB size_t compress_block(compress_codec codec, int level, const void *src, size_t len, void *dst, size_t cap);
+CBQLIB bool decompress_block(compress_codec codec, const void *src, size_t len, void *dst, size_t raw_len);
+
+// raw_hash (may be NULL) is the XXH64 of the original content, the same as hash_xxh64_file
+CBQLIB compress_result compress_file(const char *src, const char *dest, compress_codec codec, int level, uint64_t *raw_hash, uint64_t *stored_size);
+CBQLIB bool decompress_file(const char *src, const char *dest);
+// for streaming: the fd is positioned at the first block, header.raw_size is the size of the original file
+CBQLIB int decompress_open(const char *src, compress_header *header);
+CBQLIB bool decompress_fd(int fd, const compress_header *header, const char *src, int out);
+
+#endif // _CBQCOMPRESS_H
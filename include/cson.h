@@ -39,9 +39,12 @@
 
 #define CSON_DEF_ARRAY_CAPACITY   16
 #define CSON_ARRAY_MUL_F           2
-#define CSON_MAP_CAPACITY         16
+#define CSON_MAP_CAPACITY         16 // must be a power of two
+#define CSON_MAP_MUL_F             2
+#define CSON_MAP_MAX_LOAD         75 // percent of capacity before the map grows
 #define CSON_DEF_INDENT            4
 #define CSON_REGION_CAPACITY  2*1024
+#define CSON_WRITER_BUFFER_SIZE (64*1024)
 
 #define cson_ansi_rgb(r, g, b) ("\e[38;2;" #r ";" #g ";" #b "m")
 #define CSON_ANSI_END "\e[0m"
@@ -225,7 +228,7 @@ struct CsonRegion{
 CBQLIB Cson* cson__get(Cson *cson, CsonArg args[], size_t count);
 
 CBQLIB Cson* cson_new(void);
-CBQLIB Cson* cson_new_int(int32_t value);
+CBQLIB Cson* cson_new_int(int64_t value);
 CBQLIB Cson* cson_new_float(double value);
 CBQLIB Cson* cson_new_bool(bool value);
 CBQLIB Cson* cson_new_string(CsonStr value);
@@ -271,7 +274,7 @@ CBQLIB Cson *cson_map_keys(Cson *map);
 CBQLIB Cson* cson_map_dup(Cson *map);
 CBQLIB size_t cson_map_memsize(Cson *map);
 
-extern CsonArena *cson_current_arena;
+extern _Thread_local CsonArena *cson_current_arena;
 
 CsonRegion* cson__new_region(size_t capacity);
 CBQLIB void* cson_alloc(CsonArena *arena, size_t size);
@@ -291,13 +294,29 @@ CBQLIB size_t cson_str_memsize(CsonStr str);
 #define cson_print(cson) do{if (cson!=NULL){cson_fprint(cson, stdout, 0); putchar('\n');}else{printf("-null-\n");}} while (0)
 #define cson_array_print(array) do{if (array!=NULL){cson_array_fprint(array, stdout, 0); putchar('\n');}else{printf("-null-\n");}}while(0)
 #define cson_map_print(map) do{if (map!=NULL){cson_map_fprint(map, stdout, 0); putchar('\n');}else{printf("-null-\n");}}while(0)
+// streaming writer with its own output buffer, every writer is independent so threads can write in parallel
+typedef struct{
+    FILE *file;
+    char *buffer;
+    size_t len;
+    bool compact; // no indentation and newlines
+    bool ok;
+} CsonWriter;
+
+CBQLIB void cson_writer_init(CsonWriter *writer, FILE *file, bool compact);
+CBQLIB void cson_writer_value(CsonWriter *writer, Cson *value, size_t indent);
+CBQLIB void cson_writer_flush(CsonWriter *writer);
+CBQLIB bool cson_writer_finish(CsonWriter *writer);
+
 CBQLIB bool cson_write(Cson *json, char *filename);
+CBQLIB bool cson_write_compact(Cson *json, char *filename);
 CBQLIB void cson_fprint(Cson *value, FILE *file, size_t indent);
 CBQLIB void cson_array_fprint(CsonArray *array, FILE *file, size_t indent);
 CBQLIB void cson_map_fprint(CsonMap *map, FILE *file, size_t indent);
 
 /* Lexer */
-#define cson_lex_is_whitespace(c) ((c == ' ' || c == '\n' || c == '\t'))
+// carriage returns are plain whitespace, so CRLF files can be lexed without rewriting them
+#define cson_lex_is_whitespace(c) ((c == ' ' || c == '\n' || c == '\t' || c == '\r'))
 #define cson_lex_check_line(lexer, c) do{if (c == '\n'){(lexer)->loc.row++; (lexer)->loc.column=1;}else{lexer->loc.column++;}}while(0)
 #define cson_lex_inc(lexer) do{lexer->index++; lexer->loc.column++;}while(0)
 #define cson_lex_get_char(lexer) (lexer->buffer[lexer->index])
@@ -375,6 +394,35 @@ void cson_lex_set_token(CsonToken *token, CsonTokenType type, char *t_start, cha
 bool cson_lex_is_delimeter(char c);
 bool cson_lex_is_int(char *s, char *e);
 bool cson_lex_is_float(char *s, char *e);
+void cson_lex_advance(CsonLexer *lexer, size_t index);
+
+// the scanning stage finds the next byte of a class 16 or 32 bytes at a time where the cpu allows it
+typedef enum{
+    CsonSimd_Auto,
+    CsonSimd_Scalar,
+    CsonSimd_SSE2,
+    CsonSimd_AVX2,
+    CsonSimd__Count
+} CsonSimd;
+
+static const char* const CsonSimdNames[] = {
+    [CsonSimd_Auto] = "auto",
+    [CsonSimd_Scalar] = "scalar",
+    [CsonSimd_SSE2] = "sse2",
+    [CsonSimd_AVX2] = "avx2",
+};
+
+_Static_assert(CsonSimd__Count == cson_arr_len(CsonSimdNames), "CsonSimd count has changed!");
+
+typedef enum{
+    CsonScan_NonWhitespace,
+    CsonScan_StringEnd,   // '"' or '\\'
+    CsonScan_Delimeter,
+} CsonScanKind;
+
+CBQLIB extern CsonSimd cson_simd; // upper limit for the scanning stage, set before parsing
+CBQLIB CsonSimd cson_simd_level(void);
+size_t cson_scan(CsonScanKind kind, const char *buffer, size_t index, size_t end);
 
 #define cson_lex_expect(lexer, token, ...) cson__lex_expect(lexer, token, cson_token_args_array(__VA_ARGS__), __FILE__, __LINE__)
 
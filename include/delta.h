@@ -0,0 +1,69 @@
+#ifndef _CBQDELTA_H
+#define _CBQDELTA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <cebeq.h>
+
+/*
+    rsync-style block deltas for large files.
+
+    Every stored version of a large file gets a signature
+        <backup>/.delta/<file>.cbqsig    block size, then a weak rolling checksum and XXH64 per block
+    and a changed version is stored as a patch against the previous one
+        <backup>/.delta/<file>.cbqdelta  header, then a list of ops: copy blocks of the base or literal data
+    Both are kept apart from the backed up files, a file of the user named like
+    one of them could take its place otherwise.
+
+    The patch is found by rolling the weak checksum over the new file, so data that
+    moved by any number of bytes still matches. The signature of the new version is
+    built in the same pass, so a file is only read once.
+*/
+
+#define DELTA_DIR ".delta"
+#define DELTA_SIG_SUFFIX ".cbqsig"
+#define DELTA_PATCH_SUFFIX ".cbqdelta"
+#define DELTA_SIG_MAGIC "CBQSIG1"
+#define DELTA_PATCH_MAGIC "CBQDLT1"
+#define DELTA_MIN_FILE_SIZE (8*1024*1024)
+#define DELTA_MIN_BLOCK_SIZE (2*1024)
+#define DELTA_MAX_BLOCK_SIZE (128*1024)
+#define DELTA_MAX_LITERAL (1024*1024)
+
+typedef struct{
+    uint32_t weak;
+    uint32_t next; // next block in the same hash bucket or UINT32_MAX
+    uint64_t strong;
+} delta_block;
+
+typedef struct{
+    uint32_t block_size;
+    uint64_t file_size;
+    delta_block *blocks;
+    size_t count;
+    uint32_t *buckets;
+    size_t bucket_mask;
+    uint64_t *filter; // one bit per weak checksum hash, most positions of a new file match no block at all
+    size_t filter_mask;
+} delta_signature;
+
+typedef struct{
+    uint64_t literal_bytes; // bytes stored as literal data in the patch
+    uint64_t matched_bytes; // bytes copied from the base
+    uint64_t target_hash;   // XXH64 of the new version, the same as hash_xxh64_file
+} delta_stats;
+
+CBQLIB uint32_t delta_block_size(uint64_t file_size);
+// <backup>/.delta/<rel><suffix>, create makes the directories above it
+CBQLIB bool delta_path(const char *backup, const char *rel, const char *suffix, bool create, char *buffer, size_t buffer_size);
+CBQLIB bool delta_signature_read(const char *path, delta_signature *sig);
+CBQLIB void delta_signature_free(delta_signature *sig);
+// writes the signature of src, used for versions that are stored in full
+CBQLIB bool delta_signature_file(const char *src, const char *sig_path);
+// writes a patch from the version described by base to src, plus the signature of src
+CBQLIB bool delta_create(const char *src, const delta_signature *base, const char *patch_path, const char *sig_path, delta_stats *stats);
+CBQLIB bool delta_apply(const char *base_path, const char *patch_path, const char *dest);
+
+#endif // _CBQDELTA_H
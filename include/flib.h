@@ -37,6 +37,8 @@
 #define ansi_end ("\e[0m") 
 
 #define FLIB_SIZE_ERROR (fsize_t)-1
+#define FLIB_COPY_BUFFER_SIZE (128*1024)
+#define FLIB_COPY_CHUNK (1024*1024*1024)
 
 typedef uint64_t fsize_t;
 
@@ -51,14 +53,64 @@ typedef enum{
     FLIB_UNSP
 } flib_type;
 
+// copy strategies in the order flib_copy_file tries them
+typedef enum{
+    FLIB_COPY_CLONE,
+    FLIB_COPY_RANGE,
+    FLIB_COPY_SENDFILE,
+    FLIB_COPY_RW,
+    FLIB_COPY_NATIVE,
+    FLIB_COPY_URING, // batches of small files copied by the callers with uring.h
+    FLIB_COPY__COUNT
+} flib_copy_method;
+
+static const char* const flib_copy_method_names[] = {
+    [FLIB_COPY_CLONE] = "reflink",
+    [FLIB_COPY_RANGE] = "copy_file_range",
+    [FLIB_COPY_SENDFILE] = "sendfile",
+    [FLIB_COPY_RW] = "read/write",
+    [FLIB_COPY_NATIVE] = "native",
+    [FLIB_COPY_URING] = "io_uring",
+};
+
+_Static_assert(FLIB_COPY__COUNT == arr_len(flib_copy_method_names), "flib_copy_method count has changed!");
+
+#ifdef _WIN32
+    #define FLIB_PATH_SEP '\\'
+    #define flib_stat_mtime_nsec(st) 0
+    #define flib_stat_ctime_nsec(st) 0
+#elif __APPLE__
+    #define FLIB_PATH_SEP '/'
+    #define flib_stat_mtime_nsec(st) ((st).st_mtimespec.tv_nsec)
+    #define flib_stat_ctime_nsec(st) ((st).st_ctimespec.tv_nsec)
+#else
+    #define FLIB_PATH_SEP '/'
+    #define flib_stat_mtime_nsec(st) ((st).st_mtim.tv_nsec)
+    #define flib_stat_ctime_nsec(st) ((st).st_ctim.tv_nsec)
+#endif // _WIN32
+
 typedef struct{
     char name[FILENAME_MAX];
     char path[FILENAME_MAX];
     flib_type type;
     fsize_t size;
     time_t mod_time;
+    long mod_time_nsec;
+    time_t change_time; // inode change time (creation time on windows)
+    long change_time_nsec;
+    uint64_t inode;
+    uint64_t device;
+    uint32_t mode;
 } flib_entry;
 
+// open directory, entries are resolved relative to its fd instead of their full path
+typedef struct{
+    DIR *handle;
+    int fd;
+    char path[FILENAME_MAX];
+    size_t path_len;
+} flib_dir;
+
 CBQLIB bool flib_read(const char *path, flib_cont *fc);
 CBQLIB fsize_t flib_size(const char *path);
 CBQLIB bool flib_exists(const char *path);
@@ -68,10 +120,19 @@ CBQLIB bool flib_isdir(const char *path);
 CBQLIB bool flib_create_dir(const char *path);
 CBQLIB int flib_delete_dir(const char *path);
 CBQLIB int flib_copy_file(const char *from, const char *to);
+CBQLIB int flib_copy_file_method(const char *from, const char *to, flib_copy_method *method);
+CBQLIB bool flib_link_file(const char *from, const char *to);
+CBQLIB bool flib_set_attributes(const char *path, uint32_t mode, time_t mod_time, long mod_time_nsec);
 CBQLIB int flib_copy_dir_rec(const char *src, const char *dest);
 CBQLIB int flib_copy_dir_rec_ignore(const char *src, const char *dest, const char **ignore_names, size_t ignore_count);
 
 CBQLIB bool flib_get_entry(DIR *dir, const char *path, flib_entry *entry);
+CBQLIB bool flib_dir_open(flib_dir *dir, const char *path);
+CBQLIB bool flib_dir_next(flib_dir *dir, flib_entry *entry);
+CBQLIB bool flib_dir_readable(flib_dir *dir, const flib_entry *entry);
+CBQLIB bool flib_stat(const char *path, flib_entry *entry); // full metadata, also for the directories flib_dir_next does not stat
+CBQLIB bool flib_dir_stat(flib_dir *dir, const flib_entry *entry, flib_entry *attr); // flib_stat relative to the open directory
+CBQLIB void flib_dir_close(flib_dir *dir);
 CBQLIB fsize_t flib_dir_size(DIR *dir, const char *path);
 CBQLIB fsize_t flib_dir_size_rec(DIR *dir, const char *path);
 CBQLIB void flib_print_entry(flib_entry entry);
@@ -0,0 +1,43 @@
+#ifndef _CBQHASH_H
+#define _CBQHASH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <cebeq.h>
+
+#define HASH_SHA256_SIZE 32
+#define HASH_SHA256_HEX_SIZE (2*HASH_SHA256_SIZE+1)
+#define HASH_FILE_BUFFER_SIZE (256*1024)
+
+typedef struct{
+    uint32_t state[8];
+    uint64_t length; // total number of bytes hashed
+    uint8_t block[64];
+    size_t block_len;
+} hash_sha256_t;
+
+CBQLIB void hash_sha256_init(hash_sha256_t *ctx);
+CBQLIB void hash_sha256_update(hash_sha256_t *ctx, const void *data, size_t len);
+CBQLIB void hash_sha256_final(hash_sha256_t *ctx, uint8_t digest[HASH_SHA256_SIZE]);
+CBQLIB void hash_sha256(const void *data, size_t len, uint8_t digest[HASH_SHA256_SIZE]);
+
+// XXH64, a fast non-cryptographic hash to tell whether a file's content changed
+typedef struct{
+    uint64_t acc[4];
+    uint64_t length;
+    uint8_t block[32];
+    size_t block_len;
+} hash_xxh64_t;
+
+CBQLIB void hash_xxh64_init(hash_xxh64_t *ctx, uint64_t seed);
+CBQLIB void hash_xxh64_update(hash_xxh64_t *ctx, const void *data, size_t len);
+CBQLIB uint64_t hash_xxh64_final(const hash_xxh64_t *ctx);
+CBQLIB uint64_t hash_xxh64(const void *data, size_t len, uint64_t seed);
+CBQLIB bool hash_xxh64_file(const char *path, uint64_t *hash);
+
+// writes 2*len lowercase hex digits and a terminating NUL into buffer
+CBQLIB void hash_to_hex(const uint8_t *bytes, size_t len, char *buffer);
+
+#endif // _CBQHASH_H
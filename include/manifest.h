@@ -0,0 +1,169 @@
+#ifndef _CBQMANIFEST_H
+#define _CBQMANIFEST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <cebeq.h>
+#include <threading.h>
+#include <chunk.h>
+
+/*
+    Binary manifest of a backup, one file per backup: <backup>/.cebeq.manifest
+
+    Layout (native endianness):
+        manifest_header
+        manifest_entry[entry_count]
+        chunk_id[chunk_count] (only for deduplicated backups)
+        string table (NUL-terminated relative paths, '/' separated)
+
+    Entries are sorted in pre-order: every directory is directly followed by its
+    subtree, which ends at entry.next. Paths are compared component-wise, so the
+    file can be mmap'ed and binary searched without any parsing.
+
+    Every unchanged file knows which parent backup stores its content (entry.source),
+    so a merge resolves each file with one lookup, no matter how long the chain is.
+
+    Small files of a packed backup (MANIFEST_ENTRY_PACKED) are not stored on their
+    own but appended to one of the backup's segment files.
+
+    Files of a compressed backup (MANIFEST_ENTRY_COMPRESSED) are stored in the
+    container format of compress.h, entry.size and entry.hash describe the
+    original content. The header names the codec the branch used.
+
+    In a deduplicated backup (MANIFEST_FLAG_CHUNKED) every file lists the chunks
+    of its full content, so it can be restored without walking the parents.
+    The same holds for a full backup (MANIFEST_FLAG_FULL), whose unchanged files
+    are hardlinks to the previous version, unless it also has patches
+    (MANIFEST_FLAG_DELTA), which need the previous version of their file.
+*/
+
+#define MANIFEST_FILE INFO_FILE ".manifest"
+#define MANIFEST_MAGIC "CBQMANI"
+#define MANIFEST_VERSION 7
+#define MANIFEST_NONE UINT32_MAX
+#define MANIFEST_NO_OFFSET UINT64_MAX
+
+#define MANIFEST_FLAG_CHUNKED (1u << 0) // file contents live in the chunk store
+#define MANIFEST_FLAG_FULL    (1u << 1) // every file is stored (or hardlinked) in the backup itself
+#define MANIFEST_FLAG_DELTA   (1u << 2) // files may be stored as patches against the parent backup
+
+#define MANIFEST_ENTRY_HASHED (1u << 0) // entry.hash holds the XXH64 of the file's content
+#define MANIFEST_ENTRY_PACKED (1u << 1) // the content is stored in segment entry.segment at entry.pack_offset
+#define MANIFEST_ENTRY_COMPRESSED (1u << 2) // the stored file has to be decompressed, see compress.h
+
+typedef enum{
+    MANIFEST_NEW,       // content is stored in this backup
+    MANIFEST_UNCHANGED, // content is stored in one of the parent backups
+    MANIFEST_DELETED,   // existed in the parent backup, but not anymore
+    MANIFEST_DELTA,     // stored as a patch against the version in the parent backup
+    MANIFEST__STATE_COUNT
+} manifest_state;
+
+static const char* const manifest_state_names[] = {
+    [MANIFEST_NEW] = "new",
+    [MANIFEST_UNCHANGED] = "unchanged",
+    [MANIFEST_DELETED] = "deleted",
+    [MANIFEST_DELTA] = "delta",
+};
+
+_Static_assert(MANIFEST__STATE_COUNT == arr_len(manifest_state_names), "manifest_state count has changed!");
+
+typedef enum{
+    MANIFEST_TYPE_FILE,
+    MANIFEST_TYPE_DIR,
+} manifest_type;
+
+typedef struct{
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint64_t entry_count;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+    uint64_t parent_offset; // path of the parent backup in the string table or MANIFEST_NO_OFFSET
+    uint64_t chunks_offset;
+    uint64_t chunk_count;
+    int64_t scan_time;      // when the backup started scanning, see change_file_changed
+    int64_t scan_time_nsec;
+    uint32_t compression;   // compress_codec of the branch, single files may still be stored as they are
+    int32_t compression_level;
+} manifest_header;
+
+typedef struct{
+    uint64_t path_offset;
+    uint32_t path_len;
+    uint32_t parent;        // index of the containing directory or MANIFEST_NONE
+    uint32_t next;          // index of the first entry after this entry's subtree
+    uint8_t type;
+    uint8_t state;
+    uint16_t flags;
+    int64_t mod_time;
+    int64_t mod_time_nsec;
+    uint64_t size;
+    uint32_t mode;
+    uint32_t chunk_count;
+    uint64_t chunk_index;   // first chunk of this file in the chunk table
+    int64_t change_time;
+    int64_t change_time_nsec;
+    uint64_t inode;
+    uint64_t device;
+    uint64_t hash;
+    uint32_t source;        // for unchanged files: how many backups up the chain the content is stored
+    uint32_t segment;       // for packed files, see pack.h
+    uint64_t pack_offset;
+} manifest_entry;
+
+typedef struct{
+    void *data;
+    size_t size;
+    bool mapped;
+    const manifest_header *header;
+    const manifest_entry *entries;
+    const chunk_id *chunks;
+    const char *strings;
+    uint32_t count;
+} manifest_t;
+
+typedef struct{
+    char *path;
+    chunk_id *chunks; // entry.chunk_count ids
+    manifest_entry entry;
+} manifest_item;
+
+typedef struct{
+    manifest_item *items;
+    size_t count;
+    size_t capacity;
+} manifest_items;
+
+typedef struct{
+    manifest_items items;
+    uint32_t flags;
+    int64_t scan_time;
+    int64_t scan_time_nsec;
+    uint32_t compression;
+    int32_t compression_level;
+    mutex_t lock;
+} manifest_builder_t;
+
+CBQLIB bool manifest_open(manifest_t *manifest, const char *backup_path);
+CBQLIB void manifest_close(manifest_t *manifest);
+CBQLIB uint32_t manifest_find(const manifest_t *manifest, const char *path, size_t path_len);
+CBQLIB const char* manifest_path(const manifest_t *manifest, uint32_t index);
+CBQLIB const char* manifest_name(const manifest_t *manifest, uint32_t index);
+CBQLIB const char* manifest_parent_backup(const manifest_t *manifest);
+CBQLIB const chunk_id* manifest_chunks(const manifest_t *manifest, uint32_t index);
+CBQLIB int manifest_path_cmp(const char *a, size_t a_len, const char *b, size_t b_len);
+
+CBQLIB manifest_item* manifest_items_push(manifest_items *items, const char *path, manifest_entry entry);
+CBQLIB void manifest_item_set_chunks(manifest_item *item, const chunk_id *chunks, size_t count);
+CBQLIB void manifest_items_free(manifest_items *items);
+
+CBQLIB void manifest_builder_init(manifest_builder_t *builder);
+CBQLIB void manifest_builder_append(manifest_builder_t *builder, manifest_items *items);
+CBQLIB bool manifest_builder_write(manifest_builder_t *builder, const char *backup_path, const char *parent_backup);
+CBQLIB void manifest_builder_free(manifest_builder_t *builder);
+
+#endif // _CBQMANIFEST_H
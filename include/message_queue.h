@@ -1,11 +1,25 @@
 #ifndef _CBQMSGQ_H
 #define _CBQMSGQ_H
 
+#include <stdbool.h>
+#include <stddef.h>
+
 #include <cebeq.h>
 
-CBQLIB void msgq_init();
-CBQLIB void msgq_destroy();
-CBQLIB void msgq_push(const char* message);
-CBQLIB int  msgq_pop(char* out, int max_len);
+/*
+    Bounded lock-free queue for log messages: any number of worker threads
+    push, a single thread (the cli or gui) pops. When the queue is full new
+    messages are dropped and counted instead of overwriting older ones.
+    Before msgq_init and after msgq_destroy messages go straight to stderr.
+*/
+
+CBQLIB void   msgq_init(size_t capacity); // rounded up to a power of two, 0 for MSGQ_DEFAULT_CAPACITY
+CBQLIB void   msgq_destroy(void);
+CBQLIB bool   msgq_push(const char *message); // false if the message was dropped
+CBQLIB int    msgq_pop(char *out, int max_len);
+// waits up to timeout_ms (forever if negative) for a message, returns 0 on timeout or msgq_wake
+CBQLIB int    msgq_pop_wait(char *out, int max_len, long timeout_ms);
+CBQLIB void   msgq_wake(void);
+CBQLIB size_t msgq_dropped(void);
 
-#endif //_CBQMSGQ_H
\ No newline at end of file
+#endif //_CBQMSGQ_H
@@ -0,0 +1,52 @@
+#ifndef _CBQPACK_H
+#define _CBQPACK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include <cebeq.h>
+
+/*
+    Small files of a packed backup are appended to a few large segment files
+    instead of being stored one by one:
+        <backup>/.pack/<segment id>.cbqseg
+
+    The manifest entry keeps the segment and the offset, the length is entry.size.
+    Every backup worker appends to a segment of its own, so no locking is needed,
+    and starts a new one once it grows past PACK_SEGMENT_SIZE. Creating, restoring
+    and deleting a backup then costs a handful of files instead of one per file.
+*/
+
+#define PACK_DIR ".pack"
+#define PACK_SEGMENT_SUFFIX ".cbqseg"
+#define PACK_MAX_FILE_SIZE (64*1024)
+#define PACK_SEGMENT_SIZE (256ull*1024*1024)
+
+typedef struct{
+    int fd; // -1 while no segment is open
+    uint32_t id;
+    uint64_t size;
+} pack_writer_t;
+
+typedef struct{
+    char path[FILENAME_MAX];
+    atomic_uint next_id;
+    atomic_size_t files;
+    atomic_uint_least64_t bytes;
+    pack_writer_t *writers;
+    size_t writer_count;
+} pack_t;
+
+// creates <backup>/.pack with one writer per worker
+CBQLIB bool pack_open(pack_t *pack, const char *backup, size_t writer_count);
+CBQLIB bool pack_close(pack_t *pack);
+// appends src to the segment of the writer, size is what was actually read
+CBQLIB bool pack_append_file(pack_t *pack, size_t writer, const char *src, uint32_t *segment, uint64_t *offset, uint64_t *size, uint64_t *hash);
+
+CBQLIB void pack_segment_path(const char *backup, uint32_t segment, char *buffer, size_t buffer_size);
+CBQLIB int pack_segment_open(const char *backup, uint32_t segment);
+CBQLIB bool pack_extract(int segment_fd, uint64_t offset, uint64_t size, const char *dest);
+
+#endif // _CBQPACK_H
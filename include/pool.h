@@ -0,0 +1,49 @@
+#ifndef _CBQPOOL_H
+#define _CBQPOOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+#include <cebeq.h>
+#include <threading.h>
+
+#define POOL_DEQUE_CAPACITY 64
+
+typedef void (*task_fn)(void *arg);
+
+typedef struct{
+    task_fn fn;
+    void *arg;
+} task_t;
+
+// ring buffer of tasks: the owning worker pushes and pops at the tail, thieves take from the head
+typedef struct{
+    task_t *items;
+    size_t head;
+    size_t count;
+    size_t capacity;
+    mutex_t lock;
+} task_deque_t;
+
+typedef struct{
+    thread_t *threads;
+    task_deque_t *deques;
+    size_t deque_count;
+    size_t worker_count;
+    atomic_size_t queued;
+    atomic_size_t pending;
+    atomic_size_t next_deque;
+    atomic_bool stopping;
+    mutex_t lock;
+    cond_t work_available;
+    cond_t idle;
+} pool_t;
+
+CBQLIB bool pool_init(pool_t *pool, size_t worker_count);
+CBQLIB void pool_submit(pool_t *pool, task_fn fn, void *arg);
+CBQLIB void pool_wait(pool_t *pool);
+CBQLIB void pool_destroy(pool_t *pool);
+CBQLIB int pool_worker_index(void);
+
+#endif // _CBQPOOL_H
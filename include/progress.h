@@ -0,0 +1,80 @@
+#ifndef _CBQPROGRESS_H
+#define _CBQPROGRESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include <cebeq.h>
+
+/*
+    Progress of the running backup or merge, like the message queue there is
+    only ever one run: its workers add to the counters, the cli or gui samples
+    them into a progress_view.
+
+    The totals grow while the run finds files. They are only known once the
+    run has found everything (progress_scanned) or a pre-scan has estimated
+    them (progress_estimated), before that there is no ETA. A run is done with
+    a file once it is stored, linked or found to be unchanged.
+*/
+
+typedef struct{
+    atomic_bool running;
+    atomic_bool scanned;   // files_total and bytes_total are final
+    atomic_bool estimated; // the pre-scan has finished
+    atomic_uint_least64_t start_nsec;
+    atomic_uint_least64_t files_total;
+    atomic_uint_least64_t bytes_total;
+    atomic_uint_least64_t files_estimate;
+    atomic_uint_least64_t bytes_estimate;
+    atomic_uint_least64_t files_done;
+    atomic_uint_least64_t bytes_done;
+} progress_t;
+
+// what the cli or gui shows, only updated by progress_sample
+typedef struct{
+    bool running;
+    bool known; // totals are final or estimated
+    uint64_t files_done;
+    uint64_t files_total;
+    uint64_t bytes_done;
+    uint64_t bytes_total;
+    double elapsed;    // seconds
+    double throughput; // bytes per second, smoothed
+    double eta;        // seconds, negative while unknown
+    // last sample the throughput was measured against
+    uint64_t sample_nsec;
+    uint64_t sample_bytes;
+} progress_view;
+
+CBQLIB extern progress_t progress;
+
+CBQLIB void progress_start(void);
+CBQLIB void progress_stop(void);
+CBQLIB void progress_scanned(void);
+CBQLIB void progress_estimated(void);
+CBQLIB void progress_sample(progress_view *view);
+// "1.2 GiB / 4.0 GiB (30%), 1200 / 5000 files, 85.0 MiB/s, ETA 0:32"
+CBQLIB void progress_format(const progress_view *view, char *buffer, size_t buffer_size);
+CBQLIB float progress_fraction(const progress_view *view); // 0 to 1, 0 while the totals are unknown
+
+static inline void progress_found(uint64_t files, uint64_t bytes)
+{
+    atomic_fetch_add_explicit(&progress.files_total, files, memory_order_relaxed);
+    atomic_fetch_add_explicit(&progress.bytes_total, bytes, memory_order_relaxed);
+}
+
+static inline void progress_estimate(uint64_t files, uint64_t bytes)
+{
+    atomic_fetch_add_explicit(&progress.files_estimate, files, memory_order_relaxed);
+    atomic_fetch_add_explicit(&progress.bytes_estimate, bytes, memory_order_relaxed);
+}
+
+static inline void progress_done(uint64_t files, uint64_t bytes)
+{
+    atomic_fetch_add_explicit(&progress.files_done, files, memory_order_relaxed);
+    atomic_fetch_add_explicit(&progress.bytes_done, bytes, memory_order_relaxed);
+}
+
+#endif // _CBQPROGRESS_H
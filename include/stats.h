@@ -0,0 +1,129 @@
+#ifndef _CBQSTATS_H
+#define _CBQSTATS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include <cebeq.h>
+
+/*
+    Per-phase times and counters of a backup or merge run.
+
+    A run owns its stats_t and binds it to every thread that works for it
+    (stats_bind), so code without a run, like flib, still counts its system
+    calls into the right run. Phase times are summed over all threads: with
+    several jobs they add up to more than the wall time.
+
+    Disabled stats cost a branch: a disabled stats_t is never bound,
+    stats_begin does not read the clock and nothing is counted.
+*/
+
+typedef enum{
+    STATS_PHASE_CHAIN,    // reading the manifests of the parent backups
+    STATS_PHASE_SCAN,     // listing the sources and comparing them with the parent
+    STATS_PHASE_PLAN,     // resolving where each merged file is stored, creating directories
+    STATS_PHASE_STORE,    // copying, linking, packing, compressing or restoring file contents
+    STATS_PHASE_FINISH,   // attributes of merged directories
+    STATS_PHASE_MANIFEST, // writing the manifest
+    STATS_PHASE_INFO,     // reading and writing the json info files
+    STATS__PHASE_COUNT
+} stats_phase;
+
+static const char* const stats_phase_names[] = {
+    [STATS_PHASE_CHAIN] = "chain",
+    [STATS_PHASE_SCAN] = "scan",
+    [STATS_PHASE_PLAN] = "plan",
+    [STATS_PHASE_STORE] = "store",
+    [STATS_PHASE_FINISH] = "finish",
+    [STATS_PHASE_MANIFEST] = "manifest",
+    [STATS_PHASE_INFO] = "info",
+};
+
+_Static_assert(STATS__PHASE_COUNT == arr_len(stats_phase_names), "stats_phase count has changed!");
+
+typedef enum{
+    STATS_DIRS_SCANNED,
+    STATS_DIRS_REUSED, // taken from the parent's manifest without listing them, see watch.h
+    STATS_FILES_SCANNED,
+    STATS_BYTES_SCANNED,
+    STATS_FILES_COPIED, // content written by this run, restored files for a merge
+    STATS_BYTES_COPIED,
+    STATS_FILES_LINKED,
+    STATS_FILES_SKIPPED, // unchanged, nothing was written
+    STATS_ENTRIES_DELETED,
+    // system calls made through flib
+    STATS_SYS_OPEN,
+    STATS_SYS_STAT,
+    STATS_SYS_READ,
+    STATS_SYS_WRITE,
+    STATS_SYS_COPY, // reflink, copy_file_range and sendfile
+    STATS_SYS_MKDIR,
+    STATS_SYS_LINK,
+    STATS_SYS_ATTR,
+    STATS__COUNTER_COUNT
+} stats_counter;
+
+static const char* const stats_counter_names[] = {
+    [STATS_DIRS_SCANNED] = "dirs_scanned",
+    [STATS_DIRS_REUSED] = "dirs_reused",
+    [STATS_FILES_SCANNED] = "files_scanned",
+    [STATS_BYTES_SCANNED] = "bytes_scanned",
+    [STATS_FILES_COPIED] = "files_copied",
+    [STATS_BYTES_COPIED] = "bytes_copied",
+    [STATS_FILES_LINKED] = "files_linked",
+    [STATS_FILES_SKIPPED] = "files_skipped",
+    [STATS_ENTRIES_DELETED] = "entries_deleted",
+    [STATS_SYS_OPEN] = "open",
+    [STATS_SYS_STAT] = "stat",
+    [STATS_SYS_READ] = "read",
+    [STATS_SYS_WRITE] = "write",
+    [STATS_SYS_COPY] = "copy",
+    [STATS_SYS_MKDIR] = "mkdir",
+    [STATS_SYS_LINK] = "link",
+    [STATS_SYS_ATTR] = "attr",
+};
+
+_Static_assert(STATS__COUNTER_COUNT == arr_len(stats_counter_names), "stats_counter count has changed!");
+
+typedef struct{
+    bool enabled;
+    uint64_t start_nsec;
+    uint64_t wall_nsec;
+    atomic_uint_least64_t phase_nsec[STATS__PHASE_COUNT];
+    atomic_uint_least64_t counters[STATS__COUNTER_COUNT];
+} stats_t;
+
+CBQLIB extern _Thread_local stats_t *stats_current;
+
+CBQLIB uint64_t stats_now(void); // monotonic, in nanoseconds
+CBQLIB void stats_init(stats_t *stats, bool enabled);
+CBQLIB void stats_bind(stats_t *stats); // counts the system calls of this thread into stats, NULL to stop
+CBQLIB void stats_finish(stats_t *stats); // stops the wall clock
+CBQLIB void stats_print(const stats_t *stats);
+CBQLIB bool stats_write_json(const stats_t *stats, const char *operation, const char *path);
+
+static inline uint64_t stats_begin(const stats_t *stats)
+{
+    return stats->enabled? stats_now() : 0;
+}
+
+static inline void stats_end(stats_t *stats, stats_phase phase, uint64_t begin)
+{
+    if (stats->enabled) atomic_fetch_add_explicit(&stats->phase_nsec[phase], stats_now()-begin, memory_order_relaxed);
+}
+
+static inline void stats_add(stats_t *stats, stats_counter counter, uint64_t value)
+{
+    if (stats->enabled) atomic_fetch_add_explicit(&stats->counters[counter], value, memory_order_relaxed);
+}
+
+// for code that does not know the run, counts into the stats bound to this thread
+static inline void stats_count(stats_counter counter, uint64_t value)
+{
+    stats_t *stats = stats_current;
+    if (stats != NULL) atomic_fetch_add_explicit(&stats->counters[counter], value, memory_order_relaxed);
+}
+
+#endif // _CBQSTATS_H
@@ -0,0 +1,81 @@
+#ifndef _CBQTAR_H
+#define _CBQTAR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <cebeq.h>
+
+/*
+    POSIX pax archives (ustar headers, extended by 'x' records where ustar falls short).
+
+    An entry is a 512 byte header followed by its content, padded to a multiple
+    of 512 bytes; two empty blocks end the archive. A pax record header is only
+    written for long paths, files of 8 GiB and more and modification times with
+    nanoseconds, so archives of short paths stay plain ustar.
+
+    Headers and small files are collected in the writer's buffer, so a small file
+    costs one read and no write of its own. Larger files are flushed straight
+    from their fd with sendfile where the platform has it.
+
+    The reader takes any stream (pipes included, nothing is seeked) of ustar, pax
+    or GNU archives. Extended headers and GNU long names are folded into the entry
+    they describe, content is handed out in pieces of the read buffer.
+*/
+
+#define TAR_BLOCK_SIZE 512
+#define TAR_BUFFER_SIZE (256*1024)
+// files up to this size are read into the buffer, larger ones are sent without copying
+#define TAR_SMALL_FILE_SIZE (64*1024)
+
+typedef enum{
+    TAR_TYPE_FILE,
+    TAR_TYPE_DIR,
+    TAR_TYPE_OTHER, // links, devices and fifos, only read
+} tar_type;
+
+typedef struct{
+    const char *path; // '/' separated and relative, directories without a trailing '/'
+    tar_type type;
+    uint32_t mode;
+    uint64_t size;
+    int64_t mod_time;
+    int64_t mod_time_nsec;
+} tar_entry;
+
+typedef struct{
+    int fd;
+    uint8_t *buffer;
+    size_t len;
+} tar_writer;
+
+typedef struct{
+    int fd;
+    uint8_t *buffer;
+    size_t start;
+    size_t end;
+    uint64_t remaining; // content of the current entry that was not handed out yet
+    uint64_t padding;
+    char path[FILENAME_MAX];
+} tar_reader;
+
+CBQLIB void tar_writer_init(tar_writer *writer, int fd);
+CBQLIB bool tar_writer_flush(tar_writer *writer);
+// writes the end of the archive and frees the buffer, the fd stays open
+CBQLIB bool tar_writer_finish(tar_writer *writer);
+CBQLIB bool tar_write(tar_writer *writer, const void *data, size_t len);
+CBQLIB bool tar_write_header(tar_writer *writer, const tar_entry *entry);
+// size bytes of fd starting at offset, the content of a file entry
+CBQLIB bool tar_write_content(tar_writer *writer, int fd, uint64_t offset, uint64_t size, const char *name);
+// pads the content of an entry of this size to the next block
+CBQLIB bool tar_write_padding(tar_writer *writer, uint64_t size);
+
+CBQLIB void tar_reader_init(tar_reader *reader, int fd);
+CBQLIB void tar_reader_free(tar_reader *reader);
+// skips what is left of the current entry, 1: entry.path points into the reader, 0: end of the archive, -1: error
+CBQLIB int tar_read_header(tar_reader *reader, tar_entry *entry);
+// 1: the next piece of the current entry's content, 0: its end, -1: the archive is truncated
+CBQLIB int tar_read_content(tar_reader *reader, const uint8_t **data, size_t *len);
+
+#endif // _CBQTAR_H
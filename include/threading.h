@@ -1,16 +1,20 @@
 #ifndef _CBQTHREADING_H
 #define _CBQTHREADING_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <cebeq.h>
 
 #ifdef _WIN32
 #include <windows.h>
 typedef HANDLE thread_t;
 typedef CRITICAL_SECTION mutex_t;
+typedef CONDITION_VARIABLE cond_t;
 #else
 #include <pthread.h>
 typedef pthread_t thread_t;
 typedef pthread_mutex_t mutex_t;
+typedef pthread_cond_t cond_t;
 #endif
 
 typedef void* (*thread_fn)(void* arg);
@@ -21,5 +25,12 @@ CBQLIB void mutex_init(mutex_t* mtx);
 CBQLIB void mutex_lock(mutex_t* mtx);
 CBQLIB void mutex_unlock(mutex_t* mtx);
 CBQLIB void mutex_destroy(mutex_t* mtx);
+CBQLIB void cond_init(cond_t* cond);
+CBQLIB void cond_wait(cond_t* cond, mutex_t* mtx);
+CBQLIB bool cond_timedwait(cond_t* cond, mutex_t* mtx, unsigned long timeout_ms); // false on timeout
+CBQLIB void cond_signal(cond_t* cond);
+CBQLIB void cond_broadcast(cond_t* cond);
+CBQLIB void cond_destroy(cond_t* cond);
+CBQLIB size_t cpu_count(void);
 
-#endif //_CBQTHREADING_H
\ No newline at end of file
+#endif //_CBQTHREADING_H
@@ -0,0 +1,68 @@
+#ifndef _CBQTRACE_H
+#define _CBQTRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include <cebeq.h>
+#include <stats.h>
+
+/*
+    Scoped events of every thread, written in the Chrome trace event format
+    (chrome://tracing, ui.perfetto.dev). Only builds with CEBEQ_TRACE
+    (./nob --trace) record anything, otherwise TRACE_SCOPE is nothing at all.
+
+    Each thread appends to its own list of blocks, no locks and no atomics
+    beyond registering the thread once. An event is reserved when its scope
+    begins and gets its duration when the scope ends, so nested scopes need
+    no stack. trace_write may only be called once the traced threads are done.
+*/
+
+// the end of the detail (usually a path) is kept, that is where names differ
+#define TRACE_DETAIL_SIZE 72
+#define TRACE_BLOCK_EVENTS 4096
+
+typedef struct{
+    const char *name; // a string literal
+    uint64_t start;
+    uint64_t duration;
+    char detail[TRACE_DETAIL_SIZE];
+} trace_event;
+
+CBQLIB bool trace_available(void);
+CBQLIB void trace_start(void);
+// stops tracing, writes the events to path and frees them
+CBQLIB bool trace_write(const char *path);
+
+#ifdef CEBEQ_TRACE
+
+CBQLIB extern atomic_bool trace_enabled;
+
+CBQLIB trace_event* trace__begin(const char *name, const char *detail);
+
+static inline trace_event* trace_begin(const char *name, const char *detail)
+{
+    if (!atomic_load_explicit(&trace_enabled, memory_order_relaxed)) return NULL;
+    return trace__begin(name, detail);
+}
+
+static inline void trace_end(trace_event **event)
+{
+    if (*event != NULL) (*event)->duration = stats_now() - (*event)->start;
+}
+
+#define TRACE__CONCAT2(a, b) a##b
+#define TRACE__CONCAT(a, b) TRACE__CONCAT2(a, b)
+// an event from here to the end of the enclosing block, detail may be NULL
+#define TRACE_SCOPE(name, detail) \
+    trace_event *TRACE__CONCAT(trace__event_, __LINE__) __attribute__((cleanup(trace_end))) = trace_begin(name, detail)
+
+#else
+
+#define TRACE_SCOPE(name, detail) ((void) 0)
+
+#endif // CEBEQ_TRACE
+
+#endif // _CBQTRACE_H
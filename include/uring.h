@@ -0,0 +1,68 @@
+#ifndef _CBQURING_H
+#define _CBQURING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <cebeq.h>
+
+/*
+    Batched file copies with io_uring, for trees of many small files where one
+    synchronous open/read/write/close after the other leaves the disk waiting.
+
+    Up to depth files are in flight at once. Each of them opens and stats its source
+    and opens its destination at the same time, moves the data with reads and writes
+    through its own buffer and closes both files again. Ownership, permissions and
+    timestamps are copied like flib_copy_file does.
+
+    The ring is set up with the raw syscalls, there is no dependency on liburing.
+    uring_supported tells if the kernel can do all of the above, anywhere else the
+    callers simply keep using flib_copy_file.
+*/
+
+#define URING_DEFAULT_DEPTH 32
+#define URING_MAX_DEPTH 1024
+#define URING_BUFFER_SIZE (64*1024)
+// bigger files are left to flib_copy_file, which can clone them or copy them in the kernel
+#define URING_MAX_FILE_SIZE (1024*1024)
+// files that callers hand to a single uring_copy_files call
+#define URING_BATCH_FILES 256
+
+typedef struct{
+    const char *from;
+    const char *to;
+    int error; // 0 once the file is copied, an errno value otherwise
+} uring_copy_t;
+
+typedef struct{
+    int fd;
+    unsigned depth;
+    unsigned to_submit;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring; // the same mapping as sq_ring on kernels with a single mmap
+    size_t cq_ring_size;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    void *sqes;
+    size_t sqes_size;
+    void *cqes;
+    void *slots;
+    uint8_t *buffers;
+} uring_t;
+
+CBQLIB bool uring_supported(void);
+CBQLIB bool uring_init(uring_t *ring, unsigned depth);
+CBQLIB void uring_destroy(uring_t *ring);
+// one ring for every pool worker, NULL if io_uring cannot be used
+CBQLIB uring_t* uring_create_rings(size_t count, unsigned depth);
+CBQLIB void uring_destroy_rings(uring_t *rings, size_t count);
+// copies every file, returns how many of them failed
+CBQLIB size_t uring_copy_files(uring_t *ring, uring_copy_t *copies, size_t count);
+
+#endif // _CBQURING_H
@@ -0,0 +1,68 @@
+#ifndef _CBQWATCH_H
+#define _CBQWATCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <cebeq.h>
+
+/*
+    Change journal of a branch, kept by 'cbq watch <branch>' (Linux, inotify).
+
+    The daemon watches every directory of the branch and appends each directory
+    whose listing, files or attributes changed to <program_dir>/data/<branch>.journal,
+    with the second it noticed the change. Paths are relative like in a manifest,
+    starting with the name of the branch directory. A new backup lists only the
+    directories changed since its parent scanned, everything else is taken from
+    the parent's manifest.
+
+    The journal is only complete while the daemon holds the lock file next to it,
+    from its "since" second on and after the last time the kernel's event queue
+    overflowed. Anything else and the backup scans everything, as it always did.
+    Events can still wait in the queue when a backup starts, so the backup first
+    creates a file in the barrier directory the daemon watches with the same queue.
+    Once the daemon journals that name, it has journaled every change made before.
+    Changes inotify never reports (files written through another hardlink outside
+    the branch, network filesystems changed by other hosts) need a full scan.
+
+    Text format, one record per line:
+        cebeq-journal 1
+        since <seconds>
+        root <directory of the branch>
+        overflow <seconds>
+        barrier <name of the last file created in the barrier directory>
+        <seconds> <relative path of a changed directory>
+*/
+
+#define WATCH_JOURNAL_MAGIC "cebeq-journal 1"
+#define WATCH_JOURNAL_SUFFIX ".journal"
+#define WATCH_LOCK_SUFFIX ".journal.lock"
+#define WATCH_BARRIER_SUFFIX ".barrier"
+
+typedef struct{
+    int64_t time;
+    char *rel;
+} watch_change;
+
+typedef struct{
+    int64_t since;    // every change from this second on is in the journal
+    int64_t overflow; // last second changes were lost, 0 for never
+    char *barrier;    // NULL before the first backup waited for the daemon
+    char **roots;
+    size_t root_count;
+    watch_change *changes;
+    size_t count;
+} watch_journal;
+
+CBQLIB bool watch_journal_path(const char *branch_name, const char *suffix, char *buffer, size_t buffer_size);
+// false if the branch has no journal or it is damaged
+CBQLIB bool watch_journal_read(watch_journal *journal, const char *branch_name);
+CBQLIB void watch_journal_free(watch_journal *journal);
+// reads the journal once the daemon has handled every change made before the call, false if it does not in time
+CBQLIB bool watch_journal_sync(watch_journal *journal, const char *branch_name);
+// a daemon is watching the branch right now
+CBQLIB bool watch_running(const char *branch_name);
+CBQLIB void watch_stop(void); // async-signal-safe, ends watch() within a second
+
+#endif // _CBQWATCH_H
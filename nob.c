@@ -14,7 +14,21 @@
     X("flib")\
     X("cebeq")\
     X("threading")\
+    X("pool")\
+    X("manifest")\
+    X("hash")\
+    X("chunk")\
     X("message_queue")\
+    X("change")\
+    X("delta")\
+    X("uring")\
+    X("pack")\
+    X("compress")\
+    X("tar")\
+    X("stats")\
+    X("progress")\
+    X("trace")\
+    X("watch")\
     
 #define X(name) "src/"name".c",
 const char *src_files[] = {
@@ -39,10 +53,13 @@ void print_usage(const char *program_name)
     printf("  cli        Build the CLI application (requires 'lib' to be built first)\n");
     printf("  gui        Build the GUI application (requires 'lib' to be built first)\n");
     printf("  all        Build lib, cli, and gui in the correct order\n");
+    printf("  bench      Build the benchmark driver (requires 'lib' to be built first)\n");
     printf("  clean      Remove all build and bin artifacts\n\n");
 
     printf("Options:\n");
     printf("  --static   Build statically linked versions of following targets\n");
+    printf("  --zstd     Build following targets with zstd compression (needs libzstd)\n");
+    printf("  --trace    Build following targets with tracing ('--trace <file>' of backup and merge)\n");
     printf("  -h, --help Show this help message\n\n");
 }
 
@@ -59,11 +76,21 @@ bool create_dirs()
     return true;
 }
 
+bool with_zstd = false;
+bool with_trace = false;
+
 void append_head(Nob_Cmd *cmd)
 {
-    nob_cmd_append(cmd, "gcc", "-std=gnu2x");
+    nob_cmd_append(cmd, "gcc", "-std=gnu2x", "-O2");
     nob_cmd_append(cmd, "-Wall", "-Wextra", "-Werror", "-Wno-unused-value", "-Wno-stringop-overflow", "-Wno-format-truncation");
     nob_cmd_append(cmd, "-I", "./include", "-I.");
+    if (with_zstd) nob_cmd_append(cmd, "-DCEBEQ_ZSTD");
+    if (with_trace) nob_cmd_append(cmd, "-DCEBEQ_TRACE");
+}
+
+void append_libs(Nob_Cmd *cmd)
+{
+    if (with_zstd) nob_cmd_append(cmd, "-lzstd");
 }
 
 bool build_lib(Nob_Cmd *cmd, bool compile_static)
@@ -96,6 +123,7 @@ bool build_lib(Nob_Cmd *cmd, bool compile_static)
     #else
         nob_cmd_append(cmd, "-fPIC", "-shared", "-o", "bin/libcebeq.so");
     #endif
+        append_libs(cmd);
         return nob_cmd_run(cmd);
     }
 }
@@ -112,6 +140,7 @@ bool build_cli(Nob_Cmd *cmd, bool compile_static)
     } else {
         nob_cmd_append(cmd, "-Lbin", "-lcebeq");
     }
+    append_libs(cmd);
 
 #ifndef _WIN32
     if (!compile_static)
@@ -133,6 +162,7 @@ bool build_gui(Nob_Cmd *cmd, bool compile_static)
         nob_cmd_append(cmd, "-Wl,-rpath,$ORIGIN");
     }
 
+    append_libs(cmd);
     nob_cmd_append(cmd, "-Llib", "-lraylib");
     nob_cmd_append(cmd, "-Wno-unused-function");
     nob_cmd_append(cmd, "-D", "NOB_NO_MINIRENT");
@@ -151,6 +181,27 @@ bool build_gui(Nob_Cmd *cmd, bool compile_static)
     return true;
 }
 
+bool build_bench(Nob_Cmd *cmd, bool compile_static)
+{
+    nob_log(NOB_INFO, "Building bench..");
+    append_head(cmd);
+    nob_cmd_append(cmd, "-o", "bin/cbqbench", "src/bench.c");
+
+    if (compile_static) {
+        nob_cmd_append(cmd, "-static");
+        nob_cmd_append(cmd, "build/libcebeq.a");
+    } else {
+        nob_cmd_append(cmd, "-Lbin", "-lcebeq");
+    }
+    append_libs(cmd);
+
+#ifndef _WIN32
+    if (!compile_static)
+        nob_cmd_append(cmd, "-Wl,-rpath,$ORIGIN");
+#endif
+    return nob_cmd_run(cmd);
+}
+
 bool build_all(Nob_Cmd *cmd, bool compile_static)
 {
     return build_lib(cmd, compile_static) && build_cli(cmd, compile_static) && build_gui(cmd, compile_static);
@@ -209,6 +260,9 @@ int main(int argc, char **argv)
         else if (strcmp(target, "lib") == 0) {
             if (!create_dirs() || !build_lib(&cmd, compile_static)) return 1;
         }
+        else if (strcmp(target, "bench") == 0) {
+            if (!create_dirs() || !build_bench(&cmd, compile_static)) return 1;
+        }
         else if (strcmp(target, "all") == 0) {
             if (!create_dirs() || !build_all(&cmd, compile_static)) return 1;
         }
@@ -222,6 +276,12 @@ int main(int argc, char **argv)
         else if (strcmp(target, "--static") == 0){
             compile_static = true;
         }
+        else if (strcmp(target, "--zstd") == 0){
+            with_zstd = true;
+        }
+        else if (strcmp(target, "--trace") == 0){
+            with_trace = true;
+        }
         else{
             fprintf(stderr, "[ERROR] Unknown target: '%s'!\n", target);
             return 1;
@@ -14,10 +14,97 @@
 #include <cson.h>
 #include <cwalk.h>
 #include <flib.h>
+#include <pool.h>
+#include <manifest.h>
+#include <chunk.h>
+#include <change.h>
+#include <hash.h>
+#include <delta.h>
+#include <uring.h>
+#include <pack.h>
+#include <compress.h>
+#include <tar.h>
+#include <stats.h>
+#include <progress.h>
+#include <trace.h>
+#include <watch.h>
 
 
 
-char temp_path_buffer[FILENAME_MAX];
+typedef struct backup_node backup_node;
+
+// what the summary at the end of a backup reports, counted whether or not --stats is on
+typedef struct{
+    atomic_size_t copies[FLIB_COPY__COUNT];
+    atomic_size_t links;
+    atomic_size_t same_content;
+    atomic_size_t deltas;
+    atomic_uint_least64_t delta_file_bytes;
+    atomic_uint_least64_t delta_stored_bytes;
+    atomic_size_t compressed;
+    atomic_uint_least64_t compressed_file_bytes;
+    atomic_uint_least64_t compressed_stored_bytes;
+    atomic_size_t incompressible;
+} backup_summary;
+
+typedef struct{
+    pool_t pool;
+    atomic_bool failed;
+    backup_options_t options;
+    const char *path; // of the new backup
+    manifest_t prev;
+    bool has_prev;
+    uint8_t *seen; // entries of the previous manifest that still exist
+    uint8_t *changed; // directories of the previous manifest the change journal has seen change, NULL to list every directory
+    bool prev_chunked;
+    // parent backups up to the first full one, only opened for --link-unchanged and --delta
+    manifest_t *chain;
+    char **chain_paths;
+    size_t chain_len;
+    manifest_builder_t manifest;
+    chunk_store_t chunks;
+    uring_t *rings; // one per worker, only set up for --uring
+    pack_t pack;
+    bool packing;
+    stats_t stats;
+    backup_summary summary;
+    atomic_size_t scanning; // directories not scanned yet, progress has its totals once this drops to 0
+    pool_t estimate; // walks the sources alongside the backup with --estimate
+    atomic_size_t estimating;
+} backup_run;
+
+// one directory of the backup, it is finished once the scan and all children are done
+struct backup_node{
+    backup_run *run;
+    backup_node *parent;
+    atomic_size_t pending;
+    uint32_t prev_index; // index of this directory in the previous manifest
+    char *src;
+    char *dest;
+    char *rel;
+    char *prev;
+    // only used for the json export
+    CsonArena arena;
+    Cson *files;
+    Cson *dirs;
+};
+
+// small files of a directory copied together with io_uring, their manifest items are already added
+typedef struct{
+    backup_node *node;
+    uring_copy_t copies[URING_BATCH_FILES];
+    uint64_t sizes[URING_BATCH_FILES];
+    size_t count;
+} backup_copy_batch;
+
+typedef struct{
+    backup_node *node;
+    char *src;
+    char *dest;
+    char *rel;              // only set when the job adds the manifest item itself
+    uint32_t compare_index; // previous version to compare the content hash with or MANIFEST_NONE
+    manifest_entry entry;
+} backup_copy_job;
 
 void format_time(time_t *rawtime, char *buffer, size_t buffer_size){
     struct tm * timeinfo;
@@ -25,6 +112,57 @@ void format_time(time_t *rawtime, char *buffer, size_t buffer_size){
     snprintf(buffer, buffer_size-1, "%d/%d/%d %02d:%02d:%02d", timeinfo->tm_year + 1900, timeinfo->tm_mon + 1, timeinfo->tm_mday, timeinfo->tm_hour, timeinfo->tm_min, timeinfo->tm_sec);
 }
 
+void print_copy_summary(backup_summary *summary)
+{
+    size_t total = 0;
+    char methods[MAX_MSG_LEN] = {0};
+    size_t len = 0;
+    for (size_t i=0; i<FLIB_COPY__COUNT; ++i){
+        size_t count = atomic_load(&summary->copies[i]);
+        if (count == 0) continue;
+        total += count;
+        len += snprintf(methods+len, sizeof(methods)-len, "%s%s: %zu", len>0? ", ": "", flib_copy_method_names[i], count);
+        if (len >= sizeof(methods)) break;
+    }
+    if (total == 0){
+        iprintf("Copied 0 files");
+    } else{
+        iprintf("Copied %zu files (%s)", total, methods);
+    }
+    size_t links = atomic_load(&summary->links);
+    if (links > 0) iprintf("Linked %zu unchanged files", links);
+    size_t same = atomic_load(&summary->same_content);
+    if (same > 0) iprintf("Skipped %zu touched files with unchanged content", same);
+    size_t deltas = atomic_load(&summary->deltas);
+    if (deltas > 0){
+        iprintf("Stored %zu files as patches (%"PRIu64" of %"PRIu64" bytes)", deltas, (uint64_t) atomic_load(&summary->delta_stored_bytes), (uint64_t) atomic_load(&summary->delta_file_bytes));
+    }
+}
+
+void print_compress_summary(backup_summary *summary, compress_codec codec)
+{
+    size_t count = atomic_load(&summary->compressed);
+    size_t skipped = atomic_load(&summary->incompressible);
+    if (count == 0 && skipped == 0) return;
+    iprintf("Compressed %zu files with %s (%.2f of %.2f MiB), %zu incompressible files were stored as they are", count, compress_codec_names[codec],
+            atomic_load(&summary->compressed_stored_bytes)/(1024.0*1024.0), atomic_load(&summary->compressed_file_bytes)/(1024.0*1024.0), skipped);
+}
+
+void print_pack_summary(pack_t *pack)
+{
+    size_t files = atomic_load(&pack->files);
+    if (files > 0) iprintf("Packed %zu small files (%.2f MiB) into %u segments", files, atomic_load(&pack->bytes)/(1024.0*1024.0), atomic_load(&pack->next_id));
+}
+
+void print_chunk_summary(chunk_store_t *store)
+{
+    size_t chunks_new = atomic_load(&store->chunks_new);
+    size_t chunks_dup = atomic_load(&store->chunks_dup);
+    uint64_t bytes_new = atomic_load(&store->bytes_new);
+    uint64_t bytes_dup = atomic_load(&store->bytes_dup);
+    iprintf("Stored %zu new chunks (%.2f MiB), %zu chunks (%.2f MiB) were already stored", chunks_new, bytes_new/(1024.0*1024.0), chunks_dup, bytes_dup/(1024.0*1024.0));
+}
+
 bool path_in_backup(const char *path, const char *backup)
 {
     if (path == NULL || backup == NULL) return false;
@@ -51,140 +189,750 @@ bool path_in_backup(const char *path, const char *backup)
     return result;
 }
 
-int make_backup_rec(const char *src, const char *dest, const char *prev)
+void backup_dir_task(void *arg);
+
+backup_node* backup_node_new(backup_run *run, backup_node *parent, const char *src, const char *dest, const char *rel, const char *prev, uint32_t prev_index)
 {
-    int result = 0;
+    backup_node *node = calloc(1, sizeof(*node));
+    assert(node != NULL && "Buy more RAM lol");
+    node->run = run;
+    node->parent = parent;
+    atomic_init(&node->pending, 1);
+    node->prev_index = prev_index;
+    node->src = strdup(src);
+    node->dest = strdup(dest);
+    node->rel = strdup(rel);
+    node->prev = prev != NULL? strdup(prev) : NULL;
+    if (parent != NULL) atomic_fetch_add(&parent->pending, 1);
+    return node;
+}
+
+void backup_node_write_json(backup_node *node)
+{
+    TRACE_SCOPE("backup_write_json", node->rel);
+    CsonArena *prev_arena = cson_current_arena;
+    cson_swap_arena(&node->arena);
+    if (node->files == NULL) node->files = cson_map_new();
+    if (node->dirs == NULL) node->dirs = cson_map_new();
     Cson *root = cson_map_new();
-    Cson *files = cson_map_new();
-    Cson *dirs = cson_map_new();
-    DIR *dir = opendir(src);
-    if (dir == NULL){
-        if (!flib_exists(src)){
-            eprintf("This is no valid src directory: '%s'!", src);
-            return 1;
+    cson_map_insert(root, cson_str_new("files"), node->files);
+    cson_map_insert(root, cson_str_new("dirs"), node->dirs);
+    if (node->prev == NULL){
+        cson_map_insert(root, cson_str_new("parent"), cson_new_null());
+    } else{
+        char parent[FILENAME_MAX] = {0};
+        cwk_path_normalize(node->prev, parent, FILENAME_MAX);
+        cson_map_insert(root, cson_str_new("parent"), cson_new_cstring(parent));
+    }
+    char info_path[FILENAME_MAX] = {0};
+    cwk_path_join(node->dest, INFO_FILE, info_path, FILENAME_MAX);
+    if (!cson_write_compact(root, info_path)){
+        eprintf("Could not write info file '%s'!", info_path);
+        atomic_store(&node->run->failed, true);
+    }
+    cson_swap_and_free_arena(prev_arena);
+}
+
+void backup_node_release(backup_node *node)
+{
+    while (node != NULL){
+        if (atomic_fetch_sub(&node->pending, 1) != 1) return;
+        backup_node *parent = node->parent;
+        if (node->run->options.json_export) backup_node_write_json(node);
+        free(node->src);
+        free(node->dest);
+        free(node->rel);
+        free(node->prev);
+        free(node);
+        node = parent;
+    }
+}
+
+bool backup_chunk_file(backup_copy_job *job)
+{
+    backup_run *run = job->node->run;
+    chunk_list chunks = {0};
+    if (!chunk_store_add_file(&run->chunks, job->src, &chunks)){
+        chunk_list_free(&chunks);
+        return false;
+    }
+    manifest_items items = {0};
+    manifest_item_set_chunks(manifest_items_push(&items, job->rel, job->entry), chunks.items, chunks.count);
+    manifest_builder_append(&run->manifest, &items);
+    chunk_list_free(&chunks);
+    return true;
+}
+
+bool backup_open_chain(backup_run *run, const char *parent)
+{
+    TRACE_SCOPE("backup_open_chain", parent);
+    const char *path = parent;
+    while (path != NULL){
+        run->chain = realloc(run->chain, (run->chain_len+1)*sizeof(*run->chain));
+        run->chain_paths = realloc(run->chain_paths, (run->chain_len+1)*sizeof(*run->chain_paths));
+        assert(run->chain != NULL && run->chain_paths != NULL && "Buy more RAM lol");
+        manifest_t *manifest = &run->chain[run->chain_len];
+        if (!manifest_open(manifest, path)) return false;
+        run->chain_paths[run->chain_len++] = strdup(path);
+        if (manifest->header->flags & (MANIFEST_FLAG_FULL | MANIFEST_FLAG_CHUNKED)) break;
+        path = manifest_parent_backup(manifest);
+    }
+    return true;
+}
+
+void backup_close_chain(backup_run *run)
+{
+    for (size_t i=0; i<run->chain_len; ++i){
+        manifest_close(&run->chain[i]);
+        free(run->chain_paths[i]);
+    }
+    free(run->chain);
+    free(run->chain_paths);
+}
+
+// how many backups up the chain the content of an unchanged file is stored
+uint32_t backup_source(backup_run *run, uint32_t prev_index)
+{
+    // everything a full or deduplicated backup contains can be restored from it directly
+    if (run->manifest.flags & (MANIFEST_FLAG_FULL | MANIFEST_FLAG_CHUNKED)) return 0;
+    const manifest_entry *prev = &run->prev.entries[prev_index];
+    if (prev->state != MANIFEST_UNCHANGED || (run->prev.header->flags & (MANIFEST_FLAG_FULL | MANIFEST_FLAG_CHUNKED))) return 1;
+    return prev->source + 1;
+}
+
+// finds the backup in the chain that stores the content of a file, returns its index or -1
+int backup_locate(backup_run *run, const char *rel, size_t rel_len, const manifest_entry **stored)
+{
+    for (size_t i=0; i<run->chain_len; ++i){
+        const manifest_t *manifest = &run->chain[i];
+        uint32_t index = manifest_find(manifest, rel, rel_len);
+        if (index == MANIFEST_NONE) return -1;
+        const manifest_entry *entry = &manifest->entries[index];
+        if (entry->type != MANIFEST_TYPE_FILE || entry->state == MANIFEST_DELETED) return -1;
+        // a deduplicated backup has no files, only chunks
+        if (manifest->header->flags & MANIFEST_FLAG_CHUNKED) return -1;
+        if (entry->state != MANIFEST_UNCHANGED || (manifest->header->flags & MANIFEST_FLAG_FULL)){
+            *stored = entry;
+            return (int) i;
         }
-        eprintf("Cannot access '%s'!. Skipping..", src);
-        goto write;
     }
-    if (!flib_isdir(dest)){
-        eprintf("This is no valid dest directory: '%s'!", dest);
-        closedir(dir);
-        return 1;
+    return -1;
+}
+
+// hardlinks the stored version of an unchanged file into the new backup
+bool backup_link_unchanged(backup_run *run, const char *rel, size_t rel_len, const char *dest)
+{
+    const manifest_entry *stored = NULL;
+    int i = backup_locate(run, rel, rel_len, &stored);
+    // a patch is no file to link to
+    if (i < 0 || stored->state == MANIFEST_DELTA) return false;
+    char path[FILENAME_MAX] = {0};
+    cwk_path_join(run->chain_paths[i], rel, path, sizeof(path));
+    if (!flib_link_file(path, dest)) return false;
+    atomic_fetch_add(&run->summary.links, 1);
+    stats_add(&run->stats, STATS_FILES_LINKED, 1);
+    if (run->options.delta && stored->size >= DELTA_MIN_FILE_SIZE){
+        // the signature comes along, so the next version can still be stored as a patch
+        char sig_path[FILENAME_MAX] = {0};
+        char sig_dest[FILENAME_MAX] = {0};
+        if (delta_path(run->chain_paths[i], rel, DELTA_SIG_SUFFIX, false, sig_path, sizeof(sig_path))
+            && flib_exists(sig_path) && delta_path(run->path, rel, DELTA_SIG_SUFFIX, true, sig_dest, sizeof(sig_dest))){
+            (void) flib_link_file(sig_path, sig_dest);
+        }
     }
-    if (prev != NULL && !flib_isdir(prev)){
-        eprintf("This is no valid previous directory: '%s'!", prev);
-        closedir(dir);
-        return 1;
+    return true;
+}
+
+void backup_push_item(backup_copy_job *job)
+{
+    manifest_items items = {0};
+    manifest_items_push(&items, job->rel, job->entry);
+    manifest_builder_append(&job->node->run->manifest, &items);
+}
+
+// only the metadata of the file changed, its content is compared with the previous version before copying
+bool backup_same_content(backup_copy_job *job)
+{
+    backup_run *run = job->node->run;
+    const manifest_entry *prev = &run->prev.entries[job->compare_index];
+    uint64_t hash;
+    if (!hash_xxh64_file(job->src, &hash)) return false;
+    job->entry.hash = hash;
+    job->entry.flags |= MANIFEST_ENTRY_HASHED;
+    if (hash != prev->hash) return false;
+    if (run->options.link_unchanged && !backup_link_unchanged(run, job->rel, strlen(job->rel), job->dest)) return false;
+    job->entry.state = MANIFEST_UNCHANGED;
+    job->entry.source = backup_source(run, job->compare_index);
+    job->entry.flags |= prev->flags & MANIFEST_ENTRY_COMPRESSED;
+    atomic_fetch_add(&run->summary.same_content, 1);
+    if (!run->options.link_unchanged) stats_add(&run->stats, STATS_FILES_SKIPPED, 1);
+    return true;
+}
+
+bool backup_copy_file(backup_copy_job *job)
+{
+    flib_copy_method method;
+    if (flib_copy_file_method(job->src, job->dest, &method) != 0) return false;
+    atomic_fetch_add(&job->node->run->summary.copies[method], 1);
+    return true;
+}
+
+bool backup_pack_candidate(const backup_run *run, const manifest_entry *entry)
+{
+    return run->packing && entry->size <= PACK_MAX_FILE_SIZE;
+}
+
+// appends a small file to the segment of this worker
+bool backup_pack_file(backup_copy_job *job)
+{
+    backup_run *run = job->node->run;
+    manifest_entry *entry = &job->entry;
+    uint64_t hash;
+    if (!pack_append_file(&run->pack, (size_t) pool_worker_index(), job->src, &entry->segment, &entry->pack_offset, &entry->size, run->options.hash? &hash : NULL)){
+        return false;
     }
-    
-    Cson *prev_files = NULL;
-    Cson *prev_dirs = NULL;
-    if (prev != NULL){
-        char prev_info_path[FILENAME_MAX];
-        cwk_path_join(prev, INFO_FILE, prev_info_path, FILENAME_MAX);
-        Cson *prev_info = cson_read(prev_info_path);
-        if (prev_info == NULL){
-            eprintf("Could not find any '%s' file in '%s'!", INFO_FILE, prev);
-            return_defer(1);
+    entry->flags |= MANIFEST_ENTRY_PACKED;
+    if (run->options.hash){
+        entry->hash = hash;
+        entry->flags |= MANIFEST_ENTRY_HASHED;
+    }
+    return true;
+}
+
+// small files, packed files and files stored as patches are never compressed
+bool backup_compress_candidate(const backup_run *run, const manifest_entry *entry)
+{
+    return run->options.compression != COMPRESS_NONE && entry->size >= COMPRESS_MIN_FILE_SIZE && !backup_pack_candidate(run, entry)
+        && !(run->options.delta && entry->size >= DELTA_MIN_FILE_SIZE);
+}
+
+// a file whose first block does not compress is copied as it is
+bool backup_compress_file(backup_copy_job *job)
+{
+    backup_run *run = job->node->run;
+    manifest_entry *entry = &job->entry;
+    uint64_t hash, stored_size;
+    switch (compress_file(job->src, job->dest, run->options.compression, run->options.compression_level, &hash, &stored_size)){
+        case COMPRESS_STORED:
+            entry->flags |= MANIFEST_ENTRY_COMPRESSED;
+            if (run->options.hash){
+                entry->hash = hash;
+                entry->flags |= MANIFEST_ENTRY_HASHED;
+            }
+            atomic_fetch_add(&run->summary.compressed, 1);
+            atomic_fetch_add(&run->summary.compressed_file_bytes, entry->size);
+            atomic_fetch_add(&run->summary.compressed_stored_bytes, stored_size);
+            return true;
+        case COMPRESS_SKIPPED:
+            atomic_fetch_add(&run->summary.incompressible, 1);
+            return backup_copy_file(job);
+        default:
+            return false;
+    }
+}
+
+// stores a large file as a patch against the previous version, or in full with a signature for the next one
+bool backup_store_delta(backup_copy_job *job)
+{
+    backup_run *run = job->node->run;
+    char sig_dest[FILENAME_MAX] = {0};
+    char patch_dest[FILENAME_MAX] = {0};
+    if (!delta_path(run->path, job->rel, DELTA_SIG_SUFFIX, true, sig_dest, sizeof(sig_dest))) return false;
+    if (!delta_path(run->path, job->rel, DELTA_PATCH_SUFFIX, false, patch_dest, sizeof(patch_dest))) return false;
+    const manifest_entry *stored = NULL;
+    int i = backup_locate(run, job->rel, strlen(job->rel), &stored);
+    delta_signature sig;
+    char sig_path[FILENAME_MAX] = {0};
+    if (i >= 0 && stored->size >= DELTA_MIN_FILE_SIZE
+        && delta_path(run->chain_paths[i], job->rel, DELTA_SIG_SUFFIX, false, sig_path, sizeof(sig_path))
+        && delta_signature_read(sig_path, &sig)){
+        delta_stats stats;
+        bool ok = delta_create(job->src, &sig, patch_dest, sig_dest, &stats);
+        delta_signature_free(&sig);
+        // a patch that saves little is not worth the longer restore
+        if (ok && stats.literal_bytes < job->entry.size/2){
+            job->entry.state = MANIFEST_DELTA;
+            if (run->options.hash){
+                job->entry.hash = stats.target_hash;
+                job->entry.flags |= MANIFEST_ENTRY_HASHED;
+            }
+            atomic_fetch_add(&run->summary.deltas, 1);
+            atomic_fetch_add(&run->summary.delta_file_bytes, job->entry.size);
+            atomic_fetch_add(&run->summary.delta_stored_bytes, flib_size(patch_dest));
+            return true;
         }
-        prev_files = cson_get(prev_info, key("files"));
-        prev_dirs = cson_get(prev_info, key("dirs"));
-        if (prev_files == NULL || prev_dirs == NULL){
-            eprintf("Invalid '%s' file: '%s'!", INFO_FILE, prev_info_path);
-            return_defer(1);
+        if (ok){
+            (void) remove(patch_dest);
+            (void) remove(sig_dest);
+        }
+    }
+    if (!backup_copy_file(job)) return false;
+    // without a signature the next version is simply stored in full again
+    (void) delta_signature_file(job->dest, sig_dest);
+    return true;
+}
+
+void backup_copy_task(void *arg)
+{
+    backup_copy_job *job = (backup_copy_job*) arg;
+    backup_run *run = job->node->run;
+    TRACE_SCOPE("backup_copy", job->src);
+    stats_bind(&run->stats);
+    uint64_t begin = stats_begin(&run->stats);
+    if (!atomic_load(&run->failed)){
+        if (job->compare_index != MANIFEST_NONE && backup_same_content(job)){
+            backup_push_item(job);
+        } else if (run->options.dedup){
+            if (backup_chunk_file(job)){
+                stats_add(&run->stats, STATS_FILES_COPIED, 1);
+                stats_add(&run->stats, STATS_BYTES_COPIED, job->entry.size);
+            } else{
+                atomic_store(&run->failed, true);
+            }
+        } else{
+            bool delta = run->options.delta && job->rel != NULL && job->entry.size >= DELTA_MIN_FILE_SIZE;
+            bool pack = job->rel != NULL && backup_pack_candidate(run, &job->entry);
+            bool compress = job->rel != NULL && backup_compress_candidate(run, &job->entry);
+            bool stored = delta? backup_store_delta(job) : pack? backup_pack_file(job) : compress? backup_compress_file(job) : backup_copy_file(job);
+            if (stored){
+                stats_add(&run->stats, STATS_FILES_COPIED, 1);
+                stats_add(&run->stats, STATS_BYTES_COPIED, job->entry.size);
+                if (job->rel != NULL){
+                    // the stored copy is hashed, so the hash always matches what is in the backup
+                    if (run->options.hash && !(job->entry.flags & MANIFEST_ENTRY_HASHED) && job->entry.state != MANIFEST_DELTA
+                        && hash_xxh64_file(job->dest, &job->entry.hash)){
+                        job->entry.flags |= MANIFEST_ENTRY_HASHED;
+                    }
+                    backup_push_item(job);
+                }
+            } else{
+                atomic_store(&run->failed, true);
+            }
+        }
+    }
+    stats_end(&run->stats, STATS_PHASE_STORE, begin);
+    progress_done(1, job->entry.size);
+    backup_node_release(job->node);
+    free(job->src);
+    free(job->dest);
+    free(job->rel);
+    free(job);
+}
+
+void backup_submit_copy(backup_node *node, const char *src, const char *dest, const char *rel, const manifest_entry *entry, uint32_t compare_index)
+{
+    backup_copy_job *job = malloc(sizeof(*job));
+    assert(job != NULL && "Buy more RAM lol");
+    job->node = node;
+    job->src = strdup(src);
+    job->dest = strdup(dest);
+    job->rel = rel != NULL? strdup(rel) : NULL;
+    if (entry != NULL) job->entry = *entry;
+    job->compare_index = compare_index;
+    atomic_fetch_add(&node->pending, 1);
+    pool_submit(&node->run->pool, backup_copy_task, job);
+}
+
+void backup_copy_batch_task(void *arg)
+{
+    backup_copy_batch *batch = (backup_copy_batch*) arg;
+    backup_run *run = batch->node->run;
+    TRACE_SCOPE("backup_copy_batch", batch->node->rel);
+    stats_bind(&run->stats);
+    uint64_t begin = stats_begin(&run->stats);
+    if (!atomic_load(&run->failed)){
+        stats_add(&run->stats, STATS_SYS_COPY, batch->count);
+        uring_t *ring = &run->rings[pool_worker_index()];
+        (void) uring_copy_files(ring, batch->copies, batch->count);
+        size_t copied = 0;
+        uint64_t bytes = 0;
+        for (size_t i=0; i<batch->count; ++i){
+            flib_copy_method method = FLIB_COPY_URING;
+            // anything the ring could not copy is tried again on its own, flib_copy_file reports what is wrong
+            if (batch->copies[i].error != 0 && flib_copy_file_method(batch->copies[i].from, batch->copies[i].to, &method) != 0){
+                atomic_store(&run->failed, true);
+                break;
+            }
+            atomic_fetch_add(&run->summary.copies[method], 1);
+            copied++;
+            bytes += batch->sizes[i];
+        }
+        stats_add(&run->stats, STATS_FILES_COPIED, copied);
+        stats_add(&run->stats, STATS_BYTES_COPIED, bytes);
+        progress_done(copied, bytes);
+    }
+    stats_end(&run->stats, STATS_PHASE_STORE, begin);
+    backup_node_release(batch->node);
+    for (size_t i=0; i<batch->count; ++i){
+        free((char*) batch->copies[i].from);
+        free((char*) batch->copies[i].to);
+    }
+    free(batch);
+}
+
+void backup_flush_copies(backup_copy_batch **batch)
+{
+    if (*batch == NULL) return;
+    atomic_fetch_add(&(*batch)->node->pending, 1);
+    pool_submit(&(*batch)->node->run->pool, backup_copy_batch_task, *batch);
+    *batch = NULL;
+}
+
+// a plain copy, small files are collected into batches with --uring
+void backup_queue_copy(backup_node *node, backup_copy_batch **batch, const char *src, const char *dest, uint64_t size)
+{
+    if (node->run->rings == NULL || size > URING_MAX_FILE_SIZE){
+        backup_submit_copy(node, src, dest, NULL, &(manifest_entry){.size = size}, MANIFEST_NONE);
+        return;
+    }
+    if (*batch == NULL){
+        *batch = malloc(sizeof(**batch));
+        assert(*batch != NULL && "Buy more RAM lol");
+        (*batch)->node = node;
+        (*batch)->count = 0;
+    }
+    (*batch)->sizes[(*batch)->count] = size;
+    (*batch)->copies[(*batch)->count++] = (uring_copy_t){.from = strdup(src), .to = strdup(dest)};
+    if ((*batch)->count == URING_BATCH_FILES) backup_flush_copies(batch);
+}
+
+// a file whose content may be unchanged even though its metadata is not
+uint32_t backup_hash_candidate(backup_run *run, uint32_t prev_index, const manifest_entry *item)
+{
+    if (!run->options.hash || prev_index == MANIFEST_NONE) return MANIFEST_NONE;
+    const manifest_entry *prev = &run->prev.entries[prev_index];
+    if (prev->type != MANIFEST_TYPE_FILE || !(prev->flags & MANIFEST_ENTRY_HASHED) || prev->size != item->size) return MANIFEST_NONE;
+    return prev_index;
+}
+
+// looks up a path of the current backup in the previous manifest and marks it as still existing
+uint32_t backup_find_prev(backup_run *run, backup_node *node, const char *rel, size_t rel_len)
+{
+    if (!run->has_prev || node->prev_index == MANIFEST_NONE) return MANIFEST_NONE;
+    uint32_t index = manifest_find(&run->prev, rel, rel_len);
+    if (index == MANIFEST_NONE) return MANIFEST_NONE;
+    run->seen[index] = 1;
+    if (run->prev.entries[index].state == MANIFEST_DELETED) return MANIFEST_NONE;
+    return index;
+}
+
+// an unchanged file keeps its chunks or is linked to its stored version, a copy is only made if linking fails
+void backup_keep_file(backup_node *node, manifest_items *items, backup_copy_batch **batch, const char *src, const char *dest, const char *rel, size_t rel_len, manifest_entry item, uint32_t prev_index)
+{
+    backup_run *run = node->run;
+    if (run->options.dedup){
+        manifest_item *pushed = manifest_items_push(items, rel, item);
+        manifest_item_set_chunks(pushed, manifest_chunks(&run->prev, prev_index), run->prev.entries[prev_index].chunk_count);
+        stats_add(&run->stats, STATS_FILES_SKIPPED, 1);
+        progress_done(1, item.size);
+    } else if (run->options.link_unchanged && !backup_link_unchanged(run, rel, rel_len, dest)){
+        // linking is not possible (other filesystem, link limit, ..), store a copy instead
+        item.state = MANIFEST_NEW;
+        item.flags &= ~MANIFEST_ENTRY_COMPRESSED;
+        manifest_items_push(items, rel, item);
+        backup_queue_copy(node, batch, src, dest, item.size);
+    } else{
+        manifest_items_push(items, rel, item);
+        if (!run->options.link_unchanged) stats_add(&run->stats, STATS_FILES_SKIPPED, 1);
+        progress_done(1, item.size);
+    }
+}
+
+int backup_scan_dir(backup_node *node)
+{
+    TRACE_SCOPE("backup_scan_dir", node->rel);
+    int result = 0;
+    backup_run *run = node->run;
+    bool json = run->options.json_export;
+    const char *src = node->src;
+    const char *dest = node->dest;
+    manifest_items items = {0};
+    backup_copy_batch *batch = NULL;
+    Cson *files = NULL;
+    Cson *dirs = NULL;
+    if (json){
+        files = node->files = cson_map_new();
+        dirs = node->dirs = cson_map_new();
+    }
+    flib_dir dir;
+    if (!flib_dir_open(&dir, src)){
+        if (!flib_exists(src)){
+            eprintf("This is no valid src directory: '%s'!", src);
+            return 1;
         }
+        eprintf("Cannot access '%s'!. Skipping..", src);
+        return 0;
     }
+    stats_add(&run->stats, STATS_DIRS_SCANNED, 1);
     
     flib_entry entry;
     char item_dest_path[FILENAME_MAX] = {0};
     char item_prev_path[FILENAME_MAX] = {0};
-    while (flib_get_entry(dir, src, &entry)){
+    char item_rel[FILENAME_MAX] = {0};
+    while (flib_dir_next(&dir, &entry)){
+        if (atomic_load(&run->failed)) return_defer(1);
         cwk_path_join(dest, entry.name, item_dest_path, FILENAME_MAX);
-        CsonStr entry_key = cson_str_new(entry.name);
+        int rel_len = snprintf(item_rel, sizeof(item_rel), "%s/%s", node->rel, entry.name);
+        if (rel_len < 0 || (size_t) rel_len >= sizeof(item_rel)){
+            eprintf("Path too long: '%s'! Skipping.", entry.path);
+            continue;
+        }
         
         switch (entry.type){
             case FLIB_UNSP:
             case FLIB_FILE:{
-                if (access(entry.path, R_OK) != 0){
+                if (!flib_dir_readable(&dir, &entry)){
                     eprintf("No permission for '%s'! Skipping.", entry.path);
                     continue;
                 }
-                int64_t mod_time = (int64_t) entry.mod_time;
-                cson_map_insert(files, entry_key, cson_new_int(mod_time));
-                if (prev_files != NULL){
-                    Cson *prev_file = cson_map_get(prev_files, entry_key);
-                    if (prev_file != NULL){
-                        int64_t t = cson_get_int(prev_file);
-                        if (cson_map_remove(prev_files, entry_key) != CsonError_Success) return_defer(1);
-                        if (t >= entry.mod_time) continue;
+                manifest_entry item = {
+                    .type = MANIFEST_TYPE_FILE,
+                    .state = MANIFEST_NEW,
+                };
+                change_entry_from_stat(&item, &entry);
+                stats_add(&run->stats, STATS_FILES_SCANNED, 1);
+                stats_add(&run->stats, STATS_BYTES_SCANNED, item.size);
+                progress_found(1, item.size);
+                uint32_t prev_index = backup_find_prev(run, node, item_rel, rel_len);
+                // a deduplicated backup can only reuse files whose chunks are known
+                if (prev_index != MANIFEST_NONE && (!run->options.dedup || run->prev_chunked)
+                    && !change_file_changed(run->options.changes, &run->prev, prev_index, &item)){
+                    item.state = MANIFEST_UNCHANGED;
+                    item.source = backup_source(run, prev_index);
+                    change_keep_stored(&item, &run->prev.entries[prev_index]);
+                }
+                if (json) cson_map_insert(files, cson_str_new(entry.name), cson_new_int(item.mod_time));
+                if (item.state == MANIFEST_NEW){
+                    if (run->options.dedup || run->options.hash || (run->options.delta && item.size >= DELTA_MIN_FILE_SIZE)
+                        || backup_pack_candidate(run, &item) || backup_compress_candidate(run, &item)){
+                        // the item is added once its content is stored (or found to be unchanged)
+                        backup_submit_copy(node, entry.path, item_dest_path, item_rel, &item, backup_hash_candidate(run, prev_index, &item));
+                    } else{
+                        manifest_items_push(&items, item_rel, item);
+                        backup_queue_copy(node, &batch, entry.path, item_dest_path, item.size);
                     }
+                } else{
+                    backup_keep_file(node, &items, &batch, entry.path, item_dest_path, item_rel, rel_len, item, prev_index);
                 }
-                copy_file(entry.path, item_dest_path);
             } break;
             case FLIB_DIR:{
-                if (access(entry.path, R_OK) != 0){
+                if (!flib_dir_readable(&dir, &entry)){
                     eprintf("No permission for '%s'! Skipping.", entry.path);
                     continue;
                 }
-                if (prev_dirs != NULL){
-                    Cson *prev_dir = cson_map_get(prev_dirs, entry_key);
-                    if (prev_dir != NULL){
-                        if (cson_map_remove(prev_dirs, entry_key) != CsonError_Success) return_defer(1);
-                        cson_map_insert(dirs, entry_key, cson_new_int(1));
-                        char *p = NULL;
-                        if (prev != NULL){
-                            cwk_path_join(prev, entry.name, item_prev_path, FILENAME_MAX);
-                            p = item_prev_path;
-                        }
-                        if (!flib_create_dir(item_dest_path)) return_defer(1);
-                        if (make_backup_rec(entry.path, item_dest_path, p) == 1) return_defer(1);
-                        continue;
+                manifest_entry item = {
+                    .type = MANIFEST_TYPE_DIR,
+                    .state = MANIFEST_NEW,
+                };
+                // directory entries are not stat'ed while listing, merge needs their attributes though
+                flib_entry dir_attr;
+                if (flib_dir_stat(&dir, &entry, &dir_attr)) change_entry_from_stat(&item, &dir_attr);
+                char *p = NULL;
+                uint32_t prev_index = backup_find_prev(run, node, item_rel, rel_len);
+                if (prev_index != MANIFEST_NONE && run->prev.entries[prev_index].type == MANIFEST_TYPE_DIR){
+                    item.state = MANIFEST_UNCHANGED;
+                    if (node->prev != NULL){
+                        cwk_path_join(node->prev, entry.name, item_prev_path, FILENAME_MAX);
+                        p = item_prev_path;
                     }
+                } else{
+                    prev_index = MANIFEST_NONE;
                 }
-                cson_map_insert(dirs, entry_key, cson_new_int(0));
+                manifest_items_push(&items, item_rel, item);
+                if (json) cson_map_insert(dirs, cson_str_new(entry.name), cson_new_int(item.state == MANIFEST_UNCHANGED));
                 if (!flib_create_dir(item_dest_path)) return_defer(1);
-                if (make_backup_rec(entry.path, item_dest_path, NULL) == 1) return_defer(1);
-                
+                atomic_fetch_add(&run->scanning, 1);
+                pool_submit(&run->pool, backup_dir_task, backup_node_new(run, node, entry.path, item_dest_path, item_rel, p, prev_index));
             } break;
             default : {
                 eprintf("Unsupported file type of '%s'!", entry.path);
             }
         }
     }
-    if (prev_files != NULL){
-        Cson *deleted_files = cson_map_keys(prev_files);
-        for (size_t i=0; i<cson_len(deleted_files); ++i){
-            CsonStr del_file = cson_get_string(cson_array_get(deleted_files, i));
-            cson_map_insert(files, del_file, cson_new_int(-1));
+    if (run->has_prev && node->prev_index != MANIFEST_NONE){
+        const manifest_t *prev = &run->prev;
+        uint32_t end = prev->entries[node->prev_index].next;
+        for (uint32_t i=node->prev_index+1; i<end; i=prev->entries[i].next){
+            const manifest_entry *prev_entry = &prev->entries[i];
+            if (run->seen[i] || prev_entry->state == MANIFEST_DELETED) continue;
+            manifest_entry item = *prev_entry;
+            item.state = MANIFEST_DELETED;
+            manifest_items_push(&items, manifest_path(prev, i), item);
+            stats_add(&run->stats, STATS_ENTRIES_DELETED, 1);
+            if (json){
+                Cson *map = prev_entry->type == MANIFEST_TYPE_DIR? dirs : files;
+                cson_map_insert(map, cson_str_new((char*) manifest_name(prev, i)), cson_new_int(-1));
+            }
         }
     }
-    if (prev_dirs != NULL){
-        Cson *deleted_dirs = cson_map_keys(prev_dirs);
-        for (size_t i=0; i<cson_len(deleted_dirs); ++i){
-            CsonStr del_dir = cson_get_string(cson_array_get(deleted_dirs, i));
-            cson_map_insert(dirs, del_dir, cson_new_int(-1));
-        }
+    
+  defer:
+    backup_flush_copies(&batch);
+    manifest_builder_append(&run->manifest, &items);
+    manifest_items_free(&items);
+    flib_dir_close(&dir);
+    return result;
+}
+
+// the change journal saw nothing happen in the directory since the parent backup listed it
+bool backup_journal_clean(backup_run *run, uint32_t prev_index)
+{
+    const manifest_t *prev = &run->prev;
+    if (run->changed[prev_index] || prev->entries[prev_index].state == MANIFEST_DELETED) return false;
+    uint32_t end = prev->entries[prev_index].next;
+    for (uint32_t i=prev_index+1; i<end; i=prev->entries[i].next){
+        const manifest_entry *entry = &prev->entries[i];
+        // racily clean, see change.h: it may have been written again before the daemon looked
+        if (entry->type == MANIFEST_TYPE_FILE && entry->state != MANIFEST_DELETED && entry->mod_time >= prev->header->scan_time) return false;
     }
-  write:  
-    cson_map_insert(root, cson_str_new("files"), files);
-    cson_map_insert(root, cson_str_new("dirs"), dirs);
-    char parent[FILENAME_MAX] = {0};
-    if (prev == NULL){
-        cson_map_insert(root, cson_str_new("parent"), cson_new_null());
-    } else{
-        cwk_path_normalize(prev, parent, FILENAME_MAX);
-        escape_string(parent, temp_path_buffer, sizeof(temp_path_buffer));
-        cson_map_insert(root, cson_str_new("parent"), cson_new_cstring((char*) temp_path_buffer));
+    return true;
+}
+
+// takes the entries of an unchanged directory from the previous manifest instead of listing it
+int backup_reuse_dir(backup_node *node)
+{
+    TRACE_SCOPE("backup_reuse_dir", node->rel);
+    int result = 0;
+    backup_run *run = node->run;
+    const manifest_t *prev = &run->prev;
+    bool json = run->options.json_export;
+    manifest_items items = {0};
+    backup_copy_batch *batch = NULL;
+    Cson *files = NULL;
+    Cson *dirs = NULL;
+    if (json){
+        files = node->files = cson_map_new();
+        dirs = node->dirs = cson_map_new();
     }
-    cwk_path_join(dest, INFO_FILE, item_dest_path, FILENAME_MAX);
-    if (!cson_write(root, item_dest_path)) return_defer(1);
-    
+    stats_add(&run->stats, STATS_DIRS_REUSED, 1);
+
+    char item_src_path[FILENAME_MAX] = {0};
+    char item_dest_path[FILENAME_MAX] = {0};
+    char item_prev_path[FILENAME_MAX] = {0};
+    uint32_t end = prev->entries[node->prev_index].next;
+    for (uint32_t i=node->prev_index+1; i<end; i=prev->entries[i].next){
+        if (atomic_load(&run->failed)) return_defer(1);
+        const manifest_entry *prev_entry = &prev->entries[i];
+        if (prev_entry->state == MANIFEST_DELETED) continue;
+        const char *name = manifest_name(prev, i);
+        const char *item_rel = manifest_path(prev, i);
+        cwk_path_join(node->src, name, item_src_path, FILENAME_MAX);
+        cwk_path_join(node->dest, name, item_dest_path, FILENAME_MAX);
+        manifest_entry item = {
+            .type = prev_entry->type,
+            .state = MANIFEST_UNCHANGED,
+            .mod_time = prev_entry->mod_time,
+            .mod_time_nsec = prev_entry->mod_time_nsec,
+            .size = prev_entry->size,
+            .mode = prev_entry->mode,
+        };
+        change_keep_stored(&item, prev_entry);
+        if (prev_entry->type == MANIFEST_TYPE_FILE){
+            item.source = backup_source(run, i);
+            progress_found(1, item.size);
+            if (json) cson_map_insert(files, cson_str_new((char*) name), cson_new_int(item.mod_time));
+            backup_keep_file(node, &items, &batch, item_src_path, item_dest_path, item_rel, prev_entry->path_len, item, i);
+        } else{
+            // its listing changed, so did its modification time
+            flib_entry dir_attr;
+            if (run->changed[i] && flib_stat(item_src_path, &dir_attr)) change_entry_from_stat(&item, &dir_attr);
+            char *p = NULL;
+            if (node->prev != NULL){
+                cwk_path_join(node->prev, name, item_prev_path, FILENAME_MAX);
+                p = item_prev_path;
+            }
+            manifest_items_push(&items, item_rel, item);
+            if (json) cson_map_insert(dirs, cson_str_new((char*) name), cson_new_int(1));
+            if (!flib_create_dir(item_dest_path)) return_defer(1);
+            atomic_fetch_add(&run->scanning, 1);
+            pool_submit(&run->pool, backup_dir_task, backup_node_new(run, node, item_src_path, item_dest_path, item_rel, p, i));
+        }
+    }
+
   defer:
-    closedir(dir);
+    backup_flush_copies(&batch);
+    manifest_builder_append(&run->manifest, &items);
+    manifest_items_free(&items);
     return result;
 }
 
-int backup_init(const char *src, const char *dest, const char *parent)
+void backup_scan_release(backup_run *run)
+{
+    if (atomic_fetch_sub(&run->scanning, 1) == 1) progress_scanned();
+}
+
+void backup_dir_task(void *arg)
+{
+    backup_node *node = (backup_node*) arg;
+    stats_t *stats = &node->run->stats;
+    stats_bind(stats);
+    if (!atomic_load(&node->run->failed)){
+        uint64_t begin = stats_begin(stats);
+        CsonArena *prev_arena = cson_current_arena;
+        cson_swap_arena(&node->arena);
+        backup_run *run = node->run;
+        bool reuse = run->changed != NULL && node->prev_index != MANIFEST_NONE && backup_journal_clean(run, node->prev_index);
+        if ((reuse? backup_reuse_dir(node) : backup_scan_dir(node)) != 0){
+            atomic_store(&run->failed, true);
+        }
+        cson_swap_arena(prev_arena);
+        stats_end(stats, STATS_PHASE_SCAN, begin);
+    }
+    backup_scan_release(node->run);
+    backup_node_release(node);
+}
+
+typedef struct{
+    backup_run *run;
+    char *path;
+} backup_estimate_job;
+
+void backup_estimate_dir(backup_run *run, const char *path);
+
+void backup_estimate_release(backup_run *run)
+{
+    if (atomic_fetch_sub(&run->estimating, 1) == 1) progress_estimated();
+}
+
+// only counts, anything it cannot read is reported by the scan
+void backup_estimate_task(void *arg)
+{
+    backup_estimate_job *job = (backup_estimate_job*) arg;
+    backup_run *run = job->run;
+    TRACE_SCOPE("backup_estimate", job->path);
+    flib_dir dir;
+    // once the scan has found everything the estimate is of no use
+    if (!atomic_load(&run->failed) && !atomic_load(&progress.scanned) && flib_dir_open(&dir, job->path)){
+        uint64_t files = 0;
+        uint64_t bytes = 0;
+        flib_entry entry;
+        while (flib_dir_next(&dir, &entry)){
+            if (entry.type == FLIB_FILE || entry.type == FLIB_UNSP){
+                files++;
+                bytes += entry.size;
+            } else if (entry.type == FLIB_DIR){
+                backup_estimate_dir(run, entry.path);
+            }
+        }
+        progress_estimate(files, bytes);
+        flib_dir_close(&dir);
+    }
+    backup_estimate_release(run);
+    free(job->path);
+    free(job);
+}
+
+void backup_estimate_dir(backup_run *run, const char *path)
+{
+    backup_estimate_job *job = malloc(sizeof(*job));
+    assert(job != NULL && "Buy more RAM lol");
+    job->run = run;
+    job->path = strdup(path);
+    atomic_fetch_add(&run->estimating, 1);
+    pool_submit(&run->estimate, backup_estimate_task, job);
+}
+
+int backup_init(backup_run *run, const char *src, const char *dest, const char *parent)
 {
     if (parent != NULL){
         if (!path_in_backup(src, parent)){
@@ -198,16 +946,440 @@ int backup_init(const char *src, const char *dest, const char *parent)
     size_t name_length = 0;
     cwk_path_get_basename(src, &name, &name_length);
     cwk_path_join(dest, name, dest_path, FILENAME_MAX);
+    char rel[FILENAME_MAX] = {0};
+    snprintf(rel, sizeof(rel), "%.*s", (int) name_length, name);
 
     if (!flib_create_dir(dest_path)) return 1;
-    if (parent == NULL){
-        return make_backup_rec(src, dest_path, NULL);
+    manifest_entry item = {
+        .type = MANIFEST_TYPE_DIR,
+        .state = MANIFEST_NEW,
+    };
+    flib_entry dir_attr;
+    if (flib_stat(src, &dir_attr)) change_entry_from_stat(&item, &dir_attr);
+    uint32_t prev_index = MANIFEST_NONE;
+    if (run->has_prev){
+        prev_index = manifest_find(&run->prev, rel, name_length);
+        if (prev_index != MANIFEST_NONE){
+            run->seen[prev_index] = 1;
+            item.state = MANIFEST_UNCHANGED;
+        }
+    }
+    manifest_items items = {0};
+    manifest_items_push(&items, rel, item);
+    manifest_builder_append(&run->manifest, &items);
+    if (parent != NULL){
+        cwk_path_join(parent, name, parent_path, FILENAME_MAX);
+    }
+    atomic_fetch_add(&run->scanning, 1);
+    pool_submit(&run->pool, backup_dir_task, backup_node_new(run, NULL, src, dest_path, rel, parent != NULL? parent_path : NULL, prev_index));
+    return 0;
+}
+
+// an archive read as the source of a backup, its entries arrive in any order
+typedef struct{
+    backup_run *run;
+    const char *dest;
+    manifest_items items;
+    Cson *indices; // relative path -> index in items
+    tar_reader reader;
+    size_t skipped;
+} backup_tar_t;
+
+// the path of an archive entry inside the backup, "./" and leading '/' are dropped
+bool backup_tar_rel(const char *name, const char *root, char *rel, size_t rel_size)
+{
+    size_t len = 0;
+    if (root != NULL){
+        len = (size_t) snprintf(rel, rel_size, "%s", root);
+        if (len >= rel_size) return false;
+    }
+    const char *p = name;
+    while (*p != '\0'){
+        while (*p == '/') p++;
+        const char *end = strchr(p, '/');
+        if (end == NULL) end = p + strlen(p);
+        size_t n = (size_t) (end - p);
+        if (n == 0) break;
+        // nothing may end up outside of the backup
+        if (n == 2 && p[0] == '.' && p[1] == '.') return false;
+        if (!(n == 1 && p[0] == '.')){
+            if (len + n + 2 > rel_size) return false;
+            if (len > 0) rel[len++] = '/';
+            memcpy(rel+len, p, n);
+            len += n;
+        }
+        p = end;
+    }
+    rel[len] = '\0';
+    return true;
+}
+
+uint32_t backup_tar_find_prev(backup_run *run, const char *rel)
+{
+    if (!run->has_prev) return MANIFEST_NONE;
+    uint32_t index = manifest_find(&run->prev, rel, strlen(rel));
+    if (index == MANIFEST_NONE) return MANIFEST_NONE;
+    run->seen[index] = 1;
+    if (run->prev.entries[index].state == MANIFEST_DELETED) return MANIFEST_NONE;
+    return index;
+}
+
+int64_t backup_tar_index(backup_tar_t *tar, const char *rel)
+{
+    Cson *index = cson_map_get(tar->indices, cson_str((char*) rel));
+    return index != NULL? cson_get_int(index) : -1;
+}
+
+// creates a directory and the ones above it, unless the archive already had them, returns its index or -1
+int64_t backup_tar_dir(backup_tar_t *tar, char *rel)
+{
+    int64_t index = backup_tar_index(tar, rel);
+    if (index >= 0){
+        if (tar->items.items[index].entry.type == MANIFEST_TYPE_DIR) return index;
+        eprintf("'%s' is a file and a directory in the archive!", rel);
+        return -1;
+    }
+    char *slash = strrchr(rel, '/');
+    if (slash != NULL){
+        *slash = '\0';
+        index = backup_tar_dir(tar, rel);
+        *slash = '/';
+        if (index < 0) return -1;
+    }
+    char path[FILENAME_MAX] = {0};
+    cwk_path_join(tar->dest, rel, path, sizeof(path));
+    if (!flib_create_dir(path)) return -1;
+    // archives may leave out directories, the attributes of one that shows up later are filled in then
+    manifest_entry item = {
+        .type = MANIFEST_TYPE_DIR,
+        .state = MANIFEST_NEW,
+        .mode = S_IFDIR | 0755,
+        .mod_time = tar->run->manifest.scan_time,
+    };
+    uint32_t prev_index = backup_tar_find_prev(tar->run, rel);
+    if (prev_index != MANIFEST_NONE && tar->run->prev.entries[prev_index].type == MANIFEST_TYPE_DIR) item.state = MANIFEST_UNCHANGED;
+    manifest_items_push(&tar->items, rel, item);
+    index = (int64_t) tar->items.count-1;
+    cson_map_insert(tar->indices, cson_str_new(rel), cson_new_int(index));
+    return index;
+}
+
+// writes the content of the current entry to dest
+bool backup_tar_write(backup_tar_t *tar, const char *dest, manifest_entry *item)
+{
+    bool result = true;
+    bool hash = tar->run->options.hash;
+    hash_xxh64_t ctx;
+    if (hash) hash_xxh64_init(&ctx, 0);
+    // a file of the same name earlier in the archive may be read-only
+    (void) remove(dest);
+    int fd = open(dest, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0){
+        eprintf("Could not create '%s': %s!", dest, strerror(errno));
+        return false;
+    }
+    const uint8_t *data;
+    size_t len;
+    int status;
+    while ((status = tar_read_content(&tar->reader, &data, &len)) == 1){
+        if (hash) hash_xxh64_update(&ctx, data, len);
+        while (len > 0){
+            ssize_t n = write(fd, data, len);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0){
+                eprintf("Could not write '%s': %s!", dest, strerror(errno));
+                return_defer(false);
+            }
+            data += n;
+            len -= (size_t) n;
+        }
+    }
+    if (status < 0) return_defer(false);
+    if (hash){
+        item->hash = hash_xxh64_final(&ctx);
+        item->flags |= MANIFEST_ENTRY_HASHED;
+    }
+    atomic_fetch_add(&tar->run->summary.copies[FLIB_COPY_RW], 1);
+  defer:
+    close(fd);
+    return result;
+}
+
+// files of an archive are only written once, so they are compressed after the fact
+bool backup_tar_compress(backup_tar_t *tar, const char *dest, manifest_entry *item)
+{
+    backup_run *run = tar->run;
+    char compressed[FILENAME_MAX] = {0};
+    snprintf(compressed, sizeof(compressed), "%s.cbqz", dest);
+    uint64_t stored_size;
+    switch (compress_file(dest, compressed, run->options.compression, run->options.compression_level, NULL, &stored_size)){
+        case COMPRESS_STORED:
+            if (rename(compressed, dest) != 0){
+                eprintf("Could not replace '%s': %s!", dest, strerror(errno));
+                (void) remove(compressed);
+                return false;
+            }
+            item->flags |= MANIFEST_ENTRY_COMPRESSED;
+            atomic_fetch_add(&run->summary.compressed, 1);
+            atomic_fetch_add(&run->summary.compressed_file_bytes, item->size);
+            atomic_fetch_add(&run->summary.compressed_stored_bytes, stored_size);
+            return true;
+        case COMPRESS_SKIPPED:
+            atomic_fetch_add(&run->summary.incompressible, 1);
+            return true;
+        default:
+            return false;
+    }
+}
+
+int backup_tar_file(backup_tar_t *tar, const tar_entry *entry, char *rel)
+{
+    TRACE_SCOPE("backup_tar_file", rel);
+    backup_run *run = tar->run;
+    char *slash = strrchr(rel, '/');
+    if (slash == NULL){
+        eprintf("'%s' is not inside a directory of the archive, use --tar-root <name> to put everything into one!", rel);
+        return 1;
+    }
+    *slash = '\0';
+    int64_t parent = backup_tar_dir(tar, rel);
+    *slash = '/';
+    if (parent < 0) return 1;
+    int64_t index = backup_tar_index(tar, rel);
+    if (index >= 0 && tar->items.items[index].entry.type == MANIFEST_TYPE_DIR){
+        eprintf("'%s' is a file and a directory in the archive!", rel);
+        return 1;
+    }
+    char dest[FILENAME_MAX] = {0};
+    cwk_path_join(tar->dest, rel, dest, sizeof(dest));
+    manifest_entry item = {
+        .type = MANIFEST_TYPE_FILE,
+        .state = MANIFEST_NEW,
+        .mod_time = entry->mod_time,
+        .mod_time_nsec = entry->mod_time_nsec,
+        .size = entry->size,
+        .mode = S_IFREG | (entry->mode & 07777),
+    };
+    stats_add(&run->stats, STATS_FILES_SCANNED, 1);
+    stats_add(&run->stats, STATS_BYTES_SCANNED, item.size);
+    // the last entry of a path replaces the file, so it is only found once
+    if (index < 0) progress_found(1, item.size);
+    uint32_t prev_index = backup_tar_find_prev(run, rel);
+    size_t rel_len = strlen(rel);
+    if (prev_index != MANIFEST_NONE && !change_file_changed(run->options.changes, &run->prev, prev_index, &item)){
+        // the link replaces an earlier file of the same name
+        if (index >= 0) (void) remove(dest);
+        if (!run->options.link_unchanged || backup_link_unchanged(run, rel, rel_len, dest)){
+            item.state = MANIFEST_UNCHANGED;
+            item.source = backup_source(run, prev_index);
+            change_keep_stored(&item, &run->prev.entries[prev_index]);
+            if (!run->options.link_unchanged) stats_add(&run->stats, STATS_FILES_SKIPPED, 1);
+        }
+    }
+    if (item.state == MANIFEST_NEW){
+        uint64_t begin = stats_begin(&run->stats);
+        if (!backup_tar_write(tar, dest, &item)) return 1;
+        uint32_t compare_index = backup_hash_candidate(run, prev_index, &item);
+        if (compare_index != MANIFEST_NONE && item.hash == run->prev.entries[compare_index].hash){
+            // the written copy stays if the unchanged version cannot be linked
+            char kept[FILENAME_MAX] = {0};
+            snprintf(kept, sizeof(kept), "%s.cbqkeep", dest);
+            bool same = true;
+            if (run->options.link_unchanged){
+                same = rename(dest, kept) == 0 && backup_link_unchanged(run, rel, rel_len, dest);
+                if (!same) (void) rename(kept, dest);
+            }
+            if (same){
+                (void) remove(run->options.link_unchanged? kept : dest);
+                item.state = MANIFEST_UNCHANGED;
+                item.source = backup_source(run, compare_index);
+                item.flags |= run->prev.entries[compare_index].flags & MANIFEST_ENTRY_COMPRESSED;
+                atomic_fetch_sub(&run->summary.copies[FLIB_COPY_RW], 1);
+                atomic_fetch_add(&run->summary.same_content, 1);
+                if (!run->options.link_unchanged) stats_add(&run->stats, STATS_FILES_SKIPPED, 1);
+            }
+        }
+        if (item.state == MANIFEST_NEW){
+            if (backup_compress_candidate(run, &item) && !backup_tar_compress(tar, dest, &item)) return 1;
+            (void) flib_set_attributes(dest, item.mode, (time_t) item.mod_time, (long) item.mod_time_nsec);
+            stats_add(&run->stats, STATS_FILES_COPIED, 1);
+            stats_add(&run->stats, STATS_BYTES_COPIED, item.size);
+        }
+        stats_end(&run->stats, STATS_PHASE_STORE, begin);
+    }
+    if (index < 0) progress_done(1, item.size);
+    if (index >= 0){
+        // the last entry of a path wins, like when extracting
+        tar->items.items[index].entry = item;
+    } else{
+        manifest_items_push(&tar->items, rel, item);
+        cson_map_insert(tar->indices, cson_str_new(rel), cson_new_int((int64_t) tar->items.count-1));
+    }
+    return 0;
+}
+
+// everything of the previous backup that was not in the archive is deleted
+void backup_tar_deleted(backup_tar_t *tar)
+{
+    const manifest_t *prev = &tar->run->prev;
+    uint32_t i = 0;
+    while (i < prev->count){
+        const manifest_entry *prev_entry = &prev->entries[i];
+        if (tar->run->seen[i]){
+            // the content of a directory that became a file is gone with it
+            int64_t index = backup_tar_index(tar, manifest_path(prev, i));
+            bool descend = prev_entry->type == MANIFEST_TYPE_DIR && index >= 0 && tar->items.items[index].entry.type == MANIFEST_TYPE_DIR;
+            i = descend? i+1 : prev_entry->next;
+            continue;
+        }
+        if (prev_entry->state != MANIFEST_DELETED){
+            manifest_entry item = *prev_entry;
+            item.state = MANIFEST_DELETED;
+            manifest_items_push(&tar->items, manifest_path(prev, i), item);
+            stats_add(&tar->run->stats, STATS_ENTRIES_DELETED, 1);
+        }
+        i = prev_entry->next;
+    }
+}
+
+// reads the archive front to back, the content of changed files goes straight into the backup
+int backup_tar(backup_run *run, const char *dest, const char *archive, const char *root)
+{
+    int result = 0;
+    bool from_stdin = strcmp(archive, "-") == 0;
+    int fd = from_stdin? STDIN_FILENO : open(archive, O_RDONLY);
+    if (fd < 0){
+        eprintf("Could not open archive '%s': %s!", archive, strerror(errno));
+        return 1;
+    }
+    backup_tar_t tar = {
+        .run = run,
+        .dest = dest,
+        .indices = cson_map_new(),
+    };
+    tar_reader_init(&tar.reader, fd);
+    // the size of an archive file is close enough to the size of its content
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)){
+        progress_estimate(0, (uint64_t) st.st_size);
+        progress_estimated();
+    }
+    char root_rel[FILENAME_MAX] = {0};
+    char rel[FILENAME_MAX] = {0};
+    if (root != NULL){
+        if (!backup_tar_rel(root, NULL, root_rel, sizeof(root_rel)) || root_rel[0] == '\0'){
+            eprintf("Invalid archive root '%s'!", root);
+            return_defer(1);
+        }
+        memcpy(rel, root_rel, sizeof(rel));
+        if (backup_tar_dir(&tar, rel) < 0) return_defer(1);
+    }
+    tar_entry entry;
+    int status;
+    size_t entries = 0;
+    while ((status = tar_read_header(&tar.reader, &entry)) == 1){
+        entries++;
+        if (!backup_tar_rel(entry.path, root != NULL? root_rel : NULL, rel, sizeof(rel))){
+            eprintf("Path outside of the archive or too long: '%s'! Skipping.", entry.path);
+            continue;
+        }
+        if (rel[0] == '\0') continue;
+        switch (entry.type){
+            case TAR_TYPE_FILE:{
+                if (backup_tar_file(&tar, &entry, rel) != 0) return_defer(1);
+            } break;
+            case TAR_TYPE_DIR:{
+                int64_t index = backup_tar_dir(&tar, rel);
+                if (index < 0) return_defer(1);
+                stats_add(&run->stats, STATS_DIRS_SCANNED, 1);
+                manifest_entry *item = &tar.items.items[index].entry;
+                item->mode = S_IFDIR | (entry.mode & 07777);
+                item->mod_time = entry.mod_time;
+                item->mod_time_nsec = entry.mod_time_nsec;
+            } break;
+            default:{
+                eprintf("Unsupported file type of '%s'! Skipping.", entry.path);
+                tar.skipped++;
+            }
+        }
+    }
+    if (status < 0) return_defer(1);
+    // a failed command in front of the pipe leaves nothing to read
+    if (entries == 0){
+        eprintf("The archive '%s' is empty!", archive);
+        return_defer(1);
+    }
+    progress_scanned();
+    iprintf("Read %zu files and directories from the archive, skipped %zu links and special files", tar.items.count, tar.skipped);
+    if (run->has_prev) backup_tar_deleted(&tar);
+    manifest_builder_append(&run->manifest, &tar.items);
+  defer:
+    tar_reader_free(&tar.reader);
+    manifest_items_free(&tar.items);
+    if (!from_stdin) close(fd);
+    return result;
+}
+
+// marks the directory of the previous manifest that lists rel, the closest one it has for directories it does not know yet
+bool backup_journal_mark(const manifest_t *prev, uint8_t *changed, const char *rel)
+{
+    size_t len = strlen(rel);
+    while (len > 0){
+        uint32_t index = manifest_find(prev, rel, len);
+        if (index != MANIFEST_NONE && prev->entries[index].type == MANIFEST_TYPE_DIR && prev->entries[index].state != MANIFEST_DELETED){
+            if (changed[index]) return false;
+            changed[index] = 1;
+            return true;
+        }
+        while (len > 0 && rel[len-1] != '/') len--;
+        if (len > 0) len--;
     }
-    cwk_path_join(parent, name, parent_path, FILENAME_MAX);
-    return make_backup_rec(src, dest_path, parent_path);
+    return false;
 }
 
-int backup(const char *branch_name, const char *dest, const char *parent)
+// the directories changed since the parent backup according to 'watch', NULL if the journal cannot be trusted
+uint8_t* backup_read_journal(backup_run *run, const char *branch_name, Cson *dirs)
+{
+    char path[FILENAME_MAX] = {0};
+    // branches nobody watches have no journal, they are simply scanned
+    if (!watch_journal_path(branch_name, WATCH_JOURNAL_SUFFIX, path, sizeof(path)) || !flib_exists(path)) return NULL;
+    if (!watch_running(branch_name)){
+        iprintf("Branch %s is not watched anymore, scanning everything.", branch_name);
+        return NULL;
+    }
+    // a change made right before the backup may still wait in the daemon's event queue
+    watch_journal journal;
+    if (!watch_journal_sync(&journal, branch_name)){
+        iprintf("The watch daemon of branch %s did not catch up with its changes, scanning everything.", branch_name);
+        return NULL;
+    }
+    int64_t scan_time = run->prev.header->scan_time;
+    bool same_dirs = journal.root_count == cson_len(dirs);
+    for (size_t i=0; same_dirs && i<journal.root_count; ++i){
+        same_dirs = strcmp(journal.roots[i], cson_get_string(cson_array_get(dirs, i)).value) == 0;
+    }
+    uint8_t *changed = NULL;
+    if (!same_dirs){
+        iprintf("The change journal of branch %s is for other directories, scanning everything.", branch_name);
+    } else if (journal.since >= scan_time){
+        iprintf("The change journal of branch %s starts after the parent backup, scanning everything.", branch_name);
+    } else if (journal.overflow >= scan_time){
+        iprintf("The change journal of branch %s lost changes since the parent backup, scanning everything.", branch_name);
+    } else{
+        changed = calloc(run->prev.count+1, sizeof(*changed));
+        assert(changed != NULL && "Buy more RAM lol");
+        size_t count = 0;
+        for (size_t i=0; i<journal.count; ++i){
+            // the daemon notes the second it read the event, a second early is on the safe side
+            if (journal.changes[i].time+1 >= scan_time && backup_journal_mark(&run->prev, changed, journal.changes[i].rel)) count++;
+        }
+        iprintf("The change journal of branch %s has %zu changed directories since the parent backup.", branch_name, count);
+    }
+    watch_journal_free(&journal);
+    return changed;
+}
+
+int backup(const char *branch_name, const char *dest, const char *parent, const backup_options_t *options)
 {
     if (branch_name == NULL || dest == NULL){
         eprintf("Invalid arguments: branch_name=%p, dest=%p", branch_name, dest);
@@ -223,15 +1395,90 @@ int backup(const char *branch_name, const char *dest, const char *parent)
     }
     int result = 0;
     time_t start_time = time(NULL);
+    struct timespec scan_time;
+    timespec_get(&scan_time, TIME_UTC);
+    backup_run run = {0};
+    if (options != NULL) run.options = *options;
+    stats_init(&run.stats, run.options.stats);
+    if (run.options.tar != NULL){
+        // an archive is read front to back exactly once, there are no source files to chunk, patch, pack or batch
+        if (run.options.dedup || run.options.delta || run.options.pack || run.options.uring_depth > 0 || run.options.json_export){
+            iprintf("Backups of an archive ignore --dedup, --delta, --pack, --uring and --json.");
+        }
+        run.options.dedup = run.options.delta = run.options.pack = run.options.json_export = false;
+        run.options.uring_depth = 0;
+        // archives have no inode change times, inodes or devices
+        run.options.changes = CHANGE_FAST;
+    }
+    size_t jobs = run.options.jobs;
+    if (jobs == 0) jobs = cpu_count();
+    bool pool_running = false;
+    bool dest_created = false; // deleted again unless the backup is complete
+    char dest_name[FILENAME_MAX] = {0};
+    char dest_path[FILENAME_MAX] = {0};
+    bool estimate_running = false;
+    progress_start();
+    manifest_builder_init(&run.manifest);
+    run.manifest.scan_time = (int64_t) scan_time.tv_sec;
+    run.manifest.scan_time_nsec = (int64_t) scan_time.tv_nsec;
+    uint64_t begin = stats_begin(&run.stats);
+    if (parent != NULL){
+        if (!manifest_open(&run.prev, parent)){
+            eprintf("Parent backup '%s' has no valid manifest!", parent);
+            manifest_builder_free(&run.manifest);
+            progress_stop();
+            return 1;
+        }
+        run.has_prev = true;
+        run.seen = calloc(run.prev.count+1, sizeof(*run.seen));
+        assert(run.seen != NULL && "Buy more RAM lol");
+        run.prev_chunked = (run.prev.header->flags & MANIFEST_FLAG_CHUNKED) != 0;
+    }
+    if (run.options.dedup){
+        if (run.options.link_unchanged){
+            eprintf("Deduplicated backups have no files to link, ignoring '--link-unchanged'.");
+            run.options.link_unchanged = false;
+        }
+        // unchanged content is already stored once in the chunk store, changed files only add their new chunks
+        run.options.hash = false;
+        run.options.delta = false;
+        if (!chunk_store_open(&run.chunks, dest, true)){
+            manifest_builder_free(&run.manifest);
+            manifest_close(&run.prev);
+            free(run.seen);
+            progress_stop();
+            return 1;
+        }
+        run.manifest.flags |= MANIFEST_FLAG_CHUNKED;
+    } else{
+        if (run.options.pack && run.options.link_unchanged){
+            eprintf("Packed files cannot be linked, ignoring '--link-unchanged'.");
+            run.options.link_unchanged = false;
+        }
+        if (parent == NULL || run.options.link_unchanged) run.manifest.flags |= MANIFEST_FLAG_FULL;
+        if (parent != NULL && run.options.delta) run.manifest.flags |= MANIFEST_FLAG_DELTA;
+        if (parent != NULL && (run.options.link_unchanged || run.options.delta) && !backup_open_chain(&run, parent)){
+            backup_close_chain(&run);
+            manifest_builder_free(&run.manifest);
+            manifest_close(&run.prev);
+            free(run.seen);
+            progress_stop();
+            return 1;
+        }
+    }
+    stats_end(&run.stats, STATS_PHASE_CHAIN, begin);
     
     CsonArena arena = {0};
     CsonArena *prev_arena = cson_current_arena;
     cson_swap_arena(&arena);
+    stats_bind(&run.stats);
     
     char backups_path[FILENAME_MAX];
     cwk_path_join(program_dir, BACKUPS_JSON, backups_path, sizeof(backups_path));
     
+    begin = stats_begin(&run.stats);
     Cson *branches = cson_read(backups_path);
+    stats_end(&run.stats, STATS_PHASE_INFO, begin);
     if (branches == NULL){
         eprintf("Could not find backups file '%s'!", backups_path);
         return_defer(1);
@@ -249,30 +1496,102 @@ int backup(const char *branch_name, const char *dest, const char *parent)
         eprintf("Branch %s is missing directory entry 'dirs'!", branch_name);
         return_defer(1);
     } 
+    Cson *compression = cson_map_get(branch, cson_str("compression"));
+    if (run.options.compression == COMPRESS_NONE && cson_is_string(compression)){
+        const char *value = cson_get_string(compression).value;
+        if (!compress_parse(value, &run.options.compression, &run.options.compression_level)){
+            eprintf("Branch %s has an invalid compression '%s'!", branch_name, value);
+            return_defer(1);
+        }
+    }
+    if (!compress_available(run.options.compression)){
+        eprintf("This build does not support %s compression, which branch %s uses!", compress_codec_names[run.options.compression], branch_name);
+        return_defer(1);
+    }
+    if (run.options.dedup && run.options.compression != COMPRESS_NONE){
+        iprintf("Deduplicated backups store chunks, files are not compressed.");
+        run.options.compression = COMPRESS_NONE;
+    }
+    run.manifest.compression = run.options.compression;
+    run.manifest.compression_level = run.options.compression_level;
     
-    char dest_name[FILENAME_MAX] = {0};
-    char dest_path[FILENAME_MAX] = {0};
     snprintf(dest_name, FILENAME_MAX, "%s_%"PRId64, branch_name, id);
     cwk_path_join(dest, dest_name, dest_path, FILENAME_MAX);
     
     iprintf("Creating backup '%s'..", dest_name);
     
     if (!flib_create_dir(dest_path)) return_defer(1);
+    dest_created = true;
+    run.path = dest_path;
+    if (run.options.pack && !run.options.dedup){
+        if (!pack_open(&run.pack, dest_path, jobs)) return_defer(1);
+        run.packing = true;
+    }
+    if (run.options.uring_depth > 0 && !run.options.dedup){
+        run.rings = uring_create_rings(jobs, run.options.uring_depth);
+        if (run.rings == NULL) iprintf("io_uring is not available, copying files one by one.");
+    }
+    // unchanged files of a deduplicated backup need the chunks of their previous version
+    if (parent != NULL && run.options.tar == NULL && !run.options.full_scan && (!run.options.dedup || run.prev_chunked)){
+        begin = stats_begin(&run.stats);
+        run.changed = backup_read_journal(&run, branch_name, dirs);
+        stats_end(&run.stats, STATS_PHASE_SCAN, begin);
+    }
+    if (!pool_init(&run.pool, jobs)){
+        eprintf("Could not start %zu backup workers!", jobs);
+        return_defer(1);
+    }
+    pool_running = true;
+    if (run.options.estimate && run.options.tar == NULL){
+        // the estimate competes with the backup for the disk, but mostly reads what the scan needs next anyway
+        estimate_running = pool_init(&run.estimate, jobs);
+        if (estimate_running){
+            atomic_store(&run.estimating, 1);
+            for (size_t i=0; i<cson_len(dirs); ++i){
+                backup_estimate_dir(&run, cson_get_string(cson_array_get(dirs, i)).value);
+            }
+            backup_estimate_release(&run);
+        } else{
+            iprintf("Could not start the estimate, the progress has no totals until the scan is done.");
+        }
+    }
     
-    for (size_t i=0; i<cson_len(dirs); ++i){
+    if (run.options.tar != NULL){
+        // the archive is read on this thread alone, the time spent writing its files counts as store
+        begin = stats_begin(&run.stats);
+        uint64_t store_nsec = atomic_load(&run.stats.phase_nsec[STATS_PHASE_STORE]);
+        if (backup_tar(&run, dest_path, run.options.tar, run.options.tar_root) != 0) atomic_store(&run.failed, true);
+        stats_end(&run.stats, STATS_PHASE_SCAN, begin + (atomic_load(&run.stats.phase_nsec[STATS_PHASE_STORE]) - store_nsec));
+    }
+    // held until every root is submitted, so a root scanned quickly does not end the scan
+    atomic_store(&run.scanning, 1);
+    for (size_t i=0; run.options.tar == NULL && i<cson_len(dirs); ++i){
         const char *src = cson_get_string(cson_array_get(dirs, i)).value;
         if (!flib_isdir(src)){
             eprintf("Source directory no longer exists: '%s'!", src);
-            return_defer(1);
+            atomic_store(&run.failed, true);
+            break;
         }
-        if (backup_init(src, dest_path, parent) == 1){
-            eprintf("Failed to create backup! Cleaning up..");
-            if (flib_delete_dir(dest_path) == 1){
-                eprintf("Failed to delete backup!");
-            }
-            return_defer(1);
+        if (backup_init(&run, src, dest_path, parent) == 1){
+            atomic_store(&run.failed, true);
+            break;
         }
     }
+    backup_scan_release(&run);
+    pool_wait(&run.pool);
+    if (estimate_running) pool_wait(&run.estimate);
+    if (run.packing && !pack_close(&run.pack)) atomic_store(&run.failed, true);
+    char parent_norm[FILENAME_MAX] = {0};
+    if (parent != NULL){
+        cwk_path_normalize(parent, parent_norm, sizeof(parent_norm));
+    }
+    begin = stats_begin(&run.stats);
+    if (!atomic_load(&run.failed) && !manifest_builder_write(&run.manifest, dest_path, parent != NULL? parent_norm : NULL)){
+        atomic_store(&run.failed, true);
+    }
+    stats_end(&run.stats, STATS_PHASE_MANIFEST, begin);
+    if (atomic_load(&run.failed)) return_defer(1);
+    dest_created = false;
     last_id->value.integer = id;
     Cson *backups = cson_get(branch, key("backups"));
     if (backups == NULL){
@@ -283,19 +1602,23 @@ int backup(const char *branch_name, const char *dest, const char *parent)
         cson_array_push(backups, cson_new_cstring(dest_path));
     }
     // write backup info file
+    begin = stats_begin(&run.stats);
     char time_buffer[32] = {0};
     format_time(&start_time, time_buffer, sizeof(time_buffer));
     
     Cson *root = cson_map_new();
-    cson_map_insert(root, cson_str("dirs"), dirs);
+    if (run.options.tar != NULL){
+        // no directory of the branch is in the backup, so none of them can use it as a parent
+        cson_map_insert(root, cson_str("dirs"), cson_array_new());
+        cson_map_insert(root, cson_str("tar"), cson_new_cstring((char*) run.options.tar));
+    } else{
+        cson_map_insert(root, cson_str("dirs"), dirs);
+    }
     cson_map_insert(root, cson_str("branch"), cson_new_cstring((char*) branch_name));
     cson_map_insert(root, cson_str("created"), cson_new_cstring(time_buffer));
     
-    char parent_norm[FILENAME_MAX] = {0};
     if (parent != NULL){
-        cwk_path_normalize(parent, parent_norm, sizeof(parent_norm));
-        escape_string(parent_norm, temp_path_buffer, sizeof(temp_path_buffer));
-        cson_map_insert(root, cson_str("parent"), cson_new_string(cson_str((char*)temp_path_buffer)));
+        cson_map_insert(root, cson_str("parent"), cson_new_cstring(parent_norm));
     } else{
         cson_map_insert(root, cson_str("parent"), cson_new_null());
     }
@@ -303,9 +1626,37 @@ int backup(const char *branch_name, const char *dest, const char *parent)
     cson_write(root, dest_name);
     
     cson_write(branches, backups_path);
-    escape_string(dest_path, temp_path_buffer, sizeof(temp_path_buffer));
+    stats_end(&run.stats, STATS_PHASE_INFO, begin);
     iprintf("Successfully created backup for branch '%s' at '%s'", branch_name, dest_path);
+    if (run.options.dedup){
+        print_chunk_summary(&run.chunks);
+    } else{
+        print_copy_summary(&run.summary);
+        if (run.packing) print_pack_summary(&run.pack);
+        print_compress_summary(&run.summary, run.options.compression);
+    }
+    stats_finish(&run.stats);
+    stats_print(&run.stats);
+    if (run.options.stats_json != NULL && !stats_write_json(&run.stats, "backup", run.options.stats_json)) result = 1;
   defer:
+    stats_bind(NULL);
+    progress_stop();
+    if (pool_running) pool_destroy(&run.pool);
+    if (estimate_running) pool_destroy(&run.estimate);
+    uring_destroy_rings(run.rings, jobs);
+    if (run.packing) (void) pack_close(&run.pack);
+    // a half-created backup would count as a member of the chain
+    if (dest_created){
+        eprintf("Failed to create backup! Cleaning up..");
+        if (flib_delete_dir(dest_path) == 1){
+            eprintf("Failed to delete backup!");
+        }
+    }
+    manifest_builder_free(&run.manifest);
+    manifest_close(&run.prev);
+    backup_close_chain(&run);
+    free(run.seen);
+    free(run.changed);
     cson_swap_and_free_arena(prev_arena);
     return result;
 }
@@ -313,7 +1664,7 @@ int backup(const char *branch_name, const char *dest, const char *parent)
 void* tbackup(void *pargs)
 {
     thread_args_t *args = (thread_args_t*)pargs;
-    (void) backup(args->args[0], args->args[1], args->args[2]);
-    worker_done = 1;
+    args->result = backup(args->args[0], args->args[1], args->args[2], &args->backup_options);
+    worker_finish();
     return NULL;
 }
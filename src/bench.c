@@ -0,0 +1,885 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <cebeq.h>
+#include <cson.h>
+#include <flib.h>
+#include <hash.h>
+#include <uring.h>
+#include <compress.h>
+#include <message_queue.h>
+#include <threading.h>
+
+#define BENCH_MAP_KEYS 1000000
+#define BENCH_PARSE_FILES 200000
+#define BENCH_PARSE_RUNS 5
+#define BENCH_HASH_SIZE (64*1024*1024)
+#define BENCH_COPY_FILES 100000
+#define BENCH_COPY_DIR_FILES 1000
+#define BENCH_COPY_MAX_SIZE (16*1024)
+#define BENCH_COMPRESS_SIZE (64*1024*1024)
+#define BENCH_TREE_DATA_SIZE (1024*1024)
+// modification times of generated files, far enough in the past to never count as racy, see change_file_changed
+#define BENCH_TREE_MOD_TIME 1700000000
+
+static size_t bench_copy_files = BENCH_COPY_FILES;
+
+// shape of the synthetic source tree of the 'backup' benchmark
+typedef struct{
+    size_t depth;     // levels of directories below the root
+    size_t fanout;    // subdirectories per directory
+    size_t dir_files; // files per directory
+    uint64_t min_size;
+    uint64_t max_size; // sizes are spread evenly over the powers of two in between
+    unsigned churn;   // percent of the files changed, deleted or added between backups
+    size_t chain;     // incremental backups after the full one
+    size_t jobs;
+    uint64_t seed;
+} bench_tree_t;
+
+static bench_tree_t bench_tree = {
+    .depth = 3,
+    .fanout = 4,
+    .dir_files = 50,
+    .min_size = 0,
+    .max_size = 256*1024,
+    .churn = 10,
+    .chain = 5,
+    .jobs = 1,
+    .seed = 1,
+};
+
+// results of all benchmarks for --json, NULL if they are only printed
+static Cson *bench_results = NULL;
+static CsonArena bench_results_arena = {0};
+
+typedef struct{
+    const char *name;
+    const char *description;
+    bool (*run)(void);
+} benchmark_t;
+
+double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+// prints one measurement and keeps it for the json report, the record can be extended by the caller
+Cson* bench_result(const char *bench, const char *phase, double amount, const char *unit, double seconds)
+{
+    printf("%-8s %-12s %10.2f %-5s %10.2f ms %12.2f %s/s\n", bench, phase, amount, unit, seconds*1e3, amount/seconds, unit);
+    if (bench_results == NULL) return NULL;
+    // benchmarks run in arenas of their own, the results outlive them
+    CsonArena *prev_arena = cson_current_arena;
+    cson_swap_arena(&bench_results_arena);
+    Cson *record = cson_map_new();
+    cson_map_insert(record, cson_str_new("bench"), cson_new_cstring((char*) bench));
+    cson_map_insert(record, cson_str_new("phase"), cson_new_cstring((char*) phase));
+    cson_map_insert(record, cson_str_new("amount"), cson_new_float(amount));
+    cson_map_insert(record, cson_str_new("unit"), cson_new_cstring((char*) unit));
+    cson_map_insert(record, cson_str_new("seconds"), cson_new_float(seconds));
+    cson_map_insert(record, cson_str_new("rate"), cson_new_float(amount/seconds));
+    cson_array_push(bench_results, record);
+    cson_swap_arena(prev_arena);
+    return record;
+}
+
+void bench_result_extra(Cson *record, const char *key, double value)
+{
+    if (record == NULL) return;
+    CsonArena *prev_arena = cson_current_arena;
+    cson_swap_arena(&bench_results_arena);
+    cson_map_insert(record, cson_str_new((char*) key), cson_new_float(value));
+    cson_swap_arena(prev_arena);
+}
+
+bool bench_map(void)
+{
+    bool result = true;
+    size_t count = BENCH_MAP_KEYS;
+    // keys are generated up front so that only the map operations are measured
+    char (*keys)[16] = malloc(count*sizeof(*keys));
+    assert(keys != NULL && "Buy more RAM lol");
+    for (size_t i=0; i<count; ++i){
+        snprintf(keys[i], sizeof(keys[i]), "file_%zu.txt", i);
+    }
+
+    CsonArena arena = {.region_size = 1024*1024};
+    CsonArena *prev_arena = cson_current_arena;
+    cson_swap_arena(&arena);
+    Cson *value = cson_new_int(1);
+    Cson *map = cson_map_new();
+
+    double start = bench_now();
+    for (size_t i=0; i<count; ++i){
+        cson_map_insert(map, cson_str(keys[i]), value);
+    }
+    bench_result("map", "insert", count*1e-6, "Mops", bench_now()-start);
+
+    start = bench_now();
+    for (size_t i=0; i<count; ++i){
+        if (cson_map_get(map, cson_str(keys[i])) == NULL) result = false;
+    }
+    bench_result("map", "lookup", count*1e-6, "Mops", bench_now()-start);
+
+    start = bench_now();
+    for (size_t i=0; i<count; ++i){
+        if (cson_map_remove(map, cson_str(keys[i])) != CsonError_Success) result = false;
+    }
+    bench_result("map", "remove", count*1e-6, "Mops", bench_now()-start);
+
+    if (cson_len(map) != 0) result = false;
+    cson_swap_and_free_arena(prev_arena);
+    free(keys);
+    return result;
+}
+
+// a directory info file as written by 'backup --json', plus an array of long paths
+Cson* bench_info_json(void)
+{
+    Cson *files = cson_map_new();
+    Cson *dirs = cson_array_new();
+    char key[FILENAME_MAX];
+    for (size_t i=0; i<BENCH_PARSE_FILES; ++i){
+        snprintf(key, sizeof(key), "file_%zu.txt", i);
+        cson_map_insert(files, cson_str_new(key), cson_new_int(1700000000 + (int64_t) i));
+        if (i % 10 == 0){
+            snprintf(key, sizeof(key), "/home/user/projects/cebeq/some/rather/deeply/nested/directory/number_%zu", i);
+            cson_array_push(dirs, cson_new_cstring(key));
+        }
+    }
+    Cson *root = cson_map_new();
+    cson_map_insert(root, cson_str_new("files"), files);
+    cson_map_insert(root, cson_str_new("dirs"), dirs);
+    cson_map_insert(root, cson_str_new("parent"), cson_new_null());
+    return root;
+}
+
+bool bench_temp_path(char *path)
+{
+    int fd = mkstemp(path);
+    if (fd < 0){
+        fprintf(stderr, "[ERROR] Could not create a temporary file!\n");
+        return false;
+    }
+    close(fd);
+    return true;
+}
+
+bool bench_write(void)
+{
+    char path[] = "/tmp/cbqbench_XXXXXX";
+    if (!bench_temp_path(path)) return false;
+    CsonArena arena = {.region_size = 1024*1024};
+    CsonArena *prev_arena = cson_current_arena;
+    cson_swap_arena(&arena);
+    Cson *root = bench_info_json();
+    bool result = true;
+    for (int compact=0; result && compact<=1; ++compact){
+        double best = 0;
+        for (size_t run=0; result && run<BENCH_PARSE_RUNS; ++run){
+            double start = bench_now();
+            result = compact? cson_write_compact(root, path) : cson_write(root, path);
+            double seconds = bench_now()-start;
+            if (best == 0 || seconds < best) best = seconds;
+        }
+        struct stat st;
+        if (!result || stat(path, &st) != 0) break;
+        bench_result("write", compact? "compact" : "pretty", st.st_size / (1024.0*1024.0), "MiB", best);
+    }
+    cson_swap_and_free_arena(prev_arena);
+    unlink(path);
+    return result;
+}
+
+bool bench_parse(void)
+{
+    char path[] = "/tmp/cbqbench_XXXXXX";
+    if (!bench_temp_path(path)) return false;
+    CsonArena arena = {.region_size = 1024*1024};
+    CsonArena *prev_arena = cson_current_arena;
+    cson_swap_arena(&arena);
+    Cson *root = bench_info_json();
+    bool result = cson_write(root, path);
+    cson_swap_and_free_arena(prev_arena);
+    struct stat st;
+    if (!result || stat(path, &st) != 0){
+        unlink(path);
+        return false;
+    }
+    double mb = st.st_size / (1024.0*1024.0);
+
+    CsonSimd prev_simd = cson_simd;
+    cson_simd = CsonSimd_Auto;
+    CsonSimd max_simd = cson_simd_level();
+    for (CsonSimd simd=CsonSimd_Scalar; result && simd<=max_simd; ++simd){
+        cson_simd = simd;
+        // scanning stage on its own: tokenize the whole file without building values
+        flib_cont content = {0};
+        if (!flib_read(path, &content)){
+            result = false;
+            break;
+        }
+        double best_lex = 0;
+        for (size_t run=0; run<BENCH_PARSE_RUNS; ++run){
+            CsonLexer lexer = cson_lex_init(content.buffer, content.size, path);
+            CsonToken token;
+            size_t tokens = 0;
+            double start = bench_now();
+            while (cson_lex_next(&lexer, &token)) tokens++;
+            double seconds = bench_now()-start;
+            if (token.type != CsonToken_End || tokens == 0) result = false;
+            if (best_lex == 0 || seconds < best_lex) best_lex = seconds;
+        }
+        free(content.buffer);
+        bench_result("lex", CsonSimdNames[simd], mb, "MiB", best_lex);
+
+        double best = 0;
+        for (size_t run=0; run<BENCH_PARSE_RUNS; ++run){
+            CsonArena parse_arena = {.region_size = 1024*1024};
+            cson_swap_arena(&parse_arena);
+            double start = bench_now();
+            Cson *parsed = cson_read(path);
+            double seconds = bench_now()-start;
+            if (parsed == NULL || cson_len(cson_map_get(parsed, cson_str("files"))) != BENCH_PARSE_FILES) result = false;
+            cson_swap_and_free_arena(prev_arena);
+            if (best == 0 || seconds < best) best = seconds;
+        }
+        bench_result("parse", CsonSimdNames[simd], mb, "MiB", best);
+    }
+    cson_simd = prev_simd;
+    unlink(path);
+    return result;
+}
+
+static volatile uint64_t bench_sink;
+
+bool bench_hash(void)
+{
+    uint8_t *data = malloc(BENCH_HASH_SIZE);
+    assert(data != NULL && "Buy more RAM lol");
+    for (size_t i=0; i<BENCH_HASH_SIZE; ++i){
+        data[i] = (uint8_t) (i*2654435761u >> 13);
+    }
+    double mb = BENCH_HASH_SIZE / (1024.0*1024.0);
+    double best = 0;
+    uint64_t check = 0;
+    for (size_t run=0; run<BENCH_PARSE_RUNS; ++run){
+        double start = bench_now();
+        check ^= hash_xxh64(data, BENCH_HASH_SIZE, 0);
+        double seconds = bench_now()-start;
+        if (best == 0 || seconds < best) best = seconds;
+    }
+    bench_result("hash", "xxh64", mb, "MiB", best);
+    best = 0;
+    uint8_t digest[HASH_SHA256_SIZE];
+    for (size_t run=0; run<BENCH_PARSE_RUNS; ++run){
+        double start = bench_now();
+        hash_sha256(data, BENCH_HASH_SIZE, digest);
+        double seconds = bench_now()-start;
+        if (best == 0 || seconds < best) best = seconds;
+    }
+    bench_result("hash", "sha256", mb, "MiB", best);
+    free(data);
+    // the results are used, so the hashing cannot be optimized away
+    bench_sink = check ^ digest[0];
+    return true;
+}
+
+// log-like text, about as compressible as source code and logs
+static size_t bench_compress_data(uint8_t *data, size_t size)
+{
+    size_t len = 0;
+    for (size_t i=0; len < size; ++i){
+        char line[96];
+        int n = snprintf(line, sizeof(line), "%08zu [worker %zu] copied file_%zu.dat (%zu bytes)\n", i, i%7, (i*2654435761u) % 100000, (i*40503u) % 65536);
+        size_t copy = (size_t) n < size-len? (size_t) n : size-len;
+        memcpy(data+len, line, copy);
+        len += copy;
+    }
+    return len;
+}
+
+bool bench_compress(void)
+{
+    uint8_t *data = malloc(BENCH_COMPRESS_SIZE);
+    uint8_t *restored = malloc(BENCH_COMPRESS_SIZE);
+    size_t cap = compress_bound(COMPRESS_BLOCK_SIZE);
+    size_t blocks = BENCH_COMPRESS_SIZE/COMPRESS_BLOCK_SIZE;
+    uint8_t *stored = malloc(blocks*cap);
+    size_t *lens = malloc(blocks*sizeof(*lens));
+    assert(data != NULL && restored != NULL && stored != NULL && lens != NULL && "Buy more RAM lol");
+    bench_compress_data(data, BENCH_COMPRESS_SIZE);
+    double mb = BENCH_COMPRESS_SIZE / (1024.0*1024.0);
+    const char *codecs[] = {"lz4", "zstd:1", "zstd", "zstd:9"};
+    bool result = true;
+    for (size_t c=0; c<arr_len(codecs); ++c){
+        compress_codec codec;
+        int level;
+        if (!compress_parse(codecs[c], &codec, &level) || !compress_available(codec)) continue;
+        double best = 0, best_restore = 0;
+        size_t total = 0;
+        for (size_t run=0; run<BENCH_PARSE_RUNS; ++run){
+            double start = bench_now();
+            total = 0;
+            for (size_t i=0; i<blocks; ++i){
+                lens[i] = compress_block(codec, level, data + i*COMPRESS_BLOCK_SIZE, COMPRESS_BLOCK_SIZE, stored + i*cap, cap);
+                total += lens[i];
+            }
+            double seconds = bench_now()-start;
+            if (best == 0 || seconds < best) best = seconds;
+            start = bench_now();
+            for (size_t i=0; i<blocks; ++i){
+                if (!decompress_block(codec, stored + i*cap, lens[i], restored + i*COMPRESS_BLOCK_SIZE, COMPRESS_BLOCK_SIZE)) result = false;
+            }
+            seconds = bench_now()-start;
+            if (best_restore == 0 || seconds < best_restore) best_restore = seconds;
+        }
+        if (!result || memcmp(data, restored, BENCH_COMPRESS_SIZE) != 0){
+            fprintf(stderr, "[ERROR] %s did not restore the original data!\n", codecs[c]);
+            result = false;
+            break;
+        }
+        bench_result_extra(bench_result("compress", codecs[c], mb, "MiB", best), "percent", total*100.0/BENCH_COMPRESS_SIZE);
+        printf("%-8s %-12s %10.1f %%\n", "ratio", codecs[c], total*100.0/BENCH_COMPRESS_SIZE);
+        bench_result("restore", codecs[c], mb, "MiB", best_restore);
+    }
+    free(data);
+    free(restored);
+    free(stored);
+    free(lens);
+    return result;
+}
+
+// a tree of small files with sizes between 0 and BENCH_COPY_MAX_SIZE, BENCH_COPY_DIR_FILES per directory
+bool bench_copy_tree(const char *root, const char *dir_name, size_t files, bool with_content)
+{
+    char path[FILENAME_MAX];
+    uint8_t data[BENCH_COPY_MAX_SIZE];
+    for (size_t i=0; i<sizeof(data); ++i) data[i] = (uint8_t) (i*2654435761u >> 13);
+    snprintf(path, sizeof(path), "%s/%s", root, dir_name);
+    if (!flib_create_dir(path)) return false;
+    for (size_t i=0; i<files; i+=BENCH_COPY_DIR_FILES){
+        snprintf(path, sizeof(path), "%s/%s/d%zu", root, dir_name, i/BENCH_COPY_DIR_FILES);
+        if (!flib_create_dir(path)) return false;
+        for (size_t j=i; with_content && j<files && j<i+BENCH_COPY_DIR_FILES; ++j){
+            snprintf(path, sizeof(path), "%s/%s/d%zu/f%zu", root, dir_name, i/BENCH_COPY_DIR_FILES, j);
+            FILE *file = fopen(path, "wb");
+            if (file == NULL) return false;
+            size_t size = (j*7919) % (BENCH_COPY_MAX_SIZE+1);
+            bool ok = fwrite(data, 1, size, file) == size;
+            if (fclose(file) != 0 || !ok) return false;
+        }
+    }
+    return true;
+}
+
+void bench_copy_path(char *buffer, size_t buffer_size, const char *root, const char *dir_name, size_t i)
+{
+    snprintf(buffer, buffer_size, "%s/%s/d%zu/f%zu", root, dir_name, i/BENCH_COPY_DIR_FILES, i);
+}
+
+void bench_copy_report(const char *phase, size_t files, double seconds)
+{
+    bench_result("copy", phase, (double) files, "files", seconds);
+}
+
+bool bench_copy(void)
+{
+    char root[] = "/tmp/cbqbench_XXXXXX";
+    if (mkdtemp(root) == NULL){
+        fprintf(stderr, "[ERROR] Could not create a temporary directory!\n");
+        return false;
+    }
+    size_t files = bench_copy_files;
+    bool result = bench_copy_tree(root, "src", files, true);
+    char *from = malloc(FILENAME_MAX);
+    char *to = malloc(FILENAME_MAX);
+    assert(from != NULL && to != NULL && "Buy more RAM lol");
+
+    // one file after the other, the way backup and merge copy without io_uring
+    result = result && bench_copy_tree(root, "flib", files, false);
+    double start = bench_now();
+    for (size_t i=0; result && i<files; ++i){
+        bench_copy_path(from, FILENAME_MAX, root, "src", i);
+        bench_copy_path(to, FILENAME_MAX, root, "flib", i);
+        if (flib_copy_file(from, to) != 0) result = false;
+    }
+    if (result) bench_copy_report("flib", files, bench_now()-start);
+
+    if (result && !uring_supported()){
+        printf("%-8s %-12s not supported by this kernel\n", "copy", "io_uring");
+    }
+    static const unsigned depths[] = {1, 8, URING_DEFAULT_DEPTH, 128};
+    uring_copy_t *copies = calloc(files, sizeof(*copies));
+    assert(copies != NULL && "Buy more RAM lol");
+    char dir_name[32];
+    for (size_t d=0; result && uring_supported() && d<arr_len(depths); ++d){
+        snprintf(dir_name, sizeof(dir_name), "uring%u", depths[d]);
+        if (!bench_copy_tree(root, dir_name, files, false)){
+            result = false;
+            break;
+        }
+        // the paths are built up front, so that only the copies are measured
+        for (size_t i=0; i<files; ++i){
+            bench_copy_path(from, FILENAME_MAX, root, "src", i);
+            bench_copy_path(to, FILENAME_MAX, root, dir_name, i);
+            copies[i] = (uring_copy_t){.from = strdup(from), .to = strdup(to)};
+        }
+        uring_t ring;
+        if (!uring_init(&ring, depths[d])){
+            result = false;
+        } else{
+            start = bench_now();
+            size_t failed = uring_copy_files(&ring, copies, files);
+            double seconds = bench_now()-start;
+            uring_destroy(&ring);
+            if (failed > 0) result = false;
+            char phase[32];
+            snprintf(phase, sizeof(phase), "uring/%u", depths[d]);
+            if (result) bench_copy_report(phase, files, seconds);
+        }
+        // the copies have to match the originals
+        for (size_t i=0; result && i<files; i+=files/16+1){
+            if (flib_size(copies[i].from) == 0 && flib_size(copies[i].to) == 0) continue;
+            flib_cont a = {0}, b = {0};
+            if (!flib_read(copies[i].from, &a) || !flib_read(copies[i].to, &b) || a.size != b.size || memcmp(a.buffer, b.buffer, a.size) != 0){
+                fprintf(stderr, "[ERROR] '%s' is not a copy of '%s'!\n", copies[i].to, copies[i].from);
+                result = false;
+            }
+            free(a.buffer);
+            free(b.buffer);
+        }
+        for (size_t i=0; i<files; ++i){
+            free((char*) copies[i].from);
+            free((char*) copies[i].to);
+        }
+    }
+    free(copies);
+    free(from);
+    free(to);
+    (void) flib_delete_dir(root);
+    return result;
+}
+
+// splitmix64, the same seed always generates the same tree and the same churn
+uint64_t bench_random(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+// a power of two between min_size and max_size first, then a size below it, so small files dominate like in real trees
+uint64_t bench_tree_size(uint64_t *state)
+{
+    uint64_t min = bench_tree.min_size, max = bench_tree.max_size;
+    if (max <= min) return min;
+    unsigned low = 0, high = 0;
+    while (low < 63 && (1ull << low) <= min) low++;
+    while (high < 63 && (1ull << high) <= max) high++;
+    unsigned bits = low + (unsigned) (bench_random(state) % (high - low + 1));
+    uint64_t top = bits >= 63? max : (1ull << bits);
+    if (top > max) top = max;
+    uint64_t bottom = bits == 0? 0 : (1ull << (bits-1));
+    if (bottom < min) bottom = min;
+    if (top <= bottom) return bottom;
+    return bottom + bench_random(state) % (top - bottom + 1);
+}
+
+typedef struct{
+    const uint8_t *data; // BENCH_TREE_DATA_SIZE random bytes, files are slices of it
+    uint64_t state;
+    int64_t mod_time;
+    size_t files;
+    uint64_t bytes;
+    size_t changed;   // files written, deleted or added by the last churn
+    uint64_t changed_bytes;
+} bench_tree_state;
+
+bool bench_tree_write(bench_tree_state *tree, const char *path, uint64_t size)
+{
+    FILE *file = fopen(path, "wb");
+    if (file == NULL){
+        fprintf(stderr, "[ERROR] Could not create '%s'!\n", path);
+        return false;
+    }
+    bool ok = true;
+    uint64_t left = size;
+    while (ok && left > 0){
+        size_t offset = (size_t) (bench_random(&tree->state) % (BENCH_TREE_DATA_SIZE/2));
+        size_t n = left < BENCH_TREE_DATA_SIZE/2? (size_t) left : BENCH_TREE_DATA_SIZE/2;
+        ok = fwrite(tree->data + offset, 1, n, file) == n;
+        left -= n;
+    }
+    if (fclose(file) != 0 || !ok){
+        fprintf(stderr, "[ERROR] Could not write '%s'!\n", path);
+        return false;
+    }
+    // nanoseconds differ between files, as they would on a real filesystem
+    long nsec = (long) (bench_random(&tree->state) % 1000000000);
+    return flib_set_attributes(path, 0644, (time_t) tree->mod_time, nsec);
+}
+
+// file slots of a directory: the first dir_files exist after generating, churn adds files in the rest
+size_t bench_tree_slots(void)
+{
+    return bench_tree.dir_files + bench_tree.dir_files/4 + 1;
+}
+
+bool bench_tree_generate(bench_tree_state *tree, const char *dir, size_t depth)
+{
+    if (!flib_create_dir(dir)) return false;
+    char path[FILENAME_MAX];
+    for (size_t i=0; i<bench_tree.dir_files; ++i){
+        snprintf(path, sizeof(path), "%s/f%zu", dir, i);
+        uint64_t size = bench_tree_size(&tree->state);
+        if (!bench_tree_write(tree, path, size)) return false;
+        tree->files++;
+        tree->bytes += size;
+    }
+    for (size_t i=0; depth > 0 && i<bench_tree.fanout; ++i){
+        snprintf(path, sizeof(path), "%s/d%zu", dir, i);
+        if (!bench_tree_generate(tree, path, depth-1)) return false;
+    }
+    return true;
+}
+
+// changes churn percent of the file slots: existing files are rewritten (4 in 5) or deleted, empty slots get a new file
+bool bench_tree_churn(bench_tree_state *tree, const char *dir, size_t depth)
+{
+    char path[FILENAME_MAX];
+    for (size_t i=0; i<bench_tree_slots(); ++i){
+        if (bench_random(&tree->state) % 100 >= bench_tree.churn) continue;
+        snprintf(path, sizeof(path), "%s/f%zu", dir, i);
+        bool exists = flib_isfile(path);
+        uint64_t old_size = exists? (uint64_t) flib_size(path) : 0;
+        if (exists && bench_random(&tree->state) % 5 == 0){
+            if (remove(path) != 0) return false;
+            tree->files--;
+            tree->bytes -= old_size;
+        } else{
+            uint64_t size = bench_tree_size(&tree->state);
+            if (!bench_tree_write(tree, path, size)) return false;
+            if (!exists) tree->files++;
+            tree->bytes += size - old_size;
+            tree->changed_bytes += size;
+        }
+        tree->changed++;
+    }
+    for (size_t i=0; depth > 0 && i<bench_tree.fanout; ++i){
+        snprintf(path, sizeof(path), "%s/d%zu", dir, i);
+        if (!bench_tree_churn(tree, path, depth-1)) return false;
+    }
+    return true;
+}
+
+// the library logs through the message queue, only errors are shown
+bool bench_drain_messages(void)
+{
+    bool result = true;
+    char message[MAX_MSG_LEN];
+    while (msgq_pop(message, sizeof(message))){
+        if (strstr(message, "[ERROR]") == NULL) continue;
+        fprintf(stderr, "%s\n", message);
+        result = false;
+    }
+    return result;
+}
+
+// a program directory of its own, so that the benchmark never touches the real branches
+bool bench_tree_setup(const char *root, const char *src)
+{
+    char path[FILENAME_MAX];
+    snprintf(path, sizeof(path), "%s/data", root);
+    if (!flib_create_dir(path)) return false;
+    snprintf(program_dir, sizeof(program_dir), "%s", root);
+    CsonArena arena = {0};
+    CsonArena *prev_arena = cson_current_arena;
+    cson_swap_arena(&arena);
+    Cson *dirs = cson_array_new();
+    cson_array_push(dirs, cson_new_cstring((char*) src));
+    Cson *branch = cson_map_new();
+    cson_map_insert(branch, cson_str_new("dirs"), dirs);
+    cson_map_insert(branch, cson_str_new("backups"), cson_array_new());
+    cson_map_insert(branch, cson_str_new("last_id"), cson_new_int(0));
+    Cson *branches = cson_map_new();
+    cson_map_insert(branches, cson_str_new("bench"), branch);
+    Cson *info = cson_map_new();
+    cson_map_insert(info, cson_str_new("branches"), branches);
+    snprintf(path, sizeof(path), "%s/" BACKUPS_JSON, root);
+    bool result = cson_write(info, path);
+    cson_swap_and_free_arena(prev_arena);
+    return result;
+}
+
+bool bench_backup(void)
+{
+    char root[] = "/tmp/cbqbench_XXXXXX";
+    if (mkdtemp(root) == NULL){
+        fprintf(stderr, "[ERROR] Could not create a temporary directory!\n");
+        return false;
+    }
+    char prev_program_dir[FILENAME_MAX];
+    memcpy(prev_program_dir, program_dir, sizeof(prev_program_dir));
+    char src[FILENAME_MAX], dest[FILENAME_MAX], out[FILENAME_MAX], parent[FILENAME_MAX], backup_path[FILENAME_MAX];
+    snprintf(src, sizeof(src), "%s/src", root);
+    snprintf(dest, sizeof(dest), "%s/dest", root);
+    snprintf(out, sizeof(out), "%s/out", root);
+    uint8_t *data = malloc(BENCH_TREE_DATA_SIZE);
+    assert(data != NULL && "Buy more RAM lol");
+    bench_tree_state tree = {.data = data, .state = bench_tree.seed, .mod_time = BENCH_TREE_MOD_TIME};
+    for (size_t i=0; i<BENCH_TREE_DATA_SIZE; i+=8){
+        uint64_t value = bench_random(&tree.state);
+        memcpy(data+i, &value, sizeof(value));
+    }
+    msgq_init(0);
+    bool result = bench_tree_setup(root, src) && flib_create_dir(dest) && flib_create_dir(out);
+
+    double start = bench_now();
+    result = result && bench_tree_generate(&tree, src, bench_tree.depth);
+    if (result) bench_result("tree", "generate", (double) tree.files, "files", bench_now()-start);
+    if (result) printf("%-8s %-12s %10zu files %8.2f MiB\n", "tree", "size", tree.files, tree.bytes/(1024.0*1024.0));
+
+    backup_options_t options = {.jobs = bench_tree.jobs};
+    start = bench_now();
+    result = result && backup("bench", dest, NULL, &options) == 0;
+    result = bench_drain_messages() && result;
+    if (result){
+        double seconds = bench_now()-start;
+        bench_result("backup", "full", (double) tree.files, "files", seconds);
+        bench_result("backup", "full", tree.bytes/(1024.0*1024.0), "MiB", seconds);
+    }
+
+    double incremental = 0;
+    size_t changed = 0, scanned = 0;
+    for (size_t i=1; result && i<=bench_tree.chain; ++i){
+        // every round looks like a later day, so no file counts as modified during the previous backup
+        tree.mod_time += 24*3600;
+        tree.changed = 0;
+        result = bench_tree_churn(&tree, src, bench_tree.depth);
+        changed += tree.changed;
+        scanned += tree.files;
+        snprintf(parent, sizeof(parent), "%s/bench_%zu", dest, i);
+        start = bench_now();
+        result = result && backup("bench", dest, parent, &options) == 0;
+        incremental += bench_now()-start;
+        result = bench_drain_messages() && result;
+    }
+    if (result && bench_tree.chain > 0){
+        Cson *record = bench_result("backup", "incremental", (double) scanned, "files", incremental);
+        bench_result_extra(record, "changed", (double) changed/bench_tree.chain);
+        printf("%-8s %-12s %10.2f changed files per backup of %zu\n", "backup", "churn", (double) changed/bench_tree.chain, tree.files);
+    }
+
+    merge_options_t merge_options = {.jobs = bench_tree.jobs};
+    snprintf(backup_path, sizeof(backup_path), "%s/bench_%zu", dest, bench_tree.chain+1);
+    start = bench_now();
+    result = result && merge(backup_path, out, &merge_options) == 0;
+    result = bench_drain_messages() && result;
+    if (result){
+        char phase[32];
+        snprintf(phase, sizeof(phase), "chain/%zu", bench_tree.chain+1);
+        double seconds = bench_now()-start;
+        bench_result("merge", phase, (double) tree.files, "files", seconds);
+        bench_result("merge", phase, tree.bytes/(1024.0*1024.0), "MiB", seconds);
+    }
+
+    msgq_destroy();
+    memcpy(program_dir, prev_program_dir, sizeof(program_dir));
+    free(data);
+    (void) flib_delete_dir(root);
+    return result;
+}
+
+static benchmark_t benchmarks[] = {
+    {"map", "Insert, look up and remove 1M keys in a CsonMap", bench_map},
+    {"parse", "Parse a large directory info file with every scanning stage", bench_parse},
+    {"write", "Write a large directory info file, pretty and compact", bench_write},
+    {"hash", "Hash 64 MiB with XXH64 (content hashes) and SHA-256 (chunk ids)", bench_hash},
+    {"compress", "Compress and restore 64 MiB of text with every available codec", bench_compress},
+    {"copy", "Copy a tree of small files one by one and with io_uring, in files/s", bench_copy},
+    {"backup", "Full and incremental backups of a generated tree with churn, then merge the chain", bench_backup},
+};
+
+void print_usage(const char *program_name)
+{
+    printf("Usage: %s [benchmarks..] [OPTIONS]\n\n", program_name);
+    printf("Benchmarks (default: all):\n");
+    for (size_t i=0; i<arr_len(benchmarks); ++i){
+        printf("  %-10s %s\n", benchmarks[i].name, benchmarks[i].description);
+    }
+    printf("\nOptions:\n");
+    printf("  --files <n>         Number of files for 'copy' (default: %d)\n", BENCH_COPY_FILES);
+    printf("  --json <path>       Also write all results to a JSON file\n");
+    printf("\nOptions for 'backup':\n");
+    printf("  --depth <n>         Levels of directories below the root (default: %zu)\n", bench_tree.depth);
+    printf("  --fanout <n>        Subdirectories per directory (default: %zu)\n", bench_tree.fanout);
+    printf("  --dir-files <n>     Files per directory (default: %zu)\n", bench_tree.dir_files);
+    printf("  --sizes <min>-<max> File sizes, K/M/G suffixes allowed, most files are small (default: 0-256K)\n");
+    printf("  --churn <percent>   Files changed, deleted or added before each incremental backup (default: %u)\n", bench_tree.churn);
+    printf("  --chain <n>         Incremental backups after the full one, the last one is merged (default: %zu)\n", bench_tree.chain);
+    printf("  -j, --jobs <n>      Worker threads of backup and merge (default: %zu, 0: one per cpu)\n", bench_tree.jobs);
+    printf("  --seed <n>          Seed of the generated tree and churn (default: %"PRIu64")\n", bench_tree.seed);
+}
+
+bool parse_size(const char *value, uint64_t *size)
+{
+    char *end = NULL;
+    unsigned long long number = strtoull(value, &end, 10);
+    if (end == value) return false;
+    uint64_t scale = 1;
+    switch (*end){
+        case 'k': case 'K': scale = 1024ull; end++; break;
+        case 'm': case 'M': scale = 1024ull*1024; end++; break;
+        case 'g': case 'G': scale = 1024ull*1024*1024; end++; break;
+    }
+    if (*end != '\0') return false;
+    *size = (uint64_t) number * scale;
+    return true;
+}
+
+bool parse_sizes(const char *value, uint64_t *min, uint64_t *max)
+{
+    const char *dash = strchr(value, '-');
+    if (dash == NULL || (size_t) (dash - value) >= 32) return false;
+    char low[32];
+    snprintf(low, sizeof(low), "%.*s", (int) (dash - value), value);
+    return parse_size(low, min) && parse_size(dash+1, max) && *min <= *max;
+}
+
+bool parse_count(const char *value, uint64_t *count)
+{
+    char *end = NULL;
+    unsigned long long number = strtoull(value, &end, 10);
+    if (end == value || *end != '\0' || value[0] == '-') return false;
+    *count = (uint64_t) number;
+    return true;
+}
+
+// the parameters go along with the results, runs are only comparable with the same tree
+bool bench_write_json(const char *path)
+{
+    CsonArena *prev_arena = cson_current_arena;
+    cson_swap_arena(&bench_results_arena);
+    Cson *tree = cson_map_new();
+    cson_map_insert(tree, cson_str_new("depth"), cson_new_int((int64_t) bench_tree.depth));
+    cson_map_insert(tree, cson_str_new("fanout"), cson_new_int((int64_t) bench_tree.fanout));
+    cson_map_insert(tree, cson_str_new("dir_files"), cson_new_int((int64_t) bench_tree.dir_files));
+    cson_map_insert(tree, cson_str_new("min_size"), cson_new_int((int64_t) bench_tree.min_size));
+    cson_map_insert(tree, cson_str_new("max_size"), cson_new_int((int64_t) bench_tree.max_size));
+    cson_map_insert(tree, cson_str_new("churn"), cson_new_int(bench_tree.churn));
+    cson_map_insert(tree, cson_str_new("chain"), cson_new_int((int64_t) bench_tree.chain));
+    cson_map_insert(tree, cson_str_new("jobs"), cson_new_int((int64_t) bench_tree.jobs));
+    cson_map_insert(tree, cson_str_new("seed"), cson_new_int((int64_t) bench_tree.seed));
+    char time_buffer[32];
+    time_t now = time(NULL);
+    strftime(time_buffer, sizeof(time_buffer), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+    Cson *root = cson_map_new();
+    cson_map_insert(root, cson_str_new("version"), cson_new_cstring((char*) VERSION));
+    cson_map_insert(root, cson_str_new("time"), cson_new_cstring(time_buffer));
+    cson_map_insert(root, cson_str_new("cpus"), cson_new_int((int64_t) cpu_count()));
+    cson_map_insert(root, cson_str_new("copy_files"), cson_new_int((int64_t) bench_copy_files));
+    cson_map_insert(root, cson_str_new("tree"), tree);
+    cson_map_insert(root, cson_str_new("results"), bench_results);
+    bool result = cson_write(root, (char*) path);
+    cson_swap_arena(prev_arena);
+    if (!result) fprintf(stderr, "[ERROR] Could not write the results to '%s'!\n", path);
+    return result;
+}
+
+int main(int argc, char **argv)
+{
+    const char *program_name = argv[0];
+    bool selected[arr_len(benchmarks)] = {0};
+    bool any = false;
+    const char *json_path = NULL;
+    for (int i=1; i<argc; ++i){
+        if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0){
+            print_usage(program_name);
+            return 0;
+        }
+        const char *option = argv[i];
+        if (strcmp(option, "--json") == 0 || strcmp(option, "--sizes") == 0 || strcmp(option, "--depth") == 0 || strcmp(option, "--fanout") == 0
+            || strcmp(option, "--dir-files") == 0 || strcmp(option, "--churn") == 0 || strcmp(option, "--chain") == 0
+            || strcmp(option, "--jobs") == 0 || strcmp(option, "-j") == 0 || strcmp(option, "--seed") == 0){
+            if (i+1 >= argc){
+                fprintf(stderr, "[ERROR] Missing value for '%s'!\n\n", option);
+                print_usage(program_name);
+                return 1;
+            }
+            const char *value = argv[++i];
+            uint64_t number = 0;
+            bool valid = true;
+            if (strcmp(option, "--json") == 0){
+                json_path = value;
+            } else if (strcmp(option, "--sizes") == 0){
+                valid = parse_sizes(value, &bench_tree.min_size, &bench_tree.max_size);
+            } else{
+                valid = parse_count(value, &number);
+                if (strcmp(option, "--depth") == 0) bench_tree.depth = (size_t) number;
+                else if (strcmp(option, "--fanout") == 0) bench_tree.fanout = (size_t) number;
+                else if (strcmp(option, "--dir-files") == 0) bench_tree.dir_files = (size_t) number;
+                else if (strcmp(option, "--churn") == 0){
+                    valid = valid && number <= 100;
+                    if (valid) bench_tree.churn = (unsigned) number;
+                }
+                else if (strcmp(option, "--chain") == 0) bench_tree.chain = (size_t) number;
+                else if (strcmp(option, "--seed") == 0) bench_tree.seed = number;
+                else bench_tree.jobs = (size_t) number;
+            }
+            if (!valid){
+                fprintf(stderr, "[ERROR] Invalid value for '%s': '%s'!\n\n", option, value);
+                print_usage(program_name);
+                return 1;
+            }
+            continue;
+        }
+        if (strcmp(argv[i], "--files") == 0){
+            char *end = NULL;
+            long files = i+1 < argc? strtol(argv[i+1], &end, 10) : 0;
+            if (end == NULL || end == argv[i+1] || *end != '\0' || files <= 0){
+                fprintf(stderr, "[ERROR] Invalid number of files!\n\n");
+                print_usage(program_name);
+                return 1;
+            }
+            bench_copy_files = (size_t) files;
+            i++;
+            continue;
+        }
+        bool found = false;
+        for (size_t j=0; j<arr_len(benchmarks); ++j){
+            if (strcmp(argv[i], benchmarks[j].name) == 0){
+                selected[j] = found = any = true;
+            }
+        }
+        if (!found){
+            fprintf(stderr, "[ERROR] Unknown benchmark: '%s'!\n\n", argv[i]);
+            print_usage(program_name);
+            return 1;
+        }
+    }
+    if (json_path != NULL){
+        CsonArena *prev_arena = cson_current_arena;
+        cson_swap_arena(&bench_results_arena);
+        bench_results = cson_array_new();
+        cson_swap_arena(prev_arena);
+    }
+    int result = 0;
+    for (size_t i=0; i<arr_len(benchmarks); ++i){
+        if (any && !selected[i]) continue;
+        if (!benchmarks[i].run()){
+            fprintf(stderr, "[ERROR] Benchmark '%s' failed!\n", benchmarks[i].name);
+            result = 1;
+        }
+    }
+    if (json_path != NULL && !bench_write_json(json_path)) result = 1;
+    return result;
+}
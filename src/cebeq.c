@@ -26,7 +26,7 @@
 char program_dir[FILENAME_MAX];
 char exe_dir[FILENAME_MAX];
 char exe_path[FILENAME_MAX];
-volatile int worker_done = 0;
+atomic_bool worker_done = false;
 
 bool setup(void)
 {
@@ -47,6 +47,12 @@ void cleanup(void)
     cson_free();
 }
 
+void worker_finish(void)
+{
+    atomic_store(&worker_done, true);
+    msgq_wake();
+}
+
 void escape_string(const char *string, char *buffer, size_t buffer_size)
 {
     if (string == NULL || buffer == NULL || buffer_size == 0) return;
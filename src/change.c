@@ -0,0 +1,51 @@
+#include <string.h>
+
+#include <change.h>
+
+bool change_policy_parse(const char *name, change_policy *policy)
+{
+    for (size_t i=0; i<CHANGE__POLICY_COUNT; ++i){
+        if (strcmp(name, change_policy_names[i]) == 0){
+            *policy = (change_policy) i;
+            return true;
+        }
+    }
+    return false;
+}
+
+void change_entry_from_stat(manifest_entry *item, const flib_entry *entry)
+{
+    item->mod_time = (int64_t) entry->mod_time;
+    item->mod_time_nsec = (int64_t) entry->mod_time_nsec;
+    item->change_time = (int64_t) entry->change_time;
+    item->change_time_nsec = (int64_t) entry->change_time_nsec;
+    item->size = entry->size;
+    item->inode = entry->inode;
+    item->device = entry->device;
+    item->mode = entry->mode;
+}
+
+void change_keep_stored(manifest_entry *item, const manifest_entry *stored)
+{
+    item->change_time = stored->change_time;
+    item->change_time_nsec = stored->change_time_nsec;
+    item->inode = stored->inode;
+    item->device = stored->device;
+    item->hash = stored->hash;
+    item->flags |= stored->flags & (MANIFEST_ENTRY_HASHED | MANIFEST_ENTRY_COMPRESSED);
+}
+
+bool change_file_changed(change_policy policy, const manifest_t *prev, uint32_t prev_index, const manifest_entry *current)
+{
+    const manifest_entry *old = &prev->entries[prev_index];
+    if (old->type != MANIFEST_TYPE_FILE) return true;
+    if (old->size != current->size) return true;
+    if (old->mod_time != current->mod_time || old->mod_time_nsec != current->mod_time_nsec) return true;
+    // whole seconds, filesystems with coarse timestamps round the modification time down
+    if (old->mod_time >= prev->header->scan_time) return true;
+    if (policy == CHANGE_STRICT){
+        if (old->change_time != current->change_time || old->change_time_nsec != current->change_time_nsec) return true;
+        if (old->inode != current->inode || old->device != current->device) return true;
+    }
+    return false;
+}
@@ -0,0 +1,282 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chunk.h>
+#include <cwalk.h>
+#include <flib.h>
+#include <message_queue.h>
+
+#ifdef _WIN32
+    #define chunk_mkdir(path) mkdir(path)
+    #define CHUNK_O_BINARY O_BINARY
+#else
+    #define chunk_mkdir(path) mkdir(path, 0755)
+    #define CHUNK_O_BINARY 0
+#endif // _WIN32
+
+// a cut point needs more zero bits below the average size and fewer above it
+#define CHUNK_MASK_S (~0ULL << (64-18))
+#define CHUNK_MASK_L (~0ULL << (64-14))
+
+// random values for the gear rolling hash (splitmix64)
+static const uint64_t chunk_gear[256] = {
+    0x706e5927bd4368c8ULL, 0xd82046e226bf448bULL, 0xfabfebf94baeebadULL, 0xa3afd3cb30c1f3a4ULL,
+    0x3f1b0b3d86229668ULL, 0x084a8b1becfa8178ULL, 0xba92de871b61fa92ULL, 0x8f38ad2d2a122e80ULL,
+    0xaf557806c207c7e2ULL, 0x286910557859b76fULL, 0x964cbf17dda5c043ULL, 0xffab3b47fbff6e6bULL,
+    0x39ba5663801fc214ULL, 0xe4ab45c374279dbbULL, 0x4fd89892f42042a4ULL, 0x1ab590173cb49234ULL,
+    0xbc0bf0e86c752a4cULL, 0xedf65e95f9880d0aULL, 0x588a3440d08a1a88ULL, 0x35bbd8956b937ebfULL,
+    0xbb727a58561cd8fcULL, 0xe4690639fa98c609ULL, 0x9135ab936ecea3f5ULL, 0x30ade9063ffd5f56ULL,
+    0x5a0711169bf0d120ULL, 0x5e557359bf3a6039ULL, 0x926c6cbb26871936ULL, 0x660902e4c4168521ULL,
+    0x614db9e87a1f3b04ULL, 0xc3132e78116676ecULL, 0x0e14f1f9eee60b44ULL, 0x0cad634b9d65e7d2ULL,
+    0xdec9db268bff0ee6ULL, 0x43395d6cd59967caULL, 0xe2ed5d2f4f906911ULL, 0xba545da443eeeb8aULL,
+    0xe69f05212a80bd5aULL, 0xc230aa64f3819cbeULL, 0xb854a22af807a09dULL, 0xa2b5128ebaec028fULL,
+    0x843c826d86169f49ULL, 0x3c18b57c219a2409ULL, 0x50f46a74b47a8176ULL, 0x7b1f7ec4bde265d5ULL,
+    0x0d4d980df78400c3ULL, 0x06fa4325d493676bULL, 0x16cb75e740f550d3ULL, 0xa04955282e7c585cULL,
+    0x5a02cb8a7ab8f63fULL, 0x4ac30716598280feULL, 0xe34171eeab0f6249ULL, 0x65bcfdf46850b366ULL,
+    0x052bd30deefd9442ULL, 0xec8844fa26fe4a44ULL, 0xf7c774b2723a1638ULL, 0x3929b5750fce18a0ULL,
+    0xa2de06a664022076ULL, 0x240b3f32f8be8ef3ULL, 0x624d7813bae7bdb0ULL, 0x5d8651ec25793252ULL,
+    0x705b1096c81fe812ULL, 0xc38f0194989cfddcULL, 0xf7b500aa1ab4c2a1ULL, 0x69b241634d221116ULL,
+    0xe4bd4f4ed3f4af67ULL, 0xedfe90bac12dd94fULL, 0x45913438633b8e7eULL, 0x6a28b2cb31eb4bb1ULL,
+    0x6e6181acb81ed14aULL, 0x0fc7a31c11e78a9aULL, 0x0f8176f7efc4e9ddULL, 0x7131347494b33de6ULL,
+    0x3f3878aab7ba8402ULL, 0xe4b6588a5572ae5bULL, 0x6fb2df8d70d5b418ULL, 0xd858dc09046e2896ULL,
+    0x0c2e6d682c5b085bULL, 0x2af2830971092ab2ULL, 0x501a171efde74a07ULL, 0xf97cb4bc02892e05ULL,
+    0x51be1525ad88b670ULL, 0x52213eb27abd3562ULL, 0xce8ce3993567f34dULL, 0x0dc5475afc4416baULL,
+    0x2daacdec08c942d7ULL, 0x5b17e09958f35902ULL, 0x776d285e19a2790eULL, 0x3729db15c9a41586ULL,
+    0xba899d0d4ae67194ULL, 0xd206b08a729d6750ULL, 0x6e4507c00615cbbeULL, 0x886ab415fc29a892ULL,
+    0x2d8e20e91b9f04fdULL, 0xca74826b8f7725c6ULL, 0x5294a07e5b8c513bULL, 0x5db9eb42f7414c0bULL,
+    0x01945fc71de0e6a1ULL, 0x1d871a709e36861aULL, 0x69d93aca53c3c530ULL, 0x1faa57d45ca3dc42ULL,
+    0xd77196ba892d153dULL, 0x3ab88d1c4e9735c5ULL, 0x30b1d9d548659724ULL, 0x52c4003deedaa13cULL,
+    0x8f512aed9d184457ULL, 0xfac6b29453a93cc7ULL, 0x39ccb7e07ea15078ULL, 0x73b84a0bda33f290ULL,
+    0x579cf4a642454783ULL, 0x3efcc93f4619a42aULL, 0x1723f5ec50deed93ULL, 0x1deff60716bd3c1dULL,
+    0xe09c35c98a343768ULL, 0x0579cc8ed7942476ULL, 0x7e9804a49a304dccULL, 0x331b92d8fbabb630ULL,
+    0xf2afac4f76b903e2ULL, 0xf573b5c517949c9aULL, 0xc27c8c6c94f43ebbULL, 0x970f98a86bf35a4cULL,
+    0x26e077d6b6428680ULL, 0xf1b1afbb58632496ULL, 0x4db777e16558fb0bULL, 0x66e6778893a5f5d3ULL,
+    0x11a19d0c3c007952ULL, 0xdede99084708825bULL, 0x175da92f27500522ULL, 0xabd70fd814dd9372ULL,
+    0x61939c4686e54585ULL, 0x684d848f4fc73969ULL, 0x751a074d462207f1ULL, 0x800a9e4064e1f97fULL,
+    0x768855724421bef7ULL, 0x908eba9bf69b2f9aULL, 0x2d6fad2b926332b1ULL, 0x0b5d528cd3e8675eULL,
+    0xb89f6c3a188da645ULL, 0xf4c95842b8f9cadfULL, 0x5895c77baf4b775eULL, 0x2d7d6404c7685c20ULL,
+    0x345fb751c1e44bcbULL, 0xeb9e779eb949f38dULL, 0x7bec3a6b583b6178ULL, 0xa7ce1e33a0c3e283ULL,
+    0x53c11ded9556808eULL, 0x3b7926c744993ee1ULL, 0xeb0dc5982a306442ULL, 0xabd5a0f890847ec9ULL,
+    0x276ecffcd064675aULL, 0xbc40565281b7195aULL, 0x39b37163e7fcc401ULL, 0x82025d7455906dddULL,
+    0x40d071ef483bf805ULL, 0x4b5793c777cbfe58ULL, 0xbb7f59f15da3a578ULL, 0x2f48e70ead867172ULL,
+    0x9ee3084f4ebf079eULL, 0xb13f0c2c4bde4bc4ULL, 0x143fe494e8e1a3b1ULL, 0xd85490f754ff9910ULL,
+    0x85cd04d554369b38ULL, 0x8c2be5782e001c24ULL, 0x4e83b51c8a8e1488ULL, 0x2592cc7e366fb22eULL,
+    0x1a880092fa7bd147ULL, 0xcf5187d85ee69905ULL, 0x94e4b69a3f96bbbdULL, 0x29d39d5f08f217a9ULL,
+    0xdefe355c9d977c34ULL, 0x21deb1db08b3a06bULL, 0xe820e68d26092254ULL, 0x6986777847a98535ULL,
+    0xdc30f4643bc81b2dULL, 0x9b2b42698b321b2fULL, 0xc352ee4b127358cfULL, 0x0c878a0839e8907fULL,
+    0x05ca74e835928c7aULL, 0x7ee8e2769bcf68c9ULL, 0xb2f100c48047a6eeULL, 0x614bd7b6d4bd55c8ULL,
+    0xd261f8468dae23acULL, 0x9c819155f4d047daULL, 0xe52e8cd354b4b625ULL, 0x11255185cce7a287ULL,
+    0x3850268bcccf1e43ULL, 0x3897de881ba66848ULL, 0x198b70b3e40dba54ULL, 0x45b74f34c69380e7ULL,
+    0x9a9fc9d66b9941a6ULL, 0xc5f52278e1808e90ULL, 0xdc3716436e72dfb8ULL, 0xcb6c435637e8e881ULL,
+    0xcc1a7c879622379aULL, 0xf12d25d329041760ULL, 0xaa2087b169e52235ULL, 0x24e8f8acadd4e4c8ULL,
+    0xacc3da955886d760ULL, 0x4aa0e4f668ea18afULL, 0xb4af27d8ea4f155dULL, 0x0bbe52901af8f8e2ULL,
+    0x34070292370a2317ULL, 0xfa4fd7eafe50358dULL, 0x9ab05cb5b78d5845ULL, 0x26826a5124385d85ULL,
+    0x30363dd9b63ec410ULL, 0x7b82253ec121493bULL, 0x87fc8e1eb6453b25ULL, 0xa6577875b9da6ca3ULL,
+    0x1196ea11d6ba60a5ULL, 0xd5b3a42bf5a7fe32ULL, 0xbe66c4054ab1fa51ULL, 0xd33413d7e8d1a706ULL,
+    0x9ba72a6fab2281f1ULL, 0x689168970314856dULL, 0xa2169dc1a3f94a55ULL, 0x23fa0139f82e005dULL,
+    0xbae0c30182f55c1fULL, 0x3cbec8cd6f0da69dULL, 0xea761a483a043cc0ULL, 0xce8685f84759a9b5ULL,
+    0xbbe723a5a45986beULL, 0x55b4443bddf8b19aULL, 0xb75246c29cf6c1b8ULL, 0xcada3543cb6a8310ULL,
+    0x99180cb393c9ffbdULL, 0xca20d519b7d5b877ULL, 0xa5193fbc9b4ebcc9ULL, 0xcaefc93c08726a1bULL,
+    0x3cb48135977de048ULL, 0x4df5508f45348f25ULL, 0xd075201ac5197f07ULL, 0x90dce260074acf45ULL,
+    0x3feb1bce1a4f7225ULL, 0xa22293f34f790284ULL, 0x6dbb2c0e6d092580ULL, 0x2387fc01cf91636bULL,
+    0xec2638ace791a8e9ULL, 0x1e32c65af3b64c17ULL, 0x3303bc2a009a2777ULL, 0x458947c6dd8b4062ULL,
+    0xcdef4e6a8259469bULL, 0xb7e42e6871a6dcd1ULL, 0x6a180803c6e9c2aeULL, 0x872e10828234265cULL,
+    0x0c84cf39248b37d1ULL, 0x50a30a4e3a3d3dfbULL, 0x6dce7f01df162920ULL, 0x08100ef230b80b14ULL,
+    0x6272d28788e37c81ULL, 0x43544c9cd653fb32ULL, 0x6f0e66217513d0b9ULL, 0x6e28b000daa28296ULL,
+    0xd22a9bdee9b3488cULL, 0xad190c11b2f5a4b1ULL, 0xcf8c14ba59fcb176ULL, 0x711aafe6d2c0ceccULL,
+};
+
+size_t chunk_cut(const uint8_t *data, size_t len)
+{
+    if (len <= CHUNK_MIN_SIZE) return len;
+    size_t max = len < CHUNK_MAX_SIZE? len : CHUNK_MAX_SIZE;
+    size_t normal = max < CHUNK_AVG_SIZE? max : CHUNK_AVG_SIZE;
+    uint64_t fp = 0;
+    size_t i = CHUNK_MIN_SIZE;
+    for (; i<normal; ++i){
+        fp = (fp << 1) + chunk_gear[data[i]];
+        if ((fp & CHUNK_MASK_S) == 0) return i+1;
+    }
+    for (; i<max; ++i){
+        fp = (fp << 1) + chunk_gear[data[i]];
+        if ((fp & CHUNK_MASK_L) == 0) return i+1;
+    }
+    return max;
+}
+
+void chunk_list_push(chunk_list *chunks, const chunk_id *id)
+{
+    if (chunks->count >= chunks->capacity){
+        chunks->capacity = chunks->capacity == 0? 16 : chunks->capacity*2;
+        chunks->items = realloc(chunks->items, chunks->capacity*sizeof(*chunks->items));
+        assert(chunks->items != NULL && "Buy more RAM lol");
+    }
+    chunks->items[chunks->count++] = *id;
+}
+
+void chunk_list_free(chunk_list *chunks)
+{
+    if (chunks == NULL) return;
+    free(chunks->items);
+    memset(chunks, 0, sizeof(*chunks));
+}
+
+bool chunk_store_open(chunk_store_t *store, const char *dest, bool create)
+{
+    memset(store, 0, sizeof(*store));
+    cwk_path_join(dest, CHUNK_STORE_DIR, store->path, sizeof(store->path));
+    if (!create){
+        if (!flib_isdir(store->path)){
+            eprintf("Could not find chunk store '%s'!", store->path);
+            return false;
+        }
+        return true;
+    }
+    if (!flib_isdir(store->path) && !flib_create_dir(store->path)) return false;
+    // create all fan-out directories up front, so that workers never race on them
+    char dir_path[FILENAME_MAX] = {0};
+    for (size_t i=0; i<256; ++i){
+        snprintf(dir_path, sizeof(dir_path), "%s%c%02zx", store->path, FLIB_PATH_SEP, i);
+        if (chunk_mkdir(dir_path) != 0 && errno != EEXIST){
+            eprintf("Could not create directory '%s': %s!", dir_path, strerror(errno));
+            return false;
+        }
+    }
+    return true;
+}
+
+void chunk_store_path(const chunk_store_t *store, const chunk_id *id, char *buffer, size_t buffer_size)
+{
+    char hex[HASH_SHA256_HEX_SIZE];
+    hash_to_hex(id->bytes, sizeof(id->bytes), hex);
+    snprintf(buffer, buffer_size, "%s%c%.2s%c%s", store->path, FLIB_PATH_SEP, hex, FLIB_PATH_SEP, hex+2);
+}
+
+static bool chunk_write_all(int fd, const void *data, size_t len)
+{
+    const char *bytes = data;
+    while (len > 0){
+        ssize_t n = write(fd, bytes, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        bytes += n;
+        len -= (size_t) n;
+    }
+    return true;
+}
+
+bool chunk_store_put(chunk_store_t *store, const void *data, size_t len, chunk_id *id)
+{
+    hash_sha256(data, len, id->bytes);
+    char path[FILENAME_MAX] = {0};
+    chunk_store_path(store, id, path, sizeof(path));
+    struct stat st;
+    if (stat(path, &st) == 0){
+        atomic_fetch_add(&store->chunks_dup, 1);
+        atomic_fetch_add(&store->bytes_dup, len);
+        return true;
+    }
+    // write to a unique temporary file first, so that a chunk is either complete or missing
+    char tmp_path[FILENAME_MAX] = {0};
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%zu.tmp", path, atomic_fetch_add(&store->tmp_counter, 1));
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL | CHUNK_O_BINARY, 0644);
+    if (fd < 0){
+        eprintf("Could not create chunk '%s': %s!", tmp_path, strerror(errno));
+        return false;
+    }
+    bool ok = chunk_write_all(fd, data, len);
+    ok = (close(fd) == 0) && ok;
+    if (!ok || rename(tmp_path, path) != 0){
+        eprintf("Could not write chunk '%s': %s!", path, strerror(errno));
+        unlink(tmp_path);
+        return false;
+    }
+    atomic_fetch_add(&store->chunks_new, 1);
+    atomic_fetch_add(&store->bytes_new, len);
+    return true;
+}
+
+bool chunk_store_add_file(chunk_store_t *store, const char *path, chunk_list *chunks)
+{
+    int fd = open(path, O_RDONLY | CHUNK_O_BINARY);
+    if (fd < 0){
+        eprintf("Could not open '%s': %s!", path, strerror(errno));
+        return false;
+    }
+    uint8_t *buffer = malloc(CHUNK_READ_SIZE);
+    assert(buffer != NULL && "Buy more RAM lol");
+    bool result = true;
+    bool eof = false;
+    size_t start = 0;
+    size_t end = 0;
+    while (true){
+        // a cut point can only be searched once a full chunk is buffered or the file ended
+        if (!eof && end-start < CHUNK_MAX_SIZE){
+            memmove(buffer, buffer+start, end-start);
+            end -= start;
+            start = 0;
+            while (!eof && end < CHUNK_READ_SIZE){
+                ssize_t n = read(fd, buffer+end, CHUNK_READ_SIZE-end);
+                if (n < 0 && errno == EINTR) continue;
+                if (n < 0){
+                    eprintf("Could not read '%s': %s!", path, strerror(errno));
+                    result = false;
+                    goto defer;
+                }
+                if (n == 0) eof = true;
+                end += (size_t) n;
+            }
+        }
+        if (start == end) break;
+        size_t len = chunk_cut(buffer+start, end-start);
+        chunk_id id;
+        if (!chunk_store_put(store, buffer+start, len, &id)){
+            result = false;
+            goto defer;
+        }
+        chunk_list_push(chunks, &id);
+        start += len;
+    }
+  defer:
+    free(buffer);
+    close(fd);
+    return result;
+}
+
+bool chunk_store_restore_file(chunk_store_t *store, const chunk_id *chunks, size_t count, const char *path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | CHUNK_O_BINARY, 0644);
+    if (fd < 0){
+        eprintf("Could not create '%s': %s!", path, strerror(errno));
+        return false;
+    }
+    uint8_t buffer[FLIB_COPY_BUFFER_SIZE/2];
+    bool result = true;
+    char chunk_path[FILENAME_MAX] = {0};
+    for (size_t i=0; result && i<count; ++i){
+        chunk_store_path(store, &chunks[i], chunk_path, sizeof(chunk_path));
+        int chunk_fd = open(chunk_path, O_RDONLY | CHUNK_O_BINARY);
+        if (chunk_fd < 0){
+            eprintf("Missing chunk '%s' of '%s'!", chunk_path, path);
+            result = false;
+            break;
+        }
+        ssize_t n;
+        while ((n = read(chunk_fd, buffer, sizeof(buffer))) != 0){
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 || !chunk_write_all(fd, buffer, (size_t) n)){
+                eprintf("Could not restore chunk '%s' into '%s'!", chunk_path, path);
+                result = false;
+                break;
+            }
+        }
+        close(chunk_fd);
+    }
+    if (close(fd) != 0) result = false;
+    return result;
+}
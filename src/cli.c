@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
+#include <stdlib.h>
+#include <signal.h>
 
 #define CEBEQ_COLOR
 
@@ -15,10 +17,25 @@
 #include <threading.h>
 #include <message_queue.h>
 #include <flib.h>
+#include <change.h>
+#include <uring.h>
+#include <compress.h>
+#include <progress.h>
+#include <trace.h>
+#include <watch.h>
+
+#ifdef _WIN32
+    #include <io.h>
+#else
+    #include <unistd.h>
+#endif // _WIN32
+
+// how often the progress line is redrawn while no message arrives
+#define CLI_PROGRESS_INTERVAL_MS 250
 
 
 typedef enum{
-    Cmd_None, Cmd_Backup, Cmd_Merge, Cmd_Branch
+    Cmd_None, Cmd_Backup, Cmd_Merge, Cmd_Export, Cmd_Branch, Cmd_Watch
 } Command;
 
 static thread_t worker_thread;
@@ -39,7 +56,9 @@ void print_usage(const char *program_name) {
     printf("Commands:\n");
     printf("  backup              Create a backup\n");
     printf("  merge               Merge existing backups\n");
-    printf("  branch              View and modify existing branches\n\n");
+    printf("  export              Write a backup as a tar (pax) archive\n");
+    printf("  branch              View and modify existing branches\n");
+    printf("  watch               Journal the changes to a branch, so backups only scan what changed\n\n");
     
     printf("Options:\n");
     printf("  -h, --help          Show this help message\n");
@@ -58,6 +77,24 @@ void print_backup_usage(const char *program_name)
     printf("  parent              The parent backup\n\n");
     
     printf("Options for backup:\n");
+    printf("  -j, --jobs <n>      Number of worker threads (default: 1, 0: one per cpu)\n");
+    printf("      --json          Also write a JSON '%s' file into every directory\n", INFO_FILE);
+    printf("      --dedup         Store files as deduplicated chunks shared by all backups in dest\n");
+    printf("      --link-unchanged Hardlink unchanged files from the parent backup\n");
+    printf("      --changes <p>   How changed files are detected (default: fast)\n");
+    printf("                        fast:   size and modification time\n");
+    printf("                        strict: also inode change time, inode and device\n");
+    printf("      --hash          Compare content hashes before copying files whose metadata changed\n");
+    printf("      --delta         Store only the changed blocks of large files\n");
+    printf("      --pack          Append small files to a few segment files instead of storing each on its own\n");
+    printf("      --uring <n>     Copy small files with io_uring, n files in flight per job (Linux, 0: off)\n");
+    printf("      --tar <archive> Back up the content of a tar archive ('-': stdin) instead of the branch directories\n");
+    printf("      --tar-root <name> Put the entries of the archive into this directory of the backup\n");
+    printf("      --stats         Report the time of each phase, files handled and system calls made\n");
+    printf("      --stats-json <file> Also write that report as JSON (implies --stats)\n");
+    printf("      --estimate      Count the sources in parallel first, so the progress line has an ETA early\n");
+    printf("      --full-scan     List every directory, even if '%s watch' journaled the changes since the parent\n", program_name);
+    printf("      --trace <file>  Write a Chrome trace of every thread (builds with './nob --trace')\n");
     printf("  -h, --help          Show this help message\n");
 }
 
@@ -70,6 +107,36 @@ void print_merge_usage(const char *program_name)
     printf("  dest                The destination to write the merged files to\n\n");
     
     printf("Options for merge:\n");
+    printf("  -j, --jobs <n>      Number of files restored at once (default: 1, 0: one per cpu)\n");
+    printf("      --uring <n>     Copy small files with io_uring, n files in flight per job (Linux, 0: off)\n");
+    printf("      --stats         Report the time of each phase, files restored and system calls made\n");
+    printf("      --stats-json <file> Also write that report as JSON (implies --stats)\n");
+    printf("      --trace <file>  Write a Chrome trace of every thread (builds with './nob --trace')\n");
+    printf("  -h, --help          Show this help message\n");
+}
+
+void print_export_usage(const char *program_name) 
+{
+    printf("Usage: %s export <src> <archive>\n\n", program_name);
+    
+    printf("Args:\n");
+    printf("  src                 The path of the backup to export, with everything it shares with its parents\n");
+    printf("  archive             The file to write the archive to, '-' for stdout\n\n");
+    
+    printf("Options for export:\n");
+    printf("  -h, --help          Show this help message\n");
+}
+
+void print_watch_usage(const char *program_name) 
+{
+    printf("Usage: %s watch <branch_name>\n\n", program_name);
+    
+    printf("Args:\n");
+    printf("  branch_name         The branch whose directories are watched until Ctrl+C (Linux)\n\n");
+    
+    printf("While it runs, backups with a parent only list the directories that changed since the parent.\n\n");
+    
+    printf("Options for watch:\n");
     printf("  -h, --help          Show this help message\n");
 }
 
@@ -80,14 +147,31 @@ void print_branch_usage(const char *program_name)
     printf("Commands:\n");
     printf("  list [branch]         List all available branches or all backups of specified branch\n");
     printf("  new <name> <dirs>...  Create a new branch\n");
+    printf("  compress <name> <c>   Set how new backups of a branch are compressed\n");
     printf("  delete <name>         Delete a branch\n");
     printf("  reset <name>          Resets a branch\n");
     printf("\n");
     
     printf("Options for branch:\n");
+    printf("  --compress <c>        (new) Compress the files of new backups: none, lz4, zstd or zstd:<level>\n");
     printf("  -h, --help            Show this help message\n");
 }
 
+bool check_compression(const char *value)
+{
+    compress_codec codec;
+    int level;
+    if (!compress_parse(value, &codec, &level)){
+        fprintf(stderr, "[ERROR] Invalid compression: '%s'! Use none, lz4, zstd or zstd:<1-22>.\n", value);
+        return false;
+    }
+    if (!compress_available(codec)){
+        fprintf(stderr, "[ERROR] This build does not support %s compression!\n", compress_codec_names[codec]);
+        return false;
+    }
+    return true;
+}
+
 int print_branches(Cson *branches)
 {
     Cson *branch_names = cson_map_keys(branches);
@@ -119,20 +203,61 @@ void print_version(void)
     printf(PROGRAM_NAME" - version %s\n", VERSION);
 }
 
-void run(thread_fn fn, thread_args_t args)
+bool parse_jobs(const char *value, size_t *jobs)
+{
+    char *end = NULL;
+    long n = strtol(value, &end, 10);
+    if (end == value || *end != '\0' || n < 0) return false;
+    *jobs = (size_t) n;
+    return true;
+}
+
+void stop_watch(int signal)
 {
-    msgq_init();
-    thread_create(&worker_thread, fn, &args);
+    (void) signal;
+    watch_stop();
+}
+
+// messages go to log, which is stderr when stdout carries data, a terminal gets a progress line below them
+// returns what the worker returned, the exit code of the command
+int run(thread_fn fn, thread_args_t args, FILE *log)
+{
+    bool show_progress = isatty(fileno(stderr));
+    progress_view view = {0};
+    char line[MAX_MSG_LEN];
+    msgq_init(0);
+    atomic_store(&worker_done, false);
+    if (!thread_create(&worker_thread, fn, &args)){
+        fprintf(stderr, "[ERROR] Could not start worker thread!\n");
+        msgq_destroy();
+        return 1;
+    }
     char msg[MAX_MSG_LEN];
-    while (true){
-        bool got_msg = false;
-        while (msgq_pop(msg, sizeof(msg))){
-            printf("%s\n", msg);
-            got_msg = true;
+    while (!atomic_load(&worker_done)){
+        if (msgq_pop_wait(msg, sizeof(msg), show_progress? CLI_PROGRESS_INTERVAL_MS : -1)){
+            if (show_progress) fputs("\r\033[K", stderr);
+            fprintf(log, "%s\n", msg);
+            // the line has to be out before the progress line is drawn over it again
+            if (show_progress) fflush(log);
+        }
+        if (!show_progress) continue;
+        progress_sample(&view);
+        if (view.running){
+            progress_format(&view, line, sizeof(line));
+            fprintf(stderr, "\r\033[K%s", line);
+            fflush(stderr);
         }
-        if (worker_done && !got_msg) break;
     }
+    if (show_progress) fputs("\r\033[K", stderr);
+    thread_join(worker_thread);
+    // the worker may have pushed its last messages right before finishing
+    while (msgq_pop(msg, sizeof(msg))){
+        fprintf(log, "%s\n", msg);
+    }
+    size_t dropped = msgq_dropped();
+    if (dropped > 0) fprintf(stderr, "[ERROR] %zu messages were dropped, the message queue was full!\n", dropped);
     msgq_destroy();
+    return args.result;
 }
 
 int main(int argc, char **argv)
@@ -149,9 +274,10 @@ int main(int argc, char **argv)
         return_defer(1);
     }    
     const char *program_name = shift_args(argc, argv);
+    const char *trace_path = NULL; // only set in builds with tracing
     Command current_command = Cmd_None;
     
-    thread_args_t command_options = {0};
+    thread_args_t command_options = {.backup_options = {.jobs = 1}, .merge_options = {.jobs = 1}};
     size_t command_option_count = 0;
 
     if (argc < 1){
@@ -178,9 +304,15 @@ int main(int argc, char **argv)
                 else if (strcmp(arg, "merge") == 0){
                     current_command = Cmd_Merge;
                 }
+                else if (strcmp(arg, "export") == 0){
+                    current_command = Cmd_Export;
+                }
                 else if (strcmp(arg, "branch") == 0){
                     current_command = Cmd_Branch;
                 }
+                else if (strcmp(arg, "watch") == 0){
+                    current_command = Cmd_Watch;
+                }
                 else{
                     fprintf(stderr, "[ERROR] Unknown argument: '%s'!\n\n", arg);
                     print_usage(program_name);
@@ -192,6 +324,103 @@ int main(int argc, char **argv)
                     print_backup_usage(program_name);
                     return_defer(0);
                 }
+                else if (strcmp(arg, "--jobs") == 0 || strcmp(arg, "-j") == 0){
+                    if (argc < 1){
+                        fprintf(stderr, "[ERROR] Missing value for '%s'!\n\n", arg);
+                        print_backup_usage(program_name);
+                        return_defer(1);
+                    }
+                    const char *value = shift_args(argc, argv);
+                    if (!parse_jobs(value, &command_options.backup_options.jobs)){
+                        fprintf(stderr, "[ERROR] Invalid number of jobs: '%s'!\n\n", value);
+                        print_backup_usage(program_name);
+                        return_defer(1);
+                    }
+                }
+                else if (strcmp(arg, "--uring") == 0){
+                    size_t depth = 0;
+                    const char *value = argc > 0? shift_args(argc, argv) : NULL;
+                    if (value == NULL || !parse_jobs(value, &depth) || depth > URING_MAX_DEPTH){
+                        fprintf(stderr, "[ERROR] Invalid io_uring queue depth: '%s'!\n\n", value != NULL? value : "");
+                        print_backup_usage(program_name);
+                        return_defer(1);
+                    }
+                    command_options.backup_options.uring_depth = (unsigned) depth;
+                }
+                else if (strcmp(arg, "--json") == 0){
+                    command_options.backup_options.json_export = true;
+                }
+                else if (strcmp(arg, "--dedup") == 0){
+                    command_options.backup_options.dedup = true;
+                }
+                else if (strcmp(arg, "--link-unchanged") == 0){
+                    command_options.backup_options.link_unchanged = true;
+                }
+                else if (strcmp(arg, "--delta") == 0){
+                    command_options.backup_options.delta = true;
+                }
+                else if (strcmp(arg, "--pack") == 0){
+                    command_options.backup_options.pack = true;
+                }
+                else if (strcmp(arg, "--hash") == 0){
+                    command_options.backup_options.hash = true;
+                }
+                else if (strcmp(arg, "--stats") == 0){
+                    command_options.backup_options.stats = true;
+                }
+                else if (strcmp(arg, "--estimate") == 0){
+                    command_options.backup_options.estimate = true;
+                }
+                else if (strcmp(arg, "--full-scan") == 0){
+                    command_options.backup_options.full_scan = true;
+                }
+                else if (strcmp(arg, "--trace") == 0){
+                    if (argc < 1){
+                        fprintf(stderr, "[ERROR] Missing value for '%s'!\n\n", arg);
+                        print_backup_usage(program_name);
+                        return_defer(1);
+                    }
+                    if (!trace_available()){
+                        fprintf(stderr, "[ERROR] This build has no tracing, build it with './nob --trace'!\n");
+                        return_defer(1);
+                    }
+                    trace_path = shift_args(argc, argv);
+                }
+                else if (strcmp(arg, "--stats-json") == 0){
+                    if (argc < 1){
+                        fprintf(stderr, "[ERROR] Missing value for '%s'!\n\n", arg);
+                        print_backup_usage(program_name);
+                        return_defer(1);
+                    }
+                    command_options.backup_options.stats = true;
+                    command_options.backup_options.stats_json = shift_args(argc, argv);
+                }
+                else if (strcmp(arg, "--tar") == 0 || strcmp(arg, "--tar-root") == 0){
+                    if (argc < 1){
+                        fprintf(stderr, "[ERROR] Missing value for '%s'!\n\n", arg);
+                        print_backup_usage(program_name);
+                        return_defer(1);
+                    }
+                    const char *value = shift_args(argc, argv);
+                    if (strcmp(arg, "--tar") == 0){
+                        command_options.backup_options.tar = value;
+                    } else{
+                        command_options.backup_options.tar_root = value;
+                    }
+                }
+                else if (strcmp(arg, "--changes") == 0){
+                    if (argc < 1){
+                        fprintf(stderr, "[ERROR] Missing value for '%s'!\n\n", arg);
+                        print_backup_usage(program_name);
+                        return_defer(1);
+                    }
+                    const char *value = shift_args(argc, argv);
+                    if (!change_policy_parse(value, &command_options.backup_options.changes)){
+                        fprintf(stderr, "[ERROR] Unknown change detection policy: '%s'!\n\n", value);
+                        print_backup_usage(program_name);
+                        return_defer(1);
+                    }
+                }
                 else{
                     if (command_option_count >= 3){
                         fprintf(stderr, "[ERROR] Unknown argument: '%s'!\n\n", arg);
@@ -206,6 +435,53 @@ int main(int argc, char **argv)
                     print_merge_usage(program_name);
                     return_defer(0);
                 }
+                else if (strcmp(arg, "--jobs") == 0 || strcmp(arg, "-j") == 0){
+                    if (argc < 1){
+                        fprintf(stderr, "[ERROR] Missing value for '%s'!\n\n", arg);
+                        print_merge_usage(program_name);
+                        return_defer(1);
+                    }
+                    const char *value = shift_args(argc, argv);
+                    if (!parse_jobs(value, &command_options.merge_options.jobs)){
+                        fprintf(stderr, "[ERROR] Invalid number of jobs: '%s'!\n\n", value);
+                        print_merge_usage(program_name);
+                        return_defer(1);
+                    }
+                }
+                else if (strcmp(arg, "--uring") == 0){
+                    size_t depth = 0;
+                    const char *value = argc > 0? shift_args(argc, argv) : NULL;
+                    if (value == NULL || !parse_jobs(value, &depth) || depth > URING_MAX_DEPTH){
+                        fprintf(stderr, "[ERROR] Invalid io_uring queue depth: '%s'!\n\n", value != NULL? value : "");
+                        print_merge_usage(program_name);
+                        return_defer(1);
+                    }
+                    command_options.merge_options.uring_depth = (unsigned) depth;
+                }
+                else if (strcmp(arg, "--stats") == 0){
+                    command_options.merge_options.stats = true;
+                }
+                else if (strcmp(arg, "--stats-json") == 0){
+                    if (argc < 1){
+                        fprintf(stderr, "[ERROR] Missing value for '%s'!\n\n", arg);
+                        print_merge_usage(program_name);
+                        return_defer(1);
+                    }
+                    command_options.merge_options.stats = true;
+                    command_options.merge_options.stats_json = shift_args(argc, argv);
+                }
+                else if (strcmp(arg, "--trace") == 0){
+                    if (argc < 1){
+                        fprintf(stderr, "[ERROR] Missing value for '%s'!\n\n", arg);
+                        print_merge_usage(program_name);
+                        return_defer(1);
+                    }
+                    if (!trace_available()){
+                        fprintf(stderr, "[ERROR] This build has no tracing, build it with './nob --trace'!\n");
+                        return_defer(1);
+                    }
+                    trace_path = shift_args(argc, argv);
+                }
                 else{
                     if (command_option_count >= 2){
                         fprintf(stderr, "[ERROR] Unknown argument: '%s'!\n\n", arg);
@@ -215,6 +491,30 @@ int main(int argc, char **argv)
                     command_options.args[command_option_count++] = arg;
                 }
             } break;
+            case Cmd_Export:{
+                if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0){
+                    print_export_usage(program_name);
+                    return_defer(0);
+                }
+                if (command_option_count >= 2){
+                    fprintf(stderr, "[ERROR] Unknown argument: '%s'!\n\n", arg);
+                    print_export_usage(program_name);
+                    return_defer(1);
+                }
+                command_options.args[command_option_count++] = arg;
+            } break;
+            case Cmd_Watch:{
+                if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0){
+                    print_watch_usage(program_name);
+                    return_defer(0);
+                }
+                if (command_option_count >= 1){
+                    fprintf(stderr, "[ERROR] Unknown argument: '%s'!\n\n", arg);
+                    print_watch_usage(program_name);
+                    return_defer(1);
+                }
+                command_options.args[command_option_count++] = arg;
+            } break;
             case Cmd_Branch: {
                 if (strcmp(arg, "list") == 0){
                     Cson *branches = cson_get(info, key("branches"));
@@ -281,13 +581,20 @@ int main(int argc, char **argv)
                     Cson *dirs = cson_array_new();
                     Cson *id = cson_new_int(0);
                     Cson *backups = cson_array_new();
+                    const char *compression = NULL;
                     while (argc > 0){
                         const char *dir = shift_args(argc, argv);
+                        if (strcmp(dir, "--compress") == 0){
+                            compression = argc > 0? shift_args(argc, argv) : "";
+                            if (!check_compression(compression)) return_defer(1);
+                            continue;
+                        }
                         cson_array_push(dirs, cson_new_cstring((char*) dir));
                     }
                     (void) cson_map_insert(branch, cson_str("dirs"), dirs);
                     (void) cson_map_insert(branch, cson_str("backups"), backups);
                     (void) cson_map_insert(branch, cson_str("last_id"), id);
+                    if (compression != NULL) (void) cson_map_insert(branch, cson_str("compression"), cson_new_cstring((char*) compression));
                     
                     (void) cson_map_insert(branches, cson_str((char*) name), branch);
                     
@@ -295,6 +602,32 @@ int main(int argc, char **argv)
                     fprintf(stdout, "[INFO] Successfully created new branch '%s'!\n", name);
                     return_defer(0);
                 }
+                else if (strcmp(arg, "compress") == 0){
+                    if (argc < 2){
+                        fprintf(stderr, "[ERROR] Missing arguments!\n");
+                        print_branch_usage(program_name);
+                        return_defer(1);
+                    }
+                    Cson *branches = cson_get(info, key("branches"));
+                    if (!cson_is_map(branches)){
+                        fprintf(stderr, "[ERROR] Invalid info file state!\n");
+                        return_defer(1);
+                    }
+                    char *name = (char*) shift_args(argc, argv);
+                    const char *compression = shift_args(argc, argv);
+                    Cson *branch = cson_get(branches, key(name));
+                    if (!cson_is_map(branch)){
+                        fprintf(stderr, "[ERROR] Unknown branch '%s'!\n", name);
+                        fprintf(stdout, "Use '%s branch list' to see a list of all branches.\n", program_name);
+                        return_defer(1);
+                    }
+                    if (!check_compression(compression)) return_defer(1);
+                    // existing backups keep their format, the manifest of every backup names its codec
+                    (void) cson_map_insert(branch, cson_str("compression"), cson_new_cstring((char*) compression));
+                    cson_write(info, info_path);
+                    fprintf(stdout, "[INFO] New backups of branch '%s' are compressed with '%s'.\n", name, compression);
+                    return_defer(0);
+                }
                 else if (strcmp(arg, "delete") == 0){
                     if (argc < 1){
                         fprintf(stderr, "[ERROR] Missing argument!\n");
@@ -382,7 +715,14 @@ int main(int argc, char **argv)
                 print_backup_usage(program_name);
                 return_defer(1);
             }
-            run(tbackup, command_options);
+            if (command_options.backup_options.tar_root != NULL && command_options.backup_options.tar == NULL){
+                fprintf(stderr, "[ERROR] '--tar-root' only applies to '--tar'!\n\n");
+                print_backup_usage(program_name);
+                return_defer(1);
+            }
+            if (trace_path != NULL) trace_start();
+            result = run(tbackup, command_options, stdout);
+            if (trace_path != NULL && !trace_write(trace_path)) result = 1;
         }break;
         case Cmd_Merge:{
             if (command_option_count < 2){
@@ -390,11 +730,31 @@ int main(int argc, char **argv)
                 print_merge_usage(program_name);
                 return_defer(1);
             }
-            run(tmerge, command_options);
+            if (trace_path != NULL) trace_start();
+            result = run(tmerge, command_options, stdout);
+            if (trace_path != NULL && !trace_write(trace_path)) result = 1;
+        }break;
+        case Cmd_Export:{
+            if (command_option_count < 2){
+                fprintf(stderr, "[ERROR] Too few arguments provided!\n\n");
+                print_export_usage(program_name);
+                return_defer(1);
+            }
+            result = run(texport, command_options, strcmp(command_options.args[1], "-") == 0? stderr : stdout);
         }break;
         case Cmd_Branch:{
             print_branch_usage(program_name);
         } break;
+        case Cmd_Watch:{
+            if (command_option_count < 1){
+                fprintf(stderr, "[ERROR] Too few arguments provided!\n\n");
+                print_watch_usage(program_name);
+                return_defer(1);
+            }
+            signal(SIGINT, stop_watch);
+            signal(SIGTERM, stop_watch);
+            result = run(twatch, command_options, stdout);
+        } break;
         default: {assert(0 && "Invalid Cmd type\n\n");};
     }
   defer:
@@ -0,0 +1,475 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <compress.h>
+#include <hash.h>
+#include <message_queue.h>
+
+#ifdef CEBEQ_ZSTD
+    #include <zstd.h>
+#endif // CEBEQ_ZSTD
+
+#ifdef _WIN32
+    #define COMPRESS_O_BINARY O_BINARY
+#else
+    #define COMPRESS_O_BINARY 0
+#endif // _WIN32
+
+/*
+    LZ4 block format: a sequence is a token (literal length << 4 | match length - 4),
+    the literals, a 2 byte little endian offset and the match. Lengths of 15 and
+    more continue in bytes of 255. The block ends with literals only, the last
+    match starts at least LZ4_MFLIMIT bytes and ends LZ4_LASTLITERALS before the end.
+*/
+#define LZ4_MINMATCH 4
+#define LZ4_LASTLITERALS 5
+#define LZ4_MFLIMIT 12
+#define LZ4_MAX_OFFSET 65535
+#define LZ4_HASH_LOG 14
+// the search step grows by one every 2^LZ4_SKIP_TRIGGER bytes without a match
+#define LZ4_SKIP_TRIGGER 6
+// short literal runs and matches are copied in fixed steps that may write past their end
+#define LZ4_WILDCOPY 16
+
+static uint32_t lz4_read32(const uint8_t *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint64_t lz4_read64(const uint8_t *p)
+{
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+// number of equal bytes at ip and ref, ip stops at limit
+static size_t lz4_count(const uint8_t *ip, const uint8_t *ref, const uint8_t *limit)
+{
+    const uint8_t *start = ip;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (ip + sizeof(uint64_t) <= limit){
+        uint64_t diff = lz4_read64(ip) ^ lz4_read64(ref);
+        if (diff != 0) return (size_t) (ip - start) + (__builtin_ctzll(diff) >> 3);
+        ip += sizeof(uint64_t);
+        ref += sizeof(uint64_t);
+    }
+#endif
+    while (ip < limit && *ip == *ref){
+        ip++;
+        ref++;
+    }
+    return (size_t) (ip - start);
+}
+
+static uint32_t lz4_hash(uint32_t sequence)
+{
+    return (sequence*2654435761u) >> (32 - LZ4_HASH_LOG);
+}
+
+static uint8_t *lz4_write_length(uint8_t *op, size_t len)
+{
+    for (; len >= 255; len -= 255) *op++ = 255;
+    *op++ = (uint8_t) len;
+    return op;
+}
+
+static size_t lz4_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap)
+{
+    uint32_t table[1 << LZ4_HASH_LOG] = {0};
+    const uint8_t *ip = src, *anchor = src, *end = src + len;
+    uint8_t *op = dst, *oend = dst + cap;
+    if (len > LZ4_MFLIMIT){
+        const uint8_t *mflimit = end - LZ4_MFLIMIT;
+        const uint8_t *matchlimit = end - LZ4_LASTLITERALS;
+        ip++;
+        while (ip < mflimit){
+            uint32_t h = lz4_hash(lz4_read32(ip));
+            const uint8_t *ref = src + table[h];
+            table[h] = (uint32_t) (ip - src);
+            if (ref >= ip || ip - ref > LZ4_MAX_OFFSET || lz4_read32(ref) != lz4_read32(ip)){
+                ip += 1 + ((size_t) (ip - anchor) >> LZ4_SKIP_TRIGGER);
+                continue;
+            }
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]){
+                ip--;
+                ref--;
+            }
+            size_t match = LZ4_MINMATCH + lz4_count(ip + LZ4_MINMATCH, ref + LZ4_MINMATCH, matchlimit);
+
+            size_t literals = (size_t) (ip - anchor);
+            if ((size_t) (oend - op) < 1 + literals/255 + 1 + literals + 2 + match/255 + 1) return 0;
+            uint8_t *token = op++;
+            *token = (uint8_t) ((literals >= 15? 15 : literals) << 4);
+            if (literals >= 15) op = lz4_write_length(op, literals - 15);
+            memcpy(op, anchor, literals);
+            op += literals;
+            uint16_t offset = (uint16_t) (ip - ref);
+            *op++ = (uint8_t) offset;
+            *op++ = (uint8_t) (offset >> 8);
+            size_t rest = match - LZ4_MINMATCH;
+            *token |= (uint8_t) (rest >= 15? 15 : rest);
+            if (rest >= 15) op = lz4_write_length(op, rest - 15);
+
+            ip += match;
+            anchor = ip;
+            if (ip < mflimit) table[lz4_hash(lz4_read32(ip - 2))] = (uint32_t) (ip - 2 - src);
+        }
+    }
+    size_t literals = (size_t) (end - anchor);
+    if ((size_t) (oend - op) < 1 + literals/255 + 1 + literals) return 0;
+    *op++ = (uint8_t) ((literals >= 15? 15 : literals) << 4);
+    if (literals >= 15) op = lz4_write_length(op, literals - 15);
+    memcpy(op, anchor, literals);
+    op += literals;
+    return (size_t) (op - dst);
+}
+
+static bool lz4_read_length(const uint8_t **ip, const uint8_t *iend, size_t *len)
+{
+    uint8_t byte;
+    do{
+        if (*ip >= iend) return false;
+        byte = *(*ip)++;
+        *len += byte;
+    } while (byte == 255);
+    return true;
+}
+
+static bool lz4_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t raw_len)
+{
+    const uint8_t *ip = src, *iend = src + len;
+    uint8_t *op = dst, *oend = dst + raw_len;
+    while (ip < iend){
+        uint8_t token = *ip++;
+        size_t literals = token >> 4;
+        if (literals == 15 && !lz4_read_length(&ip, iend, &literals)) return false;
+        if (literals > (size_t) (iend - ip) || literals > (size_t) (oend - op)) return false;
+        if (literals <= LZ4_WILDCOPY && (size_t) (iend - ip) >= LZ4_WILDCOPY && (size_t) (oend - op) >= LZ4_WILDCOPY){
+            memcpy(op, ip, LZ4_WILDCOPY);
+        } else{
+            memcpy(op, ip, literals);
+        }
+        op += literals;
+        ip += literals;
+        if (ip == iend) break;
+
+        if (iend - ip < 2) return false;
+        size_t offset = ip[0] | (size_t) ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > (size_t) (op - dst)) return false;
+        size_t match = token & 15;
+        if (match == 15 && !lz4_read_length(&ip, iend, &match)) return false;
+        match += LZ4_MINMATCH;
+        if (match > (size_t) (oend - op)) return false;
+        const uint8_t *ref = op - offset;
+        if (offset >= LZ4_WILDCOPY && (size_t) (oend - op) >= match + LZ4_WILDCOPY){
+            // every step reads bytes that are already written
+            for (size_t i=0; i<match; i+=LZ4_WILDCOPY) memcpy(op + i, ref + i, LZ4_WILDCOPY);
+            op += match;
+        } else if (offset >= match){
+            memcpy(op, ref, match);
+            op += match;
+        } else {
+            // overlapping match repeats the last offset bytes
+            for (size_t i=0; i<match; ++i) *op++ = ref[i];
+        }
+    }
+    return op == oend;
+}
+
+bool compress_parse(const char *value, compress_codec *codec, int *level)
+{
+    const char *colon = strchr(value, ':');
+    size_t name_len = colon != NULL? (size_t) (colon - value) : strlen(value);
+    bool found = false;
+    for (size_t i=0; i<COMPRESS__CODEC_COUNT; ++i){
+        if (strlen(compress_codec_names[i]) == name_len && strncmp(value, compress_codec_names[i], name_len) == 0){
+            *codec = (compress_codec) i;
+            found = true;
+            break;
+        }
+    }
+    if (!found) return false;
+    *level = *codec == COMPRESS_ZSTD? COMPRESS_ZSTD_DEFAULT_LEVEL : 0;
+    if (colon == NULL) return true;
+    // only zstd has levels
+    if (*codec != COMPRESS_ZSTD) return false;
+    char *end = NULL;
+    errno = 0;
+    long parsed = strtol(colon + 1, &end, 10);
+    if (errno != 0 || end == colon + 1 || *end != '\0' || parsed < 1 || parsed > 22) return false;
+    *level = (int) parsed;
+    return true;
+}
+
+bool compress_available(compress_codec codec)
+{
+    switch (codec){
+        case COMPRESS_NONE:
+        case COMPRESS_LZ4:
+            return true;
+        case COMPRESS_ZSTD:
+        #ifdef CEBEQ_ZSTD
+            return true;
+        #else
+            return false;
+        #endif // CEBEQ_ZSTD
+        default:
+            return false;
+    }
+}
+
+size_t compress_bound(size_t len)
+{
+#ifdef CEBEQ_ZSTD
+    size_t zstd_bound = ZSTD_compressBound(len);
+#else
+    size_t zstd_bound = 0;
+#endif // CEBEQ_ZSTD
+    size_t lz4_bound = len + len/255 + 16;
+    return zstd_bound > lz4_bound? zstd_bound : lz4_bound;
+}
+
+size_t compress_block(compress_codec codec, int level, const void *src, size_t len, void *dst, size_t cap)
+{
+    switch (codec){
+        case COMPRESS_LZ4:
+            return lz4_compress(src, len, dst, cap);
+        case COMPRESS_ZSTD:{
+        #ifdef CEBEQ_ZSTD
+            size_t n = ZSTD_compress(dst, cap, src, len, level);
+            return ZSTD_isError(n)? 0 : n;
+        #else
+            (void) level;
+            return 0;
+        #endif // CEBEQ_ZSTD
+        }
+        default:
+            return 0;
+    }
+}
+
+bool decompress_block(compress_codec codec, const void *src, size_t len, void *dst, size_t raw_len)
+{
+    switch (codec){
+        case COMPRESS_LZ4:
+            return lz4_decompress(src, len, dst, raw_len);
+        case COMPRESS_ZSTD:{
+        #ifdef CEBEQ_ZSTD
+            size_t n = ZSTD_decompress(dst, raw_len, src, len);
+            return !ZSTD_isError(n) && n == raw_len;
+        #else
+            return false;
+        #endif // CEBEQ_ZSTD
+        }
+        default:
+            return false;
+    }
+}
+
+static bool compress_write_all(int fd, const void *data, size_t len)
+{
+    const char *bytes = data;
+    while (len > 0){
+        ssize_t n = write(fd, bytes, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        bytes += n;
+        len -= (size_t) n;
+    }
+    return true;
+}
+
+// reads until len bytes or the end of the file, returns -1 on errors
+static ssize_t compress_read_full(int fd, void *data, size_t len)
+{
+    char *bytes = data;
+    size_t total = 0;
+    while (total < len){
+        ssize_t n = read(fd, bytes + total, len - total);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) break;
+        total += (size_t) n;
+    }
+    return (ssize_t) total;
+}
+
+compress_result compress_file(const char *src, const char *dest, compress_codec codec, int level, uint64_t *raw_hash, uint64_t *stored_size)
+{
+    int fd = open(src, O_RDONLY | COMPRESS_O_BINARY);
+    if (fd < 0){
+        eprintf("Could not open '%s': %s!", src, strerror(errno));
+        return COMPRESS_FAILED;
+    }
+    struct stat attr;
+    if (fstat(fd, &attr) != 0 || attr.st_size < COMPRESS_MIN_FILE_SIZE){
+        close(fd);
+        return COMPRESS_SKIPPED;
+    }
+
+    size_t cap = compress_bound(COMPRESS_BLOCK_SIZE);
+    uint8_t *raw = malloc(COMPRESS_BLOCK_SIZE);
+    uint8_t *stored = malloc(cap);
+    assert(raw != NULL && stored != NULL && "Buy more RAM lol");
+    compress_result result = COMPRESS_STORED;
+    int out = -1;
+    hash_xxh64_t ctx;
+    hash_xxh64_init(&ctx, 0);
+    uint64_t raw_size = 0, written = 0;
+
+    ssize_t n = compress_read_full(fd, raw, COMPRESS_BLOCK_SIZE);
+    if (n < 0){
+        eprintf("Could not read '%s': %s!", src, strerror(errno));
+        result = COMPRESS_FAILED;
+        goto defer;
+    }
+    size_t len = compress_block(codec, level, raw, (size_t) n, stored, cap);
+    if (len == 0 || len*100 > (size_t) n*COMPRESS_SAMPLE_PERCENT){
+        result = COMPRESS_SKIPPED;
+        goto defer;
+    }
+
+    out = open(dest, O_WRONLY | O_CREAT | O_TRUNC | COMPRESS_O_BINARY, 0644);
+    if (out < 0){
+        eprintf("Could not create '%s': %s!", dest, strerror(errno));
+        result = COMPRESS_FAILED;
+        goto defer;
+    }
+    compress_header header = {.magic = COMPRESS_MAGIC, .codec = codec, .block_size = COMPRESS_BLOCK_SIZE};
+    if (!compress_write_all(out, &header, sizeof(header))) goto write_error;
+    written = sizeof(header);
+    // the file is read until its end, it may have grown since it was listed
+    while (n > 0){
+        hash_xxh64_update(&ctx, raw, (size_t) n);
+        raw_size += (uint64_t) n;
+        uint32_t block[2] = {(uint32_t) n, (uint32_t) len};
+        const uint8_t *data = stored;
+        if (len == 0 || len >= (size_t) n){
+            block[1] = (uint32_t) n | COMPRESS_RAW_BLOCK;
+            data = raw;
+            len = (size_t) n;
+        }
+        if (!compress_write_all(out, block, sizeof(block)) || !compress_write_all(out, data, len)) goto write_error;
+        written += sizeof(block) + len;
+
+        n = compress_read_full(fd, raw, COMPRESS_BLOCK_SIZE);
+        if (n < 0){
+            eprintf("Could not read '%s': %s!", src, strerror(errno));
+            result = COMPRESS_FAILED;
+            goto defer;
+        }
+        if (n > 0) len = compress_block(codec, level, raw, (size_t) n, stored, cap);
+    }
+    header.raw_size = raw_size;
+    if (lseek(out, 0, SEEK_SET) != 0 || !compress_write_all(out, &header, sizeof(header))) goto write_error;
+    if (raw_hash != NULL) *raw_hash = hash_xxh64_final(&ctx);
+    if (stored_size != NULL) *stored_size = written;
+    goto defer;
+
+write_error:
+    eprintf("Could not write '%s': %s!", dest, strerror(errno));
+    result = COMPRESS_FAILED;
+
+defer:
+    if (out >= 0 && close(out) != 0 && result == COMPRESS_STORED){
+        eprintf("Could not write '%s': %s!", dest, strerror(errno));
+        result = COMPRESS_FAILED;
+    }
+    if (out >= 0 && result == COMPRESS_FAILED) remove(dest);
+    close(fd);
+    free(raw);
+    free(stored);
+    return result;
+}
+
+int decompress_open(const char *src, compress_header *header)
+{
+    int fd = open(src, O_RDONLY | COMPRESS_O_BINARY);
+    if (fd < 0){
+        eprintf("Could not open '%s': %s!", src, strerror(errno));
+        return -1;
+    }
+    if (compress_read_full(fd, header, sizeof(*header)) != sizeof(*header) || memcmp(header->magic, COMPRESS_MAGIC, sizeof(header->magic)) != 0
+        || header->codec >= COMPRESS__CODEC_COUNT || header->block_size == 0 || header->block_size > COMPRESS_BLOCK_SIZE){
+        eprintf("'%s' is not a compressed file!", src);
+        close(fd);
+        return -1;
+    }
+    if (!compress_available(header->codec)){
+        eprintf("'%s' is compressed with %s, which this build does not support!", src, compress_codec_names[header->codec]);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool decompress_fd(int fd, const compress_header *header, const char *src, int out)
+{
+    size_t cap = compress_bound(header->block_size);
+    uint8_t *raw = malloc(header->block_size);
+    uint8_t *stored = malloc(cap);
+    assert(raw != NULL && stored != NULL && "Buy more RAM lol");
+    bool result = true;
+    uint64_t raw_size = 0;
+    while (true){
+        uint32_t block[2];
+        ssize_t n = compress_read_full(fd, block, sizeof(block));
+        if (n == 0) break;
+        bool raw_block = block[1] & COMPRESS_RAW_BLOCK;
+        size_t len = block[1] & ~COMPRESS_RAW_BLOCK;
+        if (n != sizeof(block) || block[0] == 0 || block[0] > header->block_size || (raw_block? len != block[0] : len > cap)
+            || compress_read_full(fd, raw_block? raw : stored, len) != (ssize_t) len){
+            eprintf("'%s' is truncated or corrupt!", src);
+            result = false;
+            break;
+        }
+        if (!raw_block && !decompress_block(header->codec, stored, len, raw, block[0])){
+            eprintf("Could not decompress '%s': corrupt block at %"PRIu64"!", src, raw_size);
+            result = false;
+            break;
+        }
+        if (!compress_write_all(out, raw, block[0])){
+            eprintf("Could not write the content of '%s': %s!", src, strerror(errno));
+            result = false;
+            break;
+        }
+        raw_size += block[0];
+    }
+    if (result && raw_size != header->raw_size){
+        eprintf("'%s' is truncated: %"PRIu64" of %"PRIu64" bytes!", src, raw_size, header->raw_size);
+        result = false;
+    }
+    free(raw);
+    free(stored);
+    return result;
+}
+
+bool decompress_file(const char *src, const char *dest)
+{
+    compress_header header;
+    int fd = decompress_open(src, &header);
+    if (fd < 0) return false;
+    int out = open(dest, O_WRONLY | O_CREAT | O_TRUNC | COMPRESS_O_BINARY, 0644);
+    if (out < 0){
+        eprintf("Could not create '%s': %s!", dest, strerror(errno));
+        close(fd);
+        return false;
+    }
+    bool result = decompress_fd(fd, &header, src, out);
+    if (close(out) != 0 && result){
+        eprintf("Could not write '%s': %s!", dest, strerror(errno));
+        result = false;
+    }
+    if (!result) remove(dest);
+    close(fd);
+    return result;
+}
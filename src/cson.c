@@ -1,9 +1,21 @@
 #include <cson.h>
+#include <trace.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(__GNUC__) && defined(__SSE2__)
+    #define CSON_SIMD_X86
+    #include <immintrin.h>
+#endif // __SSE2__
+#ifndef O_BINARY
+    #define O_BINARY 0
+#endif // O_BINARY
+
+CsonSimd cson_simd = CsonSimd_Auto;
 
 static CsonArena cson_default_arena = {0};
-CsonArena *cson_current_arena = &cson_default_arena;
+_Thread_local CsonArena *cson_current_arena = &cson_default_arena;
 
-char cson_temp_buffer[256] = {0};
 
 
 Cson* cson__get(Cson *cson, CsonArg args[], size_t count)
@@ -71,7 +83,7 @@ Cson* cson_new(void)
     return cson;
 }
 
-Cson* cson_new_int(int32_t value)
+Cson* cson_new_int(int64_t value)
 {
     Cson *cson = cson_alloc(cson_current_arena, sizeof(*cson));
     cson_assert_alloc(cson);
@@ -391,27 +403,57 @@ CsonMapItem* cson_map_item_new(CsonStr key, Cson *value)
     return item;
 }
 
+static inline size_t cson__map_index(CsonMap *map, CsonStr key)
+{
+    // the capacity is a power of two, so fold the high bits of the hash into the mask
+    uint32_t hash = cson_str_hash(key);
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    return hash & (map->capacity-1);
+}
+
+void cson__map_grow(CsonMap *map)
+{
+    size_t old_capacity = map->capacity;
+    size_t new_capacity = old_capacity * CSON_MAP_MUL_F;
+    map->items = cson_realloc(cson_current_arena, map->items, old_capacity*sizeof(CsonMapItem*), new_capacity*sizeof(CsonMapItem*));
+    cson_assert_alloc(map->items);
+    memset(map->items + old_capacity, 0, (new_capacity-old_capacity)*sizeof(CsonMapItem*));
+    map->capacity = new_capacity;
+    // every item either stays in its bucket or moves to a bucket of the new half
+    for (size_t i=0; i<old_capacity; ++i){
+        CsonMapItem *item = map->items[i];
+        map->items[i] = NULL;
+        while (item != NULL){
+            CsonMapItem *next = item->next;
+            size_t index = cson__map_index(map, item->key);
+            item->next = map->items[index];
+            map->items[index] = item;
+            item = next;
+        }
+    }
+}
+
 CsonError cson_map_insert(Cson *map, CsonStr key, Cson *value)
 {
     if (map == NULL || key.value == NULL || value == NULL) return CsonError_InvalidParam;
     if (map->type != Cson_Map) return CsonError_InvalidType;
     CsonMap *i_map = cson__to_map(map);
-    size_t index = cson_str_hash(key) % i_map->capacity;
-    CsonMapItem *item = i_map->items[index];
-    if (item != NULL){
-        do {
-            if (cson_str_equals(item->key, key)){
-                item->value = value;
-                return CsonError_Success;
-            }
-            if (item->next == NULL) break;
-            item = item->next;
-        }while(true);
-        item->next = cson_map_item_new(key, value);
+    size_t index = cson__map_index(i_map, key);
+    for (CsonMapItem *item = i_map->items[index]; item != NULL; item = item->next){
+        if (cson_str_equals(item->key, key)){
+            item->value = value;
+            return CsonError_Success;
+        }
     }
-    else{
-        i_map->items[index] = cson_map_item_new(key, value);
+    if ((i_map->size+1)*100 > i_map->capacity*CSON_MAP_MAX_LOAD){
+        cson__map_grow(i_map);
+        index = cson__map_index(i_map, key);
     }
+    CsonMapItem *item = cson_map_item_new(key, value);
+    item->next = i_map->items[index];
+    i_map->items[index] = item;
     i_map->size++;
     return CsonError_Success;
 }
@@ -421,21 +463,14 @@ CsonError cson_map_remove(Cson *map, CsonStr key)
     if (map == NULL || key.value == NULL) return CsonError_InvalidParam;
     if (map->type != Cson_Map) return CsonError_InvalidType;
     CsonMap *i_map = cson__to_map(map);
-    size_t index = cson_str_hash(key) % i_map->capacity;
-    CsonMapItem *item = i_map->items[index];
-    if (item == NULL) return CsonError_KeyError;
-    if (cson_str_equals(item->key, key)){
-        i_map->items[index] = item->next;
-        i_map->size--;
-        return CsonError_Success;
-    }
-    while (item->next != NULL){
-        if (cson_str_equals(item->next->key, key)){
-            item->next = item->next->next;
+    CsonMapItem **item = &i_map->items[cson__map_index(i_map, key)];
+    while (*item != NULL){
+        if (cson_str_equals((*item)->key, key)){
+            *item = (*item)->next;
             i_map->size--;
             return CsonError_Success;
         }
-        item = item->next;
+        item = &(*item)->next;
     }
     return CsonError_KeyError;
 }
@@ -445,8 +480,7 @@ Cson* cson_map_get(Cson *map, CsonStr key)
     if (map == NULL || key.value == NULL) return NULL;
     if (map->type != Cson_Map) return NULL;
     CsonMap *i_map = cson__to_map(map);
-    size_t index = cson_str_hash(key) % i_map->capacity;
-    CsonMapItem *item = i_map->items[index];
+    CsonMapItem *item = i_map->items[cson__map_index(i_map, key)];
     while (item != NULL){
         if (cson_str_equals(item->key, key)) return item->value;
         item = item->next;
@@ -665,33 +699,173 @@ size_t cson_str_memsize(CsonStr string)
     return total;
 }
 
-#define cson_print_indent(file, indent) (fprintf((file), "%*s", (int)(indent)*CSON_PRINT_INDENT, ""))
+/* Writer */
 
-void cson_fprint(Cson *value, FILE *file, size_t indent)
+void cson_writer_init(CsonWriter *writer, FILE *file, bool compact)
 {
-    if (value == NULL || file == NULL) return;
+    writer->file = file;
+    writer->buffer = malloc(CSON_WRITER_BUFFER_SIZE);
+    cson_assert_alloc(writer->buffer);
+    writer->len = 0;
+    writer->compact = compact;
+    writer->ok = true;
+}
+
+void cson_writer_flush(CsonWriter *writer)
+{
+    if (writer->len == 0) return;
+    if (writer->ok && fwrite(writer->buffer, 1, writer->len, writer->file) != writer->len){
+        writer->ok = false;
+    }
+    writer->len = 0;
+}
+
+bool cson_writer_finish(CsonWriter *writer)
+{
+    cson_writer_flush(writer);
+    free(writer->buffer);
+    writer->buffer = NULL;
+    return writer->ok;
+}
+
+static inline void cson__writer_mem(CsonWriter *writer, const char *data, size_t len)
+{
+    if (writer->len + len > CSON_WRITER_BUFFER_SIZE){
+        cson_writer_flush(writer);
+        if (len > CSON_WRITER_BUFFER_SIZE){
+            if (writer->ok && fwrite(data, 1, len, writer->file) != len) writer->ok = false;
+            return;
+        }
+    }
+    memcpy(writer->buffer + writer->len, data, len);
+    writer->len += len;
+}
+
+static inline void cson__writer_char(CsonWriter *writer, char c)
+{
+    if (writer->len >= CSON_WRITER_BUFFER_SIZE) cson_writer_flush(writer);
+    writer->buffer[writer->len++] = c;
+}
+
+#define cson__writer_cstr(writer, cstr) cson__writer_mem((writer), (cstr), sizeof(cstr)-1)
+
+static void cson__writer_indent(CsonWriter *writer, size_t indent)
+{
+    if (writer->compact) return;
+    static const char spaces[] = "                                ";
+    size_t n = indent*CSON_PRINT_INDENT;
+    while (n > 0){
+        size_t len = n < sizeof(spaces)-1? n : sizeof(spaces)-1;
+        cson__writer_mem(writer, spaces, len);
+        n -= len;
+    }
+}
+
+static void cson__writer_int(CsonWriter *writer, int64_t value)
+{
+    char digits[24];
+    size_t i = sizeof(digits);
+    uint64_t u = value < 0? -(uint64_t) value : (uint64_t) value;
+    do{
+        digits[--i] = '0' + (u % 10);
+        u /= 10;
+    }while (u > 0);
+    if (value < 0) digits[--i] = '-';
+    cson__writer_mem(writer, digits+i, sizeof(digits)-i);
+}
+
+static void cson__writer_string(CsonWriter *writer, CsonStr str)
+{
+    cson__writer_char(writer, '"');
+    const char *run = str.value;
+    const char *end = str.value + str.len;
+    for (const char *c = str.value; c < end; ++c){
+        char escaped;
+        switch (*c){
+            case '\\': escaped = '\\'; break;
+            case '"':  escaped = '"'; break;
+            case '\n': escaped = 'n'; break;
+            case '\r': escaped = 'r'; break;
+            case '\t': escaped = 't'; break;
+            case '\b': escaped = 'b'; break;
+            case '\f': escaped = 'f'; break;
+            default: continue;
+        }
+        // copy everything up to the escaped character in one go
+        cson__writer_mem(writer, run, c-run);
+        cson__writer_char(writer, '\\');
+        cson__writer_char(writer, escaped);
+        run = c+1;
+    }
+    cson__writer_mem(writer, run, end-run);
+    cson__writer_char(writer, '"');
+}
+
+void cson_writer_value(CsonWriter *writer, Cson *value, size_t indent)
+{
+    if (value == NULL) return;
     switch (value->type){
         case Cson_Int:{
-            fprintf(file, "%"PRId64, value->value.integer);
+            cson__writer_int(writer, value->value.integer);
         }break;
         case Cson_Float:{
-            fprintf(file, "%lf", value->value.floating);
+            char buffer[64];
+            int len = snprintf(buffer, sizeof(buffer), "%lf", value->value.floating);
+            if (len > 0) cson__writer_mem(writer, buffer, (size_t) len < sizeof(buffer)? (size_t) len : sizeof(buffer)-1);
         }break;
         case Cson_Bool:{
-            fprintf(file, "%s", value->value.boolean? "true":"false");
-        }break; 
+            if (value->value.boolean){
+                cson__writer_cstr(writer, "true");
+            } else{
+                cson__writer_cstr(writer, "false");
+            }
+        }break;
         case Cson_String:{
-            escape_string(value->value.string.value, cson_temp_buffer, sizeof(cson_temp_buffer));
-            fprintf(file, "\"%s\"", cson_temp_buffer);
+            cson__writer_string(writer, value->value.string);
         }break;
         case Cson_Null:{
-            fprintf(file, "null");
+            cson__writer_cstr(writer, "null");
         }break;
         case Cson_Array:{
-            cson_array_fprint(value->value.array, file, indent);
+            CsonArray *array = value->value.array;
+            cson__writer_char(writer, '[');
+            if (!writer->compact) cson__writer_char(writer, '\n');
+            for (size_t i=0; i<array->size; ++i){
+                cson__writer_indent(writer, indent+1);
+                cson_writer_value(writer, array->items[i], indent+1);
+                if (writer->compact){
+                    if (i+1 < array->size) cson__writer_char(writer, ',');
+                } else{
+                    cson__writer_char(writer, (i+1 == array->size)? ' ' : ',');
+                    cson__writer_char(writer, '\n');
+                }
+            }
+            cson__writer_indent(writer, indent);
+            cson__writer_char(writer, ']');
         }break;
         case Cson_Map:{
-            cson_map_fprint(value->value.map, file, indent);
+            CsonMap *map = value->value.map;
+            size_t size = map->size;
+            cson__writer_char(writer, '{');
+            if (!writer->compact) cson__writer_char(writer, '\n');
+            for (size_t i=0; i<map->capacity; ++i){
+                for (CsonMapItem *item = map->items[i]; item != NULL; item = item->next){
+                    cson__writer_indent(writer, indent+1);
+                    cson__writer_string(writer, item->key);
+                    if (writer->compact){
+                        cson__writer_char(writer, ':');
+                        cson_writer_value(writer, item->value, indent+1);
+                        if (--size > 0) cson__writer_char(writer, ',');
+                    } else{
+                        cson__writer_cstr(writer, ": ");
+                        cson_writer_value(writer, item->value, indent+1);
+                        cson__writer_char(writer, (--size > 0)? ',' : ' ');
+                        cson__writer_char(writer, '\n');
+                    }
+                }
+            }
+            cson__writer_indent(writer, indent);
+            cson__writer_char(writer, '}');
         }break;
         default:{
             cson_error(CsonError_InvalidType, "Invalid value type: %s", CsonErrorStrings[value->type]);
@@ -700,47 +874,53 @@ void cson_fprint(Cson *value, FILE *file, size_t indent)
     }
 }
 
+void cson_fprint(Cson *value, FILE *file, size_t indent)
+{
+    if (value == NULL || file == NULL) return;
+    CsonWriter writer;
+    cson_writer_init(&writer, file, false);
+    cson_writer_value(&writer, value, indent);
+    (void) cson_writer_finish(&writer);
+}
+
 void cson_array_fprint(CsonArray *array, FILE *file, size_t indent)
 {
-    fprintf(file, "[\n");
-    for (size_t i=0; i<array->size; ++i){
-        cson_print_indent(file, indent+1);
-        cson_fprint(array->items[i], file, indent+1);
-        fprintf(file, "%c\n", (i+1 == array->size)? ' ':',');
-    }
-    cson_print_indent(file, indent);
-    fputc(']', file);
+    Cson value = {.type = Cson_Array, .value.array = array};
+    cson_fprint(&value, file, indent);
 }
 
 void cson_map_fprint(CsonMap *map, FILE *file, size_t indent)
 {
-    fprintf(file, "{\n");
-    size_t size = map->size;
-    for (size_t i=0; i<map->capacity; ++i){
-        CsonMapItem *value = map->items[i];
-        while (value){
-            cson_print_indent(file, indent+1);
-            fprintf(file, "\"%s\": ", value->key.value);
-            cson_fprint(value->value, file, indent+1);
-            fprintf(file, "%c\n", (--size > 0)? ',':' ');
-            value = value->next;
-        }
-    }
-    cson_print_indent(file, indent);
-    fputc('}', file);
+    Cson value = {.type = Cson_Map, .value.map = map};
+    cson_fprint(&value, file, indent);
 }
 
-bool cson_write(Cson *json, char *filename)
+bool cson__write(Cson *json, char *filename, bool compact)
 {
+    TRACE_SCOPE("cson_write", filename);
     if (json == NULL || filename == NULL) return false;
-    FILE *file = fopen(filename, "w");
+    FILE *file = fopen(filename, "wb");
     if (file == NULL){
         cson_error(CsonError_FileNotFound, "Could not find file: \"%s\"", filename);
         return false;
     }
-    cson_fprint(json, file, 0);
-    fclose(file);
-    return true;
+    // the writer does its own buffering
+    setvbuf(file, NULL, _IONBF, 0);
+    CsonWriter writer;
+    cson_writer_init(&writer, file, compact);
+    cson_writer_value(&writer, json, 0);
+    bool ok = cson_writer_finish(&writer);
+    return (fclose(file) == 0) && ok;
+}
+
+bool cson_write(Cson *json, char *filename)
+{
+    return cson__write(json, filename, false);
+}
+
+bool cson_write_compact(Cson *json, char *filename)
+{
+    return cson__write(json, filename, true);
 }
 
 CsonLexer cson_lex_init(char *buffer, size_t buffer_size, char *filename)
@@ -800,23 +980,19 @@ bool cson_lex_next(CsonLexer *lexer, CsonToken *token)
         default:{
             // multi-character literal
             // find end of literal
-            char c;
-            while (lexer->index < lexer->buffer_size && !cson_lex_is_delimeter(c = cson_lex_get_char(lexer))){
-                cson_lex_check_line(lexer, c);
-                lexer->index++;
-            }
+            cson_lex_advance(lexer, cson_scan(CsonScan_Delimeter, lexer->buffer, lexer->index, lexer->buffer_size));
             char *t_end = cson_lex_get_pointer(lexer);
             size_t t_len = t_end-t_start;
             // check for known literals
-            if (memcmp(t_start, "true", t_len) == 0){
+            if (t_len == 4 && memcmp(t_start, "true", t_len) == 0){
                 cson_lex_set_token(token, CsonToken_True, t_start, t_end, t_loc);
                 return true;
             }
-            if (memcmp(t_start, "false", t_len) == 0){
+            if (t_len == 5 && memcmp(t_start, "false", t_len) == 0){
                 cson_lex_set_token(token, CsonToken_False, t_start, t_end, t_loc);
                 return true;
             }
-            if (memcmp(t_start, "null", t_len) == 0){
+            if (t_len == 4 && memcmp(t_start, "null", t_len) == 0){
                 cson_lex_set_token(token, CsonToken_Null, t_start, t_end, t_loc);
                 return true;
             }
@@ -854,10 +1030,8 @@ bool cson_lex_extract(CsonToken *token, char *buffer, size_t buffer_size)
     if (token == NULL || buffer == NULL || buffer_size == 0) return false;
     if (token->len >= buffer_size) return false;
     if (token->type == CsonToken_String){
-        char temp_buffer[token->len+1];
-        memset(temp_buffer, 0, token->len+1);
         char *r = token->t_start;
-        char *w = temp_buffer;
+        char *w = buffer;
         while (r != token->t_end){
             if (*r == '\\'){
                 switch(*++r){
@@ -884,10 +1058,11 @@ bool cson_lex_extract(CsonToken *token, char *buffer, size_t buffer_size)
             r++;
             w++;
         }
-        sprintf(buffer, "%.*s", (int) (w-temp_buffer+1), temp_buffer);
+        *w = '\0';
     }
     else{
-        sprintf(buffer, "%.*s", (int)token->len, token->t_start);
+        memcpy(buffer, token->t_start, token->len);
+        buffer[token->len] = '\0';
     }
     return true;
 }
@@ -908,24 +1083,49 @@ void cson_lex_set_token(CsonToken *token, CsonTokenType type, char *t_start, cha
     token->loc = loc;
 }
 
+void cson_lex_advance(CsonLexer *lexer, size_t index)
+{
+    // only newlines change the row, so the skipped bytes don't have to be looked at one by one
+    const char *start = lexer->buffer + lexer->index;
+    const char *end = lexer->buffer + index;
+    const char *line = NULL;
+    const char *nl;
+    while (start < end && (nl = memchr(start, '\n', end-start)) != NULL){
+        lexer->loc.row++;
+        line = nl+1;
+        start = line;
+    }
+    if (line != NULL){
+        lexer->loc.column = 1 + (end-line);
+    } else{
+        lexer->loc.column += index - lexer->index;
+    }
+    lexer->index = index;
+}
+
 bool cson_lex_find(CsonLexer *lexer, char c)
 {
-    char rc;
-    while (lexer->index < lexer->buffer_size){
-        if ((rc = cson_lex_get_char(lexer)) == c) return true;
-        cson_lex_check_line(lexer, rc);
-        lexer->index++;
+    size_t end = lexer->buffer_size;
+    size_t index = lexer->index;
+    if (c != '"'){
+        const char *found = memchr(lexer->buffer + index, c, end - index);
+        if (found == NULL) return false;
+        cson_lex_advance(lexer, found - lexer->buffer);
+        return true;
+    }
+    while ((index = cson_scan(CsonScan_StringEnd, lexer->buffer, index, end)) < end){
+        if (lexer->buffer[index] == '"'){
+            cson_lex_advance(lexer, index);
+            return true;
+        }
+        index += 2; // skip the escaped character
     }
     return false;
 }
 
 void cson_lex_trim_left(CsonLexer *lexer)
 {
-    char c;
-    while (lexer->index <= lexer->buffer_size && cson_lex_is_whitespace((c = cson_lex_get_char(lexer)))){
-        cson_lex_check_line(lexer, c);
-        lexer->index++;
-    }
+    cson_lex_advance(lexer, cson_scan(CsonScan_NonWhitespace, lexer->buffer, lexer->index, lexer->buffer_size));
 }
 
 bool cson_lex_is_delimeter(char c)
@@ -939,7 +1139,8 @@ bool cson_lex_is_delimeter(char c)
         case ':':
         case ' ':
         case '\n':
-        case '\t':{
+        case '\t':
+        case '\r':{
             return true;
         }
         default: return false;
@@ -963,6 +1164,124 @@ bool cson_lex_is_float(char *s, char *e)
     return (ep && ep == e);
 }
 
+/* Scanning stage */
+
+static inline bool cson__scan_stop(CsonScanKind kind, char c)
+{
+    switch (kind){
+        case CsonScan_NonWhitespace: return !cson_lex_is_whitespace(c);
+        case CsonScan_StringEnd: return c == '"' || c == '\\';
+        case CsonScan_Delimeter: return cson_lex_is_delimeter(c);
+    }
+    return true;
+}
+
+static size_t cson__scan_scalar(CsonScanKind kind, const char *buffer, size_t index, size_t end)
+{
+    while (index < end && !cson__scan_stop(kind, buffer[index])) index++;
+    return index;
+}
+
+#ifdef CSON_SIMD_X86
+
+__attribute__((always_inline))
+static inline uint32_t cson__sse2_stop(CsonScanKind kind, __m128i v)
+{
+    #define eq(c) _mm_cmpeq_epi8(v, _mm_set1_epi8(c))
+    switch (kind){
+        case CsonScan_NonWhitespace:{
+            __m128i ws = _mm_or_si128(_mm_or_si128(eq(' '), eq('\n')), _mm_or_si128(eq('\t'), eq('\r')));
+            return ~_mm_movemask_epi8(ws) & 0xffff;
+        }
+        case CsonScan_StringEnd: return _mm_movemask_epi8(_mm_or_si128(eq('"'), eq('\\')));
+        case CsonScan_Delimeter:{
+            __m128i ws = _mm_or_si128(_mm_or_si128(eq(' '), eq('\n')), _mm_or_si128(eq('\t'), eq('\r')));
+            __m128i structural = _mm_or_si128(_mm_or_si128(eq(','), eq(':')), _mm_or_si128(eq('['), eq(']')));
+            structural = _mm_or_si128(structural, _mm_or_si128(eq('{'), eq('}')));
+            return _mm_movemask_epi8(_mm_or_si128(ws, structural));
+        }
+    }
+    #undef eq
+    return 0xffff;
+}
+
+static size_t cson__scan_sse2(CsonScanKind kind, const char *buffer, size_t index, size_t end)
+{
+    while (index + 16 <= end){
+        uint32_t mask = cson__sse2_stop(kind, _mm_loadu_si128((const __m128i*) (buffer+index)));
+        if (mask != 0) return index + __builtin_ctz(mask);
+        index += 16;
+    }
+    return cson__scan_scalar(kind, buffer, index, end);
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline uint32_t cson__avx2_stop(CsonScanKind kind, __m256i v)
+{
+    #define eq(c) _mm256_cmpeq_epi8(v, _mm256_set1_epi8(c))
+    switch (kind){
+        case CsonScan_NonWhitespace:{
+            __m256i ws = _mm256_or_si256(_mm256_or_si256(eq(' '), eq('\n')), _mm256_or_si256(eq('\t'), eq('\r')));
+            return ~(uint32_t) _mm256_movemask_epi8(ws);
+        }
+        case CsonScan_StringEnd: return (uint32_t) _mm256_movemask_epi8(_mm256_or_si256(eq('"'), eq('\\')));
+        case CsonScan_Delimeter:{
+            __m256i ws = _mm256_or_si256(_mm256_or_si256(eq(' '), eq('\n')), _mm256_or_si256(eq('\t'), eq('\r')));
+            __m256i structural = _mm256_or_si256(_mm256_or_si256(eq(','), eq(':')), _mm256_or_si256(eq('['), eq(']')));
+            structural = _mm256_or_si256(structural, _mm256_or_si256(eq('{'), eq('}')));
+            return (uint32_t) _mm256_movemask_epi8(_mm256_or_si256(ws, structural));
+        }
+    }
+    #undef eq
+    return UINT32_MAX;
+}
+
+__attribute__((target("avx2")))
+static size_t cson__scan_avx2(CsonScanKind kind, const char *buffer, size_t index, size_t end)
+{
+    while (index + 32 <= end){
+        uint32_t mask = cson__avx2_stop(kind, _mm256_loadu_si256((const __m256i*) (buffer+index)));
+        if (mask != 0) return index + __builtin_ctz(mask);
+        index += 32;
+    }
+    // the tail stays in this function, so no legacy SSE code runs with dirty upper registers
+    while (index + 16 <= end){
+        uint32_t mask = cson__sse2_stop(kind, _mm_loadu_si128((const __m128i*) (buffer+index)));
+        if (mask != 0) return index + __builtin_ctz(mask);
+        index += 16;
+    }
+    return cson__scan_scalar(kind, buffer, index, end);
+}
+
+#endif // CSON_SIMD_X86
+
+CsonSimd cson_simd_level(void)
+{
+#ifdef CSON_SIMD_X86
+    CsonSimd available = __builtin_cpu_supports("avx2")? CsonSimd_AVX2 : CsonSimd_SSE2;
+#else
+    CsonSimd available = CsonSimd_Scalar;
+#endif // CSON_SIMD_X86
+    if (cson_simd == CsonSimd_Auto || cson_simd > available) return available;
+    return cson_simd;
+}
+
+size_t cson_scan(CsonScanKind kind, const char *buffer, size_t index, size_t end)
+{
+    // most tokens are short, the vector paths only pay off once a full vector is left
+    if (index >= end || cson__scan_stop(kind, buffer[index])) return index;
+#ifdef CSON_SIMD_X86
+    if (end - index >= 16){
+        switch (cson_simd_level()){
+            case CsonSimd_AVX2: return cson__scan_avx2(kind, buffer, index, end);
+            case CsonSimd_SSE2: return cson__scan_sse2(kind, buffer, index, end);
+            default: break;
+        }
+    }
+#endif // CSON_SIMD_X86
+    return cson__scan_scalar(kind, buffer, index, end);
+}
+
 void cson__error_unexpected(CsonLoc loc, CsonTokenType expected[], size_t expected_count, CsonTokenType actual, char *filename, size_t line)
 {
     if (expected_count == 0) return;
@@ -1042,9 +1361,10 @@ bool cson__parse_array(Cson *array, CsonLexer *lexer)
 bool cson__parse_value(Cson **cson, CsonLexer *lexer, CsonToken *token)
 {
     if (cson == NULL || lexer == NULL || token == NULL) return false;
-    size_t buff_size = token->len+1;
+    bool extract = token->type == CsonToken_Int || token->type == CsonToken_Float || token->type == CsonToken_String;
+    size_t buff_size = extract? token->len+1 : 1;
     char buffer[buff_size];
-    cson_lex_extract(token, buffer, buff_size);
+    if (extract) cson_lex_extract(token, buffer, buff_size);
     switch (token->type){
         case CsonToken_ArrayOpen:{
             Cson *array = cson_array_new();
@@ -1118,38 +1438,32 @@ Cson* cson_parse_buffer(char *buffer, size_t buffer_size, char *filename)
     return cson;
 }
 
-size_t cson__read_file(FILE *file, char *buffer, size_t buffer_size) {
-    size_t total = 0;
-    int prev = 0;
-
-    while (total < buffer_size - 1) {
-        int c = fgetc(file);
-        if (c == EOF) break;
-
-        if (prev == '\r' && c == '\n') {
-            buffer[total - 1] = '\n'; // Replace \r with \n
-        } else {
-            buffer[total++] = (char)c;
-        }
-        prev = c;
-    }
-
-    buffer[total] = '\0';
-    return total;
-}
-
 Cson* cson_read(char *filename){
-    FILE *file = fopen(filename, "r");
-    if (file == NULL){
+    TRACE_SCOPE("cson_read", filename);
+    int fd = open(filename, O_RDONLY | O_BINARY);
+    if (fd < 0){
         cson_error(CsonError_FileNotFound, "Could not open file: \"%s\"", filename);
         return NULL;
     }
-    uint64_t file_size = cson_file_size(filename);
-    char *file_content = (char*) calloc(file_size+1, sizeof(*file_content));
+    struct stat st;
+    if (fstat(fd, &st) != 0){
+        cson_error(CsonError_FileNotFound, "Could not stat file: \"%s\"", filename);
+        close(fd);
+        return NULL;
+    }
+    // one bulk read, the lexer treats '\r' as whitespace so the content is parsed in place
+    size_t file_size = (size_t) st.st_size;
+    char *file_content = (char*) malloc(file_size+1);
     cson_assert_alloc(file_content);
-    (void) cson__read_file(file, file_content, file_size+1);
-    fclose(file);
-    Cson *cson = cson_parse_buffer(file_content, file_size, filename);
+    size_t total = 0;
+    while (total < file_size){
+        ssize_t n = read(fd, file_content+total, file_size-total);
+        if (n <= 0) break;
+        total += (size_t) n;
+    }
+    close(fd);
+    file_content[total] = '\0';
+    Cson *cson = cson_parse_buffer(file_content, total, filename);
     free(file_content);
     return cson;
 }
@@ -0,0 +1,563 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <cwalk.h>
+#include <delta.h>
+#include <flib.h>
+#include <hash.h>
+#include <message_queue.h>
+
+#ifdef _WIN32
+    #define delta_mkdir(path) mkdir(path)
+    #define DELTA_O_BINARY O_BINARY
+#else
+    #define delta_mkdir(path) mkdir(path, 0755)
+    #define DELTA_O_BINARY 0
+#endif // _WIN32
+
+#define DELTA_READ_SIZE (4*1024*1024)
+#define DELTA_NONE UINT32_MAX
+
+typedef enum{
+    DELTA_OP_END,
+    DELTA_OP_COPY, // uint64_t first block, uint32_t block count
+    DELTA_OP_DATA, // uint32_t length, then the literal bytes
+} delta_op;
+
+typedef struct{
+    char magic[8];
+    uint32_t block_size;
+    uint32_t reserved;
+    uint64_t file_size;
+    uint64_t block_count;
+} delta_sig_header;
+
+typedef struct{
+    uint64_t strong;
+    uint32_t weak;
+    uint32_t reserved;
+} delta_sig_entry;
+
+typedef struct{
+    char magic[8];
+    uint32_t block_size;
+    uint32_t reserved;
+    uint64_t base_size;
+    uint64_t target_size;
+    uint64_t target_hash; // XXH64 of the whole new version, checked when the patch is applied
+} delta_patch_header;
+
+// builds the signature of a file from its bytes in order
+typedef struct{
+    FILE *file;
+    uint32_t block_size;
+    uint32_t a, b;
+    size_t fill;
+    hash_xxh64_t strong;
+    uint64_t size;
+    uint64_t count;
+    bool ok;
+} delta_sig_writer;
+
+typedef struct{
+    FILE *file;
+    uint64_t copy_block;
+    uint32_t copy_count;
+    delta_sig_writer sig;
+    hash_xxh64_t target;
+    delta_stats stats;
+    bool ok;
+} delta_patch_writer;
+
+uint32_t delta_block_size(uint64_t file_size)
+{
+    // like rsync, the square root of the size keeps both the signature and the unmatched data small
+    uint64_t root = 1;
+    while (root*root < file_size) root <<= 1;
+    while (root > 1 && (root-1)*(root-1) >= file_size) root--;
+    uint64_t size = (root + 1023) & ~(uint64_t) 1023;
+    if (size < DELTA_MIN_BLOCK_SIZE) size = DELTA_MIN_BLOCK_SIZE;
+    if (size > DELTA_MAX_BLOCK_SIZE) size = DELTA_MAX_BLOCK_SIZE;
+    return (uint32_t) size;
+}
+
+bool delta_path(const char *backup, const char *rel, const char *suffix, bool create, char *buffer, size_t buffer_size)
+{
+    char dir[FILENAME_MAX] = {0};
+    cwk_path_join(backup, DELTA_DIR, dir, sizeof(dir));
+    size_t dir_len = cwk_path_join(dir, rel, buffer, buffer_size);
+    if (dir_len + strlen(suffix) >= buffer_size){
+        eprintf("Path of the delta for '%s' is too long!", rel);
+        return false;
+    }
+    strcat(buffer, suffix);
+    if (!create) return true;
+    // workers store files of the same directory at once, so an existing directory is fine
+    for (size_t i=strlen(dir); i<dir_len; ++i){
+        if (buffer[i] != FLIB_PATH_SEP) continue;
+        char c = buffer[i];
+        buffer[i] = '\0';
+        int err = delta_mkdir(buffer) != 0? errno : 0;
+        buffer[i] = c;
+        if (err != 0 && err != EEXIST){
+            eprintf("Could not create directory for '%s': %s!", buffer, strerror(err));
+            return false;
+        }
+    }
+    return true;
+}
+
+static inline uint32_t delta_weak(uint32_t a, uint32_t b)
+{
+    return (a & 0xffff) | (b << 16);
+}
+
+static inline size_t delta_bucket(const delta_signature *sig, uint32_t weak)
+{
+    return (size_t) ((weak * 0x9E3779B1u) >> 7) & sig->bucket_mask;
+}
+
+static inline size_t delta_filter_bit(const delta_signature *sig, uint32_t weak)
+{
+    uint32_t h = weak * 0x85EBCA6Bu;
+    return (h ^ (h >> 16)) & sig->filter_mask;
+}
+
+static bool delta_write(FILE *file, const void *data, size_t size)
+{
+    return size == 0 || fwrite(data, size, 1, file) == 1;
+}
+
+static FILE* delta_create_file(const char *path)
+{
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) eprintf("Could not create '%s': %s!", path, strerror(errno));
+    return file;
+}
+
+static bool delta_close_file(FILE *file, const char *path, bool ok)
+{
+    if (fclose(file) != 0) ok = false;
+    if (!ok){
+        eprintf("Could not write '%s'!", path);
+        (void) remove(path);
+    }
+    return ok;
+}
+
+static bool delta_sig_begin(delta_sig_writer *writer, const char *path, uint32_t block_size)
+{
+    memset(writer, 0, sizeof(*writer));
+    writer->file = delta_create_file(path);
+    if (writer->file == NULL) return false;
+    writer->block_size = block_size;
+    hash_xxh64_init(&writer->strong, 0);
+    // the header is written again with the final counts
+    delta_sig_header header = {.magic = DELTA_SIG_MAGIC, .block_size = block_size};
+    writer->ok = delta_write(writer->file, &header, sizeof(header));
+    return true;
+}
+
+static void delta_sig_feed(delta_sig_writer *writer, const uint8_t *data, size_t len)
+{
+    writer->size += len;
+    while (len > 0){
+        size_t n = writer->block_size - writer->fill;
+        if (n > len) n = len;
+        hash_xxh64_update(&writer->strong, data, n);
+        uint32_t a = writer->a, b = writer->b;
+        for (size_t i=0; i<n; ++i){
+            a += data[i];
+            b += a;
+        }
+        writer->a = a;
+        writer->b = b;
+        writer->fill += n;
+        data += n;
+        len -= n;
+        if (writer->fill == writer->block_size){
+            // only full blocks are matched, a short last block is always sent as data
+            delta_sig_entry entry = {.strong = hash_xxh64_final(&writer->strong), .weak = delta_weak(a, b)};
+            if (writer->ok) writer->ok = delta_write(writer->file, &entry, sizeof(entry));
+            writer->count++;
+            writer->a = writer->b = 0;
+            writer->fill = 0;
+            hash_xxh64_init(&writer->strong, 0);
+        }
+    }
+}
+
+static bool delta_sig_end(delta_sig_writer *writer, const char *path)
+{
+    delta_sig_header header = {.magic = DELTA_SIG_MAGIC, .block_size = writer->block_size, .file_size = writer->size, .block_count = writer->count};
+    if (writer->ok) writer->ok = fseek(writer->file, 0, SEEK_SET) == 0 && delta_write(writer->file, &header, sizeof(header));
+    return delta_close_file(writer->file, path, writer->ok);
+}
+
+static bool delta_read_full(int fd, uint8_t *buffer, size_t size, size_t *read_size, const char *path)
+{
+    size_t total = 0;
+    while (total < size){
+        ssize_t n = read(fd, buffer+total, size-total);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0){
+            eprintf("Could not read '%s': %s!", path, strerror(errno));
+            return false;
+        }
+        if (n == 0) break;
+        total += (size_t) n;
+    }
+    *read_size = total;
+    return true;
+}
+
+static uint64_t delta_file_size(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0) return 0;
+    return (uint64_t) st.st_size;
+}
+
+bool delta_signature_file(const char *src, const char *sig_path)
+{
+    int fd = open(src, O_RDONLY | DELTA_O_BINARY);
+    if (fd < 0){
+        eprintf("Could not open '%s': %s!", src, strerror(errno));
+        return false;
+    }
+    delta_sig_writer writer;
+    if (!delta_sig_begin(&writer, sig_path, delta_block_size(delta_file_size(fd)))){
+        close(fd);
+        return false;
+    }
+    uint8_t *buffer = malloc(DELTA_READ_SIZE);
+    assert(buffer != NULL && "Buy more RAM lol");
+    while (writer.ok){
+        size_t n = 0;
+        writer.ok = delta_read_full(fd, buffer, DELTA_READ_SIZE, &n, src);
+        if (n == 0) break;
+        delta_sig_feed(&writer, buffer, n);
+    }
+    free(buffer);
+    close(fd);
+    return delta_sig_end(&writer, sig_path);
+}
+
+bool delta_signature_read(const char *path, delta_signature *sig)
+{
+    memset(sig, 0, sizeof(*sig));
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) return false;
+    bool result = false;
+    delta_sig_header header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, DELTA_SIG_MAGIC, sizeof(DELTA_SIG_MAGIC)) != 0
+        || header.block_size == 0 || header.block_count >= DELTA_NONE || header.block_count*header.block_size > header.file_size){
+        eprintf("Invalid signature '%s'!", path);
+        goto defer;
+    }
+    sig->block_size = header.block_size;
+    sig->file_size = header.file_size;
+    sig->count = (size_t) header.block_count;
+    size_t buckets = 16;
+    while (buckets < 2*sig->count) buckets <<= 1;
+    sig->bucket_mask = buckets-1;
+    sig->blocks = malloc((sig->count+1)*sizeof(*sig->blocks));
+    sig->buckets = malloc(buckets*sizeof(*sig->buckets));
+    assert(sig->blocks != NULL && sig->buckets != NULL && "Buy more RAM lol");
+    memset(sig->buckets, 0xff, buckets*sizeof(*sig->buckets));
+    size_t filter_bits = 1 << 16;
+    while (filter_bits < 8*sig->count) filter_bits <<= 1;
+    sig->filter_mask = filter_bits-1;
+    sig->filter = calloc(filter_bits/64, sizeof(*sig->filter));
+    assert(sig->filter != NULL && "Buy more RAM lol");
+    for (size_t i=0; i<sig->count; ++i){
+        delta_sig_entry entry;
+        if (fread(&entry, sizeof(entry), 1, file) != 1){
+            eprintf("Invalid signature '%s'!", path);
+            goto defer;
+        }
+        sig->blocks[i] = (delta_block){.weak = entry.weak, .strong = entry.strong};
+    }
+    // inserted backwards, so every bucket lists the earliest block first
+    for (size_t i=sig->count; i-- > 0;){
+        size_t bucket = delta_bucket(sig, sig->blocks[i].weak);
+        sig->blocks[i].next = sig->buckets[bucket];
+        sig->buckets[bucket] = (uint32_t) i;
+        size_t bit = delta_filter_bit(sig, sig->blocks[i].weak);
+        sig->filter[bit/64] |= (uint64_t) 1 << (bit%64);
+    }
+    result = true;
+  defer:
+    fclose(file);
+    if (!result) delta_signature_free(sig);
+    return result;
+}
+
+void delta_signature_free(delta_signature *sig)
+{
+    free(sig->blocks);
+    free(sig->buckets);
+    free(sig->filter);
+    memset(sig, 0, sizeof(*sig));
+}
+
+static inline uint32_t delta_find(const delta_signature *sig, uint32_t weak, const uint8_t *data)
+{
+    size_t bit = delta_filter_bit(sig, weak);
+    if (!(sig->filter[bit/64] & ((uint64_t) 1 << (bit%64)))) return DELTA_NONE;
+    bool hashed = false;
+    uint64_t strong = 0;
+    for (uint32_t i=sig->buckets[delta_bucket(sig, weak)]; i != DELTA_NONE; i=sig->blocks[i].next){
+        if (sig->blocks[i].weak != weak) continue;
+        if (!hashed){
+            strong = hash_xxh64(data, sig->block_size, 0);
+            hashed = true;
+        }
+        if (sig->blocks[i].strong == strong) return i;
+    }
+    return DELTA_NONE;
+}
+
+static void delta_flush_copy(delta_patch_writer *writer)
+{
+    if (writer->copy_count == 0) return;
+    uint8_t op = DELTA_OP_COPY;
+    if (writer->ok){
+        writer->ok = delta_write(writer->file, &op, sizeof(op))
+                  && delta_write(writer->file, &writer->copy_block, sizeof(writer->copy_block))
+                  && delta_write(writer->file, &writer->copy_count, sizeof(writer->copy_count));
+    }
+    writer->copy_count = 0;
+}
+
+static void delta_emit_data(delta_patch_writer *writer, const uint8_t *data, size_t len)
+{
+    if (len == 0) return;
+    delta_flush_copy(writer);
+    uint8_t op = DELTA_OP_DATA;
+    uint32_t op_len = (uint32_t) len;
+    if (writer->ok){
+        writer->ok = delta_write(writer->file, &op, sizeof(op))
+                  && delta_write(writer->file, &op_len, sizeof(op_len))
+                  && delta_write(writer->file, data, len);
+    }
+    delta_sig_feed(&writer->sig, data, len);
+    hash_xxh64_update(&writer->target, data, len);
+    writer->stats.literal_bytes += len;
+}
+
+static void delta_emit_copy(delta_patch_writer *writer, uint32_t block, const uint8_t *data, size_t len)
+{
+    if (writer->copy_count > 0 && writer->copy_block + writer->copy_count == block && writer->copy_count < UINT32_MAX){
+        writer->copy_count++;
+    } else{
+        delta_flush_copy(writer);
+        writer->copy_block = block;
+        writer->copy_count = 1;
+    }
+    delta_sig_feed(&writer->sig, data, len);
+    hash_xxh64_update(&writer->target, data, len);
+    writer->stats.matched_bytes += len;
+}
+
+bool delta_create(const char *src, const delta_signature *base, const char *patch_path, const char *sig_path, delta_stats *stats)
+{
+    int fd = open(src, O_RDONLY | DELTA_O_BINARY);
+    if (fd < 0){
+        eprintf("Could not open '%s': %s!", src, strerror(errno));
+        return false;
+    }
+    delta_patch_writer writer = {0};
+    writer.file = delta_create_file(patch_path);
+    if (writer.file == NULL){
+        close(fd);
+        return false;
+    }
+    // the new version is matched against the old blocks, but signed with the block size of its own size
+    if (!delta_sig_begin(&writer.sig, sig_path, delta_block_size(delta_file_size(fd)))){
+        (void) delta_close_file(writer.file, patch_path, false);
+        close(fd);
+        return false;
+    }
+    hash_xxh64_init(&writer.target, 0);
+    delta_patch_header header = {.magic = DELTA_PATCH_MAGIC, .block_size = base->block_size, .base_size = base->file_size};
+    writer.ok = delta_write(writer.file, &header, sizeof(header));
+
+    const size_t bs = base->block_size;
+    uint8_t *buffer = malloc(DELTA_READ_SIZE + 2*DELTA_MAX_BLOCK_SIZE);
+    assert(buffer != NULL && "Buy more RAM lol");
+    size_t p = 0, lit = 0, end = 0;
+    bool eof = false;
+    bool have_weak = false;
+    uint32_t a = 0, b = 0;
+    while (writer.ok && writer.sig.ok){
+        if (!eof && end-p < bs){
+            // everything before p is either emitted or pending data, which is emitted before the move
+            delta_emit_data(&writer, buffer+lit, p-lit);
+            memmove(buffer, buffer+p, end-p);
+            end -= p;
+            p = lit = 0;
+            size_t n = 0;
+            if (!delta_read_full(fd, buffer+end, DELTA_READ_SIZE, &n, src)) writer.ok = false;
+            if (n == 0) eof = true;
+            end += n;
+            continue;
+        }
+        if (end-p < bs || base->count == 0) break;
+        if (!have_weak){
+            a = b = 0;
+            for (size_t i=0; i<bs; ++i){
+                a += buffer[p+i];
+                b += a;
+            }
+            have_weak = true;
+        }
+        uint32_t block = delta_find(base, delta_weak(a, b), buffer+p);
+        if (block != DELTA_NONE){
+            delta_emit_data(&writer, buffer+lit, p-lit);
+            delta_emit_copy(&writer, block, buffer+p, bs);
+            p += bs;
+            lit = p;
+            have_weak = false;
+            continue;
+        }
+        if (p+bs < end){
+            uint8_t out = buffer[p];
+            a += buffer[p+bs] - out;
+            b += a - (uint32_t) bs*out;
+        } else{
+            have_weak = false;
+        }
+        p++;
+        if (p-lit >= DELTA_MAX_LITERAL){
+            delta_emit_data(&writer, buffer+lit, p-lit);
+            lit = p;
+        }
+    }
+    // the rest of the file is shorter than a block (or there was nothing to match against)
+    while (writer.ok && writer.sig.ok){
+        delta_emit_data(&writer, buffer+lit, end-lit);
+        if (eof) break;
+        size_t n = 0;
+        if (!delta_read_full(fd, buffer, DELTA_READ_SIZE, &n, src)) writer.ok = false;
+        lit = 0;
+        end = n;
+        eof = n == 0;
+    }
+    delta_flush_copy(&writer);
+    uint8_t op = DELTA_OP_END;
+    if (writer.ok) writer.ok = delta_write(writer.file, &op, sizeof(op));
+    header.target_size = writer.sig.size;
+    header.target_hash = hash_xxh64_final(&writer.target);
+    if (writer.ok) writer.ok = fseek(writer.file, 0, SEEK_SET) == 0 && delta_write(writer.file, &header, sizeof(header));
+    free(buffer);
+    close(fd);
+    bool sig_ok = delta_sig_end(&writer.sig, sig_path);
+    bool patch_ok = delta_close_file(writer.file, patch_path, writer.ok && sig_ok);
+    if (!patch_ok && sig_ok) (void) remove(sig_path);
+    writer.stats.target_hash = header.target_hash;
+    if (stats != NULL) *stats = writer.stats;
+    return patch_ok && sig_ok;
+}
+
+static bool delta_read_at(int fd, uint8_t *buffer, size_t size, uint64_t offset)
+{
+#ifdef _WIN32
+    if (_lseeki64(fd, (__int64) offset, SEEK_SET) < 0) return false;
+    size_t n = 0;
+    return delta_read_full(fd, buffer, size, &n, "base") && n == size;
+#else
+    size_t total = 0;
+    while (total < size){
+        ssize_t n = pread(fd, buffer+total, size-total, (off_t) (offset+total));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        total += (size_t) n;
+    }
+    return true;
+#endif // _WIN32
+}
+
+bool delta_apply(const char *base_path, const char *patch_path, const char *dest)
+{
+    FILE *patch = fopen(patch_path, "rb");
+    if (patch == NULL){
+        eprintf("Could not open '%s': %s!", patch_path, strerror(errno));
+        return false;
+    }
+    int base = open(base_path, O_RDONLY | DELTA_O_BINARY);
+    if (base < 0){
+        eprintf("Could not open '%s': %s!", base_path, strerror(errno));
+        fclose(patch);
+        return false;
+    }
+    FILE *out = delta_create_file(dest);
+    if (out == NULL){
+        close(base);
+        fclose(patch);
+        return false;
+    }
+    uint8_t *buffer = malloc(DELTA_READ_SIZE);
+    assert(buffer != NULL && "Buy more RAM lol");
+    hash_xxh64_t target;
+    hash_xxh64_init(&target, 0);
+    uint64_t size = 0;
+    bool ok = true;
+    delta_patch_header header;
+    if (fread(&header, sizeof(header), 1, patch) != 1 || memcmp(header.magic, DELTA_PATCH_MAGIC, sizeof(DELTA_PATCH_MAGIC)) != 0
+        || header.block_size == 0 || delta_file_size(base) != header.base_size){
+        eprintf("Patch '%s' does not belong to '%s'!", patch_path, base_path);
+        ok = false;
+    }
+    while (ok){
+        uint8_t op;
+        if (fread(&op, sizeof(op), 1, patch) != 1){
+            ok = false;
+            break;
+        }
+        if (op == DELTA_OP_END) break;
+        if (op == DELTA_OP_COPY){
+            uint64_t block;
+            uint32_t count;
+            ok = fread(&block, sizeof(block), 1, patch) == 1 && fread(&count, sizeof(count), 1, patch) == 1;
+            uint64_t offset = block*header.block_size;
+            uint64_t remaining = (uint64_t) count*header.block_size;
+            if (ok && offset + remaining > header.base_size) ok = false;
+            while (ok && remaining > 0){
+                size_t n = remaining < DELTA_READ_SIZE? (size_t) remaining : DELTA_READ_SIZE;
+                ok = delta_read_at(base, buffer, n, offset) && delta_write(out, buffer, n);
+                hash_xxh64_update(&target, buffer, n);
+                offset += n;
+                remaining -= n;
+                size += n;
+            }
+        } else if (op == DELTA_OP_DATA){
+            uint32_t len;
+            ok = fread(&len, sizeof(len), 1, patch) == 1;
+            while (ok && len > 0){
+                size_t n = len < DELTA_READ_SIZE? len : DELTA_READ_SIZE;
+                ok = fread(buffer, n, 1, patch) == 1 && delta_write(out, buffer, n);
+                hash_xxh64_update(&target, buffer, n);
+                len -= (uint32_t) n;
+                size += n;
+            }
+        } else{
+            ok = false;
+        }
+    }
+    if (ok && (size != header.target_size || hash_xxh64_final(&target) != header.target_hash)){
+        eprintf("Patch '%s' produced a different file than it was made from!", patch_path);
+        ok = false;
+    } else if (!ok){
+        eprintf("Could not apply patch '%s'!", patch_path);
+    }
+    free(buffer);
+    close(base);
+    fclose(patch);
+    return delta_close_file(out, dest, ok);
+}
@@ -1,4 +1,20 @@
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE // copy_file_range
+#endif // _GNU_SOURCE
 #include <flib.h>
+#include <stats.h>
+#include <trace.h>
+
+#ifdef __linux__
+    #include <sys/ioctl.h>
+    #include <sys/sendfile.h>
+    #include <linux/fs.h>
+#endif // __linux__
+#ifdef _WIN32
+    #include <sys/utime.h>
+#else
+    #include <fcntl.h>
+#endif // _WIN32
 
 char *long_path_buf = NULL;
 #ifdef _WIN32
@@ -55,6 +71,7 @@ bool flib_read(const char *path, flib_cont *fc)
 
 bool flib_create_dir(const char *path)
 {
+    TRACE_SCOPE("flib_create_dir", path);
   #ifdef _WIN32
     const char *long_path = win_long_path(path);
     if (mkdir(long_path) == -1){
@@ -64,6 +81,7 @@ bool flib_create_dir(const char *path)
         return false;
     }
   #else
+    stats_count(STATS_SYS_MKDIR, 1);
 	if (mkdir(path, 0700) == -1){
         eprintf("Could not create directory '%s': %s!", path, strerror(errno));
         return false;
@@ -74,25 +92,55 @@ bool flib_create_dir(const char *path)
 
 int flib_delete_dir(const char *path)
 {
-    DIR *dir = opendir(path);
-    if (dir == NULL){
+    flib_dir dir;
+    if (!flib_dir_open(&dir, path)){
         flib_error("Could not find dir '%s'!", path);
         return 1;
     }
     flib_entry entry;
-    while (flib_get_entry(dir, path, &entry)){
+    while (flib_dir_next(&dir, &entry)){
         if (entry.type == FLIB_DIR){
             flib_delete_dir(entry.path);
         } else{
             unlink(entry.path);
         }
     }
-    closedir(dir);
+    flib_dir_close(&dir);
     return rmdir(path);
 }
 
 int flib_copy_file(const char *from, const char *to)
 {
+    return flib_copy_file_method(from, to, NULL);
+}
+
+#ifdef __linux__
+// returns 1 on success, 0 if the strategy is not supported for this pair of files and -1 on error
+static int flib__copy_kernel(int fd_from, int fd_to, flib_copy_method strategy)
+{
+    fsize_t copied = 0;
+    while (true){
+        ssize_t n;
+        stats_count(STATS_SYS_COPY, 1);
+        if (strategy == FLIB_COPY_RANGE){
+            n = copy_file_range(fd_from, NULL, fd_to, NULL, FLIB_COPY_CHUNK, 0);
+        } else{
+            n = sendfile(fd_to, fd_from, NULL, FLIB_COPY_CHUNK);
+        }
+        if (n == 0) return 1;
+        if (n < 0){
+            if (errno == EINTR) continue;
+            if (copied == 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP || errno == EBADF)) return 0;
+            return -1;
+        }
+        copied += n;
+    }
+}
+#endif // __linux__
+
+int flib_copy_file_method(const char *from, const char *to, flib_copy_method *method)
+{
+    TRACE_SCOPE("flib_copy_file", from);
 #ifdef _WIN32
     const char *long_path = win_long_path(to);
     if (CopyFile(from, long_path, false) == 0){
@@ -101,25 +149,28 @@ int flib_copy_file(const char *from, const char *to)
         LocalFree(error);
         return 1;
     }
+    if (method != NULL) *method = FLIB_COPY_NATIVE;
     return 0;
 #else
     int fd_to = -1, fd_from = -1;
-    char buffer[4096];
-    ssize_t nread;
     int saved_errno;
     struct stat st;
+    flib_copy_method used = FLIB_COPY_RW;
 
-    if (stat(from, &st) < 0) {
-        eprintf("Could not stat file '%s': %s\n", from, strerror(errno));
-        return 1;
-    }
-
+    stats_count(STATS_SYS_OPEN, 2);
+    stats_count(STATS_SYS_STAT, 1);
     fd_from = open(from, O_RDONLY);
     if (fd_from < 0){
         eprintf("Could not read file '%s': %s\n", from, strerror(errno));
         return 1;
     }
 
+    if (fstat(fd_from, &st) < 0) {
+        eprintf("Could not stat file '%s': %s\n", from, strerror(errno));
+        close(fd_from);
+        return 1;
+    }
+
     fd_to = open(to, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 0777);
     if (fd_to < 0){
         eprintf("Could not write file '%s': %s\n", to, strerror(errno));
@@ -127,11 +178,42 @@ int flib_copy_file(const char *from, const char *to)
         return 1;
     }
 
-    while ((nread = read(fd_from, buffer, sizeof(buffer))) > 0){
+#ifdef __linux__
+    // pseudo files report a size of 0, only the read/write loop copies them reliably
+    if (st.st_size > 0){
+        bool done = false;
+    #ifdef FICLONE
+        stats_count(STATS_SYS_COPY, 1);
+        if (ioctl(fd_to, FICLONE, fd_from) == 0){
+            used = FLIB_COPY_CLONE;
+            done = true;
+        }
+    #endif // FICLONE
+        for (flib_copy_method strategy = FLIB_COPY_RANGE; !done && strategy <= FLIB_COPY_SENDFILE; ++strategy){
+            int status = flib__copy_kernel(fd_from, fd_to, strategy);
+            if (status < 0) goto out_error;
+            if (status > 0){
+                used = strategy;
+                done = true;
+            }
+        }
+        if (done) goto out_meta;
+    }
+#endif // __linux__
+
+    char buffer[FLIB_COPY_BUFFER_SIZE];
+    ssize_t nread;
+    while ((nread = read(fd_from, buffer, sizeof(buffer))) != 0){
+        stats_count(STATS_SYS_READ, 1);
+        if (nread < 0){
+            if (errno == EINTR) continue;
+            goto out_error;
+        }
         char *out_ptr = buffer;
         ssize_t nwritten;
 
         do {
+            stats_count(STATS_SYS_WRITE, 1);
             nwritten = write(fd_to, out_ptr, nread);
             if (nwritten >= 0){
                 nread -= nwritten;
@@ -142,29 +224,33 @@ int flib_copy_file(const char *from, const char *to)
             }
         } while (nread > 0);
     }
+    stats_count(STATS_SYS_READ, 1); // the one that found the end
 
-    if (nread == 0){
-        // Copy ownership (ignore errors if not root)
-        fchown(fd_to, st.st_uid, st.st_gid);
+#ifdef __linux__
+  out_meta:
+#endif // __linux__
+    stats_count(STATS_SYS_ATTR, 3);
+    // Copy ownership (ignore errors if not root)
+    (void) fchown(fd_to, st.st_uid, st.st_gid);
 
-        // Copy permissions (in case umask interfered)
-        fchmod(fd_to, st.st_mode & 0777);
+    // Copy permissions (in case umask interfered)
+    fchmod(fd_to, st.st_mode & 0777);
 
-        // Copy timestamps
+    // Copy timestamps
 #if defined(HAVE_FUTIMENS) || (_POSIX_C_SOURCE >= 200809L)
-        struct timespec times[2];
-        times[0] = st.st_atim;
-        times[1] = st.st_mtim;
-        futimens(fd_to, times);
+    struct timespec times[2];
+    times[0] = st.st_atim;
+    times[1] = st.st_mtim;
+    futimens(fd_to, times);
 #endif
 
-        if (close(fd_to) < 0){
-            fd_to = -1;
-            goto out_error;
-        }
-        close(fd_from);
-        return 0;
+    if (close(fd_to) < 0){
+        fd_to = -1;
+        goto out_error;
     }
+    close(fd_from);
+    if (method != NULL) *method = used;
+    return 0;
 
 out_error:
     saved_errno = errno;
@@ -176,6 +262,38 @@ out_error:
 #endif
 }
 
+bool flib_link_file(const char *from, const char *to)
+{
+    TRACE_SCOPE("flib_link_file", to);
+#ifdef _WIN32
+    return CreateHardLinkA(win_long_path(to), from, NULL) != 0;
+#else
+    stats_count(STATS_SYS_LINK, 1);
+    return link(from, to) == 0;
+#endif // _WIN32
+}
+
+bool flib_set_attributes(const char *path, uint32_t mode, time_t mod_time, long mod_time_nsec)
+{
+    TRACE_SCOPE("flib_set_attributes", path);
+#ifdef _WIN32
+    struct _utimbuf times = {.actime = mod_time, .modtime = mod_time};
+    (void) mode;
+    (void) mod_time_nsec;
+    return _utime(path, &times) == 0;
+#else
+    bool result = true;
+    stats_count(STATS_SYS_ATTR, mode != 0? 2 : 1);
+    if (mode != 0 && chmod(path, mode & 07777) != 0) result = false;
+    struct timespec times[2] = {
+        {.tv_nsec = UTIME_OMIT},
+        {.tv_sec = mod_time, .tv_nsec = mod_time_nsec},
+    };
+    if (utimensat(AT_FDCWD, path, times, 0) != 0) result = false;
+    return result;
+#endif // _WIN32
+}
+
 int flib_copy_dir_rec(const char *src, const char *dest)
 {
     if (!flib_isdir(dest)){
@@ -254,6 +372,7 @@ int flib_copy_dir_rec_ignore(const char *src, const char *dest, const char **ign
 
 fsize_t flib_size(const char *path)
 {
+    stats_count(STATS_SYS_STAT, 1);
     struct stat attr;
     if (stat(path, &attr) == -1){
         return 0;
@@ -263,12 +382,14 @@ fsize_t flib_size(const char *path)
 
 bool flib_exists(const char *path)
 {
+    stats_count(STATS_SYS_STAT, 1);
     struct stat attr;
     return stat(path, &attr) == 0;
 }
 
 bool flib_isfile(const char *path)
 {
+    stats_count(STATS_SYS_STAT, 1);
     struct stat attr;
     if (stat(path, &attr) == -1) return false;
     return S_ISREG(attr.st_mode);
@@ -276,6 +397,7 @@ bool flib_isfile(const char *path)
 
 bool flib_isdir(const char *path)
 {
+    stats_count(STATS_SYS_STAT, 1);
     struct stat attr;
     if (stat(path, &attr) == -1) return false;
     return S_ISDIR(attr.st_mode);
@@ -300,6 +422,9 @@ bool flib_get_entry(DIR *dir, const char *dir_path, flib_entry *entry)
         entry->type = FLIB_FILE;
         entry->size = attr.st_size;
         entry->mod_time = attr.st_mtime;
+        entry->mod_time_nsec = flib_stat_mtime_nsec(attr);
+        entry->change_time = attr.st_ctime;
+        entry->change_time_nsec = flib_stat_ctime_nsec(attr);
     }
     else if (S_ISDIR(attr.st_mode)){
         entry->type = FLIB_DIR;
@@ -307,9 +432,158 @@ bool flib_get_entry(DIR *dir, const char *dir_path, flib_entry *entry)
     else{
         entry->type = FLIB_UNSP;
     }
+    entry->inode = (uint64_t) attr.st_ino;
+    entry->device = (uint64_t) attr.st_dev;
+    entry->mode = (uint32_t) attr.st_mode;
     return true;
 }
 
+static void flib__entry_from_stat(flib_entry *entry, const struct stat *attr)
+{
+    entry->size = 0;
+    if (S_ISREG(attr->st_mode)){
+        entry->type = FLIB_FILE;
+        entry->size = attr->st_size;
+    }
+    else if (S_ISDIR(attr->st_mode)){
+        entry->type = FLIB_DIR;
+    }
+    else{
+        entry->type = FLIB_UNSP;
+    }
+    entry->mod_time = attr->st_mtime;
+    entry->mod_time_nsec = flib_stat_mtime_nsec((*attr));
+    entry->change_time = attr->st_ctime;
+    entry->change_time_nsec = flib_stat_ctime_nsec((*attr));
+    entry->inode = (uint64_t) attr->st_ino;
+    entry->device = (uint64_t) attr->st_dev;
+    entry->mode = (uint32_t) attr->st_mode;
+}
+
+bool flib_dir_open(flib_dir *dir, const char *path)
+{
+    if (dir == NULL || path == NULL) return false;
+    TRACE_SCOPE("flib_dir_open", path);
+    size_t len = strlen(path);
+    while (len > 1 && (path[len-1] == '/' || path[len-1] == FLIB_PATH_SEP)) len--;
+    if (len >= sizeof(dir->path)) return false;
+    stats_count(STATS_SYS_OPEN, 1);
+    dir->handle = opendir(path);
+    if (dir->handle == NULL) return false;
+#ifdef _WIN32
+    dir->fd = -1;
+#else
+    dir->fd = dirfd(dir->handle);
+#endif // _WIN32
+    memcpy(dir->path, path, len);
+    dir->path[len] = '\0';
+    dir->path_len = len;
+    return true;
+}
+
+bool flib_dir_next(flib_dir *dir, flib_entry *entry)
+{
+    if (dir == NULL || dir->handle == NULL || entry == NULL) return false;
+    struct dirent *d_entry;
+    while ((d_entry = readdir(dir->handle)) != NULL){
+        const char *name = d_entry->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+        size_t name_len = strlen(name);
+        size_t sep_len = (dir->path[dir->path_len-1] == FLIB_PATH_SEP)? 0 : 1;
+        if (dir->path_len + sep_len + name_len >= sizeof(entry->path)){
+            eprintf("Path too long: '%s%c%s'!", dir->path, FLIB_PATH_SEP, name);
+            continue;
+        }
+        memcpy(entry->name, name, name_len+1);
+        memcpy(entry->path, dir->path, dir->path_len);
+        if (sep_len > 0) entry->path[dir->path_len] = FLIB_PATH_SEP;
+        memcpy(entry->path+dir->path_len+sep_len, name, name_len+1);
+        entry->size = 0;
+        entry->mod_time = 0;
+        entry->mod_time_nsec = 0;
+        entry->change_time = 0;
+        entry->change_time_nsec = 0;
+        entry->inode = (uint64_t) d_entry->d_ino;
+        entry->device = 0;
+        entry->mode = 0;
+        
+        struct stat attr;
+#ifdef _DIRENT_HAVE_D_TYPE
+        // only regular files and links need their metadata, everything else is known from the dirent
+        switch (d_entry->d_type){
+            case DT_DIR:{
+                entry->type = FLIB_DIR;
+                entry->mode = S_IFDIR;
+                return true;
+            }
+            case DT_REG:
+            case DT_LNK:
+            case DT_UNKNOWN: break;
+            default:{
+                entry->type = FLIB_UNSP;
+                return true;
+            }
+        }
+#endif // _DIRENT_HAVE_D_TYPE
+        stats_count(STATS_SYS_STAT, 1);
+#ifdef _WIN32
+        if (stat(entry->path, &attr) == -1){
+#else
+        if (fstatat(dir->fd, name, &attr, 0) == -1){
+#endif // _WIN32
+            eprintf("Could not access '%s': %s", entry->path, strerror(errno));
+            continue;
+        }
+        flib__entry_from_stat(entry, &attr);
+        return true;
+    }
+    return false;
+}
+
+bool flib_stat(const char *path, flib_entry *entry)
+{
+    if (path == NULL || entry == NULL) return false;
+    struct stat attr;
+    stats_count(STATS_SYS_STAT, 1);
+    if (stat(path, &attr) == -1) return false;
+    flib__entry_from_stat(entry, &attr);
+    return true;
+}
+
+bool flib_dir_stat(flib_dir *dir, const flib_entry *entry, flib_entry *attr)
+{
+    if (dir == NULL || entry == NULL || attr == NULL) return false;
+#ifdef _WIN32
+    return flib_stat(entry->path, attr);
+#else
+    struct stat st;
+    stats_count(STATS_SYS_STAT, 1);
+    // follows links like flib_dir_next, a linked directory is listed as the directory it points to
+    if (fstatat(dir->fd, entry->name, &st, 0) == -1) return false;
+    flib__entry_from_stat(attr, &st);
+    return true;
+#endif // _WIN32
+}
+
+bool flib_dir_readable(flib_dir *dir, const flib_entry *entry)
+{
+    if (dir == NULL || entry == NULL) return false;
+    stats_count(STATS_SYS_STAT, 1);
+#ifdef _WIN32
+    return access(entry->path, R_OK) == 0;
+#else
+    return faccessat(dir->fd, entry->name, R_OK, 0) == 0;
+#endif // _WIN32
+}
+
+void flib_dir_close(flib_dir *dir)
+{
+    if (dir == NULL || dir->handle == NULL) return;
+    closedir(dir->handle);
+    dir->handle = NULL;
+    dir->fd = -1;
+}
+
 fsize_t flib_dir_size(DIR *dir, const char *dir_path)
 {
     if (dir == NULL || dir_path == NULL) return FLIB_SIZE_ERROR;
@@ -11,6 +11,7 @@
 #include <flib.h>
 #include <threading.h>
 #include <message_queue.h>
+#include <progress.h>
 #include <theme.h>
 
 #include <raylib.h>
@@ -136,6 +137,8 @@ typedef struct{
     char msg[MAX_MSG_LEN];
     Log log;
     bool running;
+    progress_view progress;
+    char progress_text[MAX_MSG_LEN];
 } RunDialog;
 
 typedef struct{
@@ -647,10 +650,13 @@ void func_history_ask(void)
 void func_run_dialog_init(void)
 {
     RunDialog *rn = &state.run_dialog;
-    msgq_init();
+    msgq_init(0);
+    memset(&rn->progress, 0, sizeof(rn->progress));
+    rn->progress_text[0] = '\0';
+    // reset before the worker starts, a fast worker could finish before thread_create returns
+    atomic_store(&worker_done, false);
     thread_create(&rn->worker, rn->fn, &rn->args);
     state.run_dialog.running = true;
-    worker_done = false;
 }
 
 void func_run_dialog_exit(void)
@@ -670,11 +676,13 @@ void func_backup_dialog_create(void)
     RunDialog *rn = &state.run_dialog;
     normalize_path(bd->dest, bd->dest, sizeof(bd->dest));
     if (!flib_isdir(bd->dest)) return;
-    thread_args_t args;
+    thread_args_t args = {.backup_options = {.jobs = 1}, .merge_options = {.jobs = 1}};
     if (bd->is_backup){
         args.args[0] = bd->branch_name;
         args.args[1] = bd->dest;
         args.args[2] = bd->prev_enable && flib_isdir(bd->prev) ? bd->prev : NULL;
+        // the dialog has a progress bar, which is only useful with totals
+        args.backup_options.estimate = true;
         rn->fn = tbackup;
         rn->args = args;
     }else{
@@ -1257,15 +1265,15 @@ void dir_input_menu_layout()
 {
     FileDialog *fd = &state.file_dialog;
     if (fd->first_frame){
-        DIR *dir = opendir(fd->dir_path);
-        if (dir == NULL){
+        flib_dir dir;
+        if (!flib_dir_open(&dir, fd->dir_path)){
             func_toggle_scene((void*) SCENE_MAIN);
             eprintf("Invalid initial dir_path: '%s'!", fd->dir_path);
             return;
         }
         flib_entry entry;
         fd->items.count = 0;
-        while (flib_get_entry(dir, fd->dir_path, &entry)){
+        while (flib_dir_next(&dir, &entry)){
             if (entry.type == FLIB_DIR){
                 File file;
                 memcpy(file.path, entry.path, FILENAME_MAX);
@@ -1273,7 +1281,7 @@ void dir_input_menu_layout()
                 nob_da_append(&fd->items, file);
             }
         }
-        closedir(dir);
+        flib_dir_close(&dir);
         fd->first_frame = false;
     }
     CLAY({
@@ -1677,6 +1685,8 @@ void run_dialog_layout(void)
         while (msgq_pop(msg, sizeof(msg))){
             nob_da_append(&rn->log, strdup(msg));
         }
+        progress_sample(&rn->progress);
+        if (rn->progress.running) progress_format(&rn->progress, rn->progress_text, sizeof(rn->progress_text));
     }
     CLAY({
         .backgroundColor = state.theme.blur,
@@ -1725,6 +1735,22 @@ void run_dialog_layout(void)
                     .childGap = 4
                 }
             }){
+                CLAY({
+                    .backgroundColor = state.theme.secondary,
+                    .layout = {
+                        .sizing = {.width=CLAY_SIZING_FIXED(512), .height=CLAY_SIZING_FIXED(12)},
+                    },
+                }){
+                    CLAY({
+                        .backgroundColor = state.theme.accent,
+                        .layout = {
+                            .sizing = {.width=CLAY_SIZING_PERCENT(progress_fraction(&rn->progress)), .height=CLAY_SIZING_GROW()},
+                        },
+                    }){}
+                }
+                if (rn->progress_text[0] != '\0'){
+                    text_layout(clay_string(rn->progress_text), Font_MONO_12, 12, 0);
+                }
                 CLAY({
                     .backgroundColor = state.theme.background,
                     .layout = {
@@ -1755,8 +1781,21 @@ void run_dialog_layout(void)
                     }
                 }
             }
-            if (worker_done && rn->running){
+            if (atomic_load(&worker_done) && rn->running){
+                thread_join(rn->worker);
+                char msg[MAX_MSG_LEN];
+                while (msgq_pop(msg, sizeof(msg))){
+                    nob_da_append(&rn->log, strdup(msg));
+                }
+                size_t dropped = msgq_dropped();
+                if (dropped > 0){
+                    snprintf(msg, sizeof(msg), "[ERROR] %zu messages were dropped, the message queue was full!", dropped);
+                    nob_da_append(&rn->log, strdup(msg));
+                }
                 msgq_destroy();
+                // the bar and line show where the run ended
+                progress_sample(&rn->progress);
+                progress_format(&rn->progress, rn->progress_text, sizeof(rn->progress_text));
                 rn->running = false;
             }
             if (!rn->running){
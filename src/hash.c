@@ -0,0 +1,292 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <hash.h>
+#include <message_queue.h>
+
+#ifdef _WIN32
+    #define HASH_O_BINARY O_BINARY
+#else
+    #define HASH_O_BINARY 0
+#endif // _WIN32
+
+/* SHA-256 (FIPS 180-4) */
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define sha256_rotr(x, n) (((x) >> (n)) | ((x) << (32-(n))))
+
+static void hash_sha256_block(hash_sha256_t *ctx, const uint8_t *block)
+{
+    uint32_t w[64];
+    for (size_t i=0; i<16; ++i){
+        w[i] = (uint32_t) block[4*i] << 24 | (uint32_t) block[4*i+1] << 16 | (uint32_t) block[4*i+2] << 8 | block[4*i+3];
+    }
+    for (size_t i=16; i<64; ++i){
+        uint32_t s0 = sha256_rotr(w[i-15], 7) ^ sha256_rotr(w[i-15], 18) ^ (w[i-15] >> 3);
+        uint32_t s1 = sha256_rotr(w[i-2], 17) ^ sha256_rotr(w[i-2], 19) ^ (w[i-2] >> 10);
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+    uint32_t a = ctx->state[0], b = ctx->state[1], c = ctx->state[2], d = ctx->state[3];
+    uint32_t e = ctx->state[4], f = ctx->state[5], g = ctx->state[6], h = ctx->state[7];
+    for (size_t i=0; i<64; ++i){
+        uint32_t s1 = sha256_rotr(e, 6) ^ sha256_rotr(e, 11) ^ sha256_rotr(e, 25);
+        uint32_t ch = (e & f) ^ (~e & g);
+        uint32_t t1 = h + s1 + ch + sha256_k[i] + w[i];
+        uint32_t s0 = sha256_rotr(a, 2) ^ sha256_rotr(a, 13) ^ sha256_rotr(a, 22);
+        uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = s0 + maj;
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d;
+    ctx->state[4] += e; ctx->state[5] += f; ctx->state[6] += g; ctx->state[7] += h;
+}
+
+void hash_sha256_init(hash_sha256_t *ctx)
+{
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->length = 0;
+    ctx->block_len = 0;
+}
+
+void hash_sha256_update(hash_sha256_t *ctx, const void *data, size_t len)
+{
+    const uint8_t *bytes = data;
+    ctx->length += len;
+    if (ctx->block_len > 0){
+        size_t n = sizeof(ctx->block) - ctx->block_len;
+        if (n > len) n = len;
+        memcpy(ctx->block + ctx->block_len, bytes, n);
+        ctx->block_len += n;
+        bytes += n;
+        len -= n;
+        if (ctx->block_len < sizeof(ctx->block)) return;
+        hash_sha256_block(ctx, ctx->block);
+        ctx->block_len = 0;
+    }
+    while (len >= sizeof(ctx->block)){
+        hash_sha256_block(ctx, bytes);
+        bytes += sizeof(ctx->block);
+        len -= sizeof(ctx->block);
+    }
+    memcpy(ctx->block, bytes, len);
+    ctx->block_len = len;
+}
+
+void hash_sha256_final(hash_sha256_t *ctx, uint8_t digest[HASH_SHA256_SIZE])
+{
+    uint64_t bits = ctx->length * 8;
+    ctx->block[ctx->block_len++] = 0x80;
+    if (ctx->block_len > 56){
+        memset(ctx->block + ctx->block_len, 0, sizeof(ctx->block) - ctx->block_len);
+        hash_sha256_block(ctx, ctx->block);
+        ctx->block_len = 0;
+    }
+    memset(ctx->block + ctx->block_len, 0, 56 - ctx->block_len);
+    for (size_t i=0; i<8; ++i){
+        ctx->block[63-i] = (uint8_t) (bits >> (8*i));
+    }
+    hash_sha256_block(ctx, ctx->block);
+    for (size_t i=0; i<8; ++i){
+        digest[4*i] = (uint8_t) (ctx->state[i] >> 24);
+        digest[4*i+1] = (uint8_t) (ctx->state[i] >> 16);
+        digest[4*i+2] = (uint8_t) (ctx->state[i] >> 8);
+        digest[4*i+3] = (uint8_t) ctx->state[i];
+    }
+}
+
+void hash_sha256(const void *data, size_t len, uint8_t digest[HASH_SHA256_SIZE])
+{
+    hash_sha256_t ctx;
+    hash_sha256_init(&ctx);
+    hash_sha256_update(&ctx, data, len);
+    hash_sha256_final(&ctx, digest);
+}
+
+/* XXH64 (https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md) */
+
+#define XXH64_PRIME1 0x9E3779B185EBCA87ULL
+#define XXH64_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define XXH64_PRIME3 0x165667B19E3779F9ULL
+#define XXH64_PRIME4 0x85EBCA77C2B2AE63ULL
+#define XXH64_PRIME5 0x27D4EB2F165667C5ULL
+
+#define xxh64_rotl(x, n) (((x) << (n)) | ((x) >> (64-(n))))
+
+static inline uint64_t xxh64_read64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static inline uint32_t xxh64_read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+    acc += input*XXH64_PRIME2;
+    acc = xxh64_rotl(acc, 31);
+    return acc*XXH64_PRIME1;
+}
+
+static inline uint64_t xxh64_merge_round(uint64_t acc, uint64_t value)
+{
+    acc ^= xxh64_round(0, value);
+    return acc*XXH64_PRIME1 + XXH64_PRIME4;
+}
+
+// the four lanes are independent, so the stripes keep four multipliers busy at once
+static const uint8_t* xxh64_stripes(uint64_t acc[4], const uint8_t *p, const uint8_t *end)
+{
+    uint64_t a0 = acc[0], a1 = acc[1], a2 = acc[2], a3 = acc[3];
+    while (p+32 <= end){
+        a0 = xxh64_round(a0, xxh64_read64(p));
+        a1 = xxh64_round(a1, xxh64_read64(p+8));
+        a2 = xxh64_round(a2, xxh64_read64(p+16));
+        a3 = xxh64_round(a3, xxh64_read64(p+24));
+        p += 32;
+    }
+    acc[0] = a0; acc[1] = a1; acc[2] = a2; acc[3] = a3;
+    return p;
+}
+
+void hash_xxh64_init(hash_xxh64_t *ctx, uint64_t seed)
+{
+    ctx->acc[0] = seed + XXH64_PRIME1 + XXH64_PRIME2;
+    ctx->acc[1] = seed + XXH64_PRIME2;
+    ctx->acc[2] = seed;
+    ctx->acc[3] = seed - XXH64_PRIME1;
+    ctx->length = 0;
+    ctx->block_len = 0;
+}
+
+void hash_xxh64_update(hash_xxh64_t *ctx, const void *data, size_t len)
+{
+    const uint8_t *bytes = data;
+    const uint8_t *end = bytes + len;
+    ctx->length += len;
+    if (ctx->block_len > 0){
+        size_t n = sizeof(ctx->block) - ctx->block_len;
+        if (n > len) n = len;
+        memcpy(ctx->block + ctx->block_len, bytes, n);
+        ctx->block_len += n;
+        bytes += n;
+        if (ctx->block_len < sizeof(ctx->block)) return;
+        (void) xxh64_stripes(ctx->acc, ctx->block, ctx->block+sizeof(ctx->block));
+        ctx->block_len = 0;
+    }
+    bytes = xxh64_stripes(ctx->acc, bytes, end);
+    ctx->block_len = (size_t) (end-bytes);
+    memcpy(ctx->block, bytes, ctx->block_len);
+}
+
+uint64_t hash_xxh64_final(const hash_xxh64_t *ctx)
+{
+    uint64_t h;
+    if (ctx->length >= 32){
+        h = xxh64_rotl(ctx->acc[0], 1) + xxh64_rotl(ctx->acc[1], 7) + xxh64_rotl(ctx->acc[2], 12) + xxh64_rotl(ctx->acc[3], 18);
+        for (size_t i=0; i<4; ++i){
+            h = xxh64_merge_round(h, ctx->acc[i]);
+        }
+    } else{
+        // acc[2] still holds the seed
+        h = ctx->acc[2] + XXH64_PRIME5;
+    }
+    h += ctx->length;
+    const uint8_t *p = ctx->block;
+    const uint8_t *end = ctx->block + ctx->block_len;
+    while (p+8 <= end){
+        h ^= xxh64_round(0, xxh64_read64(p));
+        h = xxh64_rotl(h, 27)*XXH64_PRIME1 + XXH64_PRIME4;
+        p += 8;
+    }
+    if (p+4 <= end){
+        h ^= (uint64_t) xxh64_read32(p)*XXH64_PRIME1;
+        h = xxh64_rotl(h, 23)*XXH64_PRIME2 + XXH64_PRIME3;
+        p += 4;
+    }
+    while (p < end){
+        h ^= (*p++)*XXH64_PRIME5;
+        h = xxh64_rotl(h, 11)*XXH64_PRIME1;
+    }
+    h ^= h >> 33;
+    h *= XXH64_PRIME2;
+    h ^= h >> 29;
+    h *= XXH64_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+uint64_t hash_xxh64(const void *data, size_t len, uint64_t seed)
+{
+    hash_xxh64_t ctx;
+    hash_xxh64_init(&ctx, seed);
+    hash_xxh64_update(&ctx, data, len);
+    return hash_xxh64_final(&ctx);
+}
+
+bool hash_xxh64_file(const char *path, uint64_t *hash)
+{
+    int fd = open(path, O_RDONLY | HASH_O_BINARY);
+    if (fd < 0){
+        eprintf("Could not open '%s': %s!", path, strerror(errno));
+        return false;
+    }
+    uint8_t *buffer = malloc(HASH_FILE_BUFFER_SIZE);
+    assert(buffer != NULL && "Buy more RAM lol");
+    hash_xxh64_t ctx;
+    hash_xxh64_init(&ctx, 0);
+    bool result = true;
+    while (true){
+        ssize_t n = read(fd, buffer, HASH_FILE_BUFFER_SIZE);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0){
+            eprintf("Could not read '%s': %s!", path, strerror(errno));
+            result = false;
+            break;
+        }
+        if (n == 0) break;
+        hash_xxh64_update(&ctx, buffer, (size_t) n);
+    }
+    if (result) *hash = hash_xxh64_final(&ctx);
+    free(buffer);
+    close(fd);
+    return result;
+}
+
+void hash_to_hex(const uint8_t *bytes, size_t len, char *buffer)
+{
+    static const char digits[] = "0123456789abcdef";
+    for (size_t i=0; i<len; ++i){
+        buffer[2*i] = digits[bytes[i] >> 4];
+        buffer[2*i+1] = digits[bytes[i] & 0xf];
+    }
+    buffer[2*len] = '\0';
+}
@@ -0,0 +1,464 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifndef _WIN32
+    #include <sys/mman.h>
+#endif // _WIN32
+
+#include <manifest.h>
+#include <change.h>
+#include <cwalk.h>
+#include <cson.h>
+#include <flib.h>
+#include <message_queue.h>
+#include <trace.h>
+
+#define MANIFEST_WRITE_BUFFER (1024*1024)
+
+int manifest_path_cmp(const char *a, size_t a_len, const char *b, size_t b_len)
+{
+    // '/' sorts before every other byte so that a directory is directly followed by its subtree
+    size_t len = a_len < b_len? a_len : b_len;
+    for (size_t i=0; i<len; ++i){
+        if (a[i] == b[i]) continue;
+        if (a[i] == '/') return -1;
+        if (b[i] == '/') return 1;
+        return (unsigned char) a[i] < (unsigned char) b[i]? -1 : 1;
+    }
+    if (a_len == b_len) return 0;
+    return a_len < b_len? -1 : 1;
+}
+
+// a backup made before the binary manifest: a json info file in every directory, unchanged files only live in a parent
+typedef struct{
+    const manifest_t *parent; // NULL for a full backup
+    manifest_items items;
+} manifest_legacy;
+
+static bool manifest_legacy_dir(manifest_legacy *legacy, const char *dir_path, const char *rel)
+{
+    char info_path[FILENAME_MAX] = {0};
+    cwk_path_join(dir_path, INFO_FILE, info_path, sizeof(info_path));
+    Cson *info = flib_isfile(info_path)? cson_read(info_path) : NULL;
+    Cson *files = cson_map_get(info, cson_str("files"));
+    Cson *dirs = cson_map_get(info, cson_str("dirs"));
+    if (!cson_is_map(files) || !cson_is_map(dirs)){
+        eprintf("Invalid backup info file '%s'!", info_path);
+        return false;
+    }
+    char item_path[FILENAME_MAX] = {0};
+    char item_rel[FILENAME_MAX] = {0};
+    flib_entry entry;
+    Cson *names = cson_map_keys(files);
+    for (size_t i=0; i<cson_len(names); ++i){
+        char *name = cson_get_string(cson_array_get(names, i)).value;
+        cwk_path_join(dir_path, name, item_path, sizeof(item_path));
+        snprintf(item_rel, sizeof(item_rel), "%s/%s", rel, name);
+        manifest_entry item = {.type = MANIFEST_TYPE_FILE, .state = MANIFEST_NEW};
+        // -1: deleted, otherwise the file is stored here or, if it was unchanged, in a parent
+        if (cson_get_int(cson_map_get(files, cson_str(name))) < 0){
+            item.state = MANIFEST_DELETED;
+        } else if (flib_stat(item_path, &entry) && entry.type != FLIB_DIR){
+            change_entry_from_stat(&item, &entry);
+        } else{
+            uint32_t index = legacy->parent != NULL? manifest_find(legacy->parent, item_rel, strlen(item_rel)) : MANIFEST_NONE;
+            if (index == MANIFEST_NONE || legacy->parent->entries[index].type != MANIFEST_TYPE_FILE || legacy->parent->entries[index].state == MANIFEST_DELETED){
+                eprintf("Could not find any version of '%s'!", item_path);
+                return false;
+            }
+            const manifest_entry *stored = &legacy->parent->entries[index];
+            item = *stored;
+            item.state = MANIFEST_UNCHANGED;
+            item.source = stored->state == MANIFEST_UNCHANGED && !(legacy->parent->header->flags & MANIFEST_FLAG_FULL)? stored->source+1 : 1;
+        }
+        manifest_items_push(&legacy->items, item_rel, item);
+    }
+    names = cson_map_keys(dirs);
+    for (size_t i=0; i<cson_len(names); ++i){
+        char *name = cson_get_string(cson_array_get(names, i)).value;
+        cwk_path_join(dir_path, name, item_path, sizeof(item_path));
+        snprintf(item_rel, sizeof(item_rel), "%s/%s", rel, name);
+        // -1: deleted, 1: also in the parent, 0: new
+        int64_t state = cson_get_int(cson_map_get(dirs, cson_str(name)));
+        manifest_entry item = {.type = MANIFEST_TYPE_DIR, .state = state < 0? MANIFEST_DELETED : state > 0? MANIFEST_UNCHANGED : MANIFEST_NEW};
+        if (state >= 0 && flib_stat(item_path, &entry)) change_entry_from_stat(&item, &entry);
+        manifest_items_push(&legacy->items, item_rel, item);
+        if (state >= 0 && !manifest_legacy_dir(legacy, item_path, item_rel)) return false;
+    }
+    return true;
+}
+
+// writes the manifest of a legacy backup, its parent is converted first
+static bool manifest_convert_legacy(const char *backup_path, const char *info_path)
+{
+    bool result = true;
+    manifest_t parent = {0};
+    manifest_legacy legacy = {0};
+    manifest_builder_t builder;
+    manifest_builder_init(&builder);
+    CsonArena arena = {0};
+    CsonArena *prev_arena = cson_current_arena;
+    cson_swap_arena(&arena);
+    iprintf("Converting backup '%s' of an older version..", backup_path);
+
+    Cson *info = cson_read((char*) info_path);
+    const char *parent_path = cson_get_cstring(info, key("parent"));
+    if (parent_path != NULL){
+        if (!manifest_open(&parent, parent_path)){
+            result = false;
+            goto defer;
+        }
+        legacy.parent = &parent;
+    } else{
+        builder.flags |= MANIFEST_FLAG_FULL;
+    }
+    // the backup started at "created", files modified since then count as changed (see change.h)
+    struct tm created = {.tm_isdst = -1};
+    const char *created_string = cson_get_cstring(info, key("created"));
+    if (created_string != NULL && sscanf(created_string, "%d/%d/%d %d:%d:%d", &created.tm_year, &created.tm_mon, &created.tm_mday,
+                                         &created.tm_hour, &created.tm_min, &created.tm_sec) == 6){
+        created.tm_year -= 1900;
+        created.tm_mon -= 1;
+        time_t scan_time = mktime(&created);
+        if (scan_time != (time_t) -1) builder.scan_time = (int64_t) scan_time;
+    }
+
+    flib_dir dir;
+    if (!flib_dir_open(&dir, backup_path)){
+        result = false;
+        goto defer;
+    }
+    flib_entry entry;
+    while (result && flib_dir_next(&dir, &entry)){
+        if (entry.type != FLIB_DIR) continue;
+        manifest_entry item = {
+            .type = MANIFEST_TYPE_DIR,
+            .state = legacy.parent != NULL && manifest_find(legacy.parent, entry.name, strlen(entry.name)) != MANIFEST_NONE? MANIFEST_UNCHANGED : MANIFEST_NEW,
+        };
+        flib_entry dir_attr;
+        if (flib_dir_stat(&dir, &entry, &dir_attr)) change_entry_from_stat(&item, &dir_attr);
+        manifest_items_push(&legacy.items, entry.name, item);
+        result = manifest_legacy_dir(&legacy, entry.path, entry.name);
+    }
+    flib_dir_close(&dir);
+    manifest_builder_append(&builder, &legacy.items);
+    if (result) result = manifest_builder_write(&builder, backup_path, parent_path);
+
+  defer:
+    if (!result) eprintf("Could not convert backup '%s' of an older version, make a new backup without a parent instead!", backup_path);
+    manifest_items_free(&legacy.items);
+    manifest_builder_free(&builder);
+    manifest_close(&parent);
+    cson_swap_and_free_arena(prev_arena);
+    return result;
+}
+
+bool manifest_open(manifest_t *manifest, const char *backup_path)
+{
+    if (manifest == NULL || backup_path == NULL) return false;
+    TRACE_SCOPE("manifest_open", backup_path);
+    memset(manifest, 0, sizeof(*manifest));
+    char path[FILENAME_MAX] = {0};
+    cwk_path_join(backup_path, MANIFEST_FILE, path, sizeof(path));
+    int fd = open(path, O_RDONLY);
+    char info_path[FILENAME_MAX] = {0};
+    cwk_path_join(backup_path, INFO_FILE, info_path, sizeof(info_path));
+    // backups of versions without a manifest only have their json info files, they are converted once
+    if (fd < 0 && errno == ENOENT && flib_isfile(info_path)){
+        if (!manifest_convert_legacy(backup_path, info_path)) return false;
+        fd = open(path, O_RDONLY);
+    }
+    if (fd < 0){
+        eprintf("Could not open manifest '%s': %s!", path, strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(manifest_header)){
+        eprintf("Invalid manifest '%s'!", path);
+        close(fd);
+        return false;
+    }
+    manifest->size = (size_t) st.st_size;
+#ifndef _WIN32
+    manifest->data = mmap(NULL, manifest->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (manifest->data == MAP_FAILED){
+        eprintf("Could not map manifest '%s': %s!", path, strerror(errno));
+        manifest->data = NULL;
+        close(fd);
+        return false;
+    }
+    manifest->mapped = true;
+#else
+    manifest->data = malloc(manifest->size);
+    assert(manifest->data != NULL && "Buy more RAM lol");
+    size_t total = 0;
+    while (total < manifest->size){
+        int n = read(fd, (char*) manifest->data + total, manifest->size - total);
+        if (n <= 0) break;
+        total += n;
+    }
+    if (total != manifest->size){
+        eprintf("Could not read manifest '%s'!", path);
+        free(manifest->data);
+        manifest->data = NULL;
+        close(fd);
+        return false;
+    }
+#endif // _WIN32
+    close(fd);
+    
+    const manifest_header *header = manifest->data;
+    if (memcmp(header->magic, MANIFEST_MAGIC, sizeof(MANIFEST_MAGIC)) != 0 || header->version != MANIFEST_VERSION){
+        eprintf("Unsupported manifest '%s'!", path);
+        manifest_close(manifest);
+        return false;
+    }
+    uint64_t entries_end = sizeof(manifest_header) + header->entry_count*sizeof(manifest_entry);
+    uint64_t chunks_end = header->chunks_offset + header->chunk_count*sizeof(chunk_id);
+    if (header->entry_count >= MANIFEST_NONE || entries_end > manifest->size || header->strings_offset < entries_end || header->strings_offset + header->strings_size > manifest->size
+        || (header->chunk_count > 0 && (header->chunks_offset < entries_end || chunks_end > header->strings_offset))){
+        eprintf("Corrupted manifest '%s'!", path);
+        manifest_close(manifest);
+        return false;
+    }
+    manifest->header = header;
+    manifest->entries = (const manifest_entry*) (header+1);
+    manifest->chunks = (const chunk_id*) ((const char*) manifest->data + header->chunks_offset);
+    manifest->strings = (const char*) manifest->data + header->strings_offset;
+    manifest->count = (uint32_t) header->entry_count;
+    return true;
+}
+
+void manifest_close(manifest_t *manifest)
+{
+    if (manifest == NULL || manifest->data == NULL) return;
+#ifndef _WIN32
+    if (manifest->mapped){
+        munmap(manifest->data, manifest->size);
+    } else{
+        free(manifest->data);
+    }
+#else
+    free(manifest->data);
+#endif // _WIN32
+    memset(manifest, 0, sizeof(*manifest));
+}
+
+uint32_t manifest_find(const manifest_t *manifest, const char *path, size_t path_len)
+{
+    if (manifest == NULL || manifest->data == NULL || path == NULL) return MANIFEST_NONE;
+    uint32_t low = 0;
+    uint32_t high = manifest->count;
+    while (low < high){
+        uint32_t mid = low + (high-low)/2;
+        const manifest_entry *entry = &manifest->entries[mid];
+        int cmp = manifest_path_cmp(manifest->strings + entry->path_offset, entry->path_len, path, path_len);
+        if (cmp == 0) return mid;
+        if (cmp < 0){
+            low = mid+1;
+        } else{
+            high = mid;
+        }
+    }
+    return MANIFEST_NONE;
+}
+
+const char* manifest_path(const manifest_t *manifest, uint32_t index)
+{
+    if (manifest == NULL || index >= manifest->count) return NULL;
+    return manifest->strings + manifest->entries[index].path_offset;
+}
+
+const char* manifest_name(const manifest_t *manifest, uint32_t index)
+{
+    const char *path = manifest_path(manifest, index);
+    if (path == NULL) return NULL;
+    const char *sep = strrchr(path, '/');
+    return sep == NULL? path : sep+1;
+}
+
+const char* manifest_parent_backup(const manifest_t *manifest)
+{
+    if (manifest == NULL || manifest->header == NULL) return NULL;
+    if (manifest->header->parent_offset == MANIFEST_NO_OFFSET) return NULL;
+    return manifest->strings + manifest->header->parent_offset;
+}
+
+const chunk_id* manifest_chunks(const manifest_t *manifest, uint32_t index)
+{
+    if (manifest == NULL || index >= manifest->count) return NULL;
+    const manifest_entry *entry = &manifest->entries[index];
+    if (entry->chunk_count == 0 || entry->chunk_index + entry->chunk_count > manifest->header->chunk_count) return NULL;
+    return manifest->chunks + entry->chunk_index;
+}
+
+manifest_item* manifest_items_push(manifest_items *items, const char *path, manifest_entry entry)
+{
+    if (items->count >= items->capacity){
+        items->capacity = items->capacity == 0? 64 : items->capacity*2;
+        items->items = realloc(items->items, items->capacity*sizeof(*items->items));
+        assert(items->items != NULL && "Buy more RAM lol");
+    }
+    entry.path_len = (uint32_t) strlen(path);
+    entry.chunk_count = 0;
+    items->items[items->count] = (manifest_item) {.path=strdup(path), .entry=entry};
+    return &items->items[items->count++];
+}
+
+void manifest_item_set_chunks(manifest_item *item, const chunk_id *chunks, size_t count)
+{
+    free(item->chunks);
+    item->chunks = NULL;
+    item->entry.chunk_count = (uint32_t) count;
+    if (count == 0) return;
+    item->chunks = malloc(count*sizeof(*chunks));
+    assert(item->chunks != NULL && "Buy more RAM lol");
+    memcpy(item->chunks, chunks, count*sizeof(*chunks));
+}
+
+void manifest_items_free(manifest_items *items)
+{
+    if (items == NULL) return;
+    for (size_t i=0; i<items->count; ++i){
+        free(items->items[i].path);
+        free(items->items[i].chunks);
+    }
+    free(items->items);
+    memset(items, 0, sizeof(*items));
+}
+
+void manifest_builder_init(manifest_builder_t *builder)
+{
+    memset(builder, 0, sizeof(*builder));
+    mutex_init(&builder->lock);
+}
+
+void manifest_builder_append(manifest_builder_t *builder, manifest_items *items)
+{
+    if (builder == NULL || items == NULL || items->count == 0) return;
+    mutex_lock(&builder->lock);
+    manifest_items *dest = &builder->items;
+    if (dest->count + items->count > dest->capacity){
+        size_t capacity = dest->capacity == 0? 64 : dest->capacity;
+        while (capacity < dest->count + items->count) capacity *= 2;
+        dest->items = realloc(dest->items, capacity*sizeof(*dest->items));
+        assert(dest->items != NULL && "Buy more RAM lol");
+        dest->capacity = capacity;
+    }
+    memcpy(dest->items + dest->count, items->items, items->count*sizeof(*items->items));
+    dest->count += items->count;
+    mutex_unlock(&builder->lock);
+    // the builder owns the paths now
+    free(items->items);
+    memset(items, 0, sizeof(*items));
+}
+
+static int manifest_item_cmp(const void *a, const void *b)
+{
+    const manifest_item *ia = a;
+    const manifest_item *ib = b;
+    return manifest_path_cmp(ia->path, ia->entry.path_len, ib->path, ib->entry.path_len);
+}
+
+static bool manifest_is_within(const manifest_item *dir, const manifest_item *item)
+{
+    uint32_t len = dir->entry.path_len;
+    return item->entry.path_len > len && memcmp(dir->path, item->path, len) == 0 && item->path[len] == '/';
+}
+
+bool manifest_builder_write(manifest_builder_t *builder, const char *backup_path, const char *parent_backup)
+{
+    if (builder == NULL || backup_path == NULL) return false;
+    TRACE_SCOPE("manifest_write", backup_path);
+    manifest_items *items = &builder->items;
+    if (items->count >= MANIFEST_NONE){
+        eprintf("Too many entries for a manifest: %zu!", items->count);
+        return false;
+    }
+    qsort(items->items, items->count, sizeof(*items->items), manifest_item_cmp);
+    
+    // link every entry to its directory and every directory to the end of its subtree
+    uint32_t *stack = malloc((items->count+1)*sizeof(uint32_t));
+    assert(stack != NULL && "Buy more RAM lol");
+    size_t depth = 0;
+    uint64_t strings_size = parent_backup != NULL? strlen(parent_backup)+1 : 0;
+    uint64_t chunk_count = 0;
+    for (size_t i=0; i<items->count; ++i){
+        manifest_item *item = &items->items[i];
+        while (depth > 0 && !manifest_is_within(&items->items[stack[depth-1]], item)){
+            items->items[stack[--depth]].entry.next = (uint32_t) i;
+        }
+        item->entry.parent = depth > 0? stack[depth-1] : MANIFEST_NONE;
+        item->entry.next = (uint32_t) i+1;
+        item->entry.path_offset = strings_size;
+        strings_size += item->entry.path_len+1;
+        item->entry.chunk_index = chunk_count;
+        chunk_count += item->entry.chunk_count;
+        if (item->entry.type == MANIFEST_TYPE_DIR) stack[depth++] = (uint32_t) i;
+    }
+    while (depth > 0){
+        items->items[stack[--depth]].entry.next = (uint32_t) items->count;
+    }
+    free(stack);
+    
+    manifest_header header = {0};
+    memcpy(header.magic, MANIFEST_MAGIC, sizeof(MANIFEST_MAGIC));
+    header.version = MANIFEST_VERSION;
+    header.flags = builder->flags;
+    header.scan_time = builder->scan_time;
+    header.scan_time_nsec = builder->scan_time_nsec;
+    header.compression = builder->compression;
+    header.compression_level = builder->compression_level;
+    header.entry_count = items->count;
+    header.chunks_offset = sizeof(header) + items->count*sizeof(manifest_entry);
+    header.chunk_count = chunk_count;
+    header.strings_offset = header.chunks_offset + chunk_count*sizeof(chunk_id);
+    header.strings_size = strings_size;
+    header.parent_offset = parent_backup != NULL? 0 : MANIFEST_NO_OFFSET;
+    
+    char path[FILENAME_MAX] = {0};
+    char temp_path[FILENAME_MAX] = {0};
+    cwk_path_join(backup_path, MANIFEST_FILE, path, sizeof(path));
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    FILE *file = fopen(temp_path, "wb");
+    if (file == NULL){
+        eprintf("Could not create manifest '%s': %s!", temp_path, strerror(errno));
+        return false;
+    }
+    char *buffer = malloc(MANIFEST_WRITE_BUFFER);
+    if (buffer != NULL) setvbuf(file, buffer, _IOFBF, MANIFEST_WRITE_BUFFER);
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    for (size_t i=0; ok && i<items->count; ++i){
+        ok = fwrite(&items->items[i].entry, sizeof(manifest_entry), 1, file) == 1;
+    }
+    for (size_t i=0; ok && i<items->count; ++i){
+        uint32_t count = items->items[i].entry.chunk_count;
+        if (count > 0) ok = fwrite(items->items[i].chunks, sizeof(chunk_id), count, file) == count;
+    }
+    if (ok && parent_backup != NULL){
+        ok = fwrite(parent_backup, strlen(parent_backup)+1, 1, file) == 1;
+    }
+    for (size_t i=0; ok && i<items->count; ++i){
+        ok = fwrite(items->items[i].path, items->items[i].entry.path_len+1, 1, file) == 1;
+    }
+    ok = (fclose(file) == 0) && ok;
+    free(buffer);
+    if (!ok || rename(temp_path, path) != 0){
+        eprintf("Could not write manifest '%s': %s!", path, strerror(errno));
+        unlink(temp_path);
+        return false;
+    }
+    return true;
+}
+
+void manifest_builder_free(manifest_builder_t *builder)
+{
+    if (builder == NULL) return;
+    manifest_items_free(&builder->items);
+    mutex_destroy(&builder->lock);
+}
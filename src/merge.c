@@ -1,5 +1,7 @@
 #include <stdbool.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
 
 #define NOB_NO_MINIRENT
 #define NOB_STRIP_PREFIX
@@ -10,209 +12,777 @@
 #include <cson.h>
 #include <cwalk.h>
 #include <flib.h>
+#include <manifest.h>
+#include <chunk.h>
+#include <delta.h>
+#include <pool.h>
+#include <uring.h>
+#include <pack.h>
+#include <compress.h>
+#include <tar.h>
+#include <stats.h>
+#include <progress.h>
+#include <trace.h>
 
+#define MERGE_PACK_BATCH_FILES 1024
 
 
-int merge_rec(const char *src, const char *dest, Cson *files, Cson *dirs)
+
+bool merge_open_chunks(const char *backup, chunk_store_t *store)
 {
-    DIR *dir = opendir(src);
-    if (dir == NULL){
-        eprintf("Invalid src directory: '%s'!", src);
-        return 1;
-    }
-    if (!flib_isdir(dest)){
-        eprintf("Invalid dest directory: '%s'!", dest);
-        closedir(dir);
-        return 1;
+    // the chunk store lives next to the backups of a destination
+    char dest[FILENAME_MAX] = ".";
+    (void) get_parent_dir(backup, dest, sizeof(dest));
+    return chunk_store_open(store, dest, false);
+}
+
+bool merge_restore_chunks(chunk_store_t *store, const manifest_t *manifest, uint32_t index, const char *dest)
+{
+    const manifest_entry *entry = &manifest->entries[index];
+    const chunk_id *chunks = manifest_chunks(manifest, index);
+    if (entry->chunk_count > 0 && chunks == NULL){
+        eprintf("Invalid chunk list for '%s'!", manifest_path(manifest, index));
+        return false;
     }
-    
-    int result = 0;
-    
-    char info_path[FILENAME_MAX] = {0};
-    cwk_path_join(src, INFO_FILE, info_path, FILENAME_MAX);
-    Cson *info = cson_read(info_path);
-    if (info == NULL){
-        eprintf("Could not find backup info file '%s'!", info_path);
-        return_defer(1);
+    if (!chunk_store_restore_file(store, chunks, entry->chunk_count, dest)) return false;
+    (void) flib_set_attributes(dest, entry->mode, (time_t) entry->mod_time, (long) entry->mod_time_nsec);
+    return true;
+}
+
+// every backup of the chain, [0] is the merged backup, each following one is the parent of the previous
+typedef struct{
+    manifest_t *manifests;
+    char **paths;
+    chunk_store_t *stores;
+    bool *stores_open;
+    size_t count;
+} merge_chain;
+
+// one entry of the plan: the merged entry, where its content is stored and the root it belongs to
+typedef struct{
+    uint32_t target;
+    uint32_t level;
+    uint32_t index;
+    uint32_t root;
+    uint32_t segment; // MANIFEST_NONE unless the content is packed
+    uint64_t offset;
+} merge_step;
+
+typedef struct{
+    merge_step *items;
+    size_t count;
+    size_t capacity;
+} merge_plan;
+
+// a top level directory of the backup, it is removed again if any of its files could not be restored
+typedef struct{
+    uint32_t entry;
+    atomic_bool failed;
+} merge_root;
+
+typedef struct{
+    merge_options_t options;
+    const char *dest;
+    merge_chain chain;
+    merge_root *roots;
+    size_t root_count;
+    merge_plan dirs;  // created while planning, their attributes are applied after every file is restored
+    merge_plan files; // restored by the pool in any order
+    size_t packed;    // files of the plan that are stored in segments
+    pool_t pool;
+    uring_t *rings; // one per worker, only set up for --uring
+    stats_t stats;
+} merge_run;
+
+typedef enum{
+    MERGE_JOB_STEP,  // a single file
+    MERGE_JOB_URING, // small files that are plain copies, with --uring
+    MERGE_JOB_PACK,  // packed files of one segment, in the order they are stored
+} merge_job_kind;
+
+typedef struct{
+    merge_run *run;
+    const merge_step *steps;
+    size_t count;
+    merge_job_kind kind;
+} merge_job;
+
+void merge_close_chain(merge_chain *chain)
+{
+    for (size_t i=0; i<chain->count; ++i){
+        manifest_close(&chain->manifests[i]);
+        free(chain->paths[i]);
     }
-    
-    if (files == NULL){
-        files = cson_map_get(info, cson_str("files"));
-        if (files == NULL){
-            eprintf("Could not find a 'files' entry in backup info file '%s'!", info_path);
-            return_defer(1);
+    free(chain->manifests);
+    free(chain->paths);
+    free(chain->stores);
+    free(chain->stores_open);
+    memset(chain, 0, sizeof(*chain));
+}
+
+// loads every manifest of the chain once, a deduplicated backup or a full one without patches ends it
+bool merge_open_chain(merge_chain *chain, const char *backup)
+{
+    TRACE_SCOPE("merge_open_chain", backup);
+    memset(chain, 0, sizeof(*chain));
+    char path[FILENAME_MAX] = {0};
+    snprintf(path, sizeof(path), "%s", backup);
+    while (true){
+        chain->manifests = realloc(chain->manifests, (chain->count+1)*sizeof(*chain->manifests));
+        chain->paths = realloc(chain->paths, (chain->count+1)*sizeof(*chain->paths));
+        assert(chain->manifests != NULL && chain->paths != NULL && "Buy more RAM lol");
+        manifest_t *manifest = &chain->manifests[chain->count];
+        if (!manifest_open(manifest, path)){
+            merge_close_chain(chain);
+            return false;
         }
+        chain->paths[chain->count++] = strdup(path);
+        const char *parent = manifest_parent_backup(manifest);
+        uint32_t flags = manifest->header->flags;
+        // the patches of a full backup are based on its parent
+        if (parent == NULL || (flags & MANIFEST_FLAG_CHUNKED) || ((flags & MANIFEST_FLAG_FULL) && !(flags & MANIFEST_FLAG_DELTA))) break;
+        snprintf(path, sizeof(path), "%s", parent);
     }
-    if (dirs == NULL){
-        dirs = cson_map_get(info, cson_str("dirs"));
-        if (dirs == NULL){
-            eprintf("Could not find a 'dirs' entry in backup info file '%s'!", info_path);
-            return_defer(1);
+    chain->stores = calloc(chain->count, sizeof(*chain->stores));
+    chain->stores_open = calloc(chain->count, sizeof(*chain->stores_open));
+    assert(chain->stores != NULL && chain->stores_open != NULL && "Buy more RAM lol");
+    return true;
+}
+
+// finds the backup that stores the content of a file, a single lookup thanks to entry.source
+bool merge_resolve(const merge_chain *chain, uint32_t target, merge_step *step)
+{
+    const manifest_t *manifest = &chain->manifests[0];
+    const manifest_entry *entry = &manifest->entries[target];
+    step->target = target;
+    step->level = 0;
+    step->index = target;
+    if (entry->state != MANIFEST_UNCHANGED || (manifest->header->flags & (MANIFEST_FLAG_FULL | MANIFEST_FLAG_CHUNKED))) return true;
+    const char *path = manifest_path(manifest, target);
+    if (entry->source == 0 || entry->source >= chain->count){
+        eprintf("Could not find any version of '%s'!", path);
+        return false;
+    }
+    const manifest_t *owner = &chain->manifests[entry->source];
+    uint32_t index = manifest_find(owner, path, entry->path_len);
+    if (index == MANIFEST_NONE || owner->entries[index].type != MANIFEST_TYPE_FILE || owner->entries[index].state == MANIFEST_DELETED){
+        eprintf("Could not find any version of '%s'!", path);
+        return false;
+    }
+    step->level = entry->source;
+    step->index = index;
+    return true;
+}
+
+bool merge_open_store(merge_chain *chain, uint32_t level)
+{
+    if (!(chain->manifests[level].header->flags & MANIFEST_FLAG_CHUNKED) || chain->stores_open[level]) return true;
+    if (!merge_open_chunks(chain->paths[level], &chain->stores[level])) return false;
+    chain->stores_open[level] = true;
+    return true;
+}
+
+// chunk stores are opened while planning, so the workers only ever read them
+bool merge_prepare_step(merge_chain *chain, const merge_step *step)
+{
+    // the base of a patch can be in any older backup, only the last one of a chain is ever deduplicated
+    if (chain->manifests[step->level].entries[step->index].state == MANIFEST_DELTA && !merge_open_store(chain, chain->count-1)) return false;
+    return merge_open_store(chain, step->level);
+}
+
+// finds the backup of the chain that stores path as of the backup at *level
+bool merge_locate(const merge_chain *chain, uint32_t *level, const char *path, uint32_t *index)
+{
+    const manifest_t *manifest = &chain->manifests[*level];
+    *index = manifest_find(manifest, path, strlen(path));
+    const manifest_entry *entry = *index != MANIFEST_NONE? &manifest->entries[*index] : NULL;
+    if (entry != NULL && entry->state == MANIFEST_UNCHANGED && !(manifest->header->flags & (MANIFEST_FLAG_FULL | MANIFEST_FLAG_CHUNKED))){
+        if (entry->source == 0 || *level + entry->source >= chain->count){
+            entry = NULL;
+        } else{
+            *level += entry->source;
+            manifest = &chain->manifests[*level];
+            *index = manifest_find(manifest, path, strlen(path));
+            entry = *index != MANIFEST_NONE? &manifest->entries[*index] : NULL;
         }
     }
-    
-    const char *parent = cson_get_cstring(info, key("parent"));
-    
-    flib_entry entry;
+    if (entry == NULL || entry->type != MANIFEST_TYPE_FILE || entry->state == MANIFEST_DELETED){
+        eprintf("Could not find any version of '%s'!", path);
+        return false;
+    }
+    return true;
+}
+
+bool merge_delta(const merge_chain *chain, uint32_t level, uint32_t index, const char *dest);
+
+// finds the content of a file as of the backup at level: a stored copy is used in place, anything else is rebuilt into tmp
+bool merge_file_version(const merge_chain *chain, uint32_t level, const char *path, const char *tmp, char *out, size_t out_size)
+{
+    uint32_t index;
+    if (!merge_locate(chain, &level, path, &index)) return false;
+    const manifest_t *owner = &chain->manifests[level];
+    const manifest_entry *entry = &owner->entries[index];
+    const char *backup = chain->paths[level];
+    snprintf(out, out_size, "%s", tmp);
+    if (owner->header->flags & MANIFEST_FLAG_CHUNKED){
+        return merge_restore_chunks(&chain->stores[level], owner, index, tmp);
+    }
+    if (entry->state == MANIFEST_DELTA){
+        return merge_delta(chain, level, index, tmp);
+    }
+    if (entry->flags & MANIFEST_ENTRY_PACKED){
+        int fd = pack_segment_open(backup, entry->segment);
+        bool result = fd >= 0 && pack_extract(fd, entry->pack_offset, entry->size, tmp);
+        if (fd >= 0) close(fd);
+        return result;
+    }
+    char stored[FILENAME_MAX] = {0};
+    cwk_path_join(backup, path, stored, sizeof(stored));
+    if (entry->flags & MANIFEST_ENTRY_COMPRESSED) return decompress_file(stored, tmp);
+    snprintf(out, out_size, "%s", stored);
+    return true;
+}
+
+// a patch is applied to the previous version of the file, which may itself be a patch
+bool merge_delta(const merge_chain *chain, uint32_t level, uint32_t index, const char *dest)
+{
+    TRACE_SCOPE("merge_delta", dest);
+    const manifest_t *manifest = &chain->manifests[level];
+    const char *path = manifest_path(manifest, index);
+    if (level+1 >= chain->count){
+        eprintf("Patch for '%s' has no parent backup!", path);
+        return false;
+    }
+    char patch[FILENAME_MAX] = {0};
+    char tmp[FILENAME_MAX] = {0};
+    char base[FILENAME_MAX] = {0};
+    if (!delta_path(chain->paths[level], path, DELTA_PATCH_SUFFIX, false, patch, sizeof(patch))) return false;
+    snprintf(tmp, sizeof(tmp), "%s.base", dest);
+    bool result = merge_file_version(chain, level+1, path, tmp, base, sizeof(base)) && delta_apply(base, patch, dest);
+    if (strcmp(base, tmp) == 0) (void) remove(tmp);
+    if (result){
+        const manifest_entry *entry = &manifest->entries[index];
+        (void) flib_set_attributes(dest, entry->mode, (time_t) entry->mod_time, (long) entry->mod_time_nsec);
+    }
+    return result;
+}
+
+// creates the directories of a root and collects its files into the plan
+int merge_plan_root(merge_run *run, uint32_t slot)
+{
+    const manifest_t *manifest = &run->chain.manifests[0];
+    uint32_t root = run->roots[slot].entry;
+    TRACE_SCOPE("merge_plan_root", manifest_path(manifest, root));
+    int result = 0;
     char item_dest_path[FILENAME_MAX] = {0};
-    while (flib_get_entry(dir, src, &entry)){
-        if (entry.type == FLIB_FILE && strcmp(entry.name, INFO_FILE) != 0){
-            Cson *info_item = cson_map_get(files, cson_str(entry.name));
-            if (info_item == NULL) continue;
-            int64_t mod_time = cson_get_int(info_item);
-            if (mod_time > 0){
-                cwk_path_join(dest, entry.name, item_dest_path, FILENAME_MAX);
-                (void) copy_file(entry.path, item_dest_path);
-            }
-            cson_map_remove(files, cson_str(entry.name));
+    da_append(&run->dirs, ((merge_step){.target = root, .root = slot}));
+    for (uint32_t i=root+1; i<manifest->entries[root].next; ++i){
+        const manifest_entry *entry = &manifest->entries[i];
+        const char *path = manifest_path(manifest, i);
+        if (entry->state == MANIFEST_DELETED){
+            // nothing below a deleted directory is part of this backup
+            if (entry->type == MANIFEST_TYPE_DIR) i = entry->next-1;
+            continue;
         }
-        else if (entry.type == FLIB_DIR){
-            Cson *info_item = cson_map_get(dirs, cson_str(entry.name));
-            if (info_item == NULL){
-                eprintf("Found unregistered directory '%s'!", entry.path);
-                return_defer(1);
-            }
+        switch (entry->type){
+            case MANIFEST_TYPE_DIR:{
+                cwk_path_join(run->dest, path, item_dest_path, FILENAME_MAX);
+                if (!flib_isdir(item_dest_path) && !flib_create_dir(item_dest_path)){
+                    eprintf("Failed to merge '%s'!", path);
+                    i = entry->next-1;
+                    continue;
+                }
+                da_append(&run->dirs, ((merge_step){.target = i, .root = slot}));
+            } break;
+            case MANIFEST_TYPE_FILE:{
+                merge_step step = {0};
+                if (merge_resolve(&run->chain, i, &step) && merge_prepare_step(&run->chain, &step)){
+                    const manifest_entry *stored = &run->chain.manifests[step.level].entries[step.index];
+                    step.root = slot;
+                    step.segment = MANIFEST_NONE;
+                    if (stored->flags & MANIFEST_ENTRY_PACKED){
+                        step.segment = stored->segment;
+                        step.offset = stored->pack_offset;
+                        run->packed++;
+                    }
+                    da_append(&run->files, step);
+                } else{
+                    result = 1;
+                }
+            } break;
+            default: continue;
         }
     }
-    
-    if (parent == NULL){
-        bool found = false;
-        Cson *file_keys = cson_map_keys(files);
-        for (size_t i=0; i<cson_len(files); ++i){
-            eprintf("Could not find any version of '%s'!", cson_get_cstring(file_keys, index(i)));    
-            found = true;
+    return result;
+}
+
+bool merge_execute_step(merge_chain *chain, const merge_step *step, const char *dest)
+{
+    const manifest_t *owner = &chain->manifests[step->level];
+    const char *backup = chain->paths[step->level];
+    const char *path = manifest_path(&chain->manifests[0], step->target);
+    TRACE_SCOPE("merge_file", path);
+    char item_src_path[FILENAME_MAX] = {0};
+    char item_dest_path[FILENAME_MAX] = {0};
+    cwk_path_join(dest, path, item_dest_path, FILENAME_MAX);
+    if (owner->header->flags & MANIFEST_FLAG_CHUNKED){
+        return merge_restore_chunks(&chain->stores[step->level], owner, step->index, item_dest_path);
+    }
+    if (owner->entries[step->index].state == MANIFEST_DELTA){
+        return merge_delta(chain, step->level, step->index, item_dest_path);
+    }
+    if (step->segment != MANIFEST_NONE){
+        int fd = pack_segment_open(backup, step->segment);
+        if (fd < 0) return false;
+        const manifest_entry *entry = &owner->entries[step->index];
+        bool result = pack_extract(fd, step->offset, entry->size, item_dest_path);
+        close(fd);
+        if (result) (void) flib_set_attributes(item_dest_path, entry->mode, (time_t) entry->mod_time, (long) entry->mod_time_nsec);
+        return result;
+    }
+    cwk_path_join(backup, path, item_src_path, FILENAME_MAX);
+    const manifest_entry *entry = &owner->entries[step->index];
+    if (entry->flags & MANIFEST_ENTRY_COMPRESSED){
+        if (!decompress_file(item_src_path, item_dest_path)) return false;
+        (void) flib_set_attributes(item_dest_path, entry->mode, (time_t) entry->mod_time, (long) entry->mod_time_nsec);
+        return true;
+    }
+    return flib_copy_file(item_src_path, item_dest_path) == 0;
+}
+
+// a file that is stored as it is, small enough for io_uring
+bool merge_uring_step(const merge_run *run, const merge_step *step)
+{
+    const manifest_t *owner = &run->chain.manifests[step->level];
+    const manifest_entry *entry = &owner->entries[step->index];
+    return run->rings != NULL && !(owner->header->flags & MANIFEST_FLAG_CHUNKED) && step->segment == MANIFEST_NONE
+        && entry->state != MANIFEST_DELTA && !(entry->flags & MANIFEST_ENTRY_COMPRESSED) && entry->size <= URING_MAX_FILE_SIZE;
+}
+
+void merge_count_restored(merge_run *run, const merge_step *step)
+{
+    uint64_t size = run->chain.manifests[0].entries[step->target].size;
+    stats_add(&run->stats, STATS_FILES_COPIED, 1);
+    stats_add(&run->stats, STATS_BYTES_COPIED, size);
+    progress_done(1, size);
+}
+
+// the segment is opened once and read front to back
+void merge_pack_task(merge_job *job)
+{
+    merge_run *run = job->run;
+    const merge_step *first = &job->steps[0];
+    TRACE_SCOPE("merge_pack_segment", run->chain.paths[first->level]);
+    int fd = pack_segment_open(run->chain.paths[first->level], first->segment);
+    char item_dest_path[FILENAME_MAX] = {0};
+    for (size_t i=0; i<job->count; ++i){
+        const merge_step *step = &job->steps[i];
+        merge_root *root = &run->roots[step->root];
+        if (atomic_load(&root->failed)) continue;
+        const manifest_entry *entry = &run->chain.manifests[step->level].entries[step->index];
+        cwk_path_join(run->dest, manifest_path(&run->chain.manifests[0], step->target), item_dest_path, FILENAME_MAX);
+        if (fd < 0 || !pack_extract(fd, step->offset, entry->size, item_dest_path)){
+            atomic_store(&root->failed, true);
+            continue;
+        }
+        (void) flib_set_attributes(item_dest_path, entry->mode, (time_t) entry->mod_time, (long) entry->mod_time_nsec);
+        merge_count_restored(run, step);
+    }
+    if (fd >= 0) close(fd);
+}
+
+// packed files go last, grouped by segment and in the order they are stored, everything else keeps the plan order
+int merge_compare_steps(const void *a, const void *b)
+{
+    const merge_step *x = a;
+    const merge_step *y = b;
+    bool x_packed = x->segment != MANIFEST_NONE;
+    bool y_packed = y->segment != MANIFEST_NONE;
+    if (x_packed != y_packed) return x_packed? 1 : -1;
+    if (x_packed){
+        if (x->level != y->level) return x->level < y->level? -1 : 1;
+        if (x->segment != y->segment) return x->segment < y->segment? -1 : 1;
+        if (x->offset != y->offset) return x->offset < y->offset? -1 : 1;
+    }
+    return x->target < y->target? -1 : x->target > y->target;
+}
+
+void merge_uring_task(merge_job *job)
+{
+    merge_run *run = job->run;
+    TRACE_SCOPE("merge_uring_batch", NULL);
+    uring_copy_t copies[URING_BATCH_FILES];
+    for (size_t i=0; i<job->count; ++i){
+        const merge_step *step = &job->steps[i];
+        const char *path = manifest_path(&run->chain.manifests[0], step->target);
+        char *from = malloc(FILENAME_MAX);
+        char *to = malloc(FILENAME_MAX);
+        assert(from != NULL && to != NULL && "Buy more RAM lol");
+        cwk_path_join(run->chain.paths[step->level], path, from, FILENAME_MAX);
+        cwk_path_join(run->dest, path, to, FILENAME_MAX);
+        copies[i] = (uring_copy_t){.from = from, .to = to};
+    }
+    stats_add(&run->stats, STATS_SYS_COPY, job->count);
+    (void) uring_copy_files(&run->rings[pool_worker_index()], copies, job->count);
+    for (size_t i=0; i<job->count; ++i){
+        // anything the ring could not copy is tried again on its own, flib_copy_file reports what is wrong
+        if (copies[i].error != 0 && flib_copy_file(copies[i].from, copies[i].to) != 0){
+            atomic_store(&run->roots[job->steps[i].root].failed, true);
+        } else{
+            merge_count_restored(run, &job->steps[i]);
         }
-        if (found) return_defer(1);
+        free((char*) copies[i].from);
+        free((char*) copies[i].to);
+    }
+}
+
+void merge_file_task(void *arg)
+{
+    merge_job *job = (merge_job*) arg;
+    merge_run *run = job->run;
+    stats_bind(&run->stats);
+    uint64_t begin = stats_begin(&run->stats);
+    merge_root *root = &run->roots[job->steps[0].root];
+    if (job->kind == MERGE_JOB_PACK){
+        merge_pack_task(job);
+    } else if (atomic_load(&root->failed)){
+        // the rest of a failed root is deleted anyway
+    } else if (job->kind == MERGE_JOB_URING){
+        merge_uring_task(job);
+    } else if (merge_execute_step(&run->chain, job->steps, run->dest)){
+        merge_count_restored(run, job->steps);
     } else{
-        return_defer(merge_rec(parent, dest, files, dirs));
+        atomic_store(&root->failed, true);
     }
-    
-  defer:
-    closedir(dir);
-    return result;
+    stats_end(&run->stats, STATS_PHASE_STORE, begin);
 }
 
-int merge_root(const char *src, const char *dest)
+// restoring files changes the modification time of their directory, so directories are finished last
+void merge_finish_dirs(merge_run *run)
 {
-    DIR *dir = opendir(src);
-    if (dir == NULL){
-        eprintf("Invalid src directory: '%s'!", src);
+    TRACE_SCOPE("merge_finish_dirs", NULL);
+    const manifest_t *manifest = &run->chain.manifests[0];
+    char item_dest_path[FILENAME_MAX] = {0};
+    // children come after their parent in the plan, walking it backwards keeps a read-only parent from blocking them
+    for (size_t i=run->dirs.count; i-- > 0;){
+        const merge_step *dir = &run->dirs.items[i];
+        if (atomic_load(&run->roots[dir->root].failed)) continue;
+        const manifest_entry *entry = &manifest->entries[dir->target];
+        // manifests written before directories had attributes
+        if (entry->mode == 0 && entry->mod_time == 0) continue;
+        cwk_path_join(run->dest, manifest_path(manifest, dir->target), item_dest_path, FILENAME_MAX);
+        (void) flib_set_attributes(item_dest_path, entry->mode, (time_t) entry->mod_time, (long) entry->mod_time_nsec);
+    }
+}
+
+int merge(const char *src, const char *dest, const merge_options_t *options)
+{
+    if (!flib_isdir(src)){
+        eprintf("Could not find backup: '%s'!", src);
         return 1;
     }
     if (!flib_isdir(dest)){
-        eprintf("Invalid dest directory: '%s'!", dest);
-        closedir(dir);
+        eprintf("Could not find dest dir: '%s'!", dest);
+        return 1;
+    }
+    merge_run run = {.options = *options, .dest = dest};
+    size_t jobs = run.options.jobs;
+    if (jobs == 0) jobs = cpu_count();
+    stats_init(&run.stats, run.options.stats);
+    progress_start();
+    uint64_t begin = stats_begin(&run.stats);
+    if (!merge_open_chain(&run.chain, src)){
+        progress_stop();
         return 1;
     }
+    stats_end(&run.stats, STATS_PHASE_CHAIN, begin);
+    stats_bind(&run.stats);
+    const manifest_t *manifest = &run.chain.manifests[0];
     
     int result = 0;
-    
-    CsonArena arena = {0};
-    CsonArena *prev_arena = cson_current_arena;
-    cson_swap_arena(&arena);
-    
-    char info_path[FILENAME_MAX] = {0};
-    cwk_path_join(src, INFO_FILE, info_path, FILENAME_MAX);
-    if (!flib_isfile(info_path)){
-        eprintf("Could not find backup info file '%s'!", info_path);
-        return_defer(1);
+    bool pool_running = false;
+    merge_job *tasks = NULL;
+    char item_dest_path[FILENAME_MAX] = {0};
+    for (uint32_t root=0; root<manifest->count; root=manifest->entries[root].next){
+        run.root_count++;
     }
-    Cson *info = cson_read(info_path);
-    if (info == NULL){
-        eprintf("Could not read backup info file '%s'!", info_path);
-        return_defer(1);
+    run.roots = calloc(run.root_count, sizeof(*run.roots));
+    assert(run.roots != NULL && "Buy more RAM lol");
+
+    // every directory is created before the first file is restored
+    begin = stats_begin(&run.stats);
+    size_t slot = 0;
+    for (uint32_t root=0; root<manifest->count; root=manifest->entries[root].next, ++slot){
+        const manifest_entry *entry = &manifest->entries[root];
+        run.roots[slot].entry = root;
+        if (entry->type != MANIFEST_TYPE_DIR || entry->state == MANIFEST_DELETED) continue;
+        const char *name = manifest_path(manifest, root);
+        cwk_path_join(dest, name, item_dest_path, FILENAME_MAX);
+        if (!flib_create_dir(item_dest_path)) return_defer(1);
+        iprintf("Merging '%s'..", name);
+        // entries are stored relative to the backup, so the roots are merged into dest directly
+        if (merge_plan_root(&run, (uint32_t) slot) != 0) atomic_store(&run.roots[slot].failed, true);
     }
-    
-    Cson *files = cson_map_get(info, cson_str("files"));
-    if (files == NULL){
-        eprintf("Could not find a 'files' entry in backup info file '%s'!", info_path);
-        return_defer(1);
+    stats_end(&run.stats, STATS_PHASE_PLAN, begin);
+    // the plan is every file there is to restore
+    for (size_t i=0; i<run.files.count; ++i){
+        progress_found(1, manifest->entries[run.files.items[i].target].size);
     }
-    Cson *dirs = cson_map_get(info, cson_str("dirs"));
-    if (dirs == NULL){
-        eprintf("Could not find a 'dirs' entry in backup info file '%s'!", info_path);
+    progress_scanned();
+
+    if (run.options.uring_depth > 0){
+        run.rings = uring_create_rings(jobs, run.options.uring_depth);
+        if (run.rings == NULL) iprintf("io_uring is not available, copying files one by one.");
+    }
+    if (!pool_init(&run.pool, jobs)){
+        eprintf("Could not start %zu merge workers!", jobs);
         return_defer(1);
     }
-    
-    const char *parent = cson_get_cstring(info, key("parent"));
-    
-    char item_dest_path[FILENAME_MAX] = {0};
-    flib_entry entry;
-    while (flib_get_entry(dir, src, &entry)){
-        cwk_path_join(dest, entry.name, item_dest_path, FILENAME_MAX);
-        switch (entry.type){
-            case FLIB_FILE:{
-                if (strcmp(entry.name, INFO_FILE) == 0) continue;
-                Cson *info_item = cson_map_get(files, cson_str(entry.name));
-                if (info_item == NULL){
-                    eprintf("Found unregistered file '%s'!", entry.path);
-                    return_defer(1);
-                }
-                (void)copy_file(entry.path, item_dest_path);
-                (void)cson_map_remove(files, cson_str(entry.name));
-            } break;
-            case FLIB_DIR: {
-                Cson *info_item = cson_map_get(dirs, cson_str(entry.name));
-                if (info_item == NULL){
-                    eprintf("Found unregistered dir '%s'!", entry.path);
-                    return_defer(1);
-                }
-                if (!flib_isdir(item_dest_path) && !flib_create_dir(item_dest_path)) continue;
-                if (merge_root(entry.path, item_dest_path) == 1){
-                    eprintf("Failed to merge '%s'!", entry.path);
-                }
-            } break;
-            default: continue;
+    pool_running = true;
+    tasks = calloc(run.files.count + 1, sizeof(*tasks));
+    assert(tasks != NULL && "Buy more RAM lol");
+    if (run.packed > 0) qsort(run.files.items, run.files.count, sizeof(*run.files.items), merge_compare_steps);
+    size_t task_count = 0;
+    for (size_t i=0; i<run.files.count;){
+        const merge_step *first = &run.files.items[i];
+        merge_job *job = &tasks[task_count++];
+        *job = (merge_job){.run = &run, .steps = first, .count = 1};
+        if (first->segment != MANIFEST_NONE){
+            job->kind = MERGE_JOB_PACK;
+            while (i+job->count < run.files.count && job->count < MERGE_PACK_BATCH_FILES
+                && first[job->count].level == first->level && first[job->count].segment == first->segment) job->count++;
+        } else if (merge_uring_step(&run, first)){
+            // neighbouring small files of the same root go to the ring together
+            job->kind = MERGE_JOB_URING;
+            while (i+job->count < run.files.count && job->count < URING_BATCH_FILES
+                && first[job->count].root == first->root && merge_uring_step(&run, &first[job->count])) job->count++;
         }
+        i += job->count;
+        pool_submit(&run.pool, merge_file_task, job);
     }
-    if (parent != NULL){
-        merge_rec(parent, dest, files, dirs);
+    pool_wait(&run.pool);
+    begin = stats_begin(&run.stats);
+    merge_finish_dirs(&run);
+    stats_end(&run.stats, STATS_PHASE_FINISH, begin);
+
+    for (size_t i=0; i<run.root_count; ++i){
+        const manifest_entry *entry = &manifest->entries[run.roots[i].entry];
+        if (entry->type != MANIFEST_TYPE_DIR || entry->state == MANIFEST_DELETED) continue;
+        cwk_path_join(dest, manifest_path(manifest, run.roots[i].entry), item_dest_path, FILENAME_MAX);
+        if (atomic_load(&run.roots[i].failed)){
+            eprintf("Failed to merge '%s'!", manifest_path(manifest, run.roots[i].entry));
+            flib_delete_dir(item_dest_path);
+            result = 1;
+            continue;
+        }
+        iprintf("Successfully merged backups into '%s'!", item_dest_path);
     }
-        
+    stats_finish(&run.stats);
+    stats_print(&run.stats);
+    if (run.options.stats_json != NULL && !stats_write_json(&run.stats, "merge", run.options.stats_json)) result = 1;
   defer:
-    cson_swap_and_free_arena(prev_arena);
-    closedir(dir);
+    stats_bind(NULL);
+    progress_stop();
+    if (pool_running) pool_destroy(&run.pool);
+    uring_destroy_rings(run.rings, jobs);
+    free(tasks);
+    free(run.files.items);
+    free(run.dirs.items);
+    free(run.roots);
+    merge_close_chain(&run.chain);
     return result;
 }
 
-int merge(const char *src, const char *dest)
+void* tmerge(void *pargs)
 {
-    DIR *dir = opendir(src);
-    if (dir == NULL){
-        eprintf("Could not find backup: '%s'!", src);
-        return 1;
+    thread_args_t *args = (thread_args_t*) pargs;
+    args->result = merge(args->args[0], args->args[1], &args->merge_options);
+    worker_finish();
+    return NULL;
+}
+
+// one file of an export, the archive lists files in the order their content is stored
+typedef struct{
+    merge_step step;
+    uint64_t inode; // of the stored copy, a good guess for its place on the disk
+} export_file;
+
+typedef struct{
+    export_file *items;
+    size_t count;
+    size_t capacity;
+} export_files;
+
+int export_compare_files(const void *a, const void *b)
+{
+    const export_file *x = a;
+    const export_file *y = b;
+    if (x->step.level != y->step.level) return x->step.level < y->step.level? -1 : 1;
+    if (x->step.segment != y->step.segment) return x->step.segment < y->step.segment? -1 : 1;
+    if (x->step.offset != y->step.offset) return x->step.offset < y->step.offset? -1 : 1;
+    if (x->inode != y->inode) return x->inode < y->inode? -1 : 1;
+    return x->step.target < y->step.target? -1 : x->step.target > y->step.target;
+}
+
+bool export_temp_path(char *path, size_t path_size)
+{
+    const char *dir = getenv("TMPDIR");
+    snprintf(path, path_size, "%s/cbq-export-XXXXXX", dir != NULL? dir : "/tmp");
+    int fd = mkstemp(path);
+    if (fd < 0){
+        eprintf("Could not create a temporary file in '%s': %s!", dir != NULL? dir : "/tmp", strerror(errno));
+        return false;
     }
-    if (!flib_isdir(dest)){
-        eprintf("Could not find dest dir: '%s'!", dest);
-        closedir(dir);
+    close(fd);
+    return true;
+}
+
+bool export_stream_file(tar_writer *writer, tar_entry *item, const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0){
+        eprintf("Could not open '%s': %s!", path, strerror(errno));
+        return false;
+    }
+    struct stat attr;
+    bool result = fstat(fd, &attr) == 0;
+    if (result){
+        item->size = (uint64_t) attr.st_size;
+        result = tar_write_header(writer, item) && tar_write_content(writer, fd, 0, item->size, path) && tar_write_padding(writer, item->size);
+    }
+    close(fd);
+    return result;
+}
+
+// writes one file of the point-in-time tree, patches and chunks are rebuilt into a temporary file first
+bool export_write_file(merge_chain *chain, const merge_step *step, tar_writer *writer)
+{
+    const manifest_t *manifest = &chain->manifests[0];
+    const manifest_t *owner = &chain->manifests[step->level];
+    const manifest_entry *entry = &owner->entries[step->index];
+    const manifest_entry *target = &manifest->entries[step->target];
+    const char *backup = chain->paths[step->level];
+    const char *path = manifest_path(manifest, step->target);
+    tar_entry item = {
+        .path = path,
+        .type = TAR_TYPE_FILE,
+        .mode = target->mode,
+        .mod_time = target->mod_time,
+        .mod_time_nsec = target->mod_time_nsec,
+    };
+    char stored[FILENAME_MAX] = {0};
+    cwk_path_join(backup, path, stored, sizeof(stored));
+    if ((owner->header->flags & MANIFEST_FLAG_CHUNKED) || entry->state == MANIFEST_DELTA){
+        char tmp[FILENAME_MAX] = {0};
+        if (!export_temp_path(tmp, sizeof(tmp))) return false;
+        bool result = (owner->header->flags & MANIFEST_FLAG_CHUNKED)? merge_restore_chunks(&chain->stores[step->level], owner, step->index, tmp)
+            : merge_delta(chain, step->level, step->index, tmp);
+        result = result && export_stream_file(writer, &item, tmp);
+        (void) remove(tmp);
+        return result;
+    }
+    if (step->segment != MANIFEST_NONE){
+        int fd = pack_segment_open(backup, step->segment);
+        if (fd < 0) return false;
+        item.size = entry->size;
+        bool result = tar_write_header(writer, &item) && tar_write_content(writer, fd, step->offset, item.size, path) && tar_write_padding(writer, item.size);
+        close(fd);
+        return result;
+    }
+    if (entry->flags & MANIFEST_ENTRY_COMPRESSED){
+        compress_header header;
+        int fd = decompress_open(stored, &header);
+        if (fd < 0) return false;
+        item.size = header.raw_size;
+        bool result = tar_write_header(writer, &item) && tar_writer_flush(writer) && decompress_fd(fd, &header, stored, writer->fd)
+            && tar_write_padding(writer, item.size);
+        close(fd);
+        return result;
+    }
+    return export_stream_file(writer, &item, stored);
+}
+
+int export_backup(const char *src, int fd)
+{
+    if (!flib_isdir(src)){
+        eprintf("Could not find backup: '%s'!", src);
         return 1;
     }
-    
+    merge_chain chain;
+    if (!merge_open_chain(&chain, src)) return 1;
+    const manifest_t *manifest = &chain.manifests[0];
     int result = 0;
-    char item_dest_path[FILENAME_MAX] = {0};
-    flib_entry entry;
-    while (flib_get_entry(dir, src, &entry)){
-        if (entry.type == FLIB_DIR){
-            cwk_path_join(dest, entry.name, item_dest_path, FILENAME_MAX);
-            if (!flib_create_dir(item_dest_path)) return_defer(1);
-            iprintf("Merging '%s'..", entry.name);
-            if (merge_root(entry.path, item_dest_path) == 1){
-                eprintf("Failed to merge '%s'!", entry.name);
-                flib_delete_dir(item_dest_path);
-                return_defer(1);
-            }
-            iprintf("Successfully merged backups into '%s'!", item_dest_path);
+    export_files files = {0};
+    tar_writer writer;
+    tar_writer_init(&writer, fd);
+    // directories go first, so every file can be extracted into an existing directory
+    for (uint32_t i=0; i<manifest->count; ++i){
+        const manifest_entry *entry = &manifest->entries[i];
+        if (entry->state == MANIFEST_DELETED){
+            if (entry->type == MANIFEST_TYPE_DIR) i = entry->next-1;
+            continue;
+        }
+        if (entry->type == MANIFEST_TYPE_DIR){
+            // manifests written before directories had attributes
+            bool known = entry->mode != 0 || entry->mod_time != 0;
+            tar_entry item = {
+                .path = manifest_path(manifest, i),
+                .type = TAR_TYPE_DIR,
+                .mode = known? entry->mode : 0755,
+                .mod_time = known? entry->mod_time : manifest->header->scan_time,
+                .mod_time_nsec = known? entry->mod_time_nsec : 0,
+            };
+            if (!tar_write_header(&writer, &item)) return_defer(1);
+            continue;
+        }
+        export_file file = {0};
+        if (!merge_resolve(&chain, i, &file.step) || !merge_prepare_step(&chain, &file.step)) return_defer(1);
+        const manifest_t *owner = &chain.manifests[file.step.level];
+        const manifest_entry *stored = &owner->entries[file.step.index];
+        file.step.segment = MANIFEST_NONE;
+        if (stored->flags & MANIFEST_ENTRY_PACKED){
+            file.step.segment = stored->segment;
+            file.step.offset = stored->pack_offset;
+        } else if (!(owner->header->flags & MANIFEST_FLAG_CHUNKED) && stored->state != MANIFEST_DELTA){
+            char path[FILENAME_MAX] = {0};
+            flib_entry attr;
+            cwk_path_join(chain.paths[file.step.level], manifest_path(manifest, i), path, sizeof(path));
+            if (flib_stat(path, &attr)) file.inode = attr.inode;
         }
+        da_append(&files, file);
     }
+    qsort(files.items, files.count, sizeof(*files.items), export_compare_files);
+    for (size_t i=0; i<files.count; ++i){
+        if (!export_write_file(&chain, &files.items[i].step, &writer)) return_defer(1);
+    }
+    if (!tar_writer_finish(&writer)) return_defer(1);
+    iprintf("Exported %zu files of '%s'", files.count, src);
   defer:
-    closedir(dir);
+    if (writer.buffer != NULL) free(writer.buffer);
+    if (result != 0) eprintf("Failed to export '%s'!", src);
+    free(files.items);
+    merge_close_chain(&chain);
     return result;
 }
 
-void* tmerge(void *pargs)
+void* texport(void *pargs)
 {
     thread_args_t *args = (thread_args_t*) pargs;
-    (void) merge(args->args[0], args->args[1]);
-    worker_done = 1;
+    const char *dest = args->args[1];
+    bool to_stdout = strcmp(dest, "-") == 0;
+    int fd = to_stdout? STDOUT_FILENO : open(dest, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    args->result = 1;
+    if (fd < 0){
+        eprintf("Could not create '%s': %s!", dest, strerror(errno));
+    } else{
+        int result = export_backup(args->args[0], fd);
+        if (!to_stdout && close(fd) != 0 && result == 0){
+            eprintf("Could not write '%s': %s!", dest, strerror(errno));
+            result = 1;
+        }
+        if (!to_stdout && result != 0) (void) remove(dest);
+        args->result = result;
+    }
+    worker_finish();
     return NULL;
 }
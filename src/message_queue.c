@@ -1,39 +1,147 @@
+#include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdatomic.h>
 
 #include <message_queue.h>
 #include <threading.h>
 
-static char queue[MAX_QUEUE][MAX_MSG_LEN];
-static int head = 0, tail = 0;
+/*
+    Ring of slots with per-slot sequence numbers: a producer claims a position
+    by advancing head and publishes the slot by setting its sequence to pos+1,
+    the consumer releases it again by setting it to pos+capacity. The consumer
+    only sleeps on the condition variable after announcing it in `sleeping`,
+    so producers never take the lock while it is busy printing.
+*/
+
+typedef struct{
+    atomic_size_t seq;
+    char message[MAX_MSG_LEN];
+} msgq_slot;
+
+static msgq_slot *slots = NULL;
+static size_t mask = 0;
+static atomic_size_t head = 0; // next position to claim, shared by producers
+static size_t tail = 0; // next position to read, owned by the consumer
+static atomic_size_t dropped = 0;
+static atomic_bool sleeping = false;
+static atomic_bool woken = false;
 static mutex_t lock;
+static cond_t cond;
 
-void msgq_init() {
+void msgq_init(size_t capacity)
+{
+    if (capacity == 0) capacity = MSGQ_DEFAULT_CAPACITY;
+    size_t size = 1;
+    while (size < capacity) size <<= 1;
+    msgq_slot *items = malloc(size*sizeof(*items));
+    assert(items != NULL && "Buy more RAM lol");
+    for (size_t i=0; i<size; ++i){
+        atomic_init(&items[i].seq, i);
+    }
+    mask = size-1;
+    tail = 0;
+    atomic_store(&head, 0);
+    atomic_store(&dropped, 0);
+    atomic_store(&sleeping, false);
+    atomic_store(&woken, false);
     mutex_init(&lock);
+    cond_init(&cond);
+    slots = items;
 }
 
-void msgq_destroy() {
+void msgq_destroy(void)
+{
+    if (slots == NULL) return;
+    free(slots);
+    slots = NULL;
+    cond_destroy(&cond);
     mutex_destroy(&lock);
 }
 
-void msgq_push(const char* msg) {
+static void msgq_notify(void)
+{
+    // pairs with the fence in msgq_pop_wait, either we see `sleeping` or the consumer sees our message
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!atomic_load_explicit(&sleeping, memory_order_relaxed)) return;
     mutex_lock(&lock);
-    strncpy(queue[tail], msg, MAX_MSG_LEN - 1);
-    queue[tail][MAX_MSG_LEN - 1] = '\0';
-    tail = (tail + 1) % MAX_QUEUE;
-    if (tail == head) head = (head + 1) % MAX_QUEUE;
+    cond_signal(&cond);
     mutex_unlock(&lock);
 }
 
-int msgq_pop(char* out, int max_len) {
+bool msgq_push(const char *message)
+{
+    if (slots == NULL){
+        fprintf(stderr, "%s\n", message);
+        return true;
+    }
+    size_t pos = atomic_load_explicit(&head, memory_order_relaxed);
+    msgq_slot *slot;
+    while (true){
+        slot = &slots[pos & mask];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+        if (diff == 0){
+            if (atomic_compare_exchange_weak_explicit(&head, &pos, pos+1, memory_order_relaxed, memory_order_relaxed)) break;
+        } else if (diff < 0){
+            // the consumer has not freed this slot yet, the queue is full
+            atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+            return false;
+        } else{
+            pos = atomic_load_explicit(&head, memory_order_relaxed);
+        }
+    }
+    size_t len = strnlen(message, MAX_MSG_LEN-1);
+    memcpy(slot->message, message, len);
+    slot->message[len] = '\0';
+    atomic_store_explicit(&slot->seq, pos+1, memory_order_release);
+    msgq_notify();
+    return true;
+}
+
+static bool msgq_ready(void)
+{
+    msgq_slot *slot = &slots[tail & mask];
+    return atomic_load_explicit(&slot->seq, memory_order_acquire) == tail+1;
+}
+
+int msgq_pop(char *out, int max_len)
+{
+    if (slots == NULL || max_len <= 0 || !msgq_ready()) return 0;
+    msgq_slot *slot = &slots[tail & mask];
+    size_t len = strnlen(slot->message, (size_t) max_len-1);
+    memcpy(out, slot->message, len);
+    out[len] = '\0';
+    atomic_store_explicit(&slot->seq, tail+mask+1, memory_order_release);
+    tail++;
+    return 1;
+}
+
+int msgq_pop_wait(char *out, int max_len, long timeout_ms)
+{
+    if (slots == NULL) return 0;
+    if (msgq_pop(out, max_len)) return 1;
     mutex_lock(&lock);
-    if (head == tail) {
-        mutex_unlock(&lock);
-        return 0;
+    atomic_store(&sleeping, true);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!msgq_ready() && !atomic_exchange(&woken, false)){
+        if (timeout_ms < 0) cond_wait(&cond, &lock);
+        else (void) cond_timedwait(&cond, &lock, (unsigned long) timeout_ms);
     }
-    strncpy(out, queue[head], max_len - 1);
-    out[max_len - 1] = '\0';
-    head = (head + 1) % MAX_QUEUE;
+    atomic_store(&sleeping, false);
     mutex_unlock(&lock);
-    return 1;
-}
\ No newline at end of file
+    return msgq_pop(out, max_len);
+}
+
+void msgq_wake(void)
+{
+    if (slots == NULL) return;
+    atomic_store(&woken, true);
+    msgq_notify();
+}
+
+size_t msgq_dropped(void)
+{
+    return atomic_load(&dropped);
+}
@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <pack.h>
+#include <cwalk.h>
+#include <flib.h>
+#include <hash.h>
+#include <message_queue.h>
+
+#ifdef _WIN32
+    #define PACK_O_BINARY O_BINARY
+#else
+    #define PACK_O_BINARY 0
+#endif // _WIN32
+
+static bool pack_write_all(int fd, const void *data, size_t len)
+{
+    const char *bytes = data;
+    while (len > 0){
+        ssize_t n = write(fd, bytes, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        bytes += n;
+        len -= (size_t) n;
+    }
+    return true;
+}
+
+bool pack_open(pack_t *pack, const char *backup, size_t writer_count)
+{
+    memset(pack, 0, sizeof(*pack));
+    cwk_path_join(backup, PACK_DIR, pack->path, sizeof(pack->path));
+    if (!flib_isdir(pack->path) && !flib_create_dir(pack->path)) return false;
+    pack->writers = malloc(writer_count*sizeof(*pack->writers));
+    assert(pack->writers != NULL && "Buy more RAM lol");
+    for (size_t i=0; i<writer_count; ++i){
+        pack->writers[i] = (pack_writer_t){.fd = -1};
+    }
+    pack->writer_count = writer_count;
+    return true;
+}
+
+static bool pack_writer_close(pack_t *pack, pack_writer_t *writer)
+{
+    if (writer->fd < 0) return true;
+    bool result = close(writer->fd) == 0;
+    if (!result) eprintf("Could not write segment %"PRIu32" in '%s': %s!", writer->id, pack->path, strerror(errno));
+    writer->fd = -1;
+    return result;
+}
+
+bool pack_close(pack_t *pack)
+{
+    bool result = true;
+    for (size_t i=0; i<pack->writer_count; ++i){
+        if (!pack_writer_close(pack, &pack->writers[i])) result = false;
+    }
+    free(pack->writers);
+    pack->writers = NULL;
+    pack->writer_count = 0;
+    return result;
+}
+
+void pack_segment_path(const char *backup, uint32_t segment, char *buffer, size_t buffer_size)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%s%c%"PRIu32 PACK_SEGMENT_SUFFIX, PACK_DIR, FLIB_PATH_SEP, segment);
+    cwk_path_join(backup, name, buffer, buffer_size);
+}
+
+bool pack_append_file(pack_t *pack, size_t writer_index, const char *src, uint32_t *segment, uint64_t *offset, uint64_t *size, uint64_t *hash)
+{
+    pack_writer_t *writer = &pack->writers[writer_index];
+    if (writer->fd >= 0 && writer->size >= PACK_SEGMENT_SIZE && !pack_writer_close(pack, writer)) return false;
+    if (writer->fd < 0){
+        writer->id = atomic_fetch_add(&pack->next_id, 1);
+        writer->size = 0;
+        char path[FILENAME_MAX] = {0};
+        snprintf(path, sizeof(path), "%s%c%"PRIu32 PACK_SEGMENT_SUFFIX, pack->path, FLIB_PATH_SEP, writer->id);
+        writer->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | PACK_O_BINARY, 0644);
+        if (writer->fd < 0){
+            eprintf("Could not create segment '%s': %s!", path, strerror(errno));
+            return false;
+        }
+    }
+    int fd = open(src, O_RDONLY | PACK_O_BINARY);
+    if (fd < 0){
+        eprintf("Could not open '%s': %s!", src, strerror(errno));
+        return false;
+    }
+    uint8_t buffer[PACK_MAX_FILE_SIZE];
+    hash_xxh64_t ctx;
+    if (hash != NULL) hash_xxh64_init(&ctx, 0);
+    uint64_t start = writer->size;
+    bool result = true;
+    ssize_t n;
+    // the file is read until its end, it may have grown since it was listed
+    while ((n = read(fd, buffer, sizeof(buffer))) != 0){
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0){
+            eprintf("Could not read '%s': %s!", src, strerror(errno));
+            result = false;
+            break;
+        }
+        if (!pack_write_all(writer->fd, buffer, (size_t) n)){
+            eprintf("Could not append '%s' to segment %"PRIu32": %s!", src, writer->id, strerror(errno));
+            result = false;
+            break;
+        }
+        writer->size += (uint64_t) n;
+        if (hash != NULL) hash_xxh64_update(&ctx, buffer, (size_t) n);
+    }
+    close(fd);
+    if (!result) return false;
+    *segment = writer->id;
+    *offset = start;
+    *size = writer->size - start;
+    if (hash != NULL) *hash = hash_xxh64_final(&ctx);
+    atomic_fetch_add(&pack->files, 1);
+    atomic_fetch_add(&pack->bytes, *size);
+    return true;
+}
+
+int pack_segment_open(const char *backup, uint32_t segment)
+{
+    char path[FILENAME_MAX] = {0};
+    pack_segment_path(backup, segment, path, sizeof(path));
+    int fd = open(path, O_RDONLY | PACK_O_BINARY);
+    if (fd < 0) eprintf("Could not open segment '%s': %s!", path, strerror(errno));
+    return fd;
+}
+
+bool pack_extract(int segment_fd, uint64_t offset, uint64_t size, const char *dest)
+{
+    int fd = open(dest, O_WRONLY | O_CREAT | O_TRUNC | PACK_O_BINARY, 0644);
+    if (fd < 0){
+        eprintf("Could not create '%s': %s!", dest, strerror(errno));
+        return false;
+    }
+    uint8_t buffer[PACK_MAX_FILE_SIZE];
+    bool result = lseek(segment_fd, (off_t) offset, SEEK_SET) == (off_t) offset;
+    while (result && size > 0){
+        ssize_t n = read(segment_fd, buffer, size < sizeof(buffer)? (size_t) size : sizeof(buffer));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0 || !pack_write_all(fd, buffer, (size_t) n)) result = false;
+        else size -= (uint64_t) n;
+    }
+    if (close(fd) != 0) result = false;
+    if (!result) eprintf("Could not extract '%s' from its segment!", dest);
+    return result;
+}
@@ -0,0 +1,200 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <pool.h>
+
+typedef struct{
+    pool_t *pool;
+    size_t index;
+} pool_worker_args;
+
+static _Thread_local pool_t *current_pool = NULL;
+static _Thread_local int current_index = -1;
+
+static void deque_init(task_deque_t *deque)
+{
+    deque->items = malloc(POOL_DEQUE_CAPACITY*sizeof(task_t));
+    assert(deque->items != NULL && "Buy more RAM lol");
+    deque->head = 0;
+    deque->count = 0;
+    deque->capacity = POOL_DEQUE_CAPACITY;
+    mutex_init(&deque->lock);
+}
+
+static void deque_push(task_deque_t *deque, task_t task)
+{
+    mutex_lock(&deque->lock);
+    if (deque->count >= deque->capacity){
+        size_t new_capacity = deque->capacity*2;
+        task_t *items = malloc(new_capacity*sizeof(task_t));
+        assert(items != NULL && "Buy more RAM lol");
+        for (size_t i=0; i<deque->count; ++i){
+            items[i] = deque->items[(deque->head+i) % deque->capacity];
+        }
+        free(deque->items);
+        deque->items = items;
+        deque->head = 0;
+        deque->capacity = new_capacity;
+    }
+    deque->items[(deque->head+deque->count) % deque->capacity] = task;
+    deque->count++;
+    mutex_unlock(&deque->lock);
+}
+
+static bool deque_pop(task_deque_t *deque, task_t *task)
+{
+    bool result = false;
+    mutex_lock(&deque->lock);
+    if (deque->count > 0){
+        deque->count--;
+        *task = deque->items[(deque->head+deque->count) % deque->capacity];
+        result = true;
+    }
+    mutex_unlock(&deque->lock);
+    return result;
+}
+
+static bool deque_steal(task_deque_t *deque, task_t *task)
+{
+    bool result = false;
+    mutex_lock(&deque->lock);
+    if (deque->count > 0){
+        *task = deque->items[deque->head];
+        deque->head = (deque->head+1) % deque->capacity;
+        deque->count--;
+        result = true;
+    }
+    mutex_unlock(&deque->lock);
+    return result;
+}
+
+static bool pool_take(pool_t *pool, size_t index, task_t *task)
+{
+    // newest own task first (depth first), then the oldest task of another worker (breadth first)
+    if (deque_pop(&pool->deques[index], task)) return true;
+    for (size_t i=1; i<pool->worker_count; ++i){
+        if (deque_steal(&pool->deques[(index+i) % pool->worker_count], task)) return true;
+    }
+    return false;
+}
+
+static void* pool_worker(void *arg)
+{
+    pool_worker_args args = *(pool_worker_args*) arg;
+    free(arg);
+    pool_t *pool = args.pool;
+    current_pool = pool;
+    current_index = (int) args.index;
+    task_t task;
+    while (true){
+        if (pool_take(pool, args.index, &task)){
+            atomic_fetch_sub(&pool->queued, 1);
+            task.fn(task.arg);
+            if (atomic_fetch_sub(&pool->pending, 1) == 1){
+                mutex_lock(&pool->lock);
+                cond_broadcast(&pool->idle);
+                mutex_unlock(&pool->lock);
+            }
+            continue;
+        }
+        mutex_lock(&pool->lock);
+        while (atomic_load(&pool->queued) == 0 && !atomic_load(&pool->stopping)){
+            cond_wait(&pool->work_available, &pool->lock);
+        }
+        bool stop = atomic_load(&pool->stopping) && atomic_load(&pool->queued) == 0;
+        mutex_unlock(&pool->lock);
+        if (stop) break;
+    }
+    current_pool = NULL;
+    current_index = -1;
+    return NULL;
+}
+
+bool pool_init(pool_t *pool, size_t worker_count)
+{
+    if (pool == NULL) return false;
+    if (worker_count == 0) worker_count = 1;
+    memset(pool, 0, sizeof(*pool));
+    pool->threads = calloc(worker_count, sizeof(thread_t));
+    pool->deques = calloc(worker_count, sizeof(task_deque_t));
+    if (pool->threads == NULL || pool->deques == NULL){
+        free(pool->threads);
+        free(pool->deques);
+        return false;
+    }
+    mutex_init(&pool->lock);
+    cond_init(&pool->work_available);
+    cond_init(&pool->idle);
+    for (size_t i=0; i<worker_count; ++i){
+        deque_init(&pool->deques[i]);
+    }
+    pool->deque_count = worker_count;
+    pool->worker_count = worker_count;
+    for (size_t i=0; i<worker_count; ++i){
+        pool_worker_args *args = malloc(sizeof(*args));
+        assert(args != NULL && "Buy more RAM lol");
+        args->pool = pool;
+        args->index = i;
+        if (!thread_create(&pool->threads[i], pool_worker, args)){
+            free(args);
+            pool->worker_count = i;
+            pool_destroy(pool);
+            return false;
+        }
+    }
+    return true;
+}
+
+void pool_submit(pool_t *pool, task_fn fn, void *arg)
+{
+    if (pool == NULL || fn == NULL) return;
+    size_t index;
+    if (current_pool == pool){
+        index = (size_t) current_index;
+    } else{
+        index = atomic_fetch_add(&pool->next_deque, 1) % pool->worker_count;
+    }
+    atomic_fetch_add(&pool->pending, 1);
+    deque_push(&pool->deques[index], (task_t){.fn=fn, .arg=arg});
+    atomic_fetch_add(&pool->queued, 1);
+    mutex_lock(&pool->lock);
+    cond_signal(&pool->work_available);
+    mutex_unlock(&pool->lock);
+}
+
+void pool_wait(pool_t *pool)
+{
+    if (pool == NULL) return;
+    mutex_lock(&pool->lock);
+    while (atomic_load(&pool->pending) > 0){
+        cond_wait(&pool->idle, &pool->lock);
+    }
+    mutex_unlock(&pool->lock);
+}
+
+void pool_destroy(pool_t *pool)
+{
+    if (pool == NULL) return;
+    mutex_lock(&pool->lock);
+    atomic_store(&pool->stopping, true);
+    cond_broadcast(&pool->work_available);
+    mutex_unlock(&pool->lock);
+    for (size_t i=0; i<pool->worker_count; ++i){
+        thread_join(pool->threads[i]);
+    }
+    for (size_t i=0; i<pool->deque_count; ++i){
+        free(pool->deques[i].items);
+        mutex_destroy(&pool->deques[i].lock);
+    }
+    mutex_destroy(&pool->lock);
+    cond_destroy(&pool->work_available);
+    cond_destroy(&pool->idle);
+    free(pool->threads);
+    free(pool->deques);
+    memset(pool, 0, sizeof(*pool));
+}
+
+int pool_worker_index(void)
+{
+    return current_index;
+}
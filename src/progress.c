@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <progress.h>
+#include <stats.h>
+
+// the throughput is measured over at least this long, shorter samples are too noisy
+#define PROGRESS_SAMPLE_NSEC 500000000ull
+// weight of the newest sample in the smoothed throughput
+#define PROGRESS_SMOOTHING 0.3
+
+progress_t progress = {0};
+
+void progress_start(void)
+{
+    atomic_store(&progress.scanned, false);
+    atomic_store(&progress.estimated, false);
+    atomic_store(&progress.files_total, 0);
+    atomic_store(&progress.bytes_total, 0);
+    atomic_store(&progress.files_estimate, 0);
+    atomic_store(&progress.bytes_estimate, 0);
+    atomic_store(&progress.files_done, 0);
+    atomic_store(&progress.bytes_done, 0);
+    atomic_store(&progress.start_nsec, stats_now());
+    atomic_store(&progress.running, true);
+}
+
+void progress_stop(void)
+{
+    atomic_store(&progress.running, false);
+}
+
+void progress_scanned(void)
+{
+    atomic_store(&progress.scanned, true);
+}
+
+void progress_estimated(void)
+{
+    atomic_store(&progress.estimated, true);
+}
+
+// until the first sample the average of the run so far has to do
+static double progress_rate(const progress_view *view)
+{
+    if (view->throughput > 0 || view->elapsed <= 0) return view->throughput;
+    return view->bytes_done/view->elapsed;
+}
+
+void progress_sample(progress_view *view)
+{
+    uint64_t now = stats_now();
+    uint64_t start = atomic_load(&progress.start_nsec);
+    // a new run started since the last sample
+    if (view->sample_nsec < start){
+        memset(view, 0, sizeof(*view));
+        view->sample_nsec = start;
+    }
+    view->running = atomic_load(&progress.running);
+    view->files_done = atomic_load_explicit(&progress.files_done, memory_order_relaxed);
+    view->bytes_done = atomic_load_explicit(&progress.bytes_done, memory_order_relaxed);
+    view->files_total = atomic_load_explicit(&progress.files_total, memory_order_relaxed);
+    view->bytes_total = atomic_load_explicit(&progress.bytes_total, memory_order_relaxed);
+    bool scanned = atomic_load(&progress.scanned);
+    if (!scanned && atomic_load(&progress.estimated)){
+        // the estimate is only used until the run has found more than it
+        uint64_t files = atomic_load_explicit(&progress.files_estimate, memory_order_relaxed);
+        uint64_t bytes = atomic_load_explicit(&progress.bytes_estimate, memory_order_relaxed);
+        if (files > view->files_total) view->files_total = files;
+        if (bytes > view->bytes_total) view->bytes_total = bytes;
+    }
+    view->known = scanned || atomic_load(&progress.estimated);
+    // done may briefly run ahead of an estimate
+    if (view->files_done > view->files_total) view->files_total = view->files_done;
+    if (view->bytes_done > view->bytes_total) view->bytes_total = view->bytes_done;
+    if (view->running) view->elapsed = (now - start)*1e-9;
+
+    uint64_t span = now - view->sample_nsec;
+    if (view->running && span >= PROGRESS_SAMPLE_NSEC){
+        double current = (view->bytes_done - view->sample_bytes)/(span*1e-9);
+        view->throughput = view->sample_bytes == 0 && view->throughput == 0? current : (1-PROGRESS_SMOOTHING)*view->throughput + PROGRESS_SMOOTHING*current;
+        view->sample_nsec = now;
+        view->sample_bytes = view->bytes_done;
+    }
+    view->eta = -1;
+    if (view->known && view->running){
+        double rate = progress_rate(view);
+        if (rate > 0) view->eta = (view->bytes_total - view->bytes_done)/rate;
+    }
+}
+
+static int progress_format_bytes(double bytes, char *buffer, size_t buffer_size)
+{
+    static const char *units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    size_t unit = 0;
+    while (bytes >= 1024 && unit+1 < arr_len(units)){
+        bytes /= 1024;
+        unit++;
+    }
+    return snprintf(buffer, buffer_size, unit == 0? "%.0f %s" : "%.1f %s", bytes, units[unit]);
+}
+
+float progress_fraction(const progress_view *view)
+{
+    if (!view->known || view->bytes_total == 0) return view->known && !view->running? 1.0f : 0.0f;
+    return (float) view->bytes_done/(float) view->bytes_total;
+}
+
+void progress_format(const progress_view *view, char *buffer, size_t buffer_size)
+{
+    char done[32], total[32], rate[32];
+    progress_format_bytes((double) view->bytes_done, done, sizeof(done));
+    progress_format_bytes((double) view->bytes_total, total, sizeof(total));
+    progress_format_bytes(progress_rate(view), rate, sizeof(rate));
+    if (!view->known){
+        snprintf(buffer, buffer_size, "%s, %"PRIu64" files done, %"PRIu64" found, %s/s", done, view->files_done, view->files_total, rate);
+        return;
+    }
+    int len = snprintf(buffer, buffer_size, "%s / %s (%.0f%%), %"PRIu64" / %"PRIu64" files, %s/s",
+                       done, total, progress_fraction(view)*100.0, view->files_done, view->files_total, rate);
+    if (len < 0 || (size_t) len >= buffer_size || view->eta < 0) return;
+    uint64_t eta = (uint64_t) (view->eta + 0.5);
+    if (eta >= 3600){
+        snprintf(buffer+len, buffer_size-len, ", ETA %"PRIu64":%02"PRIu64":%02"PRIu64, eta/3600, eta/60%60, eta%60);
+    } else{
+        snprintf(buffer+len, buffer_size-len, ", ETA %"PRIu64":%02"PRIu64, eta/60, eta%60);
+    }
+}
@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <stats.h>
+#include <cson.h>
+#include <message_queue.h>
+
+_Thread_local stats_t *stats_current = NULL;
+
+uint64_t stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec*1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+void stats_init(stats_t *stats, bool enabled)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->enabled = enabled;
+    if (enabled) stats->start_nsec = stats_now();
+}
+
+void stats_bind(stats_t *stats)
+{
+    stats_current = stats != NULL && stats->enabled? stats : NULL;
+}
+
+void stats_finish(stats_t *stats)
+{
+    if (stats->enabled) stats->wall_nsec = stats_now() - stats->start_nsec;
+}
+
+static uint64_t stats_get(const stats_t *stats, stats_counter counter)
+{
+    return atomic_load_explicit(&stats->counters[counter], memory_order_relaxed);
+}
+
+void stats_print(const stats_t *stats)
+{
+    if (!stats->enabled) return;
+    char line[MAX_MSG_LEN] = {0};
+    size_t len = (size_t) snprintf(line, sizeof(line), "Time: %.3f s wall", stats->wall_nsec*1e-9);
+    for (size_t i=0; i<STATS__PHASE_COUNT && len < sizeof(line); ++i){
+        uint64_t nsec = atomic_load_explicit(&stats->phase_nsec[i], memory_order_relaxed);
+        if (nsec == 0) continue;
+        len += (size_t) snprintf(line+len, sizeof(line)-len, ", %s %.3f s", stats_phase_names[i], nsec*1e-9);
+    }
+    iprintf("%s (phases in thread time)", line);
+    char reused[64] = {0};
+    if (stats_get(stats, STATS_DIRS_REUSED) > 0) snprintf(reused, sizeof(reused), " and %"PRIu64" unchanged ones from the journal", stats_get(stats, STATS_DIRS_REUSED));
+    iprintf("Files: %"PRIu64" scanned (%.2f MiB) in %"PRIu64" directories%s, %"PRIu64" copied (%.2f MiB), %"PRIu64" linked, %"PRIu64" skipped, %"PRIu64" deleted",
+            stats_get(stats, STATS_FILES_SCANNED), stats_get(stats, STATS_BYTES_SCANNED)/(1024.0*1024.0), stats_get(stats, STATS_DIRS_SCANNED), reused,
+            stats_get(stats, STATS_FILES_COPIED), stats_get(stats, STATS_BYTES_COPIED)/(1024.0*1024.0), stats_get(stats, STATS_FILES_LINKED),
+            stats_get(stats, STATS_FILES_SKIPPED), stats_get(stats, STATS_ENTRIES_DELETED));
+    len = (size_t) snprintf(line, sizeof(line), "System calls:");
+    for (size_t i=STATS_SYS_OPEN; i<STATS__COUNTER_COUNT && len < sizeof(line); ++i){
+        len += (size_t) snprintf(line+len, sizeof(line)-len, "%s %s %"PRIu64, i == STATS_SYS_OPEN? "" : ",", stats_counter_names[i], stats_get(stats, (stats_counter) i));
+    }
+    iprintf("%s", line);
+}
+
+bool stats_write_json(const stats_t *stats, const char *operation, const char *path)
+{
+    CsonArena arena = {0};
+    CsonArena *prev_arena = cson_current_arena;
+    cson_swap_arena(&arena);
+    Cson *phases = cson_map_new();
+    for (size_t i=0; i<STATS__PHASE_COUNT; ++i){
+        uint64_t nsec = atomic_load_explicit(&stats->phase_nsec[i], memory_order_relaxed);
+        cson_map_insert(phases, cson_str_new((char*) stats_phase_names[i]), cson_new_float(nsec*1e-9));
+    }
+    Cson *counters = cson_map_new();
+    Cson *syscalls = cson_map_new();
+    for (size_t i=0; i<STATS__COUNTER_COUNT; ++i){
+        Cson *map = i >= STATS_SYS_OPEN? syscalls : counters;
+        cson_map_insert(map, cson_str_new((char*) stats_counter_names[i]), cson_new_int((int64_t) stats_get(stats, (stats_counter) i)));
+    }
+    Cson *root = cson_map_new();
+    cson_map_insert(root, cson_str_new("operation"), cson_new_cstring((char*) operation));
+    cson_map_insert(root, cson_str_new("version"), cson_new_cstring((char*) VERSION));
+    cson_map_insert(root, cson_str_new("wall_seconds"), cson_new_float(stats->wall_nsec*1e-9));
+    cson_map_insert(root, cson_str_new("phase_seconds"), phases);
+    cson_map_insert(root, cson_str_new("counters"), counters);
+    cson_map_insert(root, cson_str_new("syscalls"), syscalls);
+    bool result = cson_write(root, (char*) path);
+    if (!result) eprintf("Could not write the stats report '%s'!", path);
+    cson_swap_and_free_arena(prev_arena);
+    return result;
+}
@@ -0,0 +1,503 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stddef.h>
+
+#ifdef __linux__
+    #include <sys/sendfile.h>
+#endif // __linux__
+
+#include <tar.h>
+#include <message_queue.h>
+
+#define TAR_MAGIC "ustar"
+#define TAR_VERSION "00"
+// largest value of a 12 byte octal field (11 digits)
+#define TAR_OCTAL_MAX 077777777777ll
+
+typedef struct{
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+} tar_header;
+
+_Static_assert(sizeof(tar_header) == TAR_BLOCK_SIZE, "tar_header must fill a block!");
+
+static bool tar_write_all(int fd, const void *data, size_t len)
+{
+    const char *bytes = data;
+    while (len > 0){
+        ssize_t n = write(fd, bytes, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        bytes += n;
+        len -= (size_t) n;
+    }
+    return true;
+}
+
+void tar_writer_init(tar_writer *writer, int fd)
+{
+    writer->fd = fd;
+    writer->buffer = malloc(TAR_BUFFER_SIZE);
+    assert(writer->buffer != NULL && "Buy more RAM lol");
+    writer->len = 0;
+}
+
+bool tar_writer_flush(tar_writer *writer)
+{
+    if (writer->len == 0) return true;
+    if (!tar_write_all(writer->fd, writer->buffer, writer->len)){
+        eprintf("Could not write the archive: %s!", strerror(errno));
+        return false;
+    }
+    writer->len = 0;
+    return true;
+}
+
+bool tar_write(tar_writer *writer, const void *data, size_t len)
+{
+    const uint8_t *bytes = data;
+    while (len > 0){
+        if (writer->len == TAR_BUFFER_SIZE && !tar_writer_flush(writer)) return false;
+        size_t n = TAR_BUFFER_SIZE - writer->len;
+        if (n > len) n = len;
+        memcpy(writer->buffer + writer->len, bytes, n);
+        writer->len += n;
+        bytes += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool tar_writer_finish(tar_writer *writer)
+{
+    uint8_t end[2*TAR_BLOCK_SIZE] = {0};
+    bool result = tar_write(writer, end, sizeof(end)) && tar_writer_flush(writer);
+    free(writer->buffer);
+    writer->buffer = NULL;
+    return result;
+}
+
+bool tar_write_padding(tar_writer *writer, uint64_t size)
+{
+    static const uint8_t zeros[TAR_BLOCK_SIZE] = {0};
+    size_t rest = (size_t) (size % TAR_BLOCK_SIZE);
+    return rest == 0 || tar_write(writer, zeros, TAR_BLOCK_SIZE - rest);
+}
+
+static void tar_octal(char *field, size_t field_size, uint64_t value)
+{
+    // the last byte stays NUL
+    snprintf(field, field_size, "%0*"PRIo64, (int) field_size-1, value);
+}
+
+static void tar_checksum(tar_header *header)
+{
+    memset(header->chksum, ' ', sizeof(header->chksum));
+    unsigned sum = 0;
+    const uint8_t *bytes = (const uint8_t*) header;
+    for (size_t i=0; i<sizeof(*header); ++i) sum += bytes[i];
+    snprintf(header->chksum, sizeof(header->chksum), "%06o", sum);
+    header->chksum[7] = ' ';
+}
+
+// ustar keeps up to 100 bytes of name and 155 of prefix, split at a '/'
+static bool tar_split_path(tar_header *header, const char *path, size_t len)
+{
+    if (len <= sizeof(header->name)){
+        memcpy(header->name, path, len);
+        return true;
+    }
+    for (size_t i=len; i-- > 0;){
+        if (path[i] != '/') continue;
+        if (len-i-1 > sizeof(header->name)) return false;
+        if (i > sizeof(header->prefix)) continue;
+        memcpy(header->prefix, path, i);
+        memcpy(header->name, path+i+1, len-i-1);
+        return true;
+    }
+    return false;
+}
+
+// a pax record is "<length> <key>=<value>\n", the length counts its own digits
+static bool tar_pax_record(char *records, size_t records_size, size_t *len, const char *key, const char *value)
+{
+    size_t base = strlen(key) + strlen(value) + 3;
+    size_t total = base + 1;
+    while (true){
+        int digits = snprintf(NULL, 0, "%zu", total);
+        if (base + (size_t) digits == total) break;
+        total = base + (size_t) digits;
+    }
+    if (*len + total >= records_size) return false;
+    *len += (size_t) snprintf(records + *len, records_size - *len, "%zu %s=%s\n", total, key, value);
+    return true;
+}
+
+static void tar_fill_header(tar_header *header, char typeflag, uint32_t mode, uint64_t size, int64_t mod_time)
+{
+    tar_octal(header->mode, sizeof(header->mode), mode & 07777);
+    // backups do not keep owners, the extracting user owns everything
+    tar_octal(header->uid, sizeof(header->uid), 0);
+    tar_octal(header->gid, sizeof(header->gid), 0);
+    tar_octal(header->size, sizeof(header->size), size <= TAR_OCTAL_MAX? size : 0);
+    tar_octal(header->mtime, sizeof(header->mtime), mod_time >= 0 && mod_time <= TAR_OCTAL_MAX? (uint64_t) mod_time : 0);
+    header->typeflag = typeflag;
+    memcpy(header->magic, TAR_MAGIC, sizeof(TAR_MAGIC));
+    memcpy(header->version, TAR_VERSION, sizeof(header->version));
+    tar_checksum(header);
+}
+
+bool tar_write_header(tar_writer *writer, const tar_entry *entry)
+{
+    char path[FILENAME_MAX+1];
+    size_t len = (size_t) snprintf(path, sizeof(path), "%s%s", entry->path, entry->type == TAR_TYPE_DIR? "/" : "");
+    if (len >= sizeof(path)){
+        eprintf("Path too long for the archive: '%s'!", entry->path);
+        return false;
+    }
+    tar_header header = {0};
+    bool fits = tar_split_path(&header, path, len);
+    char records[FILENAME_MAX+256];
+    size_t records_len = 0;
+    char value[64];
+    if (!fits && !tar_pax_record(records, sizeof(records), &records_len, "path", path)) return false;
+    if (entry->size > TAR_OCTAL_MAX){
+        snprintf(value, sizeof(value), "%"PRIu64, entry->size);
+        if (!tar_pax_record(records, sizeof(records), &records_len, "size", value)) return false;
+    }
+    if (entry->mod_time_nsec != 0 || entry->mod_time < 0 || entry->mod_time > TAR_OCTAL_MAX){
+        snprintf(value, sizeof(value), "%"PRId64".%09"PRId64, entry->mod_time, entry->mod_time_nsec);
+        if (!tar_pax_record(records, sizeof(records), &records_len, "mtime", value)) return false;
+    }
+    if (records_len > 0){
+        tar_header pax = {0};
+        const char *name = strrchr(entry->path, '/');
+        name = name != NULL? name+1 : entry->path;
+        snprintf(pax.name, sizeof(pax.name), "PaxHeaders/%.88s", name);
+        tar_fill_header(&pax, 'x', 0644, records_len, entry->mod_time);
+        if (!tar_write(writer, &pax, sizeof(pax)) || !tar_write(writer, records, records_len) || !tar_write_padding(writer, records_len)) return false;
+        // readers without pax support still get a usable, if shortened, name
+        if (!fits) memcpy(header.name, path, sizeof(header.name));
+    }
+    tar_fill_header(&header, entry->type == TAR_TYPE_DIR? '5' : '0', entry->mode, entry->type == TAR_TYPE_DIR? 0 : entry->size, entry->mod_time);
+    return tar_write(writer, &header, sizeof(header));
+}
+
+bool tar_write_content(tar_writer *writer, int fd, uint64_t offset, uint64_t size, const char *name)
+{
+    if (lseek(fd, (off_t) offset, SEEK_SET) != (off_t) offset){
+        eprintf("Could not read '%s': %s!", name, strerror(errno));
+        return false;
+    }
+    if (size > TAR_SMALL_FILE_SIZE){
+        if (!tar_writer_flush(writer)) return false;
+    #ifdef __linux__
+        // the content goes from the page cache to the archive without passing through user space
+        while (size > 0){
+            ssize_t n = sendfile(writer->fd, fd, NULL, size);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS)) break;
+            if (n <= 0){
+                if (n == 0) eprintf("'%s' became shorter while it was archived!", name);
+                else eprintf("Could not archive '%s': %s!", name, strerror(errno));
+                return false;
+            }
+            size -= (uint64_t) n;
+        }
+    #endif // __linux__
+    }
+    while (size > 0){
+        if (writer->len == TAR_BUFFER_SIZE && !tar_writer_flush(writer)) return false;
+        size_t chunk = TAR_BUFFER_SIZE - writer->len;
+        if (chunk > size) chunk = (size_t) size;
+        ssize_t n = read(fd, writer->buffer + writer->len, chunk);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0){
+            if (n == 0) eprintf("'%s' became shorter while it was archived!", name);
+            else eprintf("Could not read '%s': %s!", name, strerror(errno));
+            return false;
+        }
+        writer->len += (size_t) n;
+        size -= (uint64_t) n;
+    }
+    return true;
+}
+
+void tar_reader_init(tar_reader *reader, int fd)
+{
+    memset(reader, 0, sizeof(*reader));
+    reader->fd = fd;
+    reader->buffer = malloc(TAR_BUFFER_SIZE);
+    assert(reader->buffer != NULL && "Buy more RAM lol");
+}
+
+void tar_reader_free(tar_reader *reader)
+{
+    free(reader->buffer);
+    reader->buffer = NULL;
+}
+
+// makes len bytes available at buffer+start, returns how many there are
+static size_t tar_reader_need(tar_reader *reader, size_t len)
+{
+    if (reader->end - reader->start >= len) return len;
+    memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+    reader->end -= reader->start;
+    reader->start = 0;
+    while (reader->end < len){
+        ssize_t n = read(reader->fd, reader->buffer + reader->end, TAR_BUFFER_SIZE - reader->end);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) eprintf("Could not read the archive: %s!", strerror(errno));
+        if (n <= 0) break;
+        reader->end += (size_t) n;
+    }
+    return reader->end < len? reader->end : len;
+}
+
+static bool tar_reader_skip(tar_reader *reader, uint64_t len)
+{
+    while (len > 0){
+        size_t available = tar_reader_need(reader, 1);
+        if (available == 0) return false;
+        available = reader->end - reader->start;
+        size_t n = available < len? available : (size_t) len;
+        reader->start += n;
+        len -= n;
+    }
+    return true;
+}
+
+// octal, NUL or space terminated, or base-256 with the high bit set (GNU, for large values)
+static bool tar_parse_number(const char *field, size_t field_size, uint64_t *value)
+{
+    const uint8_t *bytes = (const uint8_t*) field;
+    *value = 0;
+    if (bytes[0] & 0x80){
+        for (size_t i=0; i<field_size; ++i){
+            *value = (*value << 8) | (i == 0? bytes[i] & 0x7f : bytes[i]);
+        }
+        return true;
+    }
+    size_t i = 0;
+    while (i < field_size && field[i] == ' ') i++;
+    bool digits = false;
+    for (; i < field_size && field[i] >= '0' && field[i] <= '7'; ++i){
+        *value = (*value << 3) | (uint64_t) (field[i] - '0');
+        digits = true;
+    }
+    return digits && (i == field_size || field[i] == '\0' || field[i] == ' ');
+}
+
+static bool tar_valid_checksum(const tar_header *header)
+{
+    uint64_t expected;
+    if (!tar_parse_number(header->chksum, sizeof(header->chksum), &expected)) return false;
+    const uint8_t *bytes = (const uint8_t*) header;
+    unsigned sum = 0;
+    int signed_sum = 0;
+    for (size_t i=0; i<sizeof(*header); ++i){
+        bool in_chksum = i >= offsetof(tar_header, chksum) && i < offsetof(tar_header, chksum) + sizeof(header->chksum);
+        sum += in_chksum? ' ' : bytes[i];
+        signed_sum += in_chksum? ' ' : (signed char) bytes[i];
+    }
+    // some old writers summed signed chars
+    return expected == sum || (int64_t) expected == signed_sum;
+}
+
+typedef struct{
+    bool has_path;
+    bool has_size;
+    bool has_mtime;
+    uint64_t size;
+    int64_t mod_time;
+    int64_t mod_time_nsec;
+} tar_overrides;
+
+static void tar_parse_pax(tar_reader *reader, const char *records, size_t len, tar_overrides *overrides)
+{
+    size_t i = 0;
+    while (i < len){
+        char *end = NULL;
+        unsigned long long record_len = strtoull(records + i, &end, 10);
+        if (end == records + i || *end != ' ' || record_len == 0 || record_len > len - i) return;
+        const char *key = end + 1;
+        const char *record_end = records + i + record_len - 1; // the newline
+        if (key > record_end) return;
+        const char *eq = memchr(key, '=', (size_t) (record_end - key));
+        if (eq != NULL){
+            size_t key_len = (size_t) (eq - key);
+            const char *value = eq + 1;
+            size_t value_len = (size_t) (record_end - value);
+            if (key_len == 4 && memcmp(key, "path", 4) == 0 && value_len < sizeof(reader->path)){
+                memcpy(reader->path, value, value_len);
+                reader->path[value_len] = '\0';
+                overrides->has_path = true;
+            } else if (key_len == 4 && memcmp(key, "size", 4) == 0){
+                overrides->size = strtoull(value, NULL, 10);
+                overrides->has_size = true;
+            } else if (key_len == 5 && memcmp(key, "mtime", 5) == 0){
+                char *frac = NULL;
+                overrides->mod_time = strtoll(value, &frac, 10);
+                overrides->mod_time_nsec = 0;
+                if (frac != NULL && *frac == '.'){
+                    int64_t scale = 100000000;
+                    for (const char *c = frac+1; c < record_end && *c >= '0' && *c <= '9' && scale > 0; ++c, scale /= 10){
+                        overrides->mod_time_nsec += (*c - '0')*scale;
+                    }
+                }
+                overrides->has_mtime = true;
+            }
+        }
+        i += (size_t) record_len;
+    }
+}
+
+// content of a metadata entry (pax records, GNU long name), returns a NUL terminated copy
+static char *tar_read_meta(tar_reader *reader, uint64_t size)
+{
+    if (size > 1024*1024){
+        eprintf("Extended header of %"PRIu64" bytes is too large!", size);
+        return NULL;
+    }
+    char *data = malloc((size_t) size + 1);
+    assert(data != NULL && "Buy more RAM lol");
+    size_t len = 0;
+    while (len < size){
+        size_t available = tar_reader_need(reader, 1);
+        if (available == 0){
+            free(data);
+            return NULL;
+        }
+        available = reader->end - reader->start;
+        size_t n = available < size - len? available : (size_t) (size - len);
+        memcpy(data + len, reader->buffer + reader->start, n);
+        reader->start += n;
+        len += n;
+    }
+    data[len] = '\0';
+    uint64_t padding = (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+    if (!tar_reader_skip(reader, padding)){
+        free(data);
+        return NULL;
+    }
+    return data;
+}
+
+int tar_read_header(tar_reader *reader, tar_entry *entry)
+{
+    if (!tar_reader_skip(reader, reader->remaining + reader->padding)){
+        eprintf("The archive is truncated!");
+        return -1;
+    }
+    reader->remaining = reader->padding = 0;
+    tar_overrides overrides = {0};
+    while (true){
+        size_t available = tar_reader_need(reader, TAR_BLOCK_SIZE);
+        // archives that end without their two empty blocks are accepted
+        if (available == 0) return 0;
+        if (available < TAR_BLOCK_SIZE){
+            eprintf("The archive is truncated!");
+            return -1;
+        }
+        tar_header header;
+        memcpy(&header, reader->buffer + reader->start, sizeof(header));
+        reader->start += TAR_BLOCK_SIZE;
+        static const tar_header empty = {0};
+        if (memcmp(&header, &empty, sizeof(header)) == 0) return 0;
+        if (!tar_valid_checksum(&header)){
+            eprintf("This is no tar archive or it is corrupt (invalid header checksum)!");
+            return -1;
+        }
+        uint64_t size, mode, mod_time;
+        if (!tar_parse_number(header.size, sizeof(header.size), &size)) size = 0;
+        if (!tar_parse_number(header.mode, sizeof(header.mode), &mode)) mode = 0;
+        if (!tar_parse_number(header.mtime, sizeof(header.mtime), &mod_time)) mod_time = 0;
+        uint64_t padding = (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+        if (header.typeflag == 'x' || header.typeflag == 'L'){
+            char *data = tar_read_meta(reader, size);
+            if (data == NULL){
+                eprintf("The archive is truncated!");
+                return -1;
+            }
+            if (header.typeflag == 'x'){
+                tar_parse_pax(reader, data, (size_t) size, &overrides);
+            } else{
+                snprintf(reader->path, sizeof(reader->path), "%s", data);
+                overrides.has_path = true;
+            }
+            free(data);
+            continue;
+        }
+        if (header.typeflag == 'g' || header.typeflag == 'K'){
+            // global records and long link names do not matter for a backup
+            if (!tar_reader_skip(reader, size + padding)){
+                eprintf("The archive is truncated!");
+                return -1;
+            }
+            continue;
+        }
+        if (!overrides.has_path){
+            // only POSIX ustar has a prefix field, GNU archives keep other data there
+            bool ustar = memcmp(header.magic, TAR_MAGIC, sizeof(header.magic)) == 0;
+            int prefix_len = ustar? (int) strnlen(header.prefix, sizeof(header.prefix)) : 0;
+            snprintf(reader->path, sizeof(reader->path), "%.*s%s%.*s", prefix_len, header.prefix, prefix_len > 0? "/" : "",
+                     (int) strnlen(header.name, sizeof(header.name)), header.name);
+        }
+        if (overrides.has_size) size = overrides.size;
+        size_t path_len = strlen(reader->path);
+        bool trailing_slash = path_len > 0 && reader->path[path_len-1] == '/';
+        while (path_len > 1 && reader->path[path_len-1] == '/') reader->path[--path_len] = '\0';
+        *entry = (tar_entry){
+            .path = reader->path,
+            .mode = (uint32_t) mode,
+            .size = size,
+            .mod_time = overrides.has_mtime? overrides.mod_time : (int64_t) mod_time,
+            .mod_time_nsec = overrides.has_mtime? overrides.mod_time_nsec : 0,
+        };
+        switch (header.typeflag){
+            case '5': entry->type = TAR_TYPE_DIR; break;
+            // old archives mark directories with a trailing slash only
+            case '0': case '\0': case '7': entry->type = trailing_slash? TAR_TYPE_DIR : TAR_TYPE_FILE; break;
+            default: entry->type = TAR_TYPE_OTHER;
+        }
+        // hardlinks and special files carry no content, whatever their size says
+        if (header.typeflag == '1' || header.typeflag == '2' || header.typeflag == '3' || header.typeflag == '4' || header.typeflag == '6') size = 0;
+        if (entry->type == TAR_TYPE_DIR) entry->size = 0;
+        reader->remaining = size;
+        reader->padding = (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+        return 1;
+    }
+}
+
+int tar_read_content(tar_reader *reader, const uint8_t **data, size_t *len)
+{
+    if (reader->remaining == 0) return 0;
+    if (tar_reader_need(reader, 1) == 0){
+        eprintf("The archive is truncated!");
+        return -1;
+    }
+    size_t available = reader->end - reader->start;
+    *len = available < reader->remaining? available : (size_t) reader->remaining;
+    *data = reader->buffer + reader->start;
+    reader->start += *len;
+    reader->remaining -= *len;
+    return 1;
+}
@@ -1,18 +1,26 @@
+#include <stdlib.h>
 #include <threading.h>
 
 #ifdef _WIN32
-static thread_fn global_start_fn = NULL;
-static void* global_start_arg = NULL;
+typedef struct{
+    thread_fn fn;
+    void *arg;
+} win32_thread_start;
 
 DWORD WINAPI win32_thread_wrapper(LPVOID lpParam) {
-    (void)lpParam;
-    return (DWORD)(uintptr_t)global_start_fn(global_start_arg);
+    win32_thread_start start = *(win32_thread_start*) lpParam;
+    free(lpParam);
+    return (DWORD)(uintptr_t)start.fn(start.arg);
 }
 
 int thread_create(thread_t* thread, thread_fn fn, void* arg) {
-    global_start_fn = fn;
-    global_start_arg = arg;
-    *thread = CreateThread(NULL, 0, win32_thread_wrapper, NULL, 0, NULL);
+    // every thread gets its own start block, several threads may be started at once
+    win32_thread_start *start = malloc(sizeof(*start));
+    if (start == NULL) return 0;
+    start->fn = fn;
+    start->arg = arg;
+    *thread = CreateThread(NULL, 0, win32_thread_wrapper, start, 0, NULL);
+    if (*thread == NULL) free(start);
     return *thread != NULL;
 }
 
@@ -37,7 +45,39 @@ void mutex_destroy(mutex_t* mtx) {
     DeleteCriticalSection(mtx);
 }
 
+void cond_init(cond_t* cond) {
+    InitializeConditionVariable(cond);
+}
+
+void cond_wait(cond_t* cond, mutex_t* mtx) {
+    SleepConditionVariableCS(cond, mtx, INFINITE);
+}
+
+bool cond_timedwait(cond_t* cond, mutex_t* mtx, unsigned long timeout_ms) {
+    return SleepConditionVariableCS(cond, mtx, (DWORD) timeout_ms) != 0;
+}
+
+void cond_signal(cond_t* cond) {
+    WakeConditionVariable(cond);
+}
+
+void cond_broadcast(cond_t* cond) {
+    WakeAllConditionVariable(cond);
+}
+
+void cond_destroy(cond_t* cond) {
+    (void) cond;
+}
+
+size_t cpu_count(void) {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0? (size_t) info.dwNumberOfProcessors : 1;
+}
+
 #else
+#include <time.h>
+#include <unistd.h>
 
 int thread_create(thread_t* thread, thread_fn fn, void* arg) {
     return pthread_create(thread, NULL, fn, arg) == 0;
@@ -62,4 +102,41 @@ void mutex_unlock(mutex_t* mtx) {
 void mutex_destroy(mutex_t* mtx) {
     pthread_mutex_destroy(mtx);
 }
+
+void cond_init(cond_t* cond) {
+    pthread_cond_init(cond, NULL);
+}
+
+void cond_wait(cond_t* cond, mutex_t* mtx) {
+    pthread_cond_wait(cond, mtx);
+}
+
+bool cond_timedwait(cond_t* cond, mutex_t* mtx, unsigned long timeout_ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms/1000;
+    deadline.tv_nsec += (long) (timeout_ms%1000)*1000000;
+    if (deadline.tv_nsec >= 1000000000){
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    return pthread_cond_timedwait(cond, mtx, &deadline) == 0;
+}
+
+void cond_signal(cond_t* cond) {
+    pthread_cond_signal(cond);
+}
+
+void cond_broadcast(cond_t* cond) {
+    pthread_cond_broadcast(cond);
+}
+
+void cond_destroy(cond_t* cond) {
+    pthread_cond_destroy(cond);
+}
+
+size_t cpu_count(void) {
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0? (size_t) count : 1;
+}
 #endif
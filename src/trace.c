@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <trace.h>
+#include <pool.h>
+#include <message_queue.h>
+
+bool trace_available(void)
+{
+#ifdef CEBEQ_TRACE
+    return true;
+#else
+    return false;
+#endif // CEBEQ_TRACE
+}
+
+#ifdef CEBEQ_TRACE
+
+typedef struct trace_block{
+    struct trace_block *next;
+    size_t count;
+    trace_event events[TRACE_BLOCK_EVENTS];
+} trace_block;
+
+typedef struct trace_buffer{
+    struct trace_buffer *next;
+    unsigned generation;
+    unsigned tid;
+    int worker; // pool_worker_index of the thread when it first traced, -1 for others
+    trace_block *first;
+    trace_block *last;
+} trace_buffer;
+
+atomic_bool trace_enabled = false;
+static _Atomic(trace_buffer*) trace_buffers = NULL;
+// bumped whenever the buffers are freed, a thread whose buffer is older registers a new one
+static atomic_uint trace_generation = 1;
+static atomic_uint trace_next_tid = 1;
+static uint64_t trace_origin;
+static _Thread_local trace_buffer *trace_local = NULL;
+
+static trace_block* trace_block_new(void)
+{
+    trace_block *block = malloc(sizeof(*block));
+    assert(block != NULL && "Buy more RAM lol");
+    block->next = NULL;
+    block->count = 0;
+    return block;
+}
+
+static trace_buffer* trace_register(void)
+{
+    trace_buffer *buffer = malloc(sizeof(*buffer));
+    assert(buffer != NULL && "Buy more RAM lol");
+    buffer->generation = atomic_load(&trace_generation);
+    buffer->tid = atomic_fetch_add(&trace_next_tid, 1);
+    buffer->worker = pool_worker_index();
+    buffer->first = buffer->last = trace_block_new();
+    buffer->next = atomic_load(&trace_buffers);
+    while (!atomic_compare_exchange_weak(&trace_buffers, &buffer->next, buffer));
+    return buffer;
+}
+
+trace_event* trace__begin(const char *name, const char *detail)
+{
+    trace_buffer *buffer = trace_local;
+    if (buffer == NULL || buffer->generation != atomic_load_explicit(&trace_generation, memory_order_relaxed)){
+        buffer = trace_local = trace_register();
+    }
+    trace_block *block = buffer->last;
+    if (block->count == TRACE_BLOCK_EVENTS){
+        block = block->next = trace_block_new();
+        buffer->last = block;
+    }
+    trace_event *event = &block->events[block->count++];
+    event->name = name;
+    event->duration = 0;
+    event->detail[0] = '\0';
+    if (detail != NULL){
+        size_t len = strlen(detail);
+        size_t skip = len >= TRACE_DETAIL_SIZE? len-(TRACE_DETAIL_SIZE-1) : 0;
+        // the kept part starts at a whole utf-8 character
+        while (skip < len && ((unsigned char) detail[skip] & 0xC0) == 0x80) skip++;
+        memcpy(event->detail, detail+skip, len-skip+1);
+    }
+    event->start = stats_now();
+    return event;
+}
+
+static void trace_free(void)
+{
+    trace_buffer *buffer = atomic_exchange(&trace_buffers, NULL);
+    while (buffer != NULL){
+        trace_block *block = buffer->first;
+        while (block != NULL){
+            trace_block *next = block->next;
+            free(block);
+            block = next;
+        }
+        trace_buffer *next = buffer->next;
+        free(buffer);
+        buffer = next;
+    }
+    atomic_fetch_add(&trace_generation, 1);
+}
+
+void trace_start(void)
+{
+    trace_free();
+    trace_origin = stats_now();
+    atomic_store(&trace_enabled, true);
+}
+
+static void trace_write_string(FILE *file, const char *string)
+{
+    fputc('"', file);
+    for (const unsigned char *c = (const unsigned char*) string; *c != '\0'; ++c){
+        if (*c == '"' || *c == '\\') fprintf(file, "\\%c", *c);
+        else if (*c < 0x20) fprintf(file, "\\u%04x", *c);
+        else fputc(*c, file);
+    }
+    fputc('"', file);
+}
+
+bool trace_write(const char *path)
+{
+    atomic_store(&trace_enabled, false);
+    FILE *file = fopen(path, "w");
+    if (file == NULL){
+        eprintf("Could not write the trace '%s'!", path);
+        trace_free();
+        return false;
+    }
+    size_t count = 0;
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(file, "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"cebeq\"}}");
+    for (trace_buffer *buffer = atomic_load(&trace_buffers); buffer != NULL; buffer = buffer->next){
+        if (buffer->worker >= 0){
+            fprintf(file, ",\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"worker %d\"}}", buffer->tid, buffer->worker);
+        }
+        for (trace_block *block = buffer->first; block != NULL; block = block->next){
+            for (size_t i=0; i<block->count; ++i){
+                const trace_event *event = &block->events[i];
+                fprintf(file, ",\n{\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"name\":",
+                        buffer->tid, (event->start-trace_origin)*1e-3, event->duration*1e-3);
+                trace_write_string(file, event->name);
+                if (event->detail[0] != '\0'){
+                    fprintf(file, ",\"args\":{\"detail\":");
+                    trace_write_string(file, event->detail);
+                    fputc('}', file);
+                }
+                fputc('}', file);
+                count++;
+            }
+        }
+    }
+    fprintf(file, "\n]}\n");
+    bool result = !ferror(file);
+    if (fclose(file) != 0) result = false;
+    if (result) iprintf("Wrote %zu trace events to '%s'", count, path);
+    else eprintf("Could not write the trace '%s'!", path);
+    trace_free();
+    return result;
+}
+
+#else
+
+void trace_start(void)
+{
+}
+
+bool trace_write(const char *path)
+{
+    eprintf("Could not write the trace '%s', this build has no tracing!", path);
+    return false;
+}
+
+#endif // CEBEQ_TRACE
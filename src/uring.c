@@ -0,0 +1,433 @@
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE // struct statx
+#endif // _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <uring.h>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include <stdatomic.h>
+
+enum{
+    URING_OP_OPEN_SRC,
+    URING_OP_OPEN_DEST,
+    URING_OP_STATX,
+    URING_OP_READ,
+    URING_OP_WRITE,
+    URING_OP_CLOSE,
+};
+
+enum{
+    URING_STAGE_OPEN,
+    URING_STAGE_DATA,
+    URING_STAGE_CLOSE,
+};
+
+// one file in flight
+typedef struct{
+    uring_copy_t *copy;
+    int src_fd;
+    int dest_fd;
+    int error;
+    unsigned pending; // operations submitted and not completed yet
+    int stage;
+    uint64_t offset;
+    uint32_t chunk;   // bytes of the buffer read at offset
+    uint32_t written; // bytes of the chunk written so far
+    struct statx stx;
+} uring_slot;
+
+#define URING_USER_DATA(slot, op) (((uint64_t) (slot) << 3) | (op))
+
+static int uring_setup(unsigned entries, struct io_uring_params *params)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// every operation of a copy has to be there, they were added over several kernel versions
+static bool uring_probe(int fd)
+{
+    static const uint8_t needed[] = {IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE};
+    size_t size = sizeof(struct io_uring_probe) + 256*sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    assert(probe != NULL && "Buy more RAM lol");
+    bool result = uring_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    for (size_t i=0; result && i<arr_len(needed); ++i){
+        if (needed[i] > probe->last_op || !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED)) result = false;
+    }
+    free(probe);
+    return result;
+}
+
+bool uring_supported(void)
+{
+    // -1 until the first call has probed the kernel
+    static atomic_int supported = -1;
+    int value = atomic_load(&supported);
+    if (value >= 0) return value;
+    uring_t ring;
+    value = uring_init(&ring, 1);
+    if (value) uring_destroy(&ring);
+    atomic_store(&supported, value);
+    return value;
+}
+
+bool uring_init(uring_t *ring, unsigned depth)
+{
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+    if (depth == 0) depth = URING_DEFAULT_DEPTH;
+    if (depth > URING_MAX_DEPTH) depth = URING_MAX_DEPTH;
+    ring->depth = depth;
+
+    // a slot has at most three operations in flight, the completion queue is twice as large
+    struct io_uring_params params = {0};
+    ring->fd = uring_setup(3*depth, &params);
+    if (ring->fd < 0) return false;
+    if (!uring_probe(ring->fd)) goto error;
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED){
+        ring->sq_ring = NULL;
+        goto error;
+    }
+    if (single){
+        ring->cq_ring = ring->sq_ring;
+    } else{
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED){
+            ring->cq_ring = NULL;
+            goto error;
+        }
+    }
+    ring->sqes_size = params.sq_entries*sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED){
+        ring->sqes = NULL;
+        goto error;
+    }
+    uint8_t *sq = ring->sq_ring;
+    uint8_t *cq = ring->cq_ring;
+    ring->sq_tail = (unsigned*) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*) (sq + params.sq_off.array);
+    ring->cq_head = (unsigned*) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*) (cq + params.cq_off.ring_mask);
+    ring->cqes = cq + params.cq_off.cqes;
+
+    ring->slots = calloc(depth, sizeof(uring_slot));
+    ring->buffers = malloc((size_t) depth*URING_BUFFER_SIZE);
+    assert(ring->slots != NULL && ring->buffers != NULL && "Buy more RAM lol");
+    return true;
+
+  error:
+    uring_destroy(ring);
+    return false;
+}
+
+void uring_destroy(uring_t *ring)
+{
+    if (ring->sqes != NULL) munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring != NULL) munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->fd >= 0) close(ring->fd);
+    free(ring->slots);
+    free(ring->buffers);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+// the queues are large enough for every slot, so there is always room for another entry
+static struct io_uring_sqe* uring_get_sqe(uring_t *ring, size_t slot, int op)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &((struct io_uring_sqe*) ring->sqes)[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = URING_USER_DATA(slot, op);
+    ring->sq_array[index] = index;
+    atomic_store_explicit((_Atomic unsigned*) ring->sq_tail, tail+1, memory_order_release);
+    ring->to_submit++;
+    ((uring_slot*) ring->slots)[slot].pending++;
+    return sqe;
+}
+
+static void uring_submit_read(uring_t *ring, size_t slot)
+{
+    uring_slot *s = &((uring_slot*) ring->slots)[slot];
+    struct io_uring_sqe *sqe = uring_get_sqe(ring, slot, URING_OP_READ);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = s->src_fd;
+    sqe->addr = (uint64_t) (uintptr_t) (ring->buffers + slot*URING_BUFFER_SIZE);
+    sqe->len = URING_BUFFER_SIZE;
+    sqe->off = s->offset;
+}
+
+static void uring_submit_write(uring_t *ring, size_t slot)
+{
+    uring_slot *s = &((uring_slot*) ring->slots)[slot];
+    struct io_uring_sqe *sqe = uring_get_sqe(ring, slot, URING_OP_WRITE);
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = s->dest_fd;
+    sqe->addr = (uint64_t) (uintptr_t) (ring->buffers + slot*URING_BUFFER_SIZE + s->written);
+    sqe->len = s->chunk - s->written;
+    sqe->off = s->offset + s->written;
+}
+
+static void uring_submit_close(uring_t *ring, size_t slot, int fd)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring, slot, URING_OP_CLOSE);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+}
+
+static void uring_start(uring_t *ring, size_t slot, uring_copy_t *copy)
+{
+    uring_slot *s = &((uring_slot*) ring->slots)[slot];
+    memset(s, 0, sizeof(*s));
+    s->copy = copy;
+    s->src_fd = s->dest_fd = -1;
+    s->stage = URING_STAGE_OPEN;
+
+    struct io_uring_sqe *sqe = uring_get_sqe(ring, slot, URING_OP_OPEN_SRC);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uint64_t) (uintptr_t) copy->from;
+    sqe->open_flags = O_RDONLY | O_CLOEXEC;
+
+    // the permissions are fixed once the data is written, like flib_copy_file does it
+    sqe = uring_get_sqe(ring, slot, URING_OP_OPEN_DEST);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uint64_t) (uintptr_t) copy->to;
+    sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    sqe->len = 0600;
+
+    sqe = uring_get_sqe(ring, slot, URING_OP_STATX);
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uint64_t) (uintptr_t) copy->from;
+    sqe->len = STATX_BASIC_STATS;
+    sqe->off = (uint64_t) (uintptr_t) &s->stx;
+}
+
+// the data is there, the attributes are set synchronously, io_uring has no operations for them
+static void uring_finish(uring_t *ring, size_t slot)
+{
+    uring_slot *s = &((uring_slot*) ring->slots)[slot];
+    if (s->error == 0){
+        (void) fchown(s->dest_fd, s->stx.stx_uid, s->stx.stx_gid);
+        (void) fchmod(s->dest_fd, s->stx.stx_mode & 0777);
+        struct timespec times[2] = {
+            {.tv_sec = s->stx.stx_atime.tv_sec, .tv_nsec = s->stx.stx_atime.tv_nsec},
+            {.tv_sec = s->stx.stx_mtime.tv_sec, .tv_nsec = s->stx.stx_mtime.tv_nsec},
+        };
+        (void) futimens(s->dest_fd, times);
+    }
+    s->stage = URING_STAGE_CLOSE;
+    if (s->src_fd >= 0) uring_submit_close(ring, slot, s->src_fd);
+    if (s->dest_fd >= 0) uring_submit_close(ring, slot, s->dest_fd);
+}
+
+// returns true once the copy of the slot is done
+static bool uring_complete(uring_t *ring, size_t slot, int op, int res)
+{
+    uring_slot *s = &((uring_slot*) ring->slots)[slot];
+    s->pending--;
+    switch (op){
+        case URING_OP_OPEN_SRC:
+        case URING_OP_OPEN_DEST:{
+            if (res >= 0){
+                if (op == URING_OP_OPEN_SRC) s->src_fd = res;
+                else s->dest_fd = res;
+            } else if (s->error == 0){
+                s->error = -res;
+            }
+        } break;
+        case URING_OP_STATX:{
+            if (res < 0 && s->error == 0) s->error = -res;
+        } break;
+        case URING_OP_READ:{
+            if (res == -EINTR || res == -EAGAIN){
+                uring_submit_read(ring, slot);
+                return false;
+            }
+            if (res < 0){
+                s->error = -res;
+                uring_finish(ring, slot);
+            } else if (res == 0){
+                uring_finish(ring, slot);
+            } else{
+                s->chunk = (uint32_t) res;
+                s->written = 0;
+                uring_submit_write(ring, slot);
+            }
+            return false;
+        }
+        case URING_OP_WRITE:{
+            if (res == -EINTR || res == -EAGAIN){
+                uring_submit_write(ring, slot);
+                return false;
+            }
+            if (res <= 0){
+                s->error = res < 0? -res : EIO;
+                uring_finish(ring, slot);
+                return false;
+            }
+            s->written += (uint32_t) res;
+            if (s->written < s->chunk){
+                uring_submit_write(ring, slot);
+                return false;
+            }
+            s->offset += s->chunk;
+            // the size from statx saves the read that only finds the end of the file,
+            // pseudo files report a size of 0 and are read until then
+            if (s->stx.stx_size > 0 && s->offset >= s->stx.stx_size) uring_finish(ring, slot);
+            else uring_submit_read(ring, slot);
+            return false;
+        }
+        case URING_OP_CLOSE:{
+            // a failing close can mean the written data is lost
+            if (res < 0 && s->error == 0) s->error = -res;
+        } break;
+        default: assert(0 && "Invalid io_uring operation");
+    }
+    if (s->pending > 0) return false;
+    if (s->stage == URING_STAGE_OPEN){
+        if (s->error != 0){
+            uring_finish(ring, slot);
+        } else{
+            s->stage = URING_STAGE_DATA;
+            uring_submit_read(ring, slot);
+        }
+        return false;
+    }
+    return s->stage == URING_STAGE_CLOSE;
+}
+
+size_t uring_copy_files(uring_t *ring, uring_copy_t *copies, size_t count)
+{
+    size_t next = 0;
+    size_t active = 0;
+    size_t failed = 0;
+    for (size_t slot=0; slot<ring->depth && next<count; ++slot, ++active){
+        uring_start(ring, slot, &copies[next++]);
+    }
+    struct io_uring_cqe *cqes = ring->cqes;
+    while (active > 0){
+        int n = uring_enter(ring->fd, ring->to_submit, 1, IORING_ENTER_GETEVENTS);
+        if (n < 0){
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+            // the ring is unusable, whatever is still in flight or waiting is reported as failed
+            int error = errno;
+            for (size_t slot=0; slot<ring->depth; ++slot){
+                uring_slot *s = &((uring_slot*) ring->slots)[slot];
+                if (s->copy == NULL) continue;
+                if (s->src_fd >= 0) close(s->src_fd);
+                if (s->dest_fd >= 0) close(s->dest_fd);
+                s->copy->error = error;
+                s->copy = NULL;
+                failed++;
+            }
+            for (; next<count; ++next){
+                copies[next].error = error;
+                failed++;
+            }
+            return failed;
+        }
+        ring->to_submit -= (unsigned) n;
+        unsigned head = *ring->cq_head;
+        unsigned tail = atomic_load_explicit((_Atomic unsigned*) ring->cq_tail, memory_order_acquire);
+        for (; head != tail; ++head){
+            struct io_uring_cqe *cqe = &cqes[head & *ring->cq_mask];
+            size_t slot = (size_t) (cqe->user_data >> 3);
+            int op = (int) (cqe->user_data & 7);
+            if (!uring_complete(ring, slot, op, cqe->res)) continue;
+            uring_slot *s = &((uring_slot*) ring->slots)[slot];
+            s->copy->error = s->error;
+            if (s->error != 0) failed++;
+            s->copy = NULL;
+            active--;
+            if (next < count){
+                uring_start(ring, slot, &copies[next++]);
+                active++;
+            }
+        }
+        atomic_store_explicit((_Atomic unsigned*) ring->cq_head, head, memory_order_release);
+    }
+    return failed;
+}
+
+#else
+
+bool uring_supported(void)
+{
+    return false;
+}
+
+bool uring_init(uring_t *ring, unsigned depth)
+{
+    (void) depth;
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+    return false;
+}
+
+void uring_destroy(uring_t *ring)
+{
+    (void) ring;
+}
+
+size_t uring_copy_files(uring_t *ring, uring_copy_t *copies, size_t count)
+{
+    (void) ring;
+    for (size_t i=0; i<count; ++i) copies[i].error = ENOSYS;
+    return count;
+}
+
+#endif // __linux__
+
+uring_t* uring_create_rings(size_t count, unsigned depth)
+{
+    if (!uring_supported()) return NULL;
+    uring_t *rings = calloc(count, sizeof(*rings));
+    assert(rings != NULL && "Buy more RAM lol");
+    for (size_t i=0; i<count; ++i){
+        if (uring_init(&rings[i], depth)) continue;
+        // usually RLIMIT_MEMLOCK on older kernels, every worker needs its ring
+        uring_destroy_rings(rings, i);
+        return NULL;
+    }
+    return rings;
+}
+
+void uring_destroy_rings(uring_t *rings, size_t count)
+{
+    if (rings == NULL) return;
+    for (size_t i=0; i<count; ++i) uring_destroy(&rings[i]);
+    free(rings);
+}
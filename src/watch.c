@@ -0,0 +1,575 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <errno.h>
+#include <stdatomic.h>
+
+#ifndef _WIN32
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/file.h>
+    #include <sys/stat.h>
+#endif // _WIN32
+#ifdef __linux__
+    #include <poll.h>
+    #include <sys/inotify.h>
+#endif // __linux__
+
+#include <watch.h>
+#include <cson.h>
+#include <cwalk.h>
+#include <flib.h>
+#include <message_queue.h>
+
+// how long the daemon waits for events before it checks whether it should stop
+#define WATCH_POLL_MS 1000
+// the journal is rewritten with one line per directory once it has this many more lines
+#define WATCH_COMPACT_LINES 65536
+// how long a backup waits for the daemon to catch up with the event queue, it scans everything after that
+#define WATCH_BARRIER_TIMEOUT_MS 10000
+#define WATCH_BARRIER_POLL_MS 10
+#define WATCH_EVENT_BUFFER_SIZE (64*1024)
+
+static atomic_bool watch_stopping = false;
+
+void watch_stop(void)
+{
+    atomic_store(&watch_stopping, true);
+}
+
+bool watch_journal_path(const char *branch_name, const char *suffix, char *buffer, size_t buffer_size)
+{
+    char name[FILENAME_MAX] = {0};
+    int len = snprintf(name, sizeof(name), "data/%s%s", branch_name, suffix);
+    if (len < 0 || (size_t) len >= sizeof(name)) return false;
+    return cwk_path_join(program_dir, name, buffer, buffer_size) < buffer_size;
+}
+
+void watch_journal_free(watch_journal *journal)
+{
+    for (size_t i=0; i<journal->root_count; ++i){
+        free(journal->roots[i]);
+    }
+    for (size_t i=0; i<journal->count; ++i){
+        free(journal->changes[i].rel);
+    }
+    free(journal->roots);
+    free(journal->changes);
+    free(journal->barrier);
+    memset(journal, 0, sizeof(*journal));
+}
+
+static bool watch_parse_time(const char *string, int64_t *time, const char **rest)
+{
+    char *end = NULL;
+    errno = 0;
+    long long value = strtoll(string, &end, 10);
+    if (end == string || errno != 0 || value < 0) return false;
+    *time = (int64_t) value;
+    if (rest != NULL){
+        if (*end != ' ') return false;
+        *rest = end+1;
+    } else if (*end != '\0'){
+        return false;
+    }
+    return true;
+}
+
+bool watch_journal_read(watch_journal *journal, const char *branch_name)
+{
+    memset(journal, 0, sizeof(*journal));
+    char path[FILENAME_MAX] = {0};
+    if (!watch_journal_path(branch_name, WATCH_JOURNAL_SUFFIX, path, sizeof(path))) return false;
+    FILE *file = fopen(path, "r");
+    if (file == NULL) return false;
+    bool result = true;
+    char line[FILENAME_MAX+32];
+    size_t capacity = 0;
+    if (fgets(line, sizeof(line), file) == NULL || strcmp(line, WATCH_JOURNAL_MAGIC "\n") != 0){
+        result = false;
+        goto defer;
+    }
+    while (fgets(line, sizeof(line), file) != NULL){
+        size_t len = strlen(line);
+        // the daemon may be in the middle of appending the last line
+        if (len == 0 || line[len-1] != '\n') break;
+        line[len-1] = '\0';
+        const char *rest = NULL;
+        int64_t time = 0;
+        if (strncmp(line, "since ", 6) == 0){
+            if (!watch_parse_time(line+6, &journal->since, NULL)) result = false;
+        } else if (strncmp(line, "overflow ", 9) == 0){
+            if (!watch_parse_time(line+9, &journal->overflow, NULL)) result = false;
+        } else if (strncmp(line, "barrier ", 8) == 0){
+            free(journal->barrier);
+            journal->barrier = strdup(line+8);
+        } else if (strncmp(line, "root ", 5) == 0){
+            journal->roots = realloc(journal->roots, (journal->root_count+1)*sizeof(*journal->roots));
+            assert(journal->roots != NULL && "Buy more RAM lol");
+            journal->roots[journal->root_count++] = strdup(line+5);
+        } else if (watch_parse_time(line, &time, &rest)){
+            if (journal->count == capacity){
+                capacity = capacity == 0? 256 : 2*capacity;
+                journal->changes = realloc(journal->changes, capacity*sizeof(*journal->changes));
+                assert(journal->changes != NULL && "Buy more RAM lol");
+            }
+            journal->changes[journal->count++] = (watch_change){.time = time, .rel = strdup(rest)};
+        } else{
+            result = false;
+        }
+        if (!result) goto defer;
+    }
+    if (journal->since == 0) result = false;
+
+  defer:
+    fclose(file);
+    if (!result) watch_journal_free(journal);
+    return result;
+}
+
+bool watch_running(const char *branch_name)
+{
+#ifdef _WIN32
+    (void) branch_name;
+    return false;
+#else
+    char path[FILENAME_MAX] = {0};
+    if (!watch_journal_path(branch_name, WATCH_LOCK_SUFFIX, path, sizeof(path))) return false;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    // the daemon holds an exclusive lock for as long as it runs
+    bool running = flock(fd, LOCK_SH | LOCK_NB) != 0 && errno == EWOULDBLOCK;
+    close(fd);
+    return running;
+#endif // _WIN32
+}
+
+bool watch_journal_sync(watch_journal *journal, const char *branch_name)
+{
+    memset(journal, 0, sizeof(*journal));
+#ifdef _WIN32
+    (void) branch_name;
+    return false;
+#else
+    char dir[FILENAME_MAX] = {0};
+    char path[FILENAME_MAX] = {0};
+    char name[64];
+    if (!watch_journal_path(branch_name, WATCH_BARRIER_SUFFIX, dir, sizeof(dir))) return false;
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    snprintf(name, sizeof(name), "%ld-%lld.%09ld", (long) getpid(), (long long) now.tv_sec, now.tv_nsec);
+    if (cwk_path_join(dir, name, path, sizeof(path)) >= sizeof(path)) return false;
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) return false;
+    close(fd);
+    bool result = false;
+    for (int waited = 0; !result && waited < WATCH_BARRIER_TIMEOUT_MS; waited += WATCH_BARRIER_POLL_MS){
+        struct timespec pause = {.tv_nsec = WATCH_BARRIER_POLL_MS*1000000L};
+        nanosleep(&pause, NULL);
+        if (!watch_journal_read(journal, branch_name)) continue;
+        result = journal->barrier != NULL && strcmp(journal->barrier, name) == 0;
+        if (!result) watch_journal_free(journal);
+    }
+    (void) remove(path);
+    return result;
+#endif // _WIN32
+}
+
+#ifdef __linux__
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO \
+                    | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+
+typedef struct{
+    char *path;
+    char *rel;
+} watch_dir;
+
+typedef struct{
+    int fd; // inotify instance
+    watch_dir *dirs; // indexed by watch descriptor
+    size_t dir_count;
+    Cson *roots;
+    Cson *dirty; // relative path -> second it was last written to the journal
+    int journal; // appended to, replaced when the journal is rewritten
+    char journal_path[FILENAME_MAX];
+    size_t lines; // appended since the journal was last rewritten
+    int64_t since;
+    int64_t overflow;
+    int barrier_wd; // watches the barrier directory, see watch_journal_sync
+    char *barrier;
+    char *pending; // lines not written yet
+    size_t pending_len;
+    size_t pending_capacity;
+} watch_t;
+
+static void watch_append(watch_t *w, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static void watch_append(watch_t *w, const char *format, ...)
+{
+    va_list args;
+    while (true){
+        va_start(args, format);
+        int len = vsnprintf(w->pending+w->pending_len, w->pending_capacity-w->pending_len, format, args);
+        va_end(args);
+        assert(len >= 0);
+        if (w->pending_len+len < w->pending_capacity){
+            w->pending_len += len;
+            return;
+        }
+        w->pending_capacity = w->pending_capacity == 0? 4096 : 2*w->pending_capacity;
+        while (w->pending_capacity <= w->pending_len+len) w->pending_capacity *= 2;
+        w->pending = realloc(w->pending, w->pending_capacity);
+        assert(w->pending != NULL && "Buy more RAM lol");
+    }
+}
+
+static bool watch_flush(watch_t *w)
+{
+    size_t done = 0;
+    while (done < w->pending_len){
+        ssize_t n = write(w->journal, w->pending+done, w->pending_len-done);
+        if (n < 0){
+            if (errno == EINTR) continue;
+            eprintf("Could not write the change journal '%s': %s!", w->journal_path, strerror(errno));
+            return false;
+        }
+        done += (size_t) n;
+    }
+    w->pending_len = 0;
+    return true;
+}
+
+// the directory changed, it is written once per second at most
+static void watch_mark(watch_t *w, const char *rel)
+{
+    char path[FILENAME_MAX];
+    snprintf(path, sizeof(path), "%s", rel);
+    // a line per path, so a name with a newline in it marks the directory above it instead
+    char *newline = strchr(path, '\n');
+    if (newline != NULL){
+        *newline = '\0';
+        char *slash = strrchr(path, '/');
+        if (slash == NULL) return;
+        *slash = '\0';
+    }
+    int64_t now = (int64_t) time(NULL);
+    Cson *last = cson_map_get(w->dirty, cson_str(path));
+    if (last != NULL){
+        if (last->value.integer == now) return;
+        last->value.integer = now;
+    } else{
+        cson_map_insert(w->dirty, cson_str_new(path), cson_new_int(now));
+    }
+    watch_append(w, "%"PRId64" %s\n", now, path);
+    w->lines++;
+}
+
+static void watch_mark_parent(watch_t *w, const char *rel)
+{
+    const char *slash = strrchr(rel, '/');
+    if (slash == NULL) return;
+    char parent[FILENAME_MAX];
+    snprintf(parent, sizeof(parent), "%.*s", (int) (slash-rel), rel);
+    watch_mark(w, parent);
+}
+
+// watches a directory and everything below it, false if the kernel has no watches left
+static bool watch_add_tree(watch_t *w, const char *path, const char *rel, bool mark)
+{
+    int wd = inotify_add_watch(w->fd, path, WATCH_MASK);
+    if (wd < 0){
+        if (errno == ENOSPC){
+            eprintf("Out of inotify watches at '%s', raise /proc/sys/fs/inotify/max_user_watches!", path);
+            return false;
+        }
+        // gone again or not readable, a backup skips it just the same
+        return true;
+    }
+    if ((size_t) wd >= w->dir_count){
+        size_t count = w->dir_count == 0? 1024 : w->dir_count;
+        while (count <= (size_t) wd) count *= 2;
+        w->dirs = realloc(w->dirs, count*sizeof(*w->dirs));
+        assert(w->dirs != NULL && "Buy more RAM lol");
+        memset(w->dirs+w->dir_count, 0, (count-w->dir_count)*sizeof(*w->dirs));
+        w->dir_count = count;
+    }
+    // a directory moved within the branch keeps its watch descriptor
+    watch_dir *dir = &w->dirs[wd];
+    free(dir->path);
+    free(dir->rel);
+    dir->path = strdup(path);
+    dir->rel = strdup(rel);
+    // a directory that just appeared may have changed before it was watched
+    if (mark) watch_mark(w, rel);
+
+    flib_dir handle;
+    if (!flib_dir_open(&handle, path)) return true;
+    bool result = true;
+    flib_entry entry;
+    char child_rel[FILENAME_MAX];
+    while (result && flib_dir_next(&handle, &entry)){
+        if (entry.type != FLIB_DIR) continue;
+        int len = snprintf(child_rel, sizeof(child_rel), "%s/%s", rel, entry.name);
+        if (len < 0 || (size_t) len >= sizeof(child_rel)) continue;
+        result = watch_add_tree(w, entry.path, child_rel, mark);
+    }
+    flib_dir_close(&handle);
+    return result;
+}
+
+static bool watch_add_roots(watch_t *w)
+{
+    for (size_t i=0; i<cson_len(w->roots); ++i){
+        const char *root = cson_get_string(cson_array_get(w->roots, i)).value;
+        const char *name = NULL;
+        size_t name_length = 0;
+        cwk_path_get_basename(root, &name, &name_length);
+        char rel[FILENAME_MAX] = {0};
+        snprintf(rel, sizeof(rel), "%.*s", (int) name_length, name);
+        if (!watch_add_tree(w, root, rel, false)) return false;
+    }
+    return true;
+}
+
+// replaces the journal with one line per changed directory, readers see either version
+static bool watch_write_journal(watch_t *w)
+{
+    char tmp_path[FILENAME_MAX+8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", w->journal_path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0){
+        eprintf("Could not write the change journal '%s': %s!", tmp_path, strerror(errno));
+        return false;
+    }
+    // anything pending is in the map already
+    w->pending_len = 0;
+    watch_append(w, WATCH_JOURNAL_MAGIC "\nsince %"PRId64"\n", w->since);
+    for (size_t i=0; i<cson_len(w->roots); ++i){
+        watch_append(w, "root %s\n", cson_get_string(cson_array_get(w->roots, i)).value);
+    }
+    if (w->overflow > 0) watch_append(w, "overflow %"PRId64"\n", w->overflow);
+    if (w->barrier != NULL) watch_append(w, "barrier %s\n", w->barrier);
+    Cson *keys = cson_map_keys(w->dirty);
+    for (size_t i=0; i<cson_len(keys); ++i){
+        CsonStr rel = cson_get_string(cson_array_get(keys, i));
+        watch_append(w, "%"PRId64" %s\n", cson_get_int(w->dirty, key(rel.value)), rel.value);
+    }
+    int prev_journal = w->journal;
+    w->journal = fd;
+    bool result = watch_flush(w);
+    if (result && rename(tmp_path, w->journal_path) != 0){
+        eprintf("Could not replace the change journal '%s': %s!", w->journal_path, strerror(errno));
+        result = false;
+    }
+    if (!result){
+        close(fd);
+        w->journal = prev_journal;
+        return false;
+    }
+    if (prev_journal >= 0) close(prev_journal);
+    w->lines = 0;
+    return true;
+}
+
+static bool watch_handle_events(watch_t *w, const char *buffer, size_t len)
+{
+    bool overflowed = false;
+    for (size_t offset = 0; offset < len;){
+        const struct inotify_event *event = (const struct inotify_event*) (buffer+offset);
+        offset += sizeof(*event) + event->len;
+        if (event->mask & IN_Q_OVERFLOW){
+            overflowed = true;
+            continue;
+        }
+        if (event->wd == w->barrier_wd){
+            // every event before this one is in the journal once the line is written
+            if ((event->mask & IN_CREATE) && event->len > 0 && strchr(event->name, '\n') == NULL){
+                free(w->barrier);
+                w->barrier = strdup(event->name);
+                watch_append(w, "barrier %s\n", w->barrier);
+                w->lines++;
+            }
+            continue;
+        }
+        if (event->wd < 0 || (size_t) event->wd >= w->dir_count || w->dirs[event->wd].rel == NULL) continue;
+        watch_dir *dir = &w->dirs[event->wd];
+        if (event->mask & IN_IGNORED){
+            free(dir->path);
+            free(dir->rel);
+            dir->path = dir->rel = NULL;
+            continue;
+        }
+        watch_mark(w, dir->rel);
+        // the directory itself changed, its attributes are listed in the directory above
+        if (event->len == 0) watch_mark_parent(w, dir->rel);
+        if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO))){
+            char path[FILENAME_MAX];
+            char rel[FILENAME_MAX];
+            int path_len = snprintf(path, sizeof(path), "%s/%s", dir->path, event->name);
+            int rel_len = snprintf(rel, sizeof(rel), "%s/%s", dir->rel, event->name);
+            if (path_len < 0 || (size_t) path_len >= sizeof(path) || rel_len < 0 || (size_t) rel_len >= sizeof(rel)) continue;
+            if (!watch_add_tree(w, path, rel, true)) return false;
+        }
+    }
+    if (overflowed){
+        // events were lost: every directory is watched again, backups from before now scan everything
+        if (!watch_add_roots(w)) return false;
+        w->overflow = (int64_t) time(NULL);
+        watch_append(w, "overflow %"PRId64"\n", w->overflow);
+        iprintf("The event queue overflowed, the next backup scans everything.");
+    }
+    if (!watch_flush(w)) return false;
+    if (w->lines > WATCH_COMPACT_LINES && w->lines > 2*cson_len(w->dirty)) return watch_write_journal(w);
+    return true;
+}
+
+int watch(const char *branch_name)
+{
+    int result = 0;
+    watch_t w = {.fd = -1, .journal = -1, .barrier_wd = -1};
+    int lock = -1;
+    CsonArena arena = {0};
+    CsonArena *prev_arena = cson_current_arena;
+    cson_swap_arena(&arena);
+    atomic_store(&watch_stopping, false);
+
+    char backups_path[FILENAME_MAX];
+    cwk_path_join(program_dir, BACKUPS_JSON, backups_path, sizeof(backups_path));
+    Cson *branches = cson_read(backups_path);
+    if (branches == NULL){
+        eprintf("Could not find backups file '%s'!", backups_path);
+        result = 1;
+        goto defer;
+    }
+    Cson *branch = cson_get(branches, key("branches"), key((char*) branch_name));
+    if (branch == NULL){
+        eprintf("Could not find a branch with name '%s'!", branch_name);
+        result = 1;
+        goto defer;
+    }
+    w.roots = cson_map_get(branch, cson_str("dirs"));
+    if (!cson_is_array(w.roots) || cson_len(w.roots) == 0){
+        eprintf("Branch %s has no directories to watch!", branch_name);
+        result = 1;
+        goto defer;
+    }
+    for (size_t i=0; i<cson_len(w.roots); ++i){
+        const char *root = cson_get_string(cson_array_get(w.roots, i)).value;
+        if (!flib_isdir(root)){
+            eprintf("Source directory no longer exists: '%s'!", root);
+            result = 1;
+            goto defer;
+        }
+    }
+
+    char lock_path[FILENAME_MAX] = {0};
+    if (!watch_journal_path(branch_name, WATCH_LOCK_SUFFIX, lock_path, sizeof(lock_path))
+        || !watch_journal_path(branch_name, WATCH_JOURNAL_SUFFIX, w.journal_path, sizeof(w.journal_path))){
+        eprintf("Branch name '%s' is too long!", branch_name);
+        result = 1;
+        goto defer;
+    }
+    lock = open(lock_path, O_RDWR | O_CREAT, 0644);
+    if (lock < 0){
+        eprintf("Could not open '%s': %s!", lock_path, strerror(errno));
+        result = 1;
+        goto defer;
+    }
+    if (flock(lock, LOCK_EX | LOCK_NB) != 0){
+        eprintf("Branch '%s' is already being watched!", branch_name);
+        result = 1;
+        goto defer;
+    }
+    w.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (w.fd < 0){
+        eprintf("Could not set up inotify: %s!", strerror(errno));
+        result = 1;
+        goto defer;
+    }
+    char barrier_path[FILENAME_MAX] = {0};
+    if (!watch_journal_path(branch_name, WATCH_BARRIER_SUFFIX, barrier_path, sizeof(barrier_path))
+        || (mkdir(barrier_path, 0755) != 0 && errno != EEXIST)){
+        eprintf("Could not create the barrier directory '%s': %s!", barrier_path, strerror(errno));
+        result = 1;
+        goto defer;
+    }
+    // shares the event queue with the branch, so backups can wait for the daemon to catch up
+    w.barrier_wd = inotify_add_watch(w.fd, barrier_path, IN_CREATE | IN_ONLYDIR);
+    if (w.barrier_wd < 0){
+        eprintf("Could not watch '%s': %s!", barrier_path, strerror(errno));
+        result = 1;
+        goto defer;
+    }
+    w.dirty = cson_map_new();
+    if (!watch_add_roots(&w)){
+        result = 1;
+        goto defer;
+    }
+    // changes before every directory was watched are not in the journal
+    w.since = (int64_t) time(NULL);
+    if (!watch_write_journal(&w)){
+        result = 1;
+        goto defer;
+    }
+    iprintf("Watching branch '%s', backups with a parent from now on only scan what changed. Stop with Ctrl+C.", branch_name);
+
+    static char buffer[WATCH_EVENT_BUFFER_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (!atomic_load(&watch_stopping)){
+        struct pollfd poll_fd = {.fd = w.fd, .events = POLLIN};
+        int ready = poll(&poll_fd, 1, WATCH_POLL_MS);
+        if (ready < 0 && errno != EINTR){
+            eprintf("Could not wait for changes: %s!", strerror(errno));
+            result = 1;
+            goto defer;
+        }
+        if (ready <= 0) continue;
+        ssize_t len = read(w.fd, buffer, sizeof(buffer));
+        if (len < 0){
+            if (errno == EAGAIN || errno == EINTR) continue;
+            eprintf("Could not read changes: %s!", strerror(errno));
+            result = 1;
+            goto defer;
+        }
+        if (!watch_handle_events(&w, buffer, (size_t) len)){
+            result = 1;
+            goto defer;
+        }
+    }
+    iprintf("Stopped watching branch '%s', backups scan everything again.", branch_name);
+
+  defer:
+    // once the lock is released no backup trusts the journal anymore
+    if (w.fd >= 0) close(w.fd);
+    if (w.journal >= 0) close(w.journal);
+    if (lock >= 0) close(lock);
+    for (size_t i=0; i<w.dir_count; ++i){
+        free(w.dirs[i].path);
+        free(w.dirs[i].rel);
+    }
+    free(w.dirs);
+    free(w.barrier);
+    free(w.pending);
+    cson_swap_and_free_arena(prev_arena);
+    return result;
+}
+
+#else
+
+int watch(const char *branch_name)
+{
+    eprintf("Cannot watch branch '%s', change notifications are only supported on Linux!", branch_name);
+    return 1;
+}
+
+#endif // __linux__
+
+void* twatch(void *pargs)
+{
+    thread_args_t *args = (thread_args_t*)pargs;
+    args->result = watch(args->args[0]);
+    worker_finish();
+    return NULL;
+}